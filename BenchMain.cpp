@@ -0,0 +1,322 @@
+#include "CommandLine.h"
+#include "ZipSync.h"
+#include "TestCreator.h"
+#include "HttpServer.h"
+#include "StdFilesystem.h"
+#include "Utils.h"
+#include "args.hxx"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace ZipSync;
+
+//note: this is end-to-end performance benchmark of the whole update pipeline
+//it generates test installation, serves it via embedded HTTP server, and measures every stage separately
+
+/**
+ * Resource counters of the whole process.
+ * Note that embedded HTTP server runs in the same process, so its syscalls are counted too.
+ */
+struct ProcessCounters {
+    uint64_t readSyscalls = 0;
+    uint64_t writeSyscalls = 0;
+    uint64_t peakRss = 0;
+
+    static ProcessCounters Get() {
+        ProcessCounters res;
+#ifdef _WIN32
+        IO_COUNTERS io;
+        if (GetProcessIoCounters(GetCurrentProcess(), &io)) {
+            res.readSyscalls = io.ReadOperationCount;
+            res.writeSyscalls = io.WriteOperationCount;
+        }
+        PROCESS_MEMORY_COUNTERS mem;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &mem, sizeof(mem)))
+            res.peakRss = mem.PeakWorkingSetSize;
+#else
+        if (FILE *f = fopen("/proc/self/io", "r")) {
+            char line[256];
+            while (fgets(line, sizeof(line), f)) {
+                unsigned long long value;
+                if (sscanf(line, "syscr: %llu", &value) == 1)
+                    res.readSyscalls = value;
+                if (sscanf(line, "syscw: %llu", &value) == 1)
+                    res.writeSyscalls = value;
+            }
+            fclose(f);
+        }
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    #ifdef __APPLE__
+            res.peakRss = usage.ru_maxrss;          //bytes
+    #else
+            res.peakRss = usage.ru_maxrss * 1024ULL;  //kilobytes
+    #endif
+        }
+#endif
+        return res;
+    }
+};
+
+struct PhaseResult {
+    std::string name;
+    double seconds = 0.0;
+    uint64_t bytes = 0;         //amount of data processed (for throughput)
+    int requests = 0;           //HTTP requests received by server
+    uint64_t readSyscalls = 0;
+    uint64_t writeSyscalls = 0;
+    uint64_t peakRss = 0;       //peak resident memory of process so far
+};
+
+class Benchmark {
+    std::vector<PhaseResult> _phases;
+    const HttpServer *_server = nullptr;
+
+    //start of the current phase
+    std::chrono::steady_clock::time_point _startTime;
+    ProcessCounters _startCounters;
+    int _startRequests = 0;
+
+public:
+    void SetServer(const HttpServer *server) { _server = server; }
+
+    void Start() {
+        _startCounters = ProcessCounters::Get();
+        _startRequests = (_server ? _server->GetRequestsCount() : 0);
+        _startTime = std::chrono::steady_clock::now();
+    }
+    void Finish(const char *name, uint64_t bytes) {
+        auto finishTime = std::chrono::steady_clock::now();
+        ProcessCounters counters = ProcessCounters::Get();
+        PhaseResult res;
+        res.name = name;
+        res.seconds = std::chrono::duration_cast<std::chrono::microseconds>(finishTime - _startTime).count() * 1e-6;
+        res.bytes = bytes;
+        res.requests = (_server ? _server->GetRequestsCount() : 0) - _startRequests;
+        res.readSyscalls = counters.readSyscalls - _startCounters.readSyscalls;
+        res.writeSyscalls = counters.writeSyscalls - _startCounters.writeSyscalls;
+        res.peakRss = counters.peakRss;
+        _phases.push_back(res);
+        fprintf(stderr, "%-10s: %8.3lf sec  %8.1lf MB/s\n", name, res.seconds, ThroughputOf(res));
+        //next phase starts right after this one
+        Start();
+    }
+    template<class Func> void Measure(const char *name, const Func &func) {
+        Start();
+        uint64_t bytes = func();
+        Finish(name, bytes);
+    }
+
+    static double ThroughputOf(const PhaseResult &res) {
+        return res.seconds > 0.0 ? res.bytes * 1e-6 / res.seconds : 0.0;
+    }
+
+    void WriteJson(FILE *f, const std::vector<std::pair<std::string, std::string>> &config) const {
+        fprintf(f, "{\n");
+        fprintf(f, "  \"config\": {\n");
+        for (int i = 0; i < config.size(); i++)
+            fprintf(f, "    \"%s\": %s%s\n", config[i].first.c_str(), config[i].second.c_str(), i+1 < config.size() ? "," : "");
+        fprintf(f, "  },\n");
+        fprintf(f, "  \"phases\": [\n");
+        for (int i = 0; i < _phases.size(); i++) {
+            const PhaseResult &p = _phases[i];
+            fprintf(f, "    {\"name\": \"%s\", \"seconds\": %0.6lf, \"bytes\": %llu, \"MBps\": %0.3lf, \"requests\": %d, "
+                "\"readSyscalls\": %llu, \"writeSyscalls\": %llu, \"peakRssMB\": %0.1lf}%s\n",
+                p.name.c_str(), p.seconds, (unsigned long long)p.bytes, ThroughputOf(p), p.requests,
+                (unsigned long long)p.readSyscalls, (unsigned long long)p.writeSyscalls, p.peakRss * 1e-6,
+                i+1 < _phases.size() ? "," : ""
+            );
+        }
+        fprintf(f, "  ]\n");
+        fprintf(f, "}\n");
+    }
+};
+
+static uint64_t TotalSizeOfFiles(const std::vector<std::string> &paths) {
+    uint64_t res = 0;
+    for (const std::string &p : paths)
+        res += SizeOfFile(p);
+    return res;
+}
+
+int main(int argc, char **argv) {
+    args::ArgumentParser parser("End-to-end performance benchmark of ZipSync update pipeline.");
+    parser.helpParams.programName = "zipsync_bench";
+    args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+    args::ValueFlag<std::string> argDir(parser, "dir", "Directory where test data is generated (removed at the end)", {'d', "dir"}, "__bench__");
+    args::ValueFlag<int> argFiles(parser, "files", "Total number of files in installation", {'f', "files"}, 20000);
+    args::ValueFlag<int> argZips(parser, "zips", "Number of zips in installation", {'z', "zips"}, 40);
+    args::ValueFlag<int> argMinSize(parser, "minsize", "File sizes are log-uniform from 2^minsize...", {"min-size"}, 6);
+    args::ValueFlag<int> argMaxSize(parser, "maxsize", "... to 2^(maxsize+1) bytes", {"max-size"}, 17);
+    args::ValueFlag<int> argSeed(parser, "seed", "Random seed for data generation", {"seed"}, 1);
+    args::ValueFlag<int> argThreads(parser, "threads", "Number of threads for analysis (0 = max)", {'j', "threads"}, 0);
+    args::ValueFlag<int> argLatency(parser, "ms", "Emulated latency of HTTP server responses", {"latency"}, 0);
+    args::ValueFlag<double> argBandwidth(parser, "MB/s", "Emulated bandwidth cap of every HTTP response (0 = unlimited)", {"bandwidth"}, 0.0);
+    args::ValueFlag<int> argMaxRanges(parser, "num", "Emulated limit on number of ranges in HTTP request (0 = unlimited)", {"max-ranges"}, 0);
+    args::ValueFlag<int> argPort(parser, "port", "Port of embedded HTTP server", {"port"}, HttpServer::PORT_DEFAULT);
+    args::ValueFlag<std::string> argOutput(parser, "output", "Write JSON results to this file (default: stdout)", {'o', "output"});
+    args::Flag argKeep(parser, "keep", "Don't remove generated data at the end", {"keep"});
+    try {
+        parser.ParseCLI(argc, argv);
+    }
+    catch (const args::Help&) {
+        std::cout << parser;
+        return 0;
+    }
+    catch (const args::Error& e) {
+        std::cerr << e.what() << std::endl;
+        std::cerr << parser;
+        return 1;
+    }
+
+    try {
+        stdext::path baseDir = stdext::canonical(stdext::current_path()) / argDir.Get();
+        std::string remoteDir = (baseDir / "remote").string();
+        std::string localDir = (baseDir / "local").string();
+        stdext::remove_all(baseDir);
+        stdext::create_directories(remoteDir);
+        stdext::create_directories(localDir);
+        int numZips = argZips.Get();
+        int threadsNum = argThreads.Get();
+        if (threadsNum <= 0)
+            threadsNum = std::max(int(std::thread::hardware_concurrency()), 1);
+
+        Benchmark bench;
+
+        //generate remote installation zip-by-zip (to keep memory usage low)
+        std::vector<std::string> remoteZips;
+        bench.Measure("generate", [&]() -> uint64_t {
+            TestCreator creator;
+            creator.SetSeed(argSeed.Get());
+            creator.SetFileSizeRange(argMinSize.Get(), argMaxSize.Get());
+            std::vector<int> fileCounts = creator.GenPartition(argFiles.Get(), numZips, 1);
+            for (int z = 0; z < numZips; z++) {
+                DirState state = creator.GenTargetState(fileCounts[z], 1);
+                std::string zipName = "data" + std::to_string(z) + ".pk4";
+                DirState renamed;
+                renamed[zipName] = std::move(state.begin()->second);
+                TestCreator::WriteState(remoteDir, "", renamed, nullptr);
+                remoteZips.push_back(remoteDir + "/" + zipName);
+            }
+            return TotalSizeOfFiles(remoteZips);
+        });
+
+        //local installation has some of the zips:
+        //  1/2 in place (nothing to do)
+        //  1/4 under different name (files must be repacked from them)
+        //  remaining 1/4 must be downloaded
+        std::vector<std::string> localZips, movedZips;
+        for (int z = 0; z < numZips; z++) {
+            std::string zipName = "data" + std::to_string(z) + ".pk4";
+            if (z % 2 == 0)
+                localZips.push_back(localDir + "/" + zipName);
+            else if (z % 4 == 1) {
+                localZips.push_back(localDir + "/old/" + zipName);
+                movedZips.push_back(localZips.back());
+            }
+            else
+                continue;
+            stdext::create_directories(stdext::path(localZips.back()).parent_path());
+            stdext::copy_file(remoteZips[z], localZips.back());
+        }
+
+        Manifest remoteMani, localMani;
+        bench.Measure("analyze", [&]() -> uint64_t {
+            remoteMani = DoAnalyze(remoteDir, remoteZips, false, threadsNum);
+            localMani = DoAnalyze(localDir, localZips, false, threadsNum);
+            return TotalSizeOfFiles(remoteZips) + TotalSizeOfFiles(localZips);
+        });
+
+        HttpServer server;
+        server.SetRootDir(remoteDir);
+        server.SetPortNumber(argPort.Get());
+        HttpServer::NetworkModel netModel;
+        netModel.latencyMs = argLatency.Get();
+        netModel.bandwidth = uint64_t(argBandwidth.Get() * 1e+6);
+        netModel.maxRanges = argMaxRanges.Get();
+        server.SetNetworkModel(netModel);
+        server.Start();
+        bench.SetServer(&server);
+
+        Manifest providedMani = remoteMani;
+        providedMani.ReRoot(server.GetRootUrl());
+        providedMani.AppendManifest(localMani);
+
+        UpdateProcess updater;
+        bench.Measure("plan", [&]() -> uint64_t {
+            updater.Init(remoteMani, providedMani, localDir);
+            for (const std::string &zip : movedZips)
+                updater.AddManagedZip(zip);
+            bool ok = updater.DevelopPlan(UpdateType::SameCompressed);
+            ZipSyncAssertF(ok, "Failed to develop update plan");
+            return 0;
+        });
+
+        //download and verification happen in one call: split them by the first postprocessing progress report
+        uint64_t downloadedBytes = 0;
+        bool verifyStarted = false;
+        bench.Start();
+        downloadedBytes = updater.DownloadRemoteFiles(
+            GlobalProgressCallback(),
+            [&](double ratio, const char *comment) -> int {
+                if (!verifyStarted) {
+                    verifyStarted = true;
+                    bench.Finish("download", downloadedBytes);
+                }
+                return 0;
+            }
+        );
+        if (!verifyStarted)
+            bench.Finish("download", downloadedBytes);
+        bench.Finish("verify", downloadedBytes);
+
+        bench.Measure("repack", [&]() -> uint64_t {
+            updater.RepackZips();
+            updater.RemoveOldZips(nullptr);
+            std::vector<std::string> resultZips;
+            for (int z = 0; z < numZips; z++)
+                resultZips.push_back(localDir + "/data" + std::to_string(z) + ".pk4");
+            return TotalSizeOfFiles(resultZips);
+        });
+        server.Stop();
+        bench.SetServer(nullptr);
+
+        std::vector<std::pair<std::string, std::string>> config = {
+            {"files", std::to_string(argFiles.Get())},
+            {"zips", std::to_string(numZips)},
+            {"minSizePwr", std::to_string(argMinSize.Get())},
+            {"maxSizePwr", std::to_string(argMaxSize.Get())},
+            {"seed", std::to_string(argSeed.Get())},
+            {"threads", std::to_string(threadsNum)},
+            {"latencyMs", std::to_string(argLatency.Get())},
+            {"bandwidthMBps", std::to_string(argBandwidth.Get())},
+            {"maxRanges", std::to_string(argMaxRanges.Get())},
+            {"totalSize", std::to_string(TotalSizeOfFiles(remoteZips))},
+        };
+        if (argOutput) {
+            StdioFileHolder f(argOutput.Get().c_str(), "wt");
+            bench.WriteJson(f, config);
+        }
+        else
+            bench.WriteJson(stdout, config);
+
+        if (!argKeep)
+            stdext::remove_all(baseDir);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Benchmark failed: " << e.what() << std::endl;
+        return 2;
+    }
+    return 0;
+}
@@ -3,7 +3,9 @@
 #include "Utils.h"
 #include "Hash.h"
 #include "Downloader.h"
+#include "Path.h"
 #include <string.h>
+#include <map>
 
 
 namespace ZipSync {
@@ -29,7 +31,34 @@ void WriteChecksummedZip(const char *zipPath, const void *data, uint32_t size, c
     SAFE_CALL(zipCloseFileInZip(zf));
 }
 
+//hash.txt is stored uncompressed at the very beginning of zip, so a few starting bytes are enough to get hash
+static const int START_BYTES_WITH_HASH = 128;    //107 bytes is enough
+
+//extracts hash from a few starting bytes of checksummed zip
+//returns false if hash is not found there
+static bool ParseHashFromStartBytes(const char *bytes, int size, HashDigest &hash) {
+    std::string str(bytes, bytes + size);
+    int pos = (int)str.find(CHECKSUMMED_HASH_PREFIX);
+    if (pos < 0 || pos + HASH_PREFIX_LEN + HASH_SIZE >= str.size())
+        return false;
+    std::string hex = str.substr(pos + HASH_PREFIX_LEN, HASH_SIZE);
+    for (char c : hex)
+        if (!(isdigit(c) || c >= 'a' && c <= 'f'))
+            return false;   //failed to find checksum
+    hash.Parse(hex.c_str());
+    return true;
+}
+
 HashDigest GetHashOfChecksummedZip(const char *zipPath) {
+    {   //fast path: look at starting bytes only
+        StdioFileHolder f(zipPath, "rb");
+        char bytes[START_BYTES_WITH_HASH];
+        int read = fread(bytes, 1, sizeof(bytes), f);
+        HashDigest hash;
+        if (ParseHashFromStartBytes(bytes, read, hash))
+            return hash;
+    }
+
     UnzFileHolder zf(zipPath);
     SAFE_CALL(unzLocateFile(zf, CHECKSUMMED_HASH_FILENAME, true));
 
@@ -70,19 +99,23 @@ std::vector<uint8_t> ReadChecksummedZip(const char *zipPath, const char *dataFil
     return data;
 }
 
+//how many connections are used to probe remote zips simultaneously
+static const int MAX_PROBE_CONNECTIONS = 16;
+
 std::vector<HashDigest> GetHashesOfRemoteChecksummedZips(Downloader &downloader, const std::vector<std::string> &urls) {
     int n = urls.size();
 
     //download a few bytes at start of each remote file
+    //note: all requests are independent, so they are issued concurrently
     std::vector<std::vector<char>> startData(n);
-    static const int DOWNLOADED_BYTES = 128;    //107 bytes is enough
     for (int i = 0; i < n; i++) {
-        auto callback = [&startData,i](const void *data, uint32_t size) -> void {
-            ZipSyncAssert(size == DOWNLOADED_BYTES);
+        auto callback = [&startData,i](const void *data, size_t size) -> void {
+            ZipSyncAssert(size == START_BYTES_WITH_HASH);
             startData[i].assign((char*)data, (char*)data + size);
         };
-        downloader.EnqueueDownload(DownloadSource(urls[i], 0, DOWNLOADED_BYTES), callback);
+        downloader.EnqueueDownload(DownloadSource(urls[i], 0, START_BYTES_WITH_HASH), callback);
     }
+    downloader.SetMaxConnections(std::min(std::max(n, 1), MAX_PROBE_CONNECTIONS));
     downloader.DownloadAll();
 
     //find hash of remote files
@@ -90,18 +123,7 @@ std::vector<HashDigest> GetHashesOfRemoteChecksummedZips(Downloader &downloader,
     for (int i = 0; i < n; i++) {
         if (startData[i].empty())
             continue;   //failed to download (possible with "silent" error mode)
-        std::string bytes(startData[i].begin(), startData[i].end());
-        int pos = (int)bytes.find(CHECKSUMMED_HASH_PREFIX);
-        if (pos < 0 || pos + HASH_PREFIX_LEN + HASH_SIZE >= bytes.size())
-            continue;
-        std::string hex = bytes.substr(pos + HASH_PREFIX_LEN, HASH_SIZE);
-        bool bad = false;
-        for (char c : hex)
-            if (!(isdigit(c) || c >= 'a' && c <= 'f'))
-                bad = true;
-        if (bad)
-            continue;   //failed to find checksum
-        remoteHashes[i].Parse(hex.c_str());
+        ParseHashFromStartBytes(startData[i].data(), startData[i].size(), remoteHashes[i]);
     }
 
     return remoteHashes;
@@ -123,32 +145,39 @@ std::vector<int> DownloadChecksummedZips(Downloader &downloader,
         cachedHashes[i] = GetHashOfChecksummedZip(cachedZipPaths[i].c_str());
 
     //detect which zips are already available locally
+    //note: first zip with every hash is remembered: cached zips go first, then remote ones
+    std::map<HashDigest, int> hashToIndex;
+    for (int j = 0; j < m; j++)
+        hashToIndex.emplace(cachedHashes[j], j);
     std::vector<int> matching(n, -1);
     for (int i = 0; i < n; i++) {
         if (remoteHashes[i] == HashDigest())
             continue;       //hash not available
-        for (int j = 0; j < m + i; j++)
-            if (remoteHashes[i] == (j < m ? cachedHashes[j] : remoteHashes[j-m])) {
-                matching[i] = j;
-                outputPaths[i] = (j < m ? cachedZipPaths[j] : outputPaths[j-m]);
-                break;
-            }
+        auto pib = hashToIndex.emplace(remoteHashes[i], m + i);
+        if (!pib.second) {
+            int j = pib.first->second;
+            matching[i] = j;
+            outputPaths[i] = (j < m ? cachedZipPaths[j] : outputPaths[j-m]);
+        }
     }
 
     //download all the rest of zips
     std::vector<StdioFileHolder> fileHandles;
+    int numDownloaded = 0;
     for (int i = 0; i < n; i++) {
         fileHandles.emplace_back(nullptr);
         if (matching[i] >= 0)
             continue;
 
         fileHandles[i] = StdioFileHolder(outputPaths[i].c_str(), "wb");
-        auto callback = [&fileHandles,i](const void *data, uint32_t size) -> void {
-            int wr = fwrite(data, 1, size, fileHandles[i]);
+        auto callback = [&fileHandles,i](const void *data, size_t size) -> void {
+            size_t wr = fwrite(data, 1, size, fileHandles[i]);
             ZipSyncAssert(wr == size);
         };
         downloader.EnqueueDownload(urls[i], callback);
+        numDownloaded++;
     }
+    downloader.SetMaxConnections(std::min(std::max(numDownloaded, 1), MAX_PROBE_CONNECTIONS));
     downloader.DownloadAll();
     fileHandles.clear();
 
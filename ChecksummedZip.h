@@ -22,10 +22,11 @@ void WriteChecksummedZip(const char *zipPath, const void *data, uint32_t size, c
 std::vector<uint8_t> ReadChecksummedZip(const char *zipPath, const char *dataFilename);
 
 //reads only the hash from archive at zipPath
+//note: usually only a few starting bytes of the file are read
 HashDigest GetHashOfChecksummedZip(const char *zipPath);
 
 //gets hashes of the zips at specified URLs
-//downloader must be default-constructed object --- it will be used for download
+//downloader must be default-constructed object --- it will be used for download (all URLs are probed concurrently)
 //note: zero hash digest is returned for a remote file without embedded hash
 std::vector<HashDigest> GetHashesOfRemoteChecksummedZips(Downloader &downloader, const std::vector<std::string> &urls);
 
@@ -3,8 +3,15 @@
 #include "Downloader.h"
 #include "Wildcards.h"
 #include "Utils.h"
+#include "Hash.h"
+#include "Ini.h"
+#include "ChecksummedZip.h"
+#include "ResourceGovernor.h"
 #include <thread>
 #include <mutex>
+#include <algorithm>
+#include <set>
+#include <cmath>
 
 #include "StdFilesystem.h"
 
@@ -132,52 +139,143 @@ std::string DownloadSimple(const std::string &url, const std::string &rootDir, c
     return filepath;
 }
 
-void ParallelFor(int from, int to, const std::function<void(int)> &body, int thrNum, int blockSize) {
-    if (thrNum == 1) {
-        for (int i = from; i < to; i++)
-            body(i);
+static const char *FETCH_CACHE_SECTION = "FetchCache";
+
+std::vector<std::string> FetchRemoteFiles(const std::vector<std::string> &urls, const std::string &cacheDir, const char *printIndent) {
+    struct FetchState {
+        std::string url;
+        std::string dataPath, metaPath;
+        bool cached = false;
+        DownloadResponseInfo info;
+        std::vector<uint8_t> data;
+        bool received = false;
+    };
+    std::vector<FetchState> states(urls.size());
+
+    CreateDirectories(cacheDir);
+    Downloader downloader;
+    for (int i = 0; i < urls.size(); i++) {
+        FetchState &st = states[i];
+        st.url = urls[i];
+        //cache key: hash of URL (filename is appended only for readability and to keep extension)
+        std::string key = Hasher().Update(st.url.data(), st.url.size()).Finalize().Hex().substr(0, 16);
+        st.dataPath = cacheDir + "/" + key + "_" + GetFilename(st.url);
+        st.metaPath = cacheDir + "/" + key + ".ini";
+
+        DownloadSource src(st.url);
+        if (IfFileExists(st.dataPath) && IfFileExists(st.metaPath)) {
+            IniData meta = ReadIniFile(st.metaPath.c_str());
+            std::map<std::string, std::string> props;
+            for (const auto &pSV : meta)
+                if (pSV.first == FETCH_CACHE_SECTION)
+                    props.insert(pSV.second.begin(), pSV.second.end());
+            if (props["url"] == st.url && (!props["etag"].empty() || !props["lastModified"].empty())) {
+                st.cached = true;
+                src.ifNoneMatch = props["etag"];
+                src.ifModifiedSince = props["lastModified"];
+            }
+        }
+        if (printIndent)
+            printf("%sFetching %s%s\n", printIndent, st.url.c_str(), (st.cached ? " (revalidating cached copy)" : ""));
+
+        auto DataCallback = [&st](const void *data, int len) {
+            st.data.assign((const uint8_t*)data, (const uint8_t*)data + len);
+            st.received = true;
+        };
+        auto InfoCallback = [&st](const DownloadResponseInfo &info) {
+            st.info = info;
+        };
+        downloader.EnqueueDownload(src, DataCallback, InfoCallback);
     }
-    else {
-        if (thrNum <= 0)
-            thrNum = std::thread::hardware_concurrency();
-        //int blockNum = (to - from + blockSize-1) / blockSize;
-
-        std::vector<std::thread> threads(thrNum);
-        int lastAssigned = from;
-        std::exception_ptr workerException;
-        std::mutex mutex;
-
-        for (int t = 0; t < thrNum; t++) {
-            auto ThreadFunc = [&,t]() {
-                while (1) {
-                    int left, right;
-                    {
-                        std::lock_guard<std::mutex> lock(mutex);
-                        if (workerException || lastAssigned == to)
-                            break;
-                        left = lastAssigned;
-                        right = std::min(lastAssigned + blockSize, to);
-                        lastAssigned = right;
-                    }
-                    try {
-                        for (int i = left; i < right; i++) {
-                            body(i);
-                        }
-                    } catch(...) {
-                        std::lock_guard<std::mutex> lock(mutex);
-                        workerException = std::current_exception();
-                        break;
-                    }
+    downloader.SetMaxConnections(std::min(int(urls.size()), 8));
+    downloader.DownloadAll();
+
+    std::vector<std::string> res;
+    for (FetchState &st : states) {
+        if (st.info.notModified) {
+            ZipSyncAssertF(st.cached, "Server returned 304 for unconditional request to %s", st.url.c_str());
+        }
+        else {
+            ZipSyncAssertF(st.received, "Failed to fetch %s", st.url.c_str());
+            //write via temporary file, so that interrupted fetch does not spoil cache
+            std::string tempPath = st.dataPath + ".tmp";
+            {
+                StdioFileHolder f(tempPath.c_str(), "wb");
+                int res = fwrite(st.data.data(), 1, st.data.size(), f);
+                if (res != st.data.size())
+                    throw std::runtime_error("Failed to write " + std::to_string(st.data.size()) + " bytes downloaded from " + st.url);
+            }
+            if (IfFileExists(st.metaPath))
+                RemoveFile(st.metaPath);
+            if (IfFileExists(st.dataPath))
+                RemoveFile(st.dataPath);
+            RenameFile(tempPath, st.dataPath);
+            if (!st.info.etag.empty() || !st.info.lastModified.empty()) {
+                IniSect sect = {
+                    {"url", st.url},
+                    {"etag", st.info.etag},
+                    {"lastModified", st.info.lastModified},
+                };
+                WriteIniFile(st.metaPath.c_str(), IniData{{FETCH_CACHE_SECTION, sect}});
+            }
+        }
+        res.push_back(st.dataPath);
+    }
+    return res;
+}
+
+Manifest FetchShardedManifest(const std::string &indexPath, const IniData &indexIni, const std::string &rootDir, const std::string &cacheDir, const std::function<bool(const ManifestShard&)> &isRelevant, const char *printIndent) {
+    std::string srcDir = GetDirPath(indexPath);
+    bool remote = PathAR::IsHttp(srcDir);
+
+    std::vector<ManifestShard> shards;
+    for (const ManifestShard &shard : ReadShardIndex(indexIni))
+        if (isRelevant(shard))
+            shards.push_back(shard);
+    if (printIndent)
+        printf("%sLoading %d shards of %s\n", printIndent, int(shards.size()), indexPath.c_str());
+
+    int n = shards.size();
+    std::vector<std::string> localPaths(n);
+    if (remote) {
+        //shards are cached locally: checksum from index tells if cached copy is still valid
+        std::vector<std::string> urls(n), cachedPaths;
+        std::vector<HashDigest> hashes(n);
+        for (int i = 0; i < n; i++) {
+            urls[i] = PathAR::FromRel(shards[i].path, srcDir).abs;
+            hashes[i] = shards[i].hash;
+            localPaths[i] = PathAR::FromRel(shards[i].path, cacheDir).abs;
+            CreateDirectoriesForFile(localPaths[i], cacheDir);
+            if (IfFileExists(localPaths[i])) {
+                try {
+                    if (GetHashOfChecksummedZip(localPaths[i].c_str()) == hashes[i])
+                        cachedPaths.push_back(localPaths[i]);
+                } catch(const ErrorException &) {
+                    //cached copy is broken: download it again
                 }
-            };
-            threads[t] = std::thread(ThreadFunc);
+            }
         }
-        for (int t = 0; t < thrNum; t++)
-            threads[t].join();
+        Downloader downloader;
+        std::vector<int> matching = DownloadChecksummedZips(downloader, urls, hashes, cachedPaths, localPaths);
+        if (printIndent) {
+            int cnt = std::count(matching.begin(), matching.end(), -1);
+            printf("%s  %d shards downloaded, %d taken from cache\n", printIndent, cnt, n - cnt);
+        }
+    }
+    else {
+        for (int i = 0; i < n; i++)
+            localPaths[i] = PathAR::FromRel(shards[i].path, srcDir).abs;
+    }
 
-        if (workerException)
-            std::rethrow_exception(workerException);
+    Manifest res;
+    for (int i = 0; i < n; i++) {
+        HashDigest hash = GetHashOfChecksummedZip(localPaths[i].c_str());
+        ZipSyncAssertF(hash == shards[i].hash, "Shard %s does not match its checksum in index", shards[i].path.c_str());
+        Manifest mani;
+        mani.ReadFromIniFile(localPaths[i].c_str(), rootDir);
+        res.AppendManifest(mani);
     }
+    return res;
 }
 
 double TotalCompressedSize(const ZipSync::Manifest &mani, bool providedOnly) {
@@ -232,74 +330,149 @@ void DoClean(std::string root) {
     }
 }
 
-void DoNormalize(std::string root, std::string outDir, std::vector<std::string> zipPaths, ProgressIndicator *progress) {
-    double totalSize = 1.0, doneSize = 0.0;
+void DoNormalize(std::string root, std::string outDir, std::vector<std::string> zipPaths, ProgressIndicator *progress, int threadsNum) {
+    uint64_t totalSize = 1;
     for (auto zip : zipPaths)
         totalSize += SizeOfFile(zip);
-    g_logger->infof("Going to normalize %d zips in %s%s of total size %0.3lf MB", int(zipPaths.size()), (root.empty() ? "nowhere" : root.c_str()), (outDir.empty() ? " inplace" : ""), totalSize * 1e-6);
+    g_logger->infof("Going to normalize %d zips in %s%s of total size %0.3lf MB in %d threads", int(zipPaths.size()), (root.empty() ? "nowhere" : root.c_str()), (outDir.empty() ? " inplace" : ""), totalSize * 1e-6, threadsNum);
 
     {
-        for (std::string zip : zipPaths) {
+        ParallelProgress parallelProgress(progress ? progress->GetDownloaderCallback() : GlobalProgressCallback(), totalSize);
+        std::atomic<int> skippedCnt(0);
+        ParallelFor(0, zipPaths.size(), [&](int index) {
+            const std::string &zip = zipPaths[index];
             std::string zipRel = PathAR::FromAbs(zip, root).rel;
-            if (progress) progress->Update(doneSize / totalSize, ("Normalizing \"" + zipRel + "\"...").c_str());
-            doneSize += SizeOfFile(zip);
+            parallelProgress.Add(0, ("Normalizing \"" + zipRel + "\"...").c_str());
+            uint64_t zipSize = SizeOfFile(zip);
+            bool rewritten;
             if (!outDir.empty()) {
                 std::string zipOut = ZipSync::PathAR::FromRel(zipRel, outDir).abs;
                 ZipSync::CreateDirectoriesForFile(zipOut, outDir);
-                ZipSync::minizipNormalize(zip.c_str(), zipOut.c_str());
+                rewritten = ZipSync::minizipNormalize(zip.c_str(), zipOut.c_str());
             }
             else
-                ZipSync::minizipNormalize(zip.c_str());
-        }
+                rewritten = ZipSync::minizipNormalize(zip.c_str());
+            if (!rewritten)
+                skippedCnt++;
+            parallelProgress.Add(zipSize, ("Normalized  \"" + zipRel + "\"").c_str());
+        }, threadsNum, 1, &parallelProgress);
         if (progress) progress->Update(1.0, "Normalizing done");
+        if (skippedCnt > 0)
+            g_logger->infof("%d zips were already normal and were not rewritten", int(skippedCnt));
     }
 }
 
-Manifest DoAnalyze(std::string root, std::vector<std::string> zipPaths, bool autoNormalize, int threadsNum, ProgressIndicator *progress) {
-    double totalSize = 1.0, doneSize = 0.0;
+Manifest DoAnalyze(std::string root, std::vector<std::string> zipPaths, bool autoNormalize, int threadsNum, ProgressIndicator *progress, HashAlgorithm hashAlgo) {
+    double totalSize = 1.0;
     for (auto zip : zipPaths)
         totalSize += SizeOfFile(zip);
     g_logger->infof("Going to analyze %d zips in %s of total size %0.3lf MB in %d threads", int(zipPaths.size()), root.c_str(), totalSize * 1e-6, threadsNum);
 
-    std::vector<Manifest> zipManis(zipPaths.size());
-    {
-        std::mutex mutex;
-        ParallelFor(0, zipPaths.size(), [&](int index) {
-            std::string zipPath = zipPaths[index];
+    //large zips are split into parts by files, so that they don't keep one thread busy while others are idle
+    //note: parts are merged in order, so the resulting manifest is the same as with serial analysis
+    struct ZipPart {
+        int zipIdx;
+        int fromIndex, toIndex;
+        uint64_t size;          //approximate (only for progress)
+        Manifest mani;
+    };
+    //with low priority, analysis runs on dedicated pool (and dedicated thread instead of caller's one)
+    //note: workers of global pool must keep normal priority
+    std::unique_ptr<ThreadPool> lowPool;
+    if (threadsNum != 1)
+        lowPool = CreateLowPriorityPool(threadsNum > 1 ? threadsNum - 1 : 0);
+    ThreadPool &pool = (lowPool ? *lowPool : ThreadPool::Global());
+
+    int hwThreads = (threadsNum <= 0 ? pool.GetThreadsNum() + 1 : threadsNum);
+    double partSize = std::max(totalSize / (4.0 * hwThreads), 16e+6);
+    auto SplitIntoParts = [&](int zipIdx, std::vector<ZipPart> &parts) {
+        const std::string &zipPath = zipPaths[zipIdx];
+        double zipSize = SizeOfFile(zipPath);
+        int filesNum = 0;
+        if (hwThreads > 1 && zipSize > partSize) {
+            unzFile zf = unzOpen(zipPath.c_str());
+            unz_global_info info;
+            if (zf && unzGetGlobalInfo(zf, &info) == UNZ_OK)
+                filesNum = info.number_entry;
+            if (zf)
+                unzClose(zf);
+        }
+        int partsNum = std::min(int(std::ceil(zipSize / partSize)), filesNum);
+        if (partsNum <= 1) {
+            //note: broken zip also gets here (error is reported during analysis)
+            parts.push_back(ZipPart{zipIdx, 0, INT_MAX, uint64_t(zipSize)});
+            return;
+        }
+        for (int p = 0; p < partsNum; p++) {
+            int from = int(int64_t(filesNum) * p / partsNum);
+            int to = int(int64_t(filesNum) * (p+1) / partsNum);
+            parts.push_back(ZipPart{zipIdx, from, to, uint64_t(zipSize * (to - from) / filesNum)});
+        }
+    };
+
+    ParallelProgress parallelProgress(progress ? progress->GetDownloaderCallback() : GlobalProgressCallback(), uint64_t(totalSize));
+    std::mutex mutex;
+    std::set<int> brokenZips;
+    auto AnalyzeParts = [&](std::vector<ZipPart> &parts, bool catchErrors) {
+        ParallelFor(0, parts.size(), [&](int index) {
+            ZipPart &part = parts[index];
+            std::string zipPath = zipPaths[part.zipIdx];
             std::string zipPathRel = PathAR::FromAbs(zipPath, root).rel;
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                if (progress) progress->Update(doneSize / totalSize, "Analysing \"" + zipPathRel + "\"...");
-            }
+            parallelProgress.Add(0, ("Analysing \"" + zipPathRel + "\"...").c_str());
 
-            if (autoNormalize) {
-                try {
-                    //try to analyze "as is"
-                    zipManis[index].AppendLocalZip(zipPath, root, "");
-                }
-                catch(const ErrorException &e) {
-                    zipManis[index].Clear();
-                    //failed: normalize and retry
-                    ZipSync::minizipNormalize(zipPath.c_str());
-                    zipManis[index].AppendLocalZip(zipPath, root, "");
-                }
-            }
-            else {
-                zipManis[index].AppendLocalZip(zipPath, root, "");
+            part.mani.SetHashAlgorithm(hashAlgo);
+            try {
+                AppendManifestsFromLocalZip(zipPath, root, FileLocation::Local, "", part.mani, part.fromIndex, part.toIndex);
             }
-
-            {
+            catch(const ErrorException &e) {
+                if (!catchErrors)
+                    throw;
+                //note: zip cannot be normalized right now: other parts of it may be under analysis
+                part.mani.Clear();
                 std::lock_guard<std::mutex> lock(mutex);
-                doneSize += SizeOfFile(zipPath);
-                if (progress) progress->Update(doneSize / totalSize, "Analysed  \"" + zipPathRel + "\"");
+                brokenZips.insert(part.zipIdx);
             }
-        }, threadsNum);
-        if (progress) progress->Update(1.0, "Analysing done");
+
+            parallelProgress.Add(part.size, ("Analysed  \"" + zipPathRel + "\"").c_str());
+        }, threadsNum, 1, &parallelProgress, pool);
+    };
+
+    std::vector<ZipPart> parts;
+    for (int i = 0; i < zipPaths.size(); i++)
+        SplitIntoParts(i, parts);
+    //try to analyze "as is"
+    RunWithLowPriority([&]() { AnalyzeParts(parts, autoNormalize); });
+
+    if (!brokenZips.empty()) {
+        //failed: normalize and retry
+        std::vector<int> zipIdxs(brokenZips.begin(), brokenZips.end());
+        RunWithLowPriority([&]() {
+            ParallelFor(0, zipIdxs.size(), [&](int index) {
+                ZipSync::minizipNormalize(zipPaths[zipIdxs[index]].c_str());
+            }, threadsNum, 1, &parallelProgress, pool);
+        });
+        std::vector<ZipPart> retryParts;
+        for (int zipIdx : zipIdxs) {
+            parallelProgress.AddTotal(SizeOfFile(zipPaths[zipIdx]));
+            SplitIntoParts(zipIdx, retryParts);
+        }
+        RunWithLowPriority([&]() { AnalyzeParts(retryParts, false); });
+        //replace all parts of broken zips with the new ones
+        parts.erase(std::remove_if(parts.begin(), parts.end(), [&](const ZipPart &p) {
+            return brokenZips.count(p.zipIdx) > 0;
+        }), parts.end());
+        for (ZipPart &part : retryParts)
+            parts.push_back(std::move(part));
+        std::stable_sort(parts.begin(), parts.end(), [](const ZipPart &a, const ZipPart &b) {
+            return a.zipIdx < b.zipIdx;
+        });
     }
+    if (progress) progress->Update(1.0, "Analysing done");
 
     Manifest manifest;
-    for (const auto &tm : zipManis)
-        manifest.AppendManifest(tm);
+    manifest.SetHashAlgorithm(hashAlgo);
+    for (const ZipPart &part : parts)
+        manifest.AppendManifest(part.mani);
     return manifest;
 }
 
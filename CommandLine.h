@@ -4,6 +4,8 @@
 #include <string>
 #include <functional>
 #include "Manifest.h"
+#include "ManifestShards.h"
+#include "ThreadPool.h"
 
 //note: this is a set of utilities extracted from zipsync command line tool
 
@@ -28,13 +30,20 @@ std::string GetPath(std::string path, const std::string &root);
 std::vector<std::string> CollectFilePaths(const std::vector<std::string> &elements, const std::string &root);
 
 std::string DownloadSimple(const std::string &url, const std::string &rootDir, const char *printIndent = "");
+//downloads all given URLs in parallel and returns paths to their local copies (in the same order)
+//every downloaded file is kept in cacheDir together with its ETag/Last-Modified,
+//so unchanged files are revalidated by conditional request instead of being downloaded again
+std::vector<std::string> FetchRemoteFiles(const std::vector<std::string> &urls, const std::string &cacheDir, const char *printIndent = "");
+
+//loads those shards of sharded manifest (given its index) which are accepted by isRelevant, and merges them into one manifest
+//remote shards are kept in cacheDir, and downloaded only if their checksum in index changes
+Manifest FetchShardedManifest(const std::string &indexPath, const IniData &indexIni, const std::string &rootDir, const std::string &cacheDir, const std::function<bool(const ManifestShard&)> &isRelevant, const char *printIndent = "");
 
-void ParallelFor(int from, int to, const std::function<void(int)> &body, int thrNum = -1, int blockSize = 1);
 double TotalCompressedSize(const ZipSync::Manifest &mani, bool providedOnly = true);
 int TotalCount(const ZipSync::Manifest &mani, bool providedOnly = true);
 
 void DoClean(std::string root);
-void DoNormalize(std::string root, std::string outDir, std::vector<std::string> zipPaths, ProgressIndicator *progress = nullptr);
-Manifest DoAnalyze(std::string root, std::vector<std::string> zipPaths, bool autoNormalize, int threadsNum, ProgressIndicator *progress = nullptr);
+void DoNormalize(std::string root, std::string outDir, std::vector<std::string> zipPaths, ProgressIndicator *progress = nullptr, int threadsNum = 1);
+Manifest DoAnalyze(std::string root, std::vector<std::string> zipPaths, bool autoNormalize, int threadsNum, ProgressIndicator *progress = nullptr, HashAlgorithm hashAlgo = HashAlgorithm::Blake2s);
 
 }
@@ -1,17 +1,28 @@
 #include "CommandLine.h"
 #include "ZipSync.h"
 #include "ChecksummedZip.h"
+#include "SharedCache.h"
+#include "LocalCache.h"
 #include "Utils.h"
 #include "StdString.h"
+#include "HttpServer.h"
+#include "Tracing.h"
+#include "ResourceGovernor.h"
 #include "args.hxx"
 #include <stdio.h>
 #include <iostream>
 #include <map>
 #include <random>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <csignal>
 
 using namespace ZipSync;
 
+//remote manifests are cached here (relative to root directory)
+static const char *MANIFESTS_CACHE_DIR = "__manifests__";
 
 class ProgressIndicatorConsole : public ProgressIndicator {
     std::string content;
@@ -64,6 +75,7 @@ void CommandNormalize(args::Subparser &parser) {
     args::ValueFlag<std::string> argRootDir(parser, "root", "Relative paths to zips are based from this directory", {'r', "root"});
     args::PositionalList<std::string> argZips(parser, "zips", "List of files or globs specifying which zips in root directory to include", args::Options::Required);
     args::ValueFlag<std::string> argOutDir(parser, "output", "Write normalized zips to this directory (instead of modifying in-place)", {'o', "output"});
+    args::ValueFlag<int> argThreads(parser, "threads", "Use this number of parallel threads to normalize several zips at once (0 = max)", {'j', "threads"}, 1);
     args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"}, args::Options::HiddenFromDescription);
     parser.Parse();
 
@@ -78,10 +90,57 @@ void CommandNormalize(args::Subparser &parser) {
 
     {
         ProgressIndicatorConsole progress;
-        DoNormalize(root, outDir, zipPaths, &progress);
+        if (argThreads.Get() > 1)
+            ThreadPool::SetGlobalThreadsNum(argThreads.Get() - 1);    //caller's thread works too
+        DoNormalize(root, outDir, zipPaths, &progress, argThreads.Get());
     }
 }
 
+//records timeline while alive, and writes it to file at the end of command (even on early return)
+class TraceSession {
+    std::string _path;
+public:
+    TraceSession(const std::string &path) : _path(path) {
+        if (!_path.empty())
+            TraceStart();
+    }
+    ~TraceSession() {
+        if (_path.empty())
+            return;
+        try {
+            TraceFinish(_path.c_str());
+            printf("Timeline saved to %s\n", _path.c_str());
+        }
+        catch(const std::exception &e) {
+            printf("Failed to save timeline to %s: %s\n", _path.c_str(), e.what());
+        }
+    }
+};
+//flags of resource governor, shared by all disk-heavy commands
+struct ResourceLimitsFlags {
+    args::ValueFlag<double> maxReadSpeed;
+    args::ValueFlag<double> maxWriteSpeed;
+    args::Flag dropCache;
+    args::Flag lowPriority;
+
+    ResourceLimitsFlags(args::Subparser &parser)
+        : maxReadSpeed(parser, "maxReadSpeed", "Limit total speed of reading zips in MB/s (unlimited by default)", {"max-read-speed"}, 0.0)
+        , maxWriteSpeed(parser, "maxWriteSpeed", "Limit total speed of writing zips in MB/s (unlimited by default)", {"max-write-speed"}, 0.0)
+        , dropCache(parser, "dropCache", "Drop processed zips from OS page cache (don't evict data of other programs)", {"drop-cache"})
+        , lowPriority(parser, "lowPriority", "Lower CPU and I/O priority of threads processing zips", {"low-priority"})
+    {}
+    void Apply() {
+        ResourceLimits limits;
+        limits.maxReadSpeed = int64_t(std::max(maxReadSpeed.Get(), 0.0) * 1e+6);
+        limits.maxWriteSpeed = int64_t(std::max(maxWriteSpeed.Get(), 0.0) * 1e+6);
+        limits.dropPageCache = dropCache;
+        limits.lowPriority = lowPriority;
+        SetResourceLimits(limits);
+    }
+};
+
+static const char *TRACE_FLAG_HELP = "Write timeline of all phases to this file in Chrome trace format (open in chrome://tracing or ui.perfetto.dev)";
+
 void CommandAnalyze(args::Subparser &parser) {
     args::ValueFlag<std::string> argRootDir(parser, "root", "Manifests would contain paths relative to this root directory\n"
         "(all relative paths are based from the root directory)", {'r', "root"});
@@ -89,6 +148,9 @@ void CommandAnalyze(args::Subparser &parser) {
     args::Flag argNormalize(parser, "normalize", "Run \"normalize\" command before analysis (on demand)", {'n', "normalize"});
     args::ValueFlag<std::string> argManifest(parser, "mani", "Path where full manifest would be written (default: manifest.iniz)", {'m', "manifest"}, "manifest.iniz");
     args::ValueFlag<int> argThreads(parser, "threads", "Use this number of parallel threads to accelerate analysis (0 = max)", {'j', "threads"}, 1);
+    args::ValueFlag<std::string> argHash(parser, "hash", "Hash function for files: blake2s (default) or blake2sp (faster on multicore/SIMD, needs updater which supports it)", {"hash"}, "blake2s");
+    args::ValueFlag<std::string> argTrace(parser, "trace", TRACE_FLAG_HELP, {"trace"});
+    ResourceLimitsFlags argLimits(parser);
     args::PositionalList<std::string> argZips(parser, "zips", "List of files or globs specifying which zips in root directory to analyze", args::Options::Required);
     args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"}, args::Options::HiddenFromDescription);
     parser.Parse();
@@ -99,6 +161,11 @@ void CommandAnalyze(args::Subparser &parser) {
     root = NormalizeSlashes(root);
     std::string maniPath = GetPath(argManifest.Get(), root);
     int threadsNum = argThreads.Get();
+    if (threadsNum > 1)
+        ThreadPool::SetGlobalThreadsNum(threadsNum - 1);    //caller's thread works too
+    HashAlgorithm hashAlgo = ParseHashAlgorithm(argHash.Get().c_str());
+    TraceSession trace(argTrace ? GetPath(argTrace.Get(), root) : "");
+    argLimits.Apply();
 
     if (argClean)
         DoClean(root);
@@ -107,10 +174,29 @@ void CommandAnalyze(args::Subparser &parser) {
     Manifest manifest;
     {
         ProgressIndicatorConsole progress;
-        manifest = DoAnalyze(root, zipPaths, argNormalize, threadsNum, &progress);
+        manifest = DoAnalyze(root, zipPaths, argNormalize, threadsNum, &progress, hashAlgo);
     }
     g_logger->infof("Saving manifest to %s", maniPath.c_str());
-    WriteIniFile(maniPath.c_str(), manifest.WriteToIni());
+    manifest.WriteToIniFile(maniPath.c_str());
+}
+
+//fetches all remote manifests at once (reusing cached copies if they did not change on server)
+//returns mapping from given path/URL to local path to be read
+static std::map<std::string, std::string> FetchManifests(const std::vector<std::string> &paths, const std::string &root, const char *printIndent = "") {
+    std::map<std::string, std::string> localPaths;
+    std::vector<std::string> urls;
+    for (const std::string &path : paths) {
+        if (PathAR::IsHttp(path))
+            urls.push_back(path);
+        else
+            localPaths[path] = path;
+    }
+    if (!urls.empty()) {
+        std::vector<std::string> fetched = FetchRemoteFiles(urls, root + "/" + MANIFESTS_CACHE_DIR, printIndent);
+        for (int i = 0; i < urls.size(); i++)
+            localPaths[urls[i]] = fetched[i];
+    }
+    return localPaths;
 }
 
 void CommandDiff(args::Subparser &parser) {
@@ -137,31 +223,37 @@ void CommandDiff(args::Subparser &parser) {
     CreateDirectories(outRoot);
 
     Manifest fullMani;
-    fullMani.ReadFromIni(ReadIniFile(maniPath.c_str()), root);
+    fullMani.ReadFromIniFile(maniPath.c_str(), root);
     printf("Subtracting from %s containing %d files of size %0.3lf MB:\n", 
         maniPath.c_str(), TotalCount(fullMani), TotalCompressedSize(fullMani) * 1e-6
     );
     std::set<HashDigest> subtractedHashes;
-    for (std::string path : argSubtractedMani.Get()) {
-        path = NormalizeSlashes(path);
-        std::string localPath = path;
-        if (PathAR::IsHttp(path))
-            localPath = DownloadSimple(path, outRoot, "  ");
+    std::set<HashDigest> subtractedZipDigests;
+    std::vector<std::string> subtractedPaths;
+    for (const std::string &path : argSubtractedMani.Get())
+        subtractedPaths.push_back(NormalizeSlashes(path));
+    std::map<std::string, std::string> localPaths = FetchManifests(subtractedPaths, root, "  ");
+    for (const std::string &path : subtractedPaths) {
+        const std::string &localPath = localPaths[path];
         std::string providedRoot = GetDirPath(path);
         Manifest mani;
-        mani.ReadFromIni(ReadIniFile(localPath.c_str()), providedRoot);
+        mani.ReadFromIniFile(localPath.c_str(), providedRoot);
         printf("   %s containing %d files of size %0.3lf MB\n", 
             path.c_str(), TotalCount(mani), TotalCompressedSize(mani) * 1e-6
         );
         for (int i = 0; i < mani.size(); i++)
             subtractedHashes.insert(mani[i].compressedHash);
+        for (const auto &pZD : ComputeZipDigests(mani))
+            subtractedZipDigests.insert(pZD.second);
     }
 
+    //zips present in subtracted manifests as a whole are subtracted without looking at their files
+    std::map<std::string, HashDigest> fullZipDigests = ComputeZipDigests(fullMani);
     Manifest filteredMani;
     Manifest subtractedMani;
     for (int i = 0; i < fullMani.size(); i++) {
         auto &pf = fullMani[i];
-        if (subtractedHashes.count(pf.compressedHash))
+        if (subtractedZipDigests.count(fullZipDigests[pf.zipPath.rel]) || subtractedHashes.count(pf.compressedHash))
             subtractedMani.AppendFile(pf);
         else
             filteredMani.AppendFile(pf);
@@ -187,7 +279,7 @@ void CommandDiff(args::Subparser &parser) {
         fullMani.AppendFile(pf);
     }
     printf("Saving manifest of the diff to %s\n", outManiPath.c_str());
-    WriteIniFile(outManiPath.c_str(), fullMani.WriteToIni());
+    fullMani.WriteToIniFile(outManiPath.c_str());
 }
 
 void CommandPatch(args::Subparser &parser) {
@@ -210,10 +302,10 @@ void CommandPatch(args::Subparser &parser) {
 
     printf("Reading patch manifest %s and base manifest %s\n", patchManiPath.c_str(), baseManiPath.c_str());
     Manifest patchMani, baseMani;
-    patchMani.ReadFromIni(ReadIniFile(patchManiPath.c_str()), root);
+    patchMani.ReadFromIniFile(patchManiPath.c_str(), root);
     if (PathAR::IsHttp(baseManiPath))
         baseManiPath = DownloadSimple(baseManiPath, root, "  ");
-    baseMani.ReadFromIni(ReadIniFile(baseManiPath.c_str()), root);
+    baseMani.ReadFromIniFile(baseManiPath.c_str(), root);
 
     std::map<std::string, ManifestIter> fullnameToIter;
     for (int i = 0; i < patchMani.size(); i++) {
@@ -238,8 +330,8 @@ void CommandPatch(args::Subparser &parser) {
             //overriden by patch
             ManifestIter iter = mit->second;
             usedPatchIds[iter._index] = true;
-            printf("  Replaced %s: size %u -> %u  hash %s -> %s\n",
-                fullname.c_str(), iter->props.contentsSize, mf.props.contentsSize,
+            printf("  Replaced %s: size %llu -> %llu  hash %s -> %s\n",
+                fullname.c_str(), (unsigned long long)iter->props.contentsSize, (unsigned long long)mf.props.contentsSize,
                 iter->contentsHash.Hex().c_str(), mf.contentsHash.Hex().c_str()
             );
         }
@@ -255,14 +347,14 @@ void CommandPatch(args::Subparser &parser) {
             continue;
         const FileMetainfo &mf = patchMani[i];
         std::string fullname = GetFullPath(mf.zipPath.rel, mf.filename);
-        printf("  Added %s: size %u  hash %s\n",
-            fullname.c_str(), mf.props.contentsSize,
+        printf("  Added %s: size %llu  hash %s\n",
+            fullname.c_str(), (unsigned long long)mf.props.contentsSize,
             mf.contentsHash.Hex().c_str()
         );
     }
 
     printf("Saving resulting manifest to %s\n", outManiPath.c_str());
-    WriteIniFile(outManiPath.c_str(), outMani.WriteToIni());
+    outMani.WriteToIniFile(outManiPath.c_str());
 }
 
 void CommandReplace(args::Subparser &parser) {
@@ -286,7 +378,7 @@ void CommandReplace(args::Subparser &parser) {
     std::vector<std::string> providManiPaths = CollectFilePaths(argProvidedMani.Get(), root);
 
     Manifest mainManifest;
-    mainManifest.ReadFromIni(ReadIniFile(modifiedManiPath.c_str()), root);
+    mainManifest.ReadFromIniFile(modifiedManiPath.c_str(), root);
     Manifest mainProvidedManifest, mainTargetOnlyManifest;
     for (int i = 0; i < mainManifest.size(); i++) {
         if (mainManifest[i].location == FileLocation::Nowhere)
@@ -305,13 +397,12 @@ void CommandReplace(args::Subparser &parser) {
 
     printf("Additional %d provided manifests:\n", (int)providManiPaths.size());
     Manifest providedManifest = mainProvidedManifest;
+    std::map<std::string, std::string> localPaths = FetchManifests(providManiPaths, root, "  ");
     for (std::string provManiPath : providManiPaths) {
         std::string srcDir = GetDirPath(provManiPath);
-        std::string provManiLocalPath = provManiPath;
-        if (PathAR::IsHttp(provManiPath))
-            provManiLocalPath = DownloadSimple(provManiPath, root, "  ");
+        std::string provManiLocalPath = localPaths[provManiPath];
         Manifest mani;
-        mani.ReadFromIni(ReadIniFile(provManiLocalPath.c_str()), srcDir);
+        mani.ReadFromIniFile(provManiLocalPath.c_str(), srcDir);
         mani = mani.Filter([](const FileMetainfo &f) {
             return f.location != FileLocation::Nowhere;
         });
@@ -348,9 +439,9 @@ void CommandReplace(args::Subparser &parser) {
                     }
                 }
                 ZipSyncAssertF(dstIter, "Destination file with contents hash %s not provided", dstHash.Hex().c_str());
-                printf("  %s -> %s\n    (size: %u / %u;  hashes: %s / %s)\n",
+                printf("  %s -> %s\n    (size: %llu / %llu;  hashes: %s / %s)\n",
                     srcHash.Hex().c_str(), GetFullPath(dstIter->zipPath.abs, dstIter->filename).c_str(),
-                    dstIter->props.contentsSize, dstIter->props.compressedSize,
+                    (unsigned long long)dstIter->props.contentsSize, (unsigned long long)dstIter->props.compressedSize,
                     dstIter->contentsHash.Hex().c_str(), dstIter->compressedHash.Hex().c_str()
                 );
                 replacementMap[srcHash] = dstIter;
@@ -393,18 +484,106 @@ void CommandReplace(args::Subparser &parser) {
     });
     mainManifest.AppendManifest(mainTargetOnlyManifest);
     printf("Saving resulting manifest to %s\n", modifiedManiPath.c_str());
-    WriteIniFile(modifiedManiPath.c_str(), mainManifest.WriteToIni());
+    mainManifest.WriteToIniFile(modifiedManiPath.c_str());
 
     if (argClean.Get())
         DoClean(root);
 }
 
+//checks that installation (described by manifest left after previous update) matches target exactly
+//this is done by comparing root digests only, without looking at individual files
+static bool IsInstallationUpToDate(const std::string &root, const std::string &installedManiPath, const ManifestDigests &targetDigests, const std::vector<std::string> &managedZips) {
+    if (!IfFileExists(installedManiPath))
+        return false;
+    if (!targetDigests.present)
+        return false;
+    std::vector<uint8_t> installedText = ReadIniText(installedManiPath.c_str());
+    ManifestDigests installedDigests;
+    if (!ReadManifestDigests(std::string_view((const char*)installedText.data(), installedText.size()), installedDigests))
+        return false;
+    if (!(targetDigests.root == installedDigests.root))
+        return false;
+    //managed zips which are not in target must be removed
+    for (const std::string &zip : managedZips)
+        if (!targetDigests.zips.count(PathAR::FromAbs(zip, root).rel))
+            return false;
+    //zips must not be changed after manifest was written: same size as recorded in it, and older than it
+    //note: zip with the same modification time as manifest is considered changed (timestamps may be coarse)
+    uint64_t maniSize, zipSize;
+    int64_t maniTime, maniTimeNsec, zipTime, zipTimeNsec;
+    if (!GetFileStat(installedManiPath, maniSize, maniTime, maniTimeNsec))
+        return false;
+    for (const auto &pZD : targetDigests.zips) {
+        auto iter = installedDigests.zipSizes.find(pZD.first);
+        if (iter == installedDigests.zipSizes.end())
+            return false;
+        std::string zipPath = PathAR::FromRel(pZD.first, root).abs;
+        if (!GetFileStat(zipPath, zipSize, zipTime, zipTimeNsec) || zipSize != iter->second)
+            return false;
+        if (std::make_pair(zipTime, zipTimeNsec) >= std::make_pair(maniTime, maniTimeNsec))
+            return false;
+    }
+    return true;
+}
+
+//prints all counters of update as "name = value" lines (easy to parse and aggregate)
+static void PrintUpdateStats(const UpdateMetrics &m) {
+    const DownloaderMetrics &d = m.download;
+    auto Seconds = [](int64_t us) { return us * 1e-6; };
+    printf("Update statistics:\n");
+    printf("  time.plan = %0.3lf\n", m.timePlan);
+    printf("  time.download = %0.3lf\n", m.timeDownload);
+    printf("  time.verify = %0.3lf\n", m.timeVerify);
+    printf("  time.repack = %0.3lf\n", m.timeRepack);
+    printf("  download.files = %d\n", m.filesDownloaded);
+    printf("  download.filesResumed = %d\n", m.filesResumed);
+    printf("  download.filesSharedCache = %d\n", m.filesFromSharedCache);
+    printf("  download.bytesSharedCache = %llu\n", (unsigned long long)m.bytesFromSharedCache);
+    printf("  download.bytes = %lld\n", (long long)d.bytesDownloaded);
+    printf("  download.bytesUseful = %lld\n", (long long)d.bytesUseful);
+    printf("  download.requests = %d\n", d.requestsCount);
+    printf("  download.multipartRequests = %d\n", d.multipartRequests);
+    printf("  download.multipartParts = %d\n", d.multipartParts);
+    printf("  download.throttlePauses = %d\n", d.throttlePauses);
+    for (int i = 0; i < sizeof(d.retriesPerProfile) / sizeof(d.retriesPerProfile[0]); i++)
+        if (d.retriesPerProfile[i] > 0)
+            printf("  download.retries.profile%d = %d\n", i, d.retriesPerProfile[i]);
+    printf("  download.time.dns = %0.3lf\n", Seconds(d.timings.dns));
+    printf("  download.time.connect = %0.3lf\n", Seconds(d.timings.connect));
+    printf("  download.time.tls = %0.3lf\n", Seconds(d.timings.tls));
+    printf("  download.time.wait = %0.3lf\n", Seconds(d.timings.wait));
+    printf("  download.time.transfer = %0.3lf\n", Seconds(d.timings.transfer));
+    printf("  repack.zipsRenamed = %d\n", m.zipsRenamed);
+    printf("  repack.zipsRepacked = %d\n", m.zipsRepacked);
+    printf("  repack.zipsReduced = %d\n", m.zipsReduced);
+    printf("  repack.entriesCopiedRaw = %d\n", m.entriesCopiedRaw);
+    printf("  repack.entriesRecompressed = %d\n", m.entriesRecompressed);
+    printf("  repack.bytesRead = %llu\n", (unsigned long long)m.bytesRepackRead);
+    printf("  repack.bytesWritten = %llu\n", (unsigned long long)m.bytesRepackWritten);
+    printf("  hash.bytes = %llu\n", (unsigned long long)m.bytesHashed);
+    printf("  hash.time = %0.3lf\n", m.timeHashing);
+    printf("  hash.throughputMBps = %0.1lf\n", m.timeHashing > 0.0 ? m.bytesHashed * 1e-6 / m.timeHashing : 0.0);
+    printf("  memory.peakBuffers = %zu\n", m.peakBufferMemory);
+}
+
 void CommandUpdate(args::Subparser &parser) {
     args::ValueFlag<std::string> argRootDir(parser, "root", "The update should create/update the set of zips in this root directory\n"
         "(all relative paths are based from the root directory)", {'r', "root"});
     args::ValueFlag<std::string> argTargetMani(parser, "trgMani", "Path to the target manifest to update to", {'t', "target"}, "manifest.iniz", args::Options::Required);
     args::ValueFlagList<std::string> argProvidedMani(parser, "provMani", "Path to additional provided manifests describing where to take files from", {'p', "provided"}, {});
     args::Flag argClean(parser, "clean", "Run \"clean\" command before and after update", {'c', "clean"});
+    args::ValueFlag<std::string> argSharedCache(parser, "sharedCache", "Directory with cache of downloaded files, which can be shared between several installations", {"shared-cache"});
+    args::ValueFlag<double> argSharedCacheSize(parser, "sharedCacheSize", "Maximum size of shared cache in MB (unlimited by default)", {"shared-cache-size"}, 0.0);
+    args::ValueFlag<std::string> argLocalCache(parser, "localCache", "Directory where files no longer used after update are kept (to be reused by future updates)", {"local-cache"});
+    args::ValueFlag<double> argLocalCacheSize(parser, "localCacheSize", "Maximum size of local cache in MB (unlimited by default)", {"local-cache-size"}, 0.0);
+    args::ValueFlag<std::string> argDelta(parser, "delta", "Path or URL of manifest delta from the installed version to target (full target manifest is used if delta does not apply)", {"delta"});
+    args::ValueFlagList<std::string> argPackages(parser, "package", "For sharded target manifest: load only shards containing these packages", {"package"}, {});
+    args::ValueFlag<std::string> argTrace(parser, "trace", TRACE_FLAG_HELP, {"trace"});
+    args::Flag argStats(parser, "stats", "Print detailed statistics of all update phases at the end", {"stats"});
+    args::ValueFlag<double> argMaxSpeed(parser, "maxSpeed", "Limit total download speed in MB/s (unlimited by default)", {"max-speed"}, 0.0);
+    args::ValueFlag<std::string> argCas(parser, "cas", "Root URL of content-addressed store (created by \"cas-export\") to download any missing file from", {"cas"});
+    args::ValueFlag<int> argConnections(parser, "connections", "Maximum number of parallel HTTP connections (default: 8 with content-addressed store, 1 otherwise)", {"connections"}, 0);
+    ResourceLimitsFlags argLimits(parser);
     args::PositionalList<std::string> argManagedZips(parser, "managed", "List of files or globs specifying which zips must be updated");
     args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"}, args::Options::HiddenFromDescription);
     parser.Parse();
@@ -415,6 +594,8 @@ void CommandUpdate(args::Subparser &parser) {
     root = NormalizeSlashes(root);
     std::string targetManiPath = GetPath(argTargetMani.Get(), root);
     CreateDirectories(root);
+    TraceSession trace(argTrace ? GetPath(argTrace.Get(), root) : "");
+    argLimits.Apply();
     if (argClean.Get())
         DoClean(root);
 
@@ -423,10 +604,62 @@ void CommandUpdate(args::Subparser &parser) {
 
     Manifest targetManifest;
     Manifest providedManifest;
-    std::string targetManiLocalPath = targetManiPath;
-    if (PathAR::IsHttp(targetManiPath))
-        targetManiLocalPath = DownloadSimple(targetManiPath, root, "");
-    targetManifest.ReadFromIni(ReadIniFile(targetManiLocalPath.c_str()), root);
+    bool targetFromDelta = false;
+    std::string installedManiPath = GetPath("manifest.iniz", root);
+    if (argDelta && IfFileExists(installedManiPath)) {
+        //try to obtain target manifest by applying delta to the manifest of installed version
+        std::string deltaPath = GetPath(argDelta.Get(), root);
+        std::string deltaLocalPath = FetchManifests({deltaPath}, root, "")[deltaPath];
+        Manifest installedManifest;
+        installedManifest.ReadFromIniFile(installedManiPath.c_str(), root);
+        try {
+            std::vector<uint8_t> deltaText = ReadIniText(deltaLocalPath.c_str());
+            targetManifest = ApplyManifestDelta(installedManifest, std::string_view((const char*)deltaText.data(), deltaText.size()), root);
+            targetFromDelta = true;
+            printf("Target manifest obtained by applying delta %s\n", deltaPath.c_str());
+        }
+        catch(const ErrorException &e) {
+            printf("Cannot apply delta %s: %s\n", deltaPath.c_str(), e.what());
+        }
+    }
+    std::vector<std::string> allManiPaths = providManiPaths;
+    if (!targetFromDelta)
+        allManiPaths.insert(allManiPaths.begin(), targetManiPath);
+    std::map<std::string, std::string> localPaths = FetchManifests(allManiPaths, root, "");
+    if (!targetFromDelta) {
+        std::string targetManiLocalPath = localPaths[targetManiPath];
+        std::vector<uint8_t> targetText = ReadIniText(targetManiLocalPath.c_str());
+        std::string_view targetView((const char*)targetText.data(), targetText.size());
+        if (IsShardIndex(targetView)) {
+            //sharded manifest: load only shards which describe managed zips or selected packages
+            std::set<std::string> managedRel, packages(argPackages.Get().begin(), argPackages.Get().end());
+            for (const std::string &zip : managedZips)
+                managedRel.insert(PathAR::FromAbs(zip, root).rel);
+            auto IsRelevant = [&](const ManifestShard &shard) -> bool {
+                if (managedRel.empty() && packages.empty())
+                    return true;
+                for (const std::string &zip : shard.zips)
+                    if (managedRel.count(zip))
+                        return true;
+                for (const std::string &pkg : shard.packages)
+                    if (packages.count(pkg))
+                        return true;
+                return false;
+            };
+            targetManifest = FetchShardedManifest(targetManiPath, ParseIniData(targetView), root, root + "/" + MANIFESTS_CACHE_DIR, IsRelevant, "");
+        }
+        else {
+            //files and digests are collected in one pass over the text
+            ManifestDigests targetDigests;
+            targetManifest.ReadFromIniText(targetView, root, &targetDigests);
+            if (targetManiLocalPath != installedManiPath && IsInstallationUpToDate(root, installedManiPath, targetDigests, managedZips)) {
+                printf("Directory %s is already up-to-date with target %s\n", root.c_str(), targetManiPath.c_str());
+                if (argClean.Get())
+                    DoClean(root);
+                return;
+            }
+        }
+    }
     printf("Updating directory %s to target %s with %d files of size %0.3lf MB\n",
         root.c_str(), targetManiPath.c_str(), TotalCount(targetManifest, false), TotalCompressedSize(targetManifest, false) * 1e-6
     );
@@ -444,11 +677,9 @@ void CommandUpdate(args::Subparser &parser) {
     }
     for (std::string provManiPath : providManiPaths) {
         std::string srcDir = GetDirPath(provManiPath);
-        std::string provManiLocalPath = provManiPath;
-        if (PathAR::IsHttp(provManiPath))
-            provManiLocalPath = DownloadSimple(provManiPath, root, "  ");
+        std::string provManiLocalPath = localPaths[provManiPath];
         Manifest mani;
-        mani.ReadFromIni(ReadIniFile(provManiLocalPath.c_str()), srcDir);
+        mani.ReadFromIniFile(provManiLocalPath.c_str(), srcDir);
         mani = mani.Filter([](const FileMetainfo &f) {
             return f.location != FileLocation::Nowhere;
         });
@@ -460,6 +691,26 @@ void CommandUpdate(args::Subparser &parser) {
 
     UpdateProcess update;
     update.Init(targetManifest, providedManifest, root);
+    std::unique_ptr<SharedCache> sharedCache;
+    if (argSharedCache) {
+        double sizeMB = argSharedCacheSize.Get();
+        sharedCache.reset(new SharedCache(GetPath(argSharedCache.Get(), root), sizeMB > 0.0 ? uint64_t(sizeMB * 1e+6) : UINT64_MAX));
+        printf("Using shared cache at %s\n", sharedCache->GetRootDir().c_str());
+        update.SetSharedCache(sharedCache.get());
+    }
+    std::unique_ptr<LocalCache> localCache;
+    if (argLocalCache) {
+        double sizeMB = argLocalCacheSize.Get();
+        localCache.reset(new LocalCache());
+        localCache->Init(GetPath(argLocalCache.Get(), root), sizeMB > 0.0 ? uint64_t(sizeMB * 1e+6) : UINT64_MAX);
+        printf("Using local cache at %s with %d files\n", localCache->GetCacheDir().c_str(), localCache->GetManifest().size());
+        update.SetLocalCache(localCache.get());
+    }
+    if (argCas) {
+        std::string casUrl = NormalizeSlashes(argCas.Get());
+        printf("Using content-addressed store at %s\n", casUrl.c_str());
+        update.AddRemoteCas(casUrl);
+    }
     if (managedZips.size())
         printf("Managing %d zip files\n", (int)managedZips.size());
     for (int i = 0; i < managedZips.size(); i++)
@@ -478,11 +729,11 @@ void CommandUpdate(args::Subparser &parser) {
         int k = std::min(n, 10);
         printf("Here are some of the missing files (%d out of %d):\n", k, n);
         for (int i = 0; i < k; i++) {
-            printf("  %s||%s of size = %d/%d with hash = %s/%s\n",
+            printf("  %s||%s of size = %llu/%llu with hash = %s/%s\n",
                 misses[i]->zipPath.rel.c_str(),
                 misses[i]->filename.c_str(),
-                misses[i]->props.compressedSize,
-                misses[i]->props.contentsSize,
+                (unsigned long long)misses[i]->props.compressedSize,
+                (unsigned long long)misses[i]->props.contentsSize,
                 misses[i]->compressedHash.Hex().c_str(),
                 misses[i]->contentsHash.Hex().c_str()
             );
@@ -495,8 +746,8 @@ void CommandUpdate(args::Subparser &parser) {
     int numTotal = 0, numRemote = 0;
     for (int i = 0; i < update.MatchCount(); i++) {
         const auto &m = update.GetMatch(i);
-        uint32_t size = m.provided->byterange[1] - m.provided->byterange[0];
-        if (m.provided->location == FileLocation::RemoteHttp) {
+        uint64_t size = m.provided->byterange[1] - m.provided->byterange[0];
+        if (m.provided->location == FileLocation::RemoteHttp || m.provided->location == FileLocation::RemoteCas) {
             numRemote++;
             bytesRemote += size;
         }
@@ -509,13 +760,24 @@ void CommandUpdate(args::Subparser &parser) {
     printf("Downloading missing files...\n");
     {
         ProgressIndicatorConsole progress;
-        update.DownloadRemoteFiles([&progress](double ratio, const char *comment) -> int {
+        Downloader downloader;
+        downloader.SetProgressCallback([&progress](double ratio, const char *comment) -> int {
             return progress.Update(ratio, comment);
         });
+        if (argMaxSpeed.Get() > 0.0)
+            downloader.SetBandwidthLimit(int64_t(argMaxSpeed.Get() * 1e+6));
+        //many small objects from content-addressed store are downloaded efficiently only in parallel
+        int connections = argConnections.Get();
+        downloader.SetMaxConnections(connections > 0 ? connections : (argCas ? 8 : 1));
+        update.DownloadRemoteFiles(downloader, GlobalProgressCallback());
         progress.Update(1.0, "All downloads complete");
     }
     printf("Repacking zips...\n");
     update.RepackZips();
+    if (localCache) {
+        printf("Moving old files to local cache...\n");
+        update.RemoveOldZips(localCache.get());
+    }
     Manifest provMani = update.GetProvidedManifest();
 
     provMani = provMani.Filter([](const FileMetainfo &f) {
@@ -523,10 +785,88 @@ void CommandUpdate(args::Subparser &parser) {
     });
     std::string resManiPath = GetPath("manifest.iniz", root);
     printf("Saving resulting manifest to %s\n", resManiPath.c_str());
-    WriteIniFile(resManiPath.c_str(), provMani.WriteToIni());
+    provMani.WriteToIniFile(resManiPath.c_str());
 
     if (argClean.Get())
         DoClean(root);
+    if (argStats)
+        PrintUpdateStats(update.GetMetrics());
+}
+
+void CommandShard(args::Subparser &parser) {
+    args::ValueFlag<std::string> argRootDir(parser, "root", "The manifest and the generated shards are located in this root directory\n"
+        "(all relative paths are based from it)", {'r', "root"});
+    args::ValueFlag<std::string> argManifest(parser, "mani", "Path to the full manifest to be split into shards", {'m', "manifest"}, "manifest.iniz");
+    args::ValueFlag<std::string> argOutIndex(parser, "index", "Path to the index of shards to be written", {'o', "output"}, "manifest_index.ini");
+    args::Flag argByPackage(parser, "byPackage", "Make one shard per package instead of one shard per zip", {"by-package"});
+    args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"}, args::Options::HiddenFromDescription);
+    parser.Parse();
+
+    std::string root = GetCwd();
+    if (argRootDir)
+        root = argRootDir.Get();
+    root = NormalizeSlashes(root);
+    std::string maniPath = GetPath(argManifest.Get(), root);
+    std::string indexPath = GetPath(argOutIndex.Get(), root);
+    ZipSyncAssertF(GetDirPath(indexPath) == root, "Index of shards must be in root directory %s", root.c_str());
+
+    Manifest mani;
+    mani.ReadFromIniFile(maniPath.c_str(), root);
+    ShardingMode mode = (argByPackage.Get() ? ShardingMode::PerPackage : ShardingMode::PerZip);
+    std::vector<ManifestShard> shards = WriteManifestShards(mani, root, mode);
+    printf("Split manifest %s with %d files into %d shards\n", maniPath.c_str(), TotalCount(mani, false), int(shards.size()));
+    printf("Saving index of shards to %s\n", indexPath.c_str());
+    WriteIniFile(indexPath.c_str(), WriteShardIndex(shards));
+}
+
+void CommandDelta(args::Subparser &parser) {
+    args::ValueFlag<std::string> argBaseMani(parser, "base", "Path to manifest of the previous version", {'b', "base"}, args::Options::Required);
+    args::ValueFlag<std::string> argNewMani(parser, "mani", "Path to manifest of the new version", {'m', "manifest"}, "manifest.iniz");
+    args::ValueFlag<std::string> argOutDelta(parser, "output", "Path to the manifest delta to be written", {'o', "output"}, "manifest_delta.iniz");
+    args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"}, args::Options::HiddenFromDescription);
+    parser.Parse();
+
+    std::string root = GetCwd();
+    std::string baseManiPath = GetPath(argBaseMani.Get(), root);
+    std::string newManiPath = GetPath(argNewMani.Get(), root);
+    std::string deltaPath = GetPath(argOutDelta.Get(), root);
+
+    Manifest baseMani, newMani;
+    baseMani.ReadFromIniFile(baseManiPath.c_str(), GetDirPath(baseManiPath));
+    newMani.ReadFromIniFile(newManiPath.c_str(), GetDirPath(newManiPath));
+    std::string delta = WriteManifestDelta(baseMani, newMani);
+    //check that delta works
+    ApplyManifestDelta(baseMani, delta, GetDirPath(newManiPath));
+    printf("Saving delta from %s to %s with %d bytes to %s\n", baseManiPath.c_str(), newManiPath.c_str(), int(delta.size()), deltaPath.c_str());
+    WriteIniText(deltaPath.c_str(), delta);
+}
+
+void CommandCasExport(args::Subparser &parser) {
+    args::ValueFlag<std::string> argRootDir(parser, "root", "The manifest and the zips it describes are located in this root directory\n"
+        "(all relative paths are based from it)", {'r', "root"});
+    args::ValueFlag<std::string> argManifest(parser, "mani", "Path to the manifest of the set of zips to be exported", {'m', "manifest"}, "manifest.iniz");
+    args::ValueFlag<std::string> argOutDir(parser, "output", "Root directory of content-addressed store to be served over HTTP (objects are put into its \"cas\" subdirectory)", {'o', "output"}, args::Options::Required);
+    args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"}, args::Options::HiddenFromDescription);
+    parser.Parse();
+
+    std::string root = GetCwd();
+    if (argRootDir)
+        root = argRootDir.Get();
+    root = NormalizeSlashes(root);
+    std::string maniPath = GetPath(argManifest.Get(), root);
+    std::string outDir = GetPath(argOutDir.Get(), root);
+
+    Manifest mani;
+    mani.ReadFromIniFile(maniPath.c_str(), root);
+    CreateDirectories(outDir);
+    int newObjects = 0;
+    {
+        ProgressIndicatorConsole progress;
+        newObjects = ExportToCas(mani, outDir, progress.GetDownloaderCallback());
+    }
+    printf("Exported %d files of size %0.3lf MB from %s: %d new objects written to %s\n",
+        TotalCount(mani), TotalCompressedSize(mani) * 1e-6, maniPath.c_str(), newObjects, outDir.c_str()
+    );
 }
 
 void CommandHashzip(args::Subparser &parser) {
@@ -546,6 +886,44 @@ void CommandHashzip(args::Subparser &parser) {
     WriteChecksummedZip(outPath.c_str(), data.data(), data.size(), filename.c_str());
 }
 
+static std::atomic<bool> g_serveStopRequested(false);
+void CommandServe(args::Subparser &parser) {
+    args::ValueFlag<std::string> argRootDir(parser, "root", "Files inside this directory are served (URL path is relative to it)", {'r', "root"});
+    args::ValueFlag<int> argPort(parser, "port", "TCP port to listen on", {'p', "port"}, HttpServer::PORT_DEFAULT);
+    args::ValueFlag<int> argThreads(parser, "threads", "Number of threads serving connections (0 = max)", {'j', "threads"}, 0);
+    args::ValueFlag<int> argOpenFiles(parser, "openFiles", "Maximum number of files kept open between requests", {"open-files"}, 256);
+    parser.Parse();
+
+    std::string root = GetCwd();
+    if (argRootDir)
+        root = argRootDir.Get();
+    root = NormalizeSlashes(root);
+    while (root.size() > 1 && root.back() == '/')
+        root.pop_back();
+    int threadsNum = argThreads.Get();
+    if (threadsNum <= 0)
+        threadsNum = std::max(int(std::thread::hardware_concurrency()), 1);
+
+    HttpServer server;
+    server.SetRootDir(root);
+    server.SetPortNumber(argPort.Get());
+    server.SetThreadPoolSize(threadsNum);
+    server.SetZeroCopy(true);
+    server.SetFileCacheSize(argOpenFiles.Get());
+    server.Start();
+    printf("Serving %s on port %d with %d threads (press Ctrl+C to stop)\n", root.c_str(), argPort.Get(), threadsNum);
+    fflush(stdout);
+
+    auto OnSignal = [](int) { g_serveStopRequested = true; };
+    std::signal(SIGINT, OnSignal);
+    std::signal(SIGTERM, OnSignal);
+    while (!g_serveStopRequested)
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    server.Stop();
+    printf("Stopped after serving %d requests\n", server.GetRequestsCount());
+}
+
 int main(int argc, char **argv) {
     args::ArgumentParser parser("ZipSync command line tool.");
     parser.helpParams.programName = "zipsync";
@@ -559,8 +937,12 @@ int main(int argc, char **argv) {
     args::Command diff(parser, "diff", "Produce differential package, containing only those files from the set of zips which are not provided by given manifests", CommandDiff);
     args::Command patch(parser, "patch", "Create differential package from zipped set of file, which are to be added/overwriten on top of specified target", CommandPatch);
     args::Command update(parser, "update", "Update the set of zips to the specified target", CommandUpdate);
+    args::Command shard(parser, "shard", "Split manifest into shards with small index, so that clients can fetch only the shards they need", CommandShard);
+    args::Command delta(parser, "delta", "Create manifest delta between two versions, which clients can apply to the manifest of installed version", CommandDelta);
+    args::Command casExport(parser, "cas-export", "Export compressed data of the set of zips into content-addressed layout, from which clients can fetch any file by hash", CommandCasExport);
     args::Command hashzip(parser, "hashzip", "Put specified file into \"checksummed\" zip (with hash of its contents at the beginning of the file)", CommandHashzip);
     args::Command replace(parser, "replace", "Replace specified files in package, assuming it is also replaced in all dependency packages", CommandReplace);
+    args::Command serve(parser, "serve", "Serve a directory (e.g. set of zips) over HTTP with byteranges support, for distribution over LAN", CommandServe);
 
     try {
         parser.ParseCLI(argc, argv);
@@ -1,8 +1,10 @@
 #include "Downloader.h"
 #include <curl/curl.h>
 #include <algorithm>
+#include <chrono>
 #include "Logging.h"
 #include "StdString.h"
+#include "Tracing.h"
 #include <string.h>
 #undef min
 #undef max
@@ -31,6 +33,12 @@ static const int SPEED_PROFILES_NUM = sizeof(SPEED_PROFILES) / sizeof(SPEED_PROF
 //download is slower than X bytes per second => halt as too slow (CURLOPT_LOW_SPEED_LIMIT)
 static const int LOW_SPEED_LIMIT = 1000;
 
+//token bucket of bandwidth limiter holds at most this many seconds of data (but not less than this number of bytes)
+static const double BANDWIDTH_BURST_TIME = 0.1;
+static const int BANDWIDTH_BURST_MIN = 16<<10;
+//bandwidth limit callback is called at most once per this period (in microseconds)
+static const int BANDWIDTH_POLL_PERIOD = 100000;
+
 //overhead per download in bytes --- for progress callback only
 static const int ESTIMATED_DOWNLOAD_OVERHEAD = 100;
 
@@ -46,22 +54,32 @@ const char *CheckHttpPrefix(const std::string &line, const std::string &prefix)
 }
 
 DownloadSource::DownloadSource() { byterange[0] = byterange[1] = 0; }
-DownloadSource::DownloadSource(const std::string &url) : url(url) { byterange[0] = 0; byterange[1] = UINT32_MAX; }
-DownloadSource::DownloadSource(const std::string &url, uint32_t from, uint32_t to) : url(url) { byterange[0] = from; byterange[1] = to; }
+DownloadSource::DownloadSource(const std::string &url) : url(url) { byterange[0] = 0; byterange[1] = UINT64_MAX; }
+DownloadSource::DownloadSource(const std::string &url, uint64_t from, uint64_t to) : url(url) { byterange[0] = from; byterange[1] = to; }
+bool DownloadSource::IsConditional() const { return !ifNoneMatch.empty() || !ifModifiedSince.empty(); }
+
+
+static int64_t SteadyMicroseconds() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
+static void CurlMultiCleanup(CURLM *multi) {
+    curl_multi_cleanup(multi);
+}
 
 Downloader::~Downloader() {}
-Downloader::Downloader() : _curlHandle(nullptr, curl_easy_cleanup) {}
+Downloader::Downloader() : _curlMulti(nullptr, CurlMultiCleanup) {}
 
-void Downloader::EnqueueDownload(const DownloadSource &source, const DownloadFinishedCallback &finishedCallback) {
+void Downloader::EnqueueDownload(const DownloadSource &source, const DownloadFinishedCallback &finishedCallback, const DownloadInfoCallback &infoCallback) {
     Download down;
     down.src = source;
     down.finishedCallback = finishedCallback;
+    down.infoCallback = infoCallback;
 
     //note: we save our initial estimates here and use it throughout the whole run
     //even though we will detect file size for whole-file downloads later, we still use initial estimates for computing progress
     down.progressSize = down.src.byterange[1] - down.src.byterange[0];
-    if (down.src.byterange[1] == UINT_MAX)
+    if (down.src.byterange[1] == UINT64_MAX)
         down.progressSize = (1<<20);    //rough estimate of unknown size
     down.progressSize += ESTIMATED_DOWNLOAD_OVERHEAD;
 
@@ -93,11 +111,90 @@ void Downloader::SetDowngradeHttps(bool enabled) {
     _downgradeHttps = enabled;
 }
 
+void Downloader::SetMaxConnections(int num) {
+    ZipSyncAssert(num >= 1);
+    _maxConnections = num;
+}
+
+void Downloader::SetBandwidthLimit(int64_t bytesPerSecond) {
+    ZipSyncAssert(bytesPerSecond >= 0);
+    _bandwidthLimit = bytesPerSecond;
+}
+
+void Downloader::SetBandwidthLimitCallback(const BandwidthLimitCallback &callback) {
+    _bandwidthCallback = callback;
+}
+
+void Downloader::RefillBandwidth() {
+    int64_t now = SteadyMicroseconds();
+    if (_bandwidthLimit > 0) {
+        double burst = std::max(_bandwidthLimit * BANDWIDTH_BURST_TIME, double(BANDWIDTH_BURST_MIN));
+        _bandwidthTokens = std::min(_bandwidthTokens + (now - _bandwidthRefillTime) * 1e-6 * _bandwidthLimit, burst);
+    }
+    _bandwidthRefillTime = now;
+}
+
+bool Downloader::ConsumeBandwidth(size_t bytes) {
+    if (_bandwidthLimit <= 0)
+        return true;
+    RefillBandwidth();
+    if (_bandwidthTokens <= 0.0)
+        return false;
+    //note: data chunk is never split, so bucket can go into debt
+    _bandwidthTokens -= bytes;
+    return true;
+}
+
+void Downloader::UpdateBandwidth() {
+    int64_t now = SteadyMicroseconds();
+    if (_bandwidthCallback && now - _bandwidthPollTime >= BANDWIDTH_POLL_PERIOD) {
+        _bandwidthPollTime = now;
+        int64_t limit = std::max(_bandwidthCallback(), int64_t(0));
+        if (limit != _bandwidthLimit) {
+            RefillBandwidth();
+            _bandwidthLimit = limit;
+        }
+    }
+    RefillBandwidth();
+    if (_bandwidthLimit > 0 && _bandwidthTokens <= 0.0)
+        return;
+
+    //resume paused requests, starting from a different one every time
+    int n = _activeResponses.size();
+    for (int i = 0; i < n; i++) {
+        CurlResponse &resp = *_activeResponses[(i + _unpauseRotation) % n];
+        if (!resp.paused)
+            continue;
+        resp.paused = false;
+        //note: CURL can call write callback right from here
+        curl_easy_pause(resp.curl.get(), CURLPAUSE_CONT);
+    }
+    _unpauseRotation++;
+}
+
+int Downloader::BandwidthWaitTime() const {
+    //how many milliseconds to wait until bandwidth limiter allows to receive data again
+    if (_bandwidthLimit <= 0 || _bandwidthTokens > 0.0)
+        return INT_MAX;
+    bool anyPaused = false;
+    for (const auto &resp : _activeResponses)
+        anyPaused |= resp->paused;
+    if (!anyPaused)
+        return INT_MAX;
+    return std::max(int(-_bandwidthTokens * 1000.0 / _bandwidthLimit) + 1, 1);
+}
+
 void Downloader::DownloadAll() {
     if (_progressCallback)
         _progressCallback(0.0, "Downloading started");
+    _bandwidthTokens = 0.0;
+    _bandwidthRefillTime = _bandwidthPollTime = SteadyMicroseconds();
+    if (_bandwidthCallback)
+        _bandwidthLimit = std::max(_bandwidthCallback(), int64_t(0));
 
-    _curlHandle.reset(curl_easy_init());
+    _curlMulti.reset(curl_multi_init());
+    //note: connections are pooled in multi handle, so they are reused between requests
+    curl_multi_setopt(_curlMulti.get(), CURLMOPT_MAX_TOTAL_CONNECTIONS, long(_maxConnections));
 
     //distribute downloads across remote files / urls
     for (int i = 0; i <  _downloads.size(); i++)
@@ -110,132 +207,203 @@ void Downloader::DownloadAll() {
         });
     }
 
-    //go over remote files and process them one by one
-    for (const auto &pKV : _urlStates) {
-        std::string url = pKV.first;
-        try {
-            DownloadAllForUrl(url);
-        }
-        catch(const ErrorException &e) {
-            if (!_silentErrors)
-                throw e;    //rethrow further to caller
-            else
-                {}          //supress exception, continue with other urls
+    //go over remote files and process them: several urls at once, requests to one url are sequental
+    try {
+        while (1) {
+            //start new requests for idle urls (if there are free connections)
+            for (auto &pKV : _urlStates) {
+                if (_activeResponses.size() >= _maxConnections)
+                    break;
+                UrlState &state = pKV.second;
+                if (state.active || state.finished)
+                    continue;
+                RunForUrl(pKV.first, [&]() {
+                    if (!StartNextRequest(pKV.first))
+                        state.finished = true;
+                });
+            }
+            if (_activeResponses.empty())
+                break;
+
+            //resume requests paused by bandwidth limiter (if allowed)
+            UpdateBandwidth();
+
+            //let CURL do its job
+            int running = 0;
+            CURLMcode mres = curl_multi_perform(_curlMulti.get(), &running);
+            ZipSyncAssertF(mres == CURLM_OK, "Unexpected CURL multi error %d", int(mres));
+
+            //process finished requests
+            int left = 0;
+            while (CURLMsg *msg = curl_multi_info_read(_curlMulti.get(), &left)) {
+                if (msg->msg != CURLMSG_DONE)
+                    continue;
+                int idx = 0;
+                while (_activeResponses[idx]->curl.get() != msg->easy_handle)
+                    idx++;
+                std::unique_ptr<CurlResponse> resp = std::move(_activeResponses[idx]);
+                _activeResponses.erase(_activeResponses.begin() + idx);
+                curl_multi_remove_handle(_curlMulti.get(), resp->curl.get());
+                CURLcode ret = msg->data.result;
+
+                std::string url = resp->urlKey;
+                RunForUrl(url, [&]() {
+                    FinishRequest(std::move(resp), ret);
+                });
+            }
+
+            if (running > 0)
+                curl_multi_wait(_curlMulti.get(), NULL, 0, std::min(100, BandwidthWaitTime()), NULL);
         }
     }
+    catch(...) {
+        //stop all the requests in flight
+        for (auto &resp : _activeResponses)
+            curl_multi_remove_handle(_curlMulti.get(), resp->curl.get());
+        _activeResponses.clear();
+        _curlMulti.reset();
+        throw;
+    }
 
-    ZipSyncAssert(_curlHandle.get_deleter() == curl_easy_cleanup);
-    _curlHandle.reset();
+    _curlMulti.reset();
+    _freeCurlHandles.clear();
 
     if (_progressCallback)
         _progressCallback(1.0, "Downloading finished");
 }
 
-void Downloader::DownloadAllForUrl(const std::string &url) {
+void Downloader::RunForUrl(const std::string &url, const std::function<void()> &func) {
+    try {
+        func();
+    }
+    catch(const ErrorException &e) {
+        if (!_silentErrors)
+            throw;      //rethrow further to caller
+        //supress exception, stop working with this url, continue with other urls
+        UrlState &state = _urlStates.find(url)->second;
+        state.active = false;
+        state.finished = true;
+    }
+}
+
+bool Downloader::StartNextRequest(const std::string &url) {
     UrlState &state = _urlStates.find(url)->second;
     int n = state.downloadsIds.size();
-
-    //used to occasionally restore faster speed profiles
-    int64_t speedLastFailedAt[SPEED_PROFILES_NUM];
-    memset(speedLastFailedAt, -1, sizeof(speedLastFailedAt));
-
-    while (state.doneCnt < n) {
-        //select speed profile
-        ZipSyncAssertF(state.speedProfile < SPEED_PROFILES_NUM, "Repeated timeout on URL %s", url.c_str());
-        SpeedProfile profile = SPEED_PROFILES[state.speedProfile];
-        if (_blockMultipart)
-            profile.maxPartsPerRequest = 1;
-
-        std::vector<SubTask> subtasks;  //set of chunks scheduled as one request
-        uint64_t totalSize = 0;         //total number of bytes scheduled into request
-        int rangesCnt = 0;              //number of separate byteranges scheduled
-        uint32_t last = UINT32_MAX;     //end of the last byterange
-
-        int end = state.doneCnt;
-        //grab a few next downloads for the next HTTP request
-        while (end < n) {
-            //what if we add the whole next download? (or what remains of it)
-            int idx = state.downloadsIds[end];
-            const Download &down = _downloads[idx];
-            uint32_t downStart = down.src.byterange[0] + (subtasks.empty() ? state.doneBytesNext : 0);
-            uint32_t downEnd = down.src.byterange[1];
-
-            //estimate quantities if we add this download
-            uint64_t newTotalSize = totalSize + (downEnd - downStart);
-            int newRangesCnt = rangesCnt + (last != downStart);
-
-            //stop before this download if it exceeds ranges limit
-            if (newRangesCnt > profile.maxPartsPerRequest)
+    if (state.doneCnt >= n)
+        return false;
+
+    //select speed profile
+    ZipSyncAssertF(state.speedProfile < SPEED_PROFILES_NUM, "Repeated timeout on URL %s", url.c_str());
+    SpeedProfile profile = SPEED_PROFILES[state.speedProfile];
+    if (_blockMultipart)
+        profile.maxPartsPerRequest = 1;
+
+    std::vector<SubTask> subtasks;  //set of chunks scheduled as one request
+    uint64_t totalSize = 0;         //total number of bytes scheduled into request
+    int rangesCnt = 0;              //number of separate byteranges scheduled
+    uint64_t last = UINT64_MAX;     //end of the last byterange
+
+    int end = state.doneCnt;
+    //grab a few next downloads for the next HTTP request
+    while (end < n) {
+        //what if we add the whole next download? (or what remains of it)
+        int idx = state.downloadsIds[end];
+        const Download &down = _downloads[idx];
+        uint64_t downStart = down.src.byterange[0] + (subtasks.empty() ? state.doneBytesNext : 0);
+        uint64_t downEnd = down.src.byterange[1];
+
+        //estimate quantities if we add this download
+        uint64_t newTotalSize = totalSize + (downEnd - downStart);
+        int newRangesCnt = rangesCnt + (last != downStart);
+
+        //stop before this download if it exceeds ranges limit
+        if (newRangesCnt > profile.maxPartsPerRequest)
+            break;
+        //conditional download must be requested alone
+        if (subtasks.size() > 0 && down.src.IsConditional())
+            break;
+        //does it exceed size limit?
+        if (newTotalSize > profile.maxRequestSize) {
+            if (subtasks.size() > 0) {
+                //we have added at least one download already,
+                //don't take a new one with size limit overflow
                 break;
-            //does it exceed size limit?
-            if (newTotalSize > profile.maxRequestSize) {
-                if (subtasks.size() > 0) {
-                    //we have added at least one download already,
-                    //don't take a new one with size limit overflow
-                    break;
-                }
-                if (downEnd != UINT32_MAX) {
-                    //this download is larger than limit: split it and download only a part of it
-                    SubTask st = {idx, {downStart, downStart + profile.maxRequestSize}};
-                    subtasks.push_back(st);
-                    break;
-                }
-                //single request with unknown size: never split...
-                //note that we will soon discover its size from HTTP headers
-                //so if timeout happens, then we will be able to split it on retry
             }
+            if (downEnd != UINT64_MAX) {
+                //this download is larger than limit: split it and download only a part of it
+                SubTask st = {idx, {downStart, downStart + profile.maxRequestSize}};
+                subtasks.push_back(st);
+                break;
+            }
+            //single request with unknown size: never split...
+            //note that we will soon discover its size from HTTP headers
+            //so if timeout happens, then we will be able to split it on retry
+        }
 
-            //no limit exceeded -> add this full download to scheduled request
-            end++;
-            SubTask st = {idx, {downStart, downEnd}};
-            subtasks.push_back(st);
+        //no limit exceeded -> add this full download to scheduled request
+        end++;
+        SubTask st = {idx, {downStart, downEnd}};
+        subtasks.push_back(st);
+
+        //update stats for limit checks on next iterations
+        last = downEnd;
+        totalSize = newTotalSize;
+        rangesCnt = newRangesCnt;
+        if (down.src.IsConditional())
+            break;
+    }
 
-            //update stats for limit checks on next iterations
-            last = downEnd;
-            totalSize = newTotalSize;
-            rangesCnt = newRangesCnt;
-        }
+    //start the HTTP request
+    StartRequest(url, subtasks, end, profile.lowSpeedTime, profile.connectTimeout);
+    state.active = true;
+    return true;
+}
 
-        //perform the HTTP request
-        bool ok = DownloadOneRequest(url, subtasks, profile.lowSpeedTime, profile.connectTimeout);
-
-        if (ok) {
-            //update number of fully finished downloads
-            state.doneCnt = end;
-            //update progress in the next download
-            if (end < state.downloadsIds.size() && subtasks.back().downloadIdx == state.downloadsIds[end]) {
-                //partly finished
-                int idx = subtasks.back().downloadIdx;
-                state.doneBytesNext = subtasks.back().byterange[1] - _downloads[idx].src.byterange[0];
-            }
-            else {
-                //fully finished
-                state.doneBytesNext = 0;
-            }
-            //reset speed profile
-            for (int i = 0; i < state.speedProfile; i++)
-                if (speedLastFailedAt[i] < 0 || _totalBytesDownloaded - speedLastFailedAt[i] > SPEED_PROFILES[i].maxRequestSize) {
-                    //last time when we failed with this profile was long time ago
-                    //so let's try this speed again, maybe it will work now
-                    state.speedProfile = i;
-                    break;
-                }
+void Downloader::FinishRequest(std::unique_ptr<CurlResponse> resp, int curlCode) {
+    std::string url = resp->urlKey;
+    UrlState &state = _urlStates.find(url)->second;
+    state.active = false;
+    int end = resp->endIdx;
+    std::vector<SubTask> subtasks = resp->subtasks;
+
+    bool ok = ProcessResponse(std::move(resp), curlCode);
+
+    if (ok) {
+        //update number of fully finished downloads
+        state.doneCnt = end;
+        //update progress in the next download
+        if (end < state.downloadsIds.size() && subtasks.back().downloadIdx == state.downloadsIds[end]) {
+            //partly finished
+            int idx = subtasks.back().downloadIdx;
+            state.doneBytesNext = subtasks.back().byterange[1] - _downloads[idx].src.byterange[0];
         }
         else {
-            //soft fail: retry with less strict limits
-            speedLastFailedAt[state.speedProfile] = _totalBytesDownloaded;
-            state.speedProfile++;
+            //fully finished
+            state.doneBytesNext = 0;
         }
+        //reset speed profile
+        for (int i = 0; i < state.speedProfile; i++)
+            if (state.speedLastFailedAt[i] < 0 || _totalBytesDownloaded - state.speedLastFailedAt[i] > SPEED_PROFILES[i].maxRequestSize) {
+                //last time when we failed with this profile was long time ago
+                //so let's try this speed again, maybe it will work now
+                state.speedProfile = i;
+                break;
+            }
+    }
+    else {
+        //soft fail: retry with less strict limits
+        _metrics.retriesPerProfile[state.speedProfile]++;
+        state.speedLastFailedAt[state.speedProfile] = _totalBytesDownloaded;
+        state.speedProfile++;
     }
 }
 
-bool Downloader::DownloadOneRequest(const std::string &urlRef, const std::vector<SubTask> &subtasks, int lowSpeedTime, int connectTimeout) {
+void Downloader::StartRequest(const std::string &urlRef, const std::vector<SubTask> &subtasks, int endIdx, int lowSpeedTime, int connectTimeout) {
     std::string url = urlRef;
-    if (subtasks.empty())
-        return true;    //scheduling algorithm should never even create such requests...
+    ZipSyncAssert(!subtasks.empty());   //scheduling algorithm should never even create such requests...
 
     //generate byterange string with all adjacent chunks merged
-    std::vector<std::pair<uint32_t, uint32_t>> coaslescedRanges;
+    std::vector<std::pair<uint64_t, uint64_t>> coaslescedRanges;
     for (const SubTask &st : subtasks) {
         if (!coaslescedRanges.empty() && coaslescedRanges.back().second >= st.byterange[0])
             coaslescedRanges.back().second = std::max(coaslescedRanges.back().second, st.byterange[1]);
@@ -247,7 +415,7 @@ bool Downloader::DownloadOneRequest(const std::string &urlRef, const std::vector
         if (!byterangeStr.empty())
             byterangeStr += ",";
         byterangeStr += std::to_string(rng.first) + "-";
-        if (rng.second != UINT32_MAX)   //it means "up to the end"
+        if (rng.second != UINT64_MAX)   //it means "up to the end"
             byterangeStr += std::to_string(rng.second - 1);
     }
 
@@ -271,12 +439,12 @@ bool Downloader::DownloadOneRequest(const std::string &urlRef, const std::vector
 //------------------- CURL callbacks: begin -------------------
     auto header_callback = [](char *buffer, size_t size, size_t nitems, void *userdata) {
         size *= nitems;
-        auto &resp = *((Downloader*)userdata)->_currResponse;
+        auto &resp = *(CurlResponse*)userdata;
         std::string str(buffer, buffer + size);
-        size_t from, to, all;
+        unsigned long long from, to, all;
         if (const char *tail = CheckHttpPrefix(str, "Content-Range: bytes ")) {
             //this is an ordinary byterange response
-            if (sscanf(tail, "%zu-%zu/%zu", &from, &to, &all) == 3) {
+            if (sscanf(tail, "%llu-%llu/%llu", &from, &to, &all) == 3) {
                 //memorize which byterange is actually returned by server
                 resp.onerange[0] = from;
                 resp.onerange[1] = to + 1;
@@ -293,22 +461,34 @@ bool Downloader::DownloadOneRequest(const std::string &urlRef, const std::vector
                 resp.boundary = std::string("\r\n--") + boundary;// + "\r\n";
             }
         }
+        //memorize validators: they allow to make conditional request next time
+        if (const char *tail = CheckHttpPrefix(str, "ETag: "))
+            resp.info.etag = stdext::trim_copy(std::string(tail));
+        if (const char *tail = CheckHttpPrefix(str, "Last-Modified: "))
+            resp.info.lastModified = stdext::trim_copy(std::string(tail));
         return size;
     };
     auto write_callback = [](char *buffer, size_t size, size_t nitems, void *userdata) -> size_t {
         size *= nitems;
-        auto &resp = *((Downloader*)userdata)->_currResponse;
+        auto &resp = *(CurlResponse*)userdata;
         if (resp.onerange[0] == resp.onerange[1] && resp.boundary.empty())
             return 0;  //neither range nor multipart response -> stop
+        if (!resp.owner->ConsumeBandwidth(size)) {
+            //bandwidth limit exceeded: CURL will pass same data again after DownloadAll resumes this request
+            //note: CURL does not check paused requests for low speed, so throttling does not cause timeout
+            resp.paused = true;
+            resp.owner->_metrics.throttlePauses++;
+            return CURL_WRITEFUNC_PAUSE;
+        }
         resp.data.insert(resp.data.end(), buffer, buffer + size);
         return size;
     };
     auto xferinfo_callback = [](void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
-        auto &resp = *((Downloader*)userdata)->_currResponse;
+        auto &resp = *(CurlResponse*)userdata;
         if (dltotal > 0 && dlnow > 0) {
             resp.progressRatio = double(dlnow) / std::max(dltotal, dlnow);
             resp.bytesDownloaded = dlnow;
-            if (int code = ((Downloader*)userdata)->UpdateProgress())
+            if (int code = resp.owner->UpdateProgress())
                 return code;   //interrupt!
         }
         return 0;
@@ -321,26 +501,44 @@ bool Downloader::DownloadOneRequest(const std::string &urlRef, const std::vector
     }
 
     //prepare temporary structure for response
-    _currResponse.reset(new CurlResponse());
-    _currResponse->url = url;
-    _currResponse->progressWeight = progressWeight;
+    std::unique_ptr<CurlResponse> respHolder(new CurlResponse());
+    CurlResponse &resp = *respHolder;
+    resp.owner = this;
+    resp.url = url;
+    resp.urlKey = urlRef;
+    resp.subtasks = subtasks;
+    resp.endIdx = endIdx;
+    resp.progressEstimate = thisEstimate;
+    resp.progressWeight = progressWeight;
+    if (!_freeCurlHandles.empty()) {
+        resp.curl = std::move(_freeCurlHandles.back());
+        _freeCurlHandles.pop_back();
+    }
+    else {
+        resp.curl = decltype(resp.curl)(curl_easy_init(), curl_easy_cleanup);
+    }
 
     //set up CURL request
-    CURL *curl = _curlHandle.get();
+    CURL *curl = resp.curl.get();
     std::string reprocmd = "curl";
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
     reprocmd += formatMessage(" %s", url.c_str());
     curl_easy_setopt(curl, CURLOPT_RANGE, byterangeStr.c_str());
     reprocmd += formatMessage(" -r %s", byterangeStr.c_str());
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, (curl_write_callback)write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp);
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, (curl_write_callback)header_callback);
-    curl_easy_setopt(curl, CURLOPT_HEADERDATA, this);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &resp);
     curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, (curl_xferinfo_callback)xferinfo_callback);
-    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &resp);
     curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0);
-    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, LOW_SPEED_LIMIT);
-    reprocmd += formatMessage(" -Y %d", LOW_SPEED_LIMIT);
+    int lowSpeedLimit = LOW_SPEED_LIMIT;
+    if (_bandwidthLimit > 0) {
+        //request is not too slow if it gets at least some share of limited bandwidth
+        lowSpeedLimit = (int)std::max(std::min(int64_t(lowSpeedLimit), _bandwidthLimit / (4 * _maxConnections)), int64_t(1));
+    }
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, lowSpeedLimit);
+    reprocmd += formatMessage(" -Y %d", lowSpeedLimit);
     curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, lowSpeedTime);
     reprocmd += formatMessage(" -y %d", lowSpeedTime);
     curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, connectTimeout);
@@ -356,23 +554,119 @@ bool Downloader::DownloadOneRequest(const std::string &urlRef, const std::vector
         blob.flags = CURL_BLOB_NOCOPY;
         curl_easy_setopt(curl, CURLOPT_CAINFO_BLOB, &blob);
     }
+    //conditional request: server returns 304 if file has not changed
+    const DownloadSource &firstSrc = _downloads[subtasks.front().downloadIdx].src;
+    if (firstSrc.IsConditional()) {
+        curl_slist *headers = nullptr;
+        if (!firstSrc.ifNoneMatch.empty()) {
+            headers = curl_slist_append(headers, ("If-None-Match: " + firstSrc.ifNoneMatch).c_str());
+            reprocmd += formatMessage(" -H \"If-None-Match: %s\"", firstSrc.ifNoneMatch.c_str());
+        }
+        if (!firstSrc.ifModifiedSince.empty()) {
+            headers = curl_slist_append(headers, ("If-Modified-Since: " + firstSrc.ifModifiedSince).c_str());
+            reprocmd += formatMessage(" -H \"If-Modified-Since: %s\"", firstSrc.ifModifiedSince.c_str());
+        }
+        resp.headers = decltype(resp.headers)(headers, curl_slist_free_all);
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, resp.headers.get());
     //log request as CURL command
     //it can be used to save and reproduce the problematic request with curl executable
     int reqIdx = _curlRequestIdx++;
     reprocmd += formatMessage(" -o out%d.bin", reqIdx);
     g_logger->debugf("[curl-cmd] %s", reprocmd.c_str());
+
+    //start the request (it will be performed in DownloadAll loop)
+    if (IsTraceEnabled())
+        resp.traceStart = TraceNow();
+    CURLMcode mres = curl_multi_add_handle(_curlMulti.get(), curl);
+    ZipSyncAssertF(mres == CURLM_OK, "Unexpected CURL multi error %d on URL %s", int(mres), url.c_str());
+    _activeResponses.push_back(std::move(respHolder));
+
     //notify user that we start downloading from this URL
     UpdateProgress();
+}
+
+//durations of request stages, computed from CURL timings (which are measured from the start of request)
+static CurlTimings GetCurlTimings(CURL *curl) {
+    curl_off_t namelookup = 0, connect = 0, appconnect = 0, starttransfer = 0, total = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    //stage is zero if skipped (e.g. reused connection or no TLS)
+    CurlTimings res;
+    curl_off_t last = 0;
+    auto Stage = [&last](curl_off_t time) -> int64_t {
+        if (time <= last)
+            return 0;
+        int64_t duration = time - last;
+        last = time;
+        return duration;
+    };
+    res.dns = Stage(namelookup);
+    res.connect = Stage(connect);
+    res.tls = Stage(appconnect);
+    res.wait = Stage(starttransfer);
+    res.transfer = Stage(total);
+    return res;
+}
 
-    //perform the request
-    CURLcode ret = curl_easy_perform(curl);
+void Downloader::TraceResponse(const CurlResponse &resp, const CurlTimings &timings, int curlCode, long httpRes) {
+    //requests to one URL are sequental, so each URL gets its own lane in timeline
+    int lane = TRACE_LANE_BASE + int(std::distance(_urlStates.begin(), _urlStates.find(resp.urlKey)));
+    TraceSetLaneName(lane, "HTTP " + resp.urlKey);
+
+    int64_t requestEnd = TraceNow();
+    std::string args;
+    TraceArgAppend(args, "url", resp.url);
+    TraceArgAppend(args, "bytes", resp.bytesDownloaded);
+    TraceArgAppend(args, "segments", resp.subtasks.size());
+    TraceArgAppend(args, "http", httpRes);
+    TraceArgAppend(args, "curl", curlCode);
+    TraceAddEvent("HTTP request", resp.traceStart, requestEnd - resp.traceStart, args, lane);
+
+    //split request into stages
+    const std::pair<const char*, int64_t> stages[] = {
+        {"dns", timings.dns},
+        {"connect", timings.connect},
+        {"tls", timings.tls},
+        {"wait", timings.wait},
+        {"transfer", timings.transfer},
+    };
+    int64_t start = resp.traceStart;
+    for (const auto &stage : stages) {
+        if (stage.second > 0)
+            TraceAddEvent(stage.first, start, stage.second, "", lane);
+        start += stage.second;
+    }
+}
+
+bool Downloader::ProcessResponse(std::unique_ptr<CurlResponse> respHolder, int curlCode) {
+    CURLcode ret = (CURLcode)curlCode;
+    CurlResponse &resp = *respHolder;
+    std::string url = resp.url;
+    std::vector<SubTask> subtasks = resp.subtasks;
+    CURL *curl = resp.curl.get();
     long httpRes = 0;
     curl_easy_getinfo(curl, CURLINFO_HTTP_CODE, &httpRes);
+    CurlTimings timings = GetCurlTimings(curl);
+    if (resp.traceStart >= 0)
+        TraceResponse(resp, timings, curlCode, httpRes);
+    _metrics.requestsCount++;
+    _metrics.bytesDownloaded += resp.bytesDownloaded;
+    _metrics.timings.dns += timings.dns;
+    _metrics.timings.connect += timings.connect;
+    _metrics.timings.tls += timings.tls;
+    _metrics.timings.wait += timings.wait;
+    _metrics.timings.transfer += timings.transfer;
+    //return handle to pool: it can be reused by next request
+    _freeCurlHandles.push_back(std::move(resp.curl));
 
     //handle return/error codes
-    if (_currResponse->totalSize != UINT_MAX && _downloads[subtasks.front().downloadIdx].src.byterange[1] == UINT_MAX) {
+    if (resp.totalSize != UINT64_MAX && _downloads[subtasks.front().downloadIdx].src.byterange[1] == UINT64_MAX) {
         //even if we have failed, now we know the size of this file (thanks to HTTP header)
-        _downloads[subtasks.front().downloadIdx].src.byterange[1] = _currResponse->totalSize;
+        _downloads[subtasks.front().downloadIdx].src.byterange[1] = resp.totalSize;
     }
     if (ret != 0 || (httpRes != 200 && httpRes != 206)) {
         //log down atypical error codes
@@ -388,7 +682,7 @@ bool Downloader::DownloadOneRequest(const std::string &urlRef, const std::vector
         //so we should retry this request again (or maybe a smaller piece of it)
         g_logger->warningf(lcDownloadTooSlow,
             "Timeout for request with %d segments of total size %lld on URL %s",
-            int(subtasks.size()), thisEstimate, url.c_str()
+            int(subtasks.size()), (long long)resp.progressEstimate, url.c_str()
         );
         return false;   //soft fail: retry is welcome
     }
@@ -397,23 +691,47 @@ bool Downloader::DownloadOneRequest(const std::string &urlRef, const std::vector
     ZipSyncAssertF(ret != CURLE_WRITE_ERROR, "Response without byteranges for URL %s", url.c_str());
     //handle all the unexpected errors
     ZipSyncAssertF(ret == CURLE_OK, "Unexpected CURL error %d on URL %s", ret, url.c_str());
-    ZipSyncAssertF(httpRes == 200 || httpRes == 206, "Unexpected HTTP return code %d for URL %s", httpRes, url.c_str());
+    ZipSyncAssertF(httpRes == 200 || httpRes == 206 || httpRes == 304, "Unexpected HTTP return code %d for URL %s", httpRes, url.c_str());
 
     //update progress indicator given that whole request is done
-    _currResponse->progressRatio = 1.0;
+    resp.progressRatio = 1.0;
+    _totalBytesDownloaded += resp.bytesDownloaded;
+    _totalProgress += resp.progressWeight;
     UpdateProgress();
-    _totalBytesDownloaded += _currResponse->bytesDownloaded;
-    _totalProgress += _currResponse->progressWeight;
+
+    if (httpRes == 304) {
+        //conditional request: remote file has not changed, nothing downloaded
+        ZipSyncAssertF(subtasks.size() == 1, "Unexpected 304 response for URL %s", url.c_str());
+        Download &down = _downloads[subtasks[0].downloadIdx];
+        ZipSyncAssertF(down.src.IsConditional(), "Unexpected 304 response for URL %s", url.c_str());
+        resp.info.notModified = true;
+        if (down.infoCallback)
+            down.infoCallback(resp.info);
+        return true;
+    }
 
     //parse multipart response, producing many single-range responses instead
     std::vector<CurlResponse> results;
-    if (_currResponse->boundary.empty())
-        results.push_back(std::move(*_currResponse));
-    else
-        BreakMultipartResponse(*_currResponse, results);
+    DownloadResponseInfo info = resp.info;
+    size_t bufferMemory = 0;
+    for (const auto &active : _activeResponses)
+        bufferMemory += active->data.size();
+    if (resp.boundary.empty()) {
+        bufferMemory += resp.data.size();
+        results.push_back(std::move(resp));
+    }
+    else {
+        BreakMultipartResponse(resp, results);
+        _metrics.multipartRequests++;
+        _metrics.multipartParts += results.size();
+        bufferMemory += resp.data.size();
+        for (const auto &part : results)
+            bufferMemory += part.data.size();
+    }
+    _metrics.peakBufferMemory = std::max(_metrics.peakBufferMemory, bufferMemory);
 
     //we have already pulled out all we need from this structure, break it down
-    _currResponse.reset();
+    respHolder.reset();
 
     std::sort(results.begin(), results.end(), [](const CurlResponse &a, const CurlResponse &b) {
         return a.onerange[0] < b.onerange[0];
@@ -428,28 +746,35 @@ bool Downloader::DownloadOneRequest(const std::string &urlRef, const std::vector
         //find all pieces in the downloaded results which are about this subtask
         for (const auto &resp : results) {
             //intersect byterange intervals of the subtask and response (remaining part of it)
-            uint32_t currPos = downSrc.byterange[0] + (uint32_t)answer.size();
-            uint32_t left = std::max(currPos, resp.onerange[0]);
-            uint32_t right = std::min(downSrc.byterange[1], resp.onerange[1]);
+            uint64_t currPos = downSrc.byterange[0] + answer.size();
+            uint64_t left = std::max(currPos, resp.onerange[0]);
+            uint64_t right = std::min(downSrc.byterange[1], resp.onerange[1]);
             if (right <= left)
                 continue;   //no intersection
 
-            ZipSyncAssertF(left == currPos, "Missing chunk %u..%u (%u bytes) after downloading URL %s", left, currPos, currPos - left, url.c_str());
+            ZipSyncAssertF(left == currPos, "Missing chunk %llu..%llu (%llu bytes) after downloading URL %s",
+                (unsigned long long)left, (unsigned long long)currPos, (unsigned long long)(currPos - left), url.c_str()
+            );
             //take data from response in the intersection range
             answer.insert(answer.end(),
                 resp.data.data() + (left - resp.onerange[0]),
                 resp.data.data() + (right - resp.onerange[0])
             );
+            _metrics.bytesUseful += right - left;
         }
 
-        //note: st.byterange[1] may be UINT_MAX for whole-file downloads
+        //note: st.byterange[1] may be UINT64_MAX for whole-file downloads
         if (st.byterange[1] >= downSrc.byterange[1]) {
             //we have just appended the very last bits of this download
-            if (downSrc.byterange[1] != UINT32_MAX) {
-                uint32_t totalSize = downSrc.byterange[1] - downSrc.byterange[0];
-                ZipSyncAssertF(answer.size() == totalSize, "Missing end chunk %zu..%u (%u bytes) after downloading URL %s", answer.size(), totalSize, totalSize - (uint32_t)answer.size(), url.c_str());
+            if (downSrc.byterange[1] != UINT64_MAX) {
+                uint64_t totalSize = downSrc.byterange[1] - downSrc.byterange[0];
+                ZipSyncAssertF(answer.size() == totalSize, "Missing end chunk %zu..%llu (%llu bytes) after downloading URL %s",
+                    answer.size(), (unsigned long long)totalSize, (unsigned long long)(totalSize - answer.size()), url.c_str()
+                );
             }
-            //pass full data to user via callback
+            //pass full data to user via callbacks
+            if (_downloads[idx].infoCallback)
+                _downloads[idx].infoCallback(info);
             _downloads[idx].finishedCallback(answer.data(), answer.size());
             //drop the data from memory (to avoid using gigabytes of virtual memory)
             answer.clear();
@@ -461,15 +786,23 @@ bool Downloader::DownloadOneRequest(const std::string &urlRef, const std::vector
 }
 
 void Downloader::BreakMultipartResponse(const CurlResponse &response, std::vector<CurlResponse> &parts) {
-    const auto &data = response.data;
-    const std::string &bound = response.boundary;
+    for (const MultipartPart &mp : ParseMultipartResponse(response.data.data(), response.data.size(), response.boundary)) {
+        CurlResponse part;
+        part.onerange[0] = mp.byterange[0];
+        part.onerange[1] = mp.byterange[1];
+        part.data.assign(mp.data, mp.data + mp.size);
+        parts.push_back(std::move(part));
+    }
+}
 
+std::vector<MultipartPart> ParseMultipartResponse(const uint8_t *data, size_t size, const std::string &bound) {
     //find all occurences of boundary
     std::vector<size_t> boundaryPos;
-    for (size_t pos = 0; pos + bound.size() <= data.size(); pos++)
+    for (size_t pos = 0; pos + bound.size() <= size; pos++)
         if (memcmp(&data[pos], &bound[0], bound.size()) == 0)
             boundaryPos.push_back(pos);
 
+    std::vector<MultipartPart> parts;
     for (size_t i = 0; i+1 < boundaryPos.size(); i++) {
         size_t left = boundaryPos[i] + bound.size() + 2;        //+2 for "\r\n" or "--"
         size_t right = boundaryPos[i+1];
@@ -488,29 +821,34 @@ void Downloader::BreakMultipartResponse(const CurlResponse &response, std::vecto
         }
 
         //find range in headers
-        CurlResponse part;
+        MultipartPart part;
+        part.byterange[0] = part.byterange[1] = UINT64_MAX;
         for (const auto &h : header) {
-            size_t from, to, all;
+            unsigned long long from, to, all;
             if (const char *tail = CheckHttpPrefix(h, "Content-Range: bytes ")) {
-                if (sscanf(tail, "%zu-%zu/%zu", &from, &to, &all) == 3) {
-                    part.onerange[0] = from;
-                    part.onerange[1] = to + 1;
+                if (sscanf(tail, "%llu-%llu/%llu", &from, &to, &all) == 3) {
+                    part.byterange[0] = from;
+                    part.byterange[1] = to + 1;
                 }
             }
         }
-        ZipSyncAssertF(part.onerange[0] != part.onerange[1], "Failed to find range in part headers");
+        ZipSyncAssertF(part.byterange[0] != part.byterange[1], "Failed to find range in part headers");
 
-        part.data.assign(&data[lineStart], &data[right]);
-        parts.push_back(std::move(part));
+        part.data = &data[lineStart];
+        part.size = right - lineStart;
+        parts.push_back(part);
     }
+    return parts;
 }
 
 int Downloader::UpdateProgress() {
     char buffer[256] = "Downloading...";
     double progress = _totalProgress;
-    if (_currResponse) {
-        sprintf(buffer, "Downloading \"%s\"...", _currResponse->url.c_str());
-        progress += _currResponse->progressWeight * _currResponse->progressRatio;
+    for (int i = 0; i < _activeResponses.size(); i++) {
+        const CurlResponse &resp = *_activeResponses[i];
+        if (i == 0)
+            snprintf(buffer, sizeof(buffer), "Downloading \"%s\"...", resp.url.c_str());
+        progress += resp.progressWeight * resp.progressRatio;
     }
     if (_progressCallback) {
         int code = _progressCallback(progress, buffer);
@@ -5,10 +5,12 @@
 #include <map>
 #include <functional>
 #include <memory>
-#include <limits.h>
+#include <stdint.h>
 
 
 typedef void CURL;
+typedef void CURLM;
+struct curl_slist;
 
 namespace ZipSync {
 
@@ -19,18 +21,86 @@ struct DownloadSource {
     //URL to download file from
     std::string url;
     //the range of bytes to be downloaded
-    //byterange[1] == UINT_MAX means: download whole file of unknown size
-    uint32_t byterange[2];
+    //byterange[1] == UINT64_MAX means: download whole file of unknown size
+    uint64_t byterange[2];
+
+    //validators for conditional download (only for whole-file downloads)
+    //if any is set and remote file has not changed, then server returns 304 and nothing is downloaded
+    std::string ifNoneMatch;        //ETag from previous download
+    std::string ifModifiedSince;    //Last-Modified from previous download
 
     DownloadSource();
     DownloadSource(const std::string &url); //download whole file
-    DownloadSource(const std::string &url, uint32_t from, uint32_t to); //download range of file
+    DownloadSource(const std::string &url, uint64_t from, uint64_t to); //download range of file
+    bool IsConditional() const;
+};
+
+/**
+ * HTTP-level information about finished download.
+ */
+struct DownloadResponseInfo {
+    //true if server returned 304 for conditional download (data is not downloaded)
+    bool notModified = false;
+    //validators returned by server (empty if not present)
+    std::string etag;
+    std::string lastModified;
+};
+
+/**
+ * One part of multipart/byteranges HTTP response.
+ * Data points into the buffer of the whole response.
+ */
+struct MultipartPart {
+    //range of bytes of the file as reported in the header of part
+    uint64_t byterange[2];
+    const uint8_t *data;
+    size_t size;
+};
+//splits body of multipart/byteranges HTTP response by the boundary, and parses byterange of every part
+std::vector<MultipartPart> ParseMultipartResponse(const uint8_t *data, size_t size, const std::string &boundary);
+
+/**
+ * Time spent in stages of HTTP requests (in microseconds).
+ * Measured by CURL, summed over requests.
+ */
+struct CurlTimings {
+    int64_t dns = 0;            //name lookup
+    int64_t connect = 0;        //TCP connection
+    int64_t tls = 0;            //SSL/TLS handshake
+    int64_t wait = 0;           //from request sent to first byte of response
+    int64_t transfer = 0;       //receiving the response
+};
+
+/**
+ * Counters collected by Downloader during its work.
+ */
+struct DownloaderMetrics {
+    //bytes received from network (as reported by CURL), including failed requests and multipart headers
+    int64_t bytesDownloaded = 0;
+    //bytes passed to the user in download callbacks
+    int64_t bytesUseful = 0;
+    //number of finished HTTP requests
+    int requestsCount = 0;
+    //number of multipart requests and the total number of parts in them
+    int multipartRequests = 0;
+    int multipartParts = 0;
+    //how many times receiving was paused by bandwidth limiter
+    int throttlePauses = 0;
+    //number of requests retried after timeout, indexed by speed profile (0 is the fastest)
+    int retriesPerProfile[8] = {0};
+    CurlTimings timings;
+    //maximum total size of response buffers kept in memory simultaneously
+    size_t peakBufferMemory = 0;
 };
 
 //called when download is complete
-typedef std::function<void(const void*, uint32_t)> DownloadFinishedCallback;
+typedef std::function<void(const void*, size_t)> DownloadFinishedCallback;
+//called when download is complete, right before DownloadFinishedCallback (or instead of it if 304 is returned)
+typedef std::function<void(const DownloadResponseInfo&)> DownloadInfoCallback;
 //called during download to report progress: returning nonzero value interrupts download
 typedef std::function<int(double, const char*)> GlobalProgressCallback;
+//called regularly during download to obtain current limit on download speed (bytes per second, 0 = unlimited)
+typedef std::function<int64_t()> BandwidthLimitCallback;
 
 
 /**
@@ -45,11 +115,15 @@ class Downloader {
     std::string _certificates;
     bool _downgradeHttps = false;
     GlobalProgressCallback _progressCallback;
+    int _maxConnections = 1;
+    int64_t _bandwidthLimit = 0;                //maximum total download speed in bytes per second (0 = unlimited)
+    BandwidthLimitCallback _bandwidthCallback;
 
     //user-specified chunk of data to be downloaded
     struct Download {
         DownloadSource src;
         DownloadFinishedCallback finishedCallback;
+        DownloadInfoCallback infoCallback;
         std::vector<uint8_t> resultData;    //temporary storage (used in case download is split)
         int64_t progressSize = 0;           //estimated size in bytes (for progress indicator)
     };
@@ -60,8 +134,12 @@ class Downloader {
     struct UrlState {
         std::vector<int> downloadsIds;      //indices in _downloads (sorted by starting offset)
         int doneCnt = 0;                    //how many FULL downloads done
-        uint32_t doneBytesNext = 0;         //how many bytes done in the current download
+        uint64_t doneBytesNext = 0;         //how many bytes done in the current download
         int speedProfile = 0;               //index in SPEED_PROFILES
+        int64_t speedLastFailedAt[8];       //used to occasionally restore faster speed profiles (indexed as SPEED_PROFILES)
+        bool active = false;                //some request to this url is in progress now
+        bool finished = false;              //all done (or failed in silent mode)
+        UrlState() { for (int64_t &t : speedLastFailedAt) t = -1; }
     };
     std::map<std::string, UrlState> _urlStates;
 
@@ -69,28 +147,47 @@ class Downloader {
     //every HTTP request contains one or several SubTasks
     struct SubTask {
         int downloadIdx;                    //index in _downloads
-        uint32_t byterange[2];              //can be part of download's byterange
+        uint64_t byterange[2];              //can be part of download's byterange
     };
-    //state of the HTTP request currently active
+    //state of the HTTP request in progress
     struct CurlResponse {
-        std::string url;
+        Downloader *owner = nullptr;
+        std::string url;                    //actual URL requested
+        std::string urlKey;                 //URL as specified by user (key in _urlStates)
+        std::unique_ptr<CURL, void (*)(CURL*)> curl = {nullptr, nullptr};
+        std::unique_ptr<curl_slist, void (*)(curl_slist*)> headers = {nullptr, nullptr};
+        std::vector<SubTask> subtasks;      //chunks of data requested
+        int endIdx = 0;                     //number of downloads in url which are done after this request
+        DownloadResponseInfo info;
 
         std::vector<uint8_t> data;          //downloaded file data is appended to here
-        uint32_t totalSize = UINT_MAX;      //size of file as reported by HTTP header (used for whole-file downloads)
-        uint32_t onerange[2] = {UINT_MAX, UINT_MAX};    //byterange actually provided by HTTP server (may differ from what we asked for)
+        uint64_t totalSize = UINT64_MAX;    //size of file as reported by HTTP header (used for whole-file downloads)
+        uint64_t onerange[2] = {UINT64_MAX, UINT64_MAX};    //byterange actually provided by HTTP server (may differ from what we asked for)
         std::string boundary;               //boundary between responses in multipart response
 
         double progressRatio = 0.0;         //which portion of this CURL request is done
         int64_t bytesDownloaded = 0;        //how many bytes actually downloaded (as reported by CURL)
         double progressWeight = 0.0;        //this request size / total size of all downloads
+        int64_t progressEstimate = 0;       //estimated size of this request
+
+        int64_t traceStart = -1;            //when request was started (if tracing is enabled)
+        bool paused = false;                //receiving is paused by bandwidth limiter
     };
-    std::unique_ptr<CurlResponse> _currResponse;
+    std::vector<std::unique_ptr<CurlResponse>> _activeResponses;
 
     double _totalProgress = 0.0;            //which portion of DownloadAll is complete (without current request)
     int64_t _totalBytesDownloaded = 0;      //how many bytes downloaded in total (without current request)
 
-    std::unique_ptr<CURL, void (*)(CURL*)> _curlHandle; //CURL handle reused between request in order to exploit connection pool
+    std::unique_ptr<CURLM, void (*)(CURLM*)> _curlMulti;  //CURL multi handle: performs requests in parallel, keeps connection pool
+    std::vector<std::unique_ptr<CURL, void (*)(CURL*)>> _freeCurlHandles;    //CURL handles reused between requests
     int _curlRequestIdx = 0;                //sequental number of HTTP request (used for logging curl commands)
+    DownloaderMetrics _metrics;
+
+    //token bucket shared by all connections: data is received only while there are tokens
+    double _bandwidthTokens = 0.0;          //number of bytes allowed to receive (negative = debt)
+    int64_t _bandwidthRefillTime = 0;       //when tokens were added last time (steady clock, microseconds)
+    int64_t _bandwidthPollTime = 0;         //when bandwidth callback was called last time
+    int _unpauseRotation = 0;               //which paused request is resumed first (for fairness)
 
 public:
     ~Downloader();
@@ -98,7 +195,7 @@ public:
 
     //schedule download of specified chunk of data
     //the obtained data will be passed to the specified callback when it is available
-    void EnqueueDownload(const DownloadSource &source, const DownloadFinishedCallback &finishedCallback);
+    void EnqueueDownload(const DownloadSource &source, const DownloadFinishedCallback &finishedCallback, const DownloadInfoCallback &infoCallback = DownloadInfoCallback());
 
     //progress callback is useful for two things:
     // * showing progress indicator to user (use passed argument)
@@ -116,6 +213,15 @@ public:
     void SetCertificates(const std::string &content);
     //enabled = true: all HTTPS urls are replaced with HTTP automatically
     void SetDowngradeHttps(bool enabled);
+    //maximum number of HTTP requests performed simultaneously (default = 1)
+    //note: requests to one URL are always sequental, so only different URLs are downloaded in parallel
+    void SetMaxConnections(int num);
+    //limit total download speed over all connections (bytes per second, 0 = unlimited)
+    //note: throttled requests are not considered too slow, so they don't cause timeouts and retries
+    void SetBandwidthLimit(int64_t bytesPerSecond);
+    //callback is polled a few times per second during download and returns current bandwidth limit,
+    //so that limit can be changed at runtime (e.g. full speed when idle, low speed under load)
+    void SetBandwidthLimitCallback(const BandwidthLimitCallback &callback);
 
     //when everything is set up, call this method to actually perform all downloads
     //it blocks until the job is done (progress callback is the only way to interrupt it)
@@ -124,10 +230,20 @@ public:
     //returns total number of bytes downloaded by this object
     //(as reported by CURL)
     int64_t TotalBytesDownloaded() const { return _totalBytesDownloaded; }
+    //returns counters collected by this object
+    const DownloaderMetrics &GetMetrics() const { return _metrics; }
 
 private:
-    void DownloadAllForUrl(const std::string &url);
-    bool DownloadOneRequest(const std::string &url, const std::vector<SubTask> &subtasks, int lowSpeedTime, int connectTimeout);
+    void RunForUrl(const std::string &url, const std::function<void()> &func);
+    bool StartNextRequest(const std::string &url);
+    void FinishRequest(std::unique_ptr<CurlResponse> resp, int curlCode);
+    void StartRequest(const std::string &url, const std::vector<SubTask> &subtasks, int endIdx, int lowSpeedTime, int connectTimeout);
+    bool ProcessResponse(std::unique_ptr<CurlResponse> resp, int curlCode);
+    void TraceResponse(const CurlResponse &resp, const CurlTimings &timings, int curlCode, long httpRes);
+    void RefillBandwidth();
+    bool ConsumeBandwidth(size_t bytes);
+    void UpdateBandwidth();
+    int BandwidthWaitTime() const;
     void BreakMultipartResponse(const CurlResponse &response, std::vector<CurlResponse> &parts);
     int UpdateProgress();
 };
@@ -62,6 +62,9 @@ class Fuzzer : private TestCreator {
                     }
                     if (pProp.first == "package")
                         pProp.second = "(removed)";
+                    //digests depend on hashes and byteranges
+                    if ((ignoreCompressedHash || ignoreByterange) && pProp.first == "digest")
+                        pProp.second = "(removed)";
                 }
             }
         };
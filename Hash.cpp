@@ -1,7 +1,12 @@
 #include "Hash.h"
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
 #include "Logging.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ZIPSYNC_BATCH_SSE2
+#endif
 
 
 namespace ZipSync {
@@ -13,13 +18,22 @@ bool HashDigest::operator== (const HashDigest &other) const {
     return memcmp(_data, other._data, sizeof(_data)) == 0;
 }
 std::string HashDigest::Hex() const {
-    char text[100];
-    for (int i = 0; i < sizeof(_data); i++)
-        sprintf(text + 2*i, "%02x", _data[i]);
-    return text;
+    char text[HEX_LENGTH];
+    HexTo(text);
+    return std::string(text, text + HEX_LENGTH);
+}
+void HashDigest::HexTo(char *text) const {
+    static const char DIGITS[] = "0123456789abcdef";
+    for (int i = 0; i < sizeof(_data); i++) {
+        text[2*i+0] = DIGITS[_data[i] >> 4];
+        text[2*i+1] = DIGITS[_data[i] & 15];
+    }
 }
 void HashDigest::Parse(const char *hex) {
-    ZipSyncAssertF(strlen(hex) == 2 * sizeof(_data), "Hex digest has wrong length %d", strlen(hex));
+    Parse(hex, strlen(hex));
+}
+void HashDigest::Parse(const char *hex, size_t len) {
+    ZipSyncAssertF(len == 2 * sizeof(_data), "Hex digest has wrong length %d", int(len));
     for (int i = 0; i < sizeof(_data); i++) {
         /*char octet[4] = {0};
         memcpy(octet, hex + 2*i, 2);
@@ -45,17 +59,227 @@ void HashDigest::Clear() {
     memset(_data, 0, sizeof(_data));
 }
 
-Hasher::Hasher() {
-    blake2s_init(&_state, sizeof(HashDigest::_data));
+const char *HashAlgorithmName(HashAlgorithm algo) {
+    switch (algo) {
+        case HashAlgorithm::Blake2s: return "blake2s";
+        case HashAlgorithm::Blake2sp: return "blake2sp";
+    }
+    ZipSyncAssertF(false, "Unknown hash algorithm %d", int(algo));
+    return nullptr;
+}
+HashAlgorithm ParseHashAlgorithm(const char *name) {
+    if (strcmp(name, "blake2s") == 0)
+        return HashAlgorithm::Blake2s;
+    if (strcmp(name, "blake2sp") == 0)
+        return HashAlgorithm::Blake2sp;
+    ZipSyncAssertF(false, "Unknown hash algorithm %s", name);
+    return HashAlgorithm::Blake2s;
+}
+
+Hasher::Hasher(HashAlgorithm algo) : _algo(algo) {
+    if (_algo == HashAlgorithm::Blake2sp)
+        blake2sp_init(&_stateP, sizeof(HashDigest::_data));
+    else
+        blake2s_init(&_state, sizeof(HashDigest::_data));
 }
 Hasher& Hasher::Update(const void *in, size_t inlen) {
-    blake2s_update(&_state, (const uint8_t *)in, inlen);
+    if (_algo == HashAlgorithm::Blake2sp)
+        blake2sp_update(&_stateP, (const uint8_t *)in, inlen);
+    else
+        blake2s_update(&_state, (const uint8_t *)in, inlen);
     return *this;
 }
 HashDigest Hasher::Finalize() {
     HashDigest res;
-    blake2s_final(&_state, res._data, sizeof(res._data));
+    if (_algo == HashAlgorithm::Blake2sp)
+        blake2sp_final(&_stateP, res._data, sizeof(res._data));
+    else
+        blake2s_final(&_state, res._data, sizeof(res._data));
     return res;
 }
 
+#ifdef ZIPSYNC_BATCH_SSE2
+
+//BLAKE2s constants (see RFC 7693)
+static const uint32_t BLAKE2S_IV[8] = {
+    0x6A09E667UL, 0xBB67AE85UL, 0x3C6EF372UL, 0xA54FF53AUL, 0x510E527FUL, 0x9B05688CUL, 0x1F83D9ABUL, 0x5BE0CD19UL
+};
+static const uint8_t BLAKE2S_SIGMA[10][16] = {
+    { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15},
+    {14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3},
+    {11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4},
+    { 7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8},
+    { 9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13},
+    { 2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9},
+    {12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11},
+    {13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10},
+    { 6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5},
+    {10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0},
+};
+//parameter block of unkeyed sequential BLAKE2s with 32-byte digest (only first word is nonzero)
+static const uint32_t BLAKE2S_PARAM0 = 0x01010000UL | 32;
+
+/**
+ * Same 32-bit word of several messages hashed together (one message per lane).
+ */
+struct Lanes {
+    __m128i x;
+};
+static const int LANE_COUNT = 4;
+static inline Lanes operator+ (Lanes a, Lanes b) { return Lanes{_mm_add_epi32(a.x, b.x)}; }
+static inline Lanes operator^ (Lanes a, Lanes b) { return Lanes{_mm_xor_si128(a.x, b.x)}; }
+template<int N> static inline Lanes Rotr(Lanes a) { return Lanes{_mm_or_si128(_mm_srli_epi32(a.x, N), _mm_slli_epi32(a.x, 32 - N))}; }
+static inline Lanes Broadcast(uint32_t value) { return Lanes{_mm_set1_epi32(int(value))}; }
+static inline Lanes LoadLanes(const uint32_t *values) { return Lanes{_mm_loadu_si128((const __m128i*)values)}; }
+static inline void StoreLanes(uint32_t *values, Lanes a) { _mm_storeu_si128((__m128i*)values, a.x); }
+//takes b where mask is set, a otherwise
+static inline Lanes Select(Lanes mask, Lanes a, Lanes b) { return Lanes{_mm_or_si128(_mm_and_si128(mask.x, b.x), _mm_andnot_si128(mask.x, a.x))}; }
+//loads 64-byte block of every lane as 16 words (transposed)
+static inline void LoadBlocks(const uint8_t *const blocks[LANE_COUNT], Lanes m[16]) {
+    for (int k = 0; k < 4; k++) {
+        __m128i r0 = _mm_loadu_si128((const __m128i*)(blocks[0] + 16 * k));
+        __m128i r1 = _mm_loadu_si128((const __m128i*)(blocks[1] + 16 * k));
+        __m128i r2 = _mm_loadu_si128((const __m128i*)(blocks[2] + 16 * k));
+        __m128i r3 = _mm_loadu_si128((const __m128i*)(blocks[3] + 16 * k));
+        __m128i t0 = _mm_unpacklo_epi32(r0, r1), t1 = _mm_unpackhi_epi32(r0, r1);
+        __m128i t2 = _mm_unpacklo_epi32(r2, r3), t3 = _mm_unpackhi_epi32(r2, r3);
+        m[4*k+0].x = _mm_unpacklo_epi64(t0, t2);
+        m[4*k+1].x = _mm_unpackhi_epi64(t0, t2);
+        m[4*k+2].x = _mm_unpacklo_epi64(t1, t3);
+        m[4*k+3].x = _mm_unpackhi_epi64(t1, t3);
+    }
+}
+
+//BLAKE2s compression function applied to all lanes at once
+//counter is at most 32-bit here, since batched messages are small
+static inline void CompressLanes(Lanes h[8], const Lanes m[16], Lanes counter, Lanes finalFlag) {
+    Lanes v[16];
+    for (int i = 0; i < 8; i++) {
+        v[i] = h[i];
+        v[i + 8] = Broadcast(BLAKE2S_IV[i]);
+    }
+    v[12] = v[12] ^ counter;
+    v[14] = v[14] ^ finalFlag;
+    auto G = [&v](int a, int b, int c, int d, Lanes x, Lanes y) {
+        v[a] = v[a] + v[b] + x;
+        v[d] = Rotr<16>(v[d] ^ v[a]);
+        v[c] = v[c] + v[d];
+        v[b] = Rotr<12>(v[b] ^ v[c]);
+        v[a] = v[a] + v[b] + y;
+        v[d] = Rotr<8>(v[d] ^ v[a]);
+        v[c] = v[c] + v[d];
+        v[b] = Rotr<7>(v[b] ^ v[c]);
+    };
+    for (int r = 0; r < 10; r++) {
+        const uint8_t *s = BLAKE2S_SIGMA[r];
+        G(0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+        G(1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+        G(2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+        G(3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+        G(0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+        G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+        G(2, 7,  8, 13, m[s[12]], m[s[13]]);
+        G(3, 4,  9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; i++)
+        h[i] = h[i] ^ v[i] ^ v[i + 8];
+}
+
+//hashes up to LANE_COUNT messages at once (missing lanes have null data and zero size)
+static void HashLanes(const uint8_t *const datas[LANE_COUNT], const size_t sizes[LANE_COUNT], uint8_t *const outs[LANE_COUNT]) {
+    static const uint8_t ZERO_BLOCK[64] = {0};
+    uint8_t padded[LANE_COUNT][64];
+    size_t blocksNum[LANE_COUNT], maxBlocksNum = 0;
+    for (int j = 0; j < LANE_COUNT; j++) {
+        //note: empty message is hashed as one zero block
+        blocksNum[j] = (outs[j] ? std::max<size_t>((sizes[j] + 63) / 64, 1) : 0);
+        maxBlocksNum = std::max(maxBlocksNum, blocksNum[j]);
+    }
+
+    Lanes h[8];
+    for (int i = 0; i < 8; i++)
+        h[i] = Broadcast(BLAKE2S_IV[i] ^ (i == 0 ? BLAKE2S_PARAM0 : 0));
+    for (size_t b = 0; b < maxBlocksNum; b++) {
+        const uint8_t *blocks[LANE_COUNT];
+        uint32_t counter[LANE_COUNT], finalFlag[LANE_COUNT], active[LANE_COUNT];
+        for (int j = 0; j < LANE_COUNT; j++) {
+            if (b >= blocksNum[j]) {
+                //lane has finished: compress garbage and drop the result
+                blocks[j] = ZERO_BLOCK;
+                counter[j] = finalFlag[j] = active[j] = 0;
+                continue;
+            }
+            size_t offset = 64 * b;
+            bool last = (b + 1 == blocksNum[j]);
+            if (offset + 64 <= sizes[j])
+                blocks[j] = datas[j] + offset;
+            else {
+                memset(padded[j], 0, 64);
+                memcpy(padded[j], datas[j] + offset, sizes[j] - offset);
+                blocks[j] = padded[j];
+            }
+            counter[j] = uint32_t(last ? sizes[j] : offset + 64);
+            finalFlag[j] = (last ? 0xFFFFFFFFU : 0);
+            active[j] = 0xFFFFFFFFU;
+        }
+        Lanes m[16];
+        LoadBlocks(blocks, m);
+        Lanes hNew[8];
+        for (int i = 0; i < 8; i++)
+            hNew[i] = h[i];
+        CompressLanes(hNew, m, LoadLanes(counter), LoadLanes(finalFlag));
+        Lanes mask = LoadLanes(active);
+        for (int i = 0; i < 8; i++)
+            h[i] = Select(mask, h[i], hNew[i]);
+    }
+
+    uint32_t words[8][LANE_COUNT];
+    for (int i = 0; i < 8; i++)
+        StoreLanes(words[i], h[i]);
+    for (int j = 0; j < LANE_COUNT; j++) {
+        if (!outs[j])
+            continue;
+        for (int i = 0; i < 8; i++)
+            for (int k = 0; k < 4; k++)
+                outs[j][4 * i + k] = uint8_t(words[i][j] >> (8 * k));
+    }
+}
+#endif
+
+BatchHasher::BatchHasher() {
+    _buffer.reserve(BUFFER_SIZE);
+}
+void BatchHasher::Add(const void *data, size_t size, HashDigest *result) {
+    ZipSyncAssertF(size <= MAX_MESSAGE_SIZE, "Message of size %d is too large for batch hashing", int(size));
+    if (_buffer.size() + size > BUFFER_SIZE)
+        Flush();
+    _messages.push_back(Message{_buffer.size(), size, result});
+    _buffer.insert(_buffer.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+}
+void BatchHasher::Flush() {
+#ifdef ZIPSYNC_BATCH_SSE2
+    //messages of similar size go together, so that lanes do not idle
+    std::stable_sort(_messages.begin(), _messages.end(), [](const Message &a, const Message &b) {
+        return a.size > b.size;
+    });
+    for (size_t i = 0; i < _messages.size(); i += LANE_COUNT) {
+        const uint8_t *datas[LANE_COUNT] = {nullptr};
+        size_t sizes[LANE_COUNT] = {0};
+        uint8_t *outs[LANE_COUNT] = {nullptr};
+        for (int j = 0; j < LANE_COUNT && i + j < _messages.size(); j++) {
+            const Message &msg = _messages[i + j];
+            datas[j] = _buffer.data() + msg.offset;
+            sizes[j] = msg.size;
+            outs[j] = msg.result->_data;
+        }
+        HashLanes(datas, sizes, outs);
+    }
+#else
+    for (const Message &msg : _messages)
+        blake2s(msg.result->_data, sizeof(msg.result->_data), _buffer.data() + msg.offset, msg.size, NULL, 0);
+#endif
+    _messages.clear();
+    _buffer.clear();
+}
+
 }
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #pragma warning(push)
 #pragma warning(disable:4804)  //warning C4804: '/': unsafe use of type 'bool' in operation
@@ -21,24 +22,75 @@ class HashDigest {
     uint8_t _data[32];
 
     friend class Hasher;
+    friend class BatchHasher;
 public:
     bool operator< (const HashDigest &other) const;
     bool operator== (const HashDigest &other) const;
+    static const int HEX_LENGTH = 64;
     std::string Hex() const;
+    //writes exactly HEX_LENGTH chars (without null terminator)
+    void HexTo(char *text) const;
     void Parse(const char *hex);
+    void Parse(const char *hex, size_t len);
     void Clear();
 };
 
+/**
+ * Hash function used to compute contents and compressed hashes of files.
+ * All manifests taking part in one update must use the same algorithm.
+ */
+enum class HashAlgorithm {
+    Blake2s = 0,    //default (all manifests written before algorithm choice appeared use it)
+    Blake2sp = 1,   //8-way parallel flavor of BLAKE2s: much faster on large files (different hash values)
+};
+const char *HashAlgorithmName(HashAlgorithm algo);
+HashAlgorithm ParseHashAlgorithm(const char *name);
+
 /**
  * Wrapper around the chosen hash function.
- * Currently it is BLAKE2s (TODO: use [p]arallel flavor?)
+ * Note: BLAKE2sp gets its speed from the SIMD code in blake2 library (chosen when the library is built).
  */
 class Hasher {
-    blake2s_state _state;
+    HashAlgorithm _algo;
+    union {
+        blake2s_state _state;
+        blake2sp_state _stateP;
+    };
 public:
-    Hasher();
+    Hasher(HashAlgorithm algo = HashAlgorithm::Blake2s);
     Hasher& Update(const void *in, size_t inlen);
     HashDigest Finalize();
 };
 
+/**
+ * Computes BLAKE2s digests of many small independent messages together.
+ * Messages are queued by Add, and their digests are written to the specified places on Flush.
+ * BLAKE2s cannot use SIMD within one small message, so Flush hashes four messages at once in SSE2 lanes
+ * (without SSE2, messages are hashed one by one).
+ * Digests are the same as computed by Hasher with HashAlgorithm::Blake2s.
+ */
+class BatchHasher {
+    struct Message {
+        size_t offset;
+        size_t size;
+        HashDigest *result;
+    };
+    //data of all queued messages, stored contiguously
+    std::vector<uint8_t> _buffer;
+    std::vector<Message> _messages;
+
+public:
+    //messages larger than this should be hashed with streaming Hasher
+    static const size_t MAX_MESSAGE_SIZE = 16 << 10;
+    //total size of queued data which triggers automatic flush
+    static const size_t BUFFER_SIZE = 1 << 20;
+
+    BatchHasher();
+    //queue message for hashing: its digest will be written to *result on flush
+    //note: result must stay valid until Flush is called (messages not flushed are discarded on destruction)
+    void Add(const void *data, size_t size, HashDigest *result);
+    //compute digests of all queued messages
+    void Flush();
+};
+
 }
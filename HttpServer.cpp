@@ -5,15 +5,183 @@
 #include "Utils.h"
 #include "StdString.h"
 #include <algorithm>
+#include <stdlib.h>
 #include <string.h>
 #include <chrono>
 #include <thread>
+#include <map>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#define close _close
+#define dup _dup
+#else
+#include <unistd.h>
+#endif
 
 namespace ZipSync {
 
 //stupid GCC complains about printing uint64_t as "%llu"
 typedef unsigned long long uint64;
 
+#ifdef _WIN32
+typedef struct _stat64 StatBuffer;
+#else
+typedef struct stat StatBuffer;
+#endif
+
+/**
+ * Identifies version of file on disk: changes when file is modified or replaced.
+ * Modification time alone has 1-second resolution, so inode and nanoseconds are added.
+ */
+struct FileVersion {
+    uint64_t size = 0;
+    uint64_t inode = 0;
+    int64_t modTime = 0;
+    int64_t modTimeNsec = 0;
+    //false if platform provides neither inode nor sub-second time (Windows)
+    bool exact = false;
+
+    FileVersion() = default;
+    FileVersion(const StatBuffer &st) : size(st.st_size), inode(st.st_ino), modTime(st.st_mtime) {
+#if defined(_WIN32)
+        exact = false;
+#elif defined(__APPLE__)
+        modTimeNsec = st.st_mtimespec.tv_nsec;
+        exact = true;
+#else
+        modTimeNsec = st.st_mtim.tv_nsec;
+        exact = true;
+#endif
+    }
+    bool operator== (const FileVersion &other) const {
+        return size == other.size && inode == other.inode && modTime == other.modTime && modTimeNsec == other.modTimeNsec;
+    }
+};
+
+/**
+ * File opened for serving.
+ * Shared between all responses which read from it (and between requests if open-file cache is enabled).
+ * Data is read with positioned reads, so the same handle can be used by many threads at once.
+ */
+class HttpServer::ServedFile {
+    int _fd = -1;
+#ifdef _WIN32
+    std::mutex _mutex;      //no pread on Windows: seek + read must be atomic
+#endif
+public:
+    uint64_t size = 0;
+    FileVersion version;
+    //validator: changes when file is modified
+    //note: it is weak (and never matched) if file version is not exact
+    std::string etag;
+
+    ServedFile(int fd, const FileVersion &fileVersion) : _fd(fd), size(fileVersion.size), version(fileVersion) {
+        etag = "\"" + std::to_string(size) + "-" + std::to_string(version.inode) + "-" + std::to_string(version.modTime) + "." + std::to_string(version.modTimeNsec) + "\"";
+        if (!version.exact)
+            etag = "W/" + etag;
+    }
+    ~ServedFile() {
+        close(_fd);
+    }
+    ServedFile(const ServedFile &) = delete;
+    ServedFile& operator=(const ServedFile &) = delete;
+
+    //returns nullptr if file cannot be opened or is not a regular file
+    static std::shared_ptr<ServedFile> Open(const std::string &path) {
+#ifdef _WIN32
+        int fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+        if (fd < 0)
+            return nullptr;
+        StatBuffer st;
+        if (_fstat64(fd, &st) != 0 || !(st.st_mode & _S_IFREG)) {
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+        StatBuffer st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+#endif
+            close(fd);
+            return nullptr;
+        }
+        return std::make_shared<ServedFile>(fd, FileVersion(st));
+    }
+
+    size_t ReadAt(uint64_t pos, char *buf, size_t len) {
+#ifdef _WIN32
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_lseeki64(_fd, pos, SEEK_SET) < 0)
+            return 0;
+        int res = _read(_fd, buf, (unsigned)std::min(len, size_t(INT_MAX)));
+#else
+        ssize_t res = pread(_fd, buf, len, pos);
+#endif
+        return res < 0 ? 0 : size_t(res);
+    }
+    //new descriptor of the same file (for responses which own their descriptor)
+    int Duplicate() const {
+        return dup(_fd);
+    }
+};
+
+/**
+ * Keeps recently used files open, so that they are not reopened on every request.
+ * File is reopened if its version (size, inode, modification time) changes.
+ * If file version is not exact on this platform, file is reopened on every request.
+ */
+class HttpServer::FileCache {
+    struct Entry {
+        std::shared_ptr<ServedFile> file;
+        uint64_t lastUse;
+    };
+    std::mutex _mutex;
+    std::map<std::string, Entry> _entries;
+    uint64_t _useCounter = 0;
+    int _maxFiles = 0;
+
+public:
+    FileCache(int maxFiles) : _maxFiles(maxFiles) {}
+
+    std::shared_ptr<ServedFile> Open(const std::string &path) {
+        if (_maxFiles <= 0)
+            return ServedFile::Open(path);
+#ifdef _WIN32
+        StatBuffer st;
+        if (_stat64(path.c_str(), &st) != 0)
+#else
+        StatBuffer st;
+        if (stat(path.c_str(), &st) != 0)
+#endif
+            return nullptr;
+        FileVersion version(st);
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto iter = _entries.find(path);
+        if (iter != _entries.end()) {
+            Entry &e = iter->second;
+            if (version.exact && e.file->version == version) {
+                e.lastUse = ++_useCounter;
+                return e.file;
+            }
+            _entries.erase(iter);   //file has changed
+        }
+        std::shared_ptr<ServedFile> file = ServedFile::Open(path);
+        if (!file)
+            return nullptr;
+        if (_entries.size() >= _maxFiles) {
+            //evict least recently used (responses still using it keep it open)
+            auto oldest = std::min_element(_entries.begin(), _entries.end(), [](const auto &a, const auto &b) {
+                return a.second.lastUse < b.second.lastUse;
+            });
+            _entries.erase(oldest);
+        }
+        _entries[path] = Entry{file, ++_useCounter};
+        return file;
+    }
+};
+
 //GCC workaround: cannot use constructor of nested struct in default value of argument
 HttpServer::PauseModel::PauseModel() = default;
 HttpServer::PauseModel::PauseModel(uint64_t bbp, int ps) {
@@ -24,11 +192,14 @@ HttpServer::PauseModel::PauseModel(uint64_t bbp, int ps) {
 HttpServer::~HttpServer() {
     Stop();
 }
-HttpServer::HttpServer() {
+HttpServer::HttpServer() : _requestsCount(0) {
     SetBlockSize();
     SetPortNumber();
     SetPauseModel();
     SetDropMultipart();
+    SetThreadPoolSize();
+    SetZeroCopy();
+    SetFileCacheSize();
 }
 
 void HttpServer::SetRootDir(const std::string &root) {
@@ -54,6 +225,46 @@ void HttpServer::SetDropMultipart(bool drop) {
     _dropMultipart = drop;
 }
 
+void HttpServer::SetThreadPoolSize(int threads) {
+    _threadPoolSize = threads;
+}
+void HttpServer::SetZeroCopy(bool enabled) {
+    _zeroCopy = enabled;
+}
+void HttpServer::SetFileCacheSize(int maxFiles) {
+    _fileCache.reset(new FileCache(maxFiles));
+}
+
+void HttpServer::SetNetworkModel(const NetworkModel &model, const std::string &urlPrefix) {
+    for (auto &pair : _networkModels)
+        if (pair.first == urlPrefix) {
+            pair.second = model;
+            return;
+        }
+    _networkModels.emplace_back(urlPrefix, model);
+    std::stable_sort(_networkModels.begin(), _networkModels.end(), [](const auto &a, const auto &b) {
+        return a.first.size() > b.first.size();
+    });
+}
+void HttpServer::ClearNetworkModels() {
+    _networkModels.clear();
+}
+void HttpServer::SetRandomSeed(int seed) {
+    std::lock_guard<std::mutex> lock(_rndMutex);
+    _rnd.seed(seed);
+}
+
+const HttpServer::NetworkModel *HttpServer::FindNetworkModel(const char *url) const {
+    for (const auto &pair : _networkModels)
+        if (strncmp(url, pair.first.c_str(), pair.first.size()) == 0)
+            return &pair.second;
+    return nullptr;
+}
+double HttpServer::RandomValue() const {
+    std::lock_guard<std::mutex> lock(_rndMutex);
+    return std::uniform_real_distribution<double>(0.0, 1.0)(_rnd);
+}
+
 void HttpServer::CloseSuspendedSocket() {
     if (_suspendedSocket) {
         MHD_socket socket = *(MHD_socket*)_suspendedSocket;
@@ -67,11 +278,6 @@ void HttpServer::CloseSuspendedSocket() {
     }
 }
 
-struct ThreadState {
-    int callCount = 0;
-};
-thread_local ThreadState threadState;
-
 static MHD_Result MhdFunction(
     void *cls,
     MHD_Connection *connection,
@@ -82,18 +288,15 @@ static MHD_Result MhdFunction(
     size_t *upload_data_size,
     void **ptr
 ) {
-    //only accept GET requests
-    if (0 != strcmp(method, "GET"))
+    //only accept GET requests (HEAD is same, but microhttpd drops body)
+    if (0 != strcmp(method, "GET") && 0 != strcmp(method, "HEAD"))
         return MHD_NO;
 
-    //clear thread state and associate it with request
-    if (*ptr == NULL)
-        threadState = ThreadState();
-    *ptr = &threadState;
-
-    threadState.callCount++;
-    if (threadState.callCount == 1) {
+    //note: pointer is kept per request, even if many connections are served by one thread
+    static int headersSeenMarker;
+    if (*ptr != &headersSeenMarker) {
         //first call only shows headers
+        *ptr = &headersSeenMarker;
         return MHD_YES;
     }
 
@@ -112,15 +315,30 @@ void HttpServer::Stop() {
 void HttpServer::Start() {
     if (_daemon)
         return;
-    _daemon = MHD_start_daemon(
-        MHD_USE_THREAD_PER_CONNECTION,
-        _port,
-        NULL,
-        NULL,
-        &MhdFunction,
-        this,
-        MHD_OPTION_END
-    );
+    if (_threadPoolSize > 0) {
+        _daemon = MHD_start_daemon(
+            MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_AUTO,
+            _port,
+            NULL,
+            NULL,
+            &MhdFunction,
+            this,
+            MHD_OPTION_THREAD_POOL_SIZE, (unsigned int)_threadPoolSize,
+            MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int)60,
+            MHD_OPTION_END
+        );
+    }
+    else {
+        _daemon = MHD_start_daemon(
+            MHD_USE_THREAD_PER_CONNECTION,
+            _port,
+            NULL,
+            NULL,
+            &MhdFunction,
+            this,
+            MHD_OPTION_END
+        );
+    }
     ZipSyncAssertF(_daemon, "Failed to start microhttpd on port %d", _port);
 }
 
@@ -132,40 +350,69 @@ void HttpServer::StartButIgnoreConnections() {
     _suspendedSocket = new MHD_socket(socket);
 }
 
-class PauseState {
-    const HttpServer::PauseModel *_model = nullptr;
+//controls how fast response data is sent
+class ThrottleState {
+    const HttpServer::PauseModel *_pauseModel = nullptr;
     uint64_t _clearTime = 0;
+    //bandwidth cap (0 = unlimited)
+    uint64_t _bandwidth = 0;
+    uint64_t _sentBytes = 0;
+    std::chrono::steady_clock::time_point _startTime;
+    //connection is reset when response reaches this position
+    uint64_t _resetPos = UINT64_MAX;
 
 public:
-    PauseState(const HttpServer::PauseModel *model) {
-        _model = model;
+    ThrottleState(const HttpServer::PauseModel *pauseModel, uint64_t bandwidth = 0, uint64_t resetPos = UINT64_MAX) {
+        _pauseModel = pauseModel;
+        _bandwidth = bandwidth;
+        _resetPos = resetPos;
+        _startTime = std::chrono::steady_clock::now();
     };
+    //returns false if connection must be reset instead of sending data at pos
+    //otherwise reduces len so that reset happens exactly at planned position
+    bool Limit(uint64_t pos, size_t &len) const {
+        if (pos >= _resetPos)
+            return false;
+        len = (size_t)std::min(uint64_t(len), _resetPos - pos);
+        return true;
+    }
     void Think(uint64_t added) {
-        if (!_model)
+        _sentBytes += added;
+        if (_bandwidth > 0) {
+            //sleep until average speed since start gets below the cap
+            double wantedTime = double(_sentBytes) / _bandwidth;
+            double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _startTime).count() * 1e-6;
+            if (wantedTime > elapsed)
+                std::this_thread::sleep_for(std::chrono::microseconds(int64_t((wantedTime - elapsed) * 1e+6)));
+        }
+        if (!_pauseModel)
             return;
-        if (_model->pauseSeconds <= 0)
+        if (_pauseModel->pauseSeconds <= 0)
             return;
         _clearTime += added;
-        if (_clearTime >= _model->bytesBetweenPauses) {
-            std::this_thread::sleep_for(_model->pauseSeconds * std::chrono::milliseconds(1000));
+        if (_clearTime >= _pauseModel->bytesBetweenPauses) {
+            std::this_thread::sleep_for(_pauseModel->pauseSeconds * std::chrono::milliseconds(1000));
             _clearTime = 0;
         }
     }
 };
 
 class HttpServer::FileDownload {
-    StdioFileHolder _file;
+    std::shared_ptr<ServedFile> _file;
     uint64_t _base = 0;
-    PauseState _pauseState;
+    ThrottleState _throttle;
 public:
-    FileDownload(StdioFileHolder &&file, uint64_t base, const PauseModel *pauseModel)
-        : _file(std::move(file)), _base(base), _pauseState(pauseModel)
+    FileDownload(const std::shared_ptr<ServedFile> &file, uint64_t base, const ThrottleState &throttle)
+        : _file(file), _base(base), _throttle(throttle)
     {}
     static ssize_t FileReaderCallback(void *cls, uint64_t pos, char *buf, size_t max) {
         auto *down = (FileDownload*)cls;
-        fseek(down->_file, down->_base + pos, SEEK_SET);
-        size_t readBytes = fread(buf, 1, max, down->_file);
-        down->_pauseState.Think(readBytes);
+        if (!down->_throttle.Limit(pos, max))
+            return MHD_CONTENT_READER_END_WITH_ERROR;
+        size_t readBytes = down->_file->ReadAt(down->_base + pos, buf, max);
+        if (readBytes == 0)
+            return MHD_CONTENT_READER_END_WITH_ERROR;   //file truncated?
+        down->_throttle.Think(readBytes);
         return readBytes;
     }
     static void FileReaderFinalize(void *cls) {
@@ -201,18 +448,17 @@ struct ChunkInfo {
     }
 };
 class HttpServer::MultipartDownload {
-    StdioFileHolder _file;
-    uint64_t _fileSize = UINT64_MAX;
+    std::shared_ptr<ServedFile> _file;
     uint64_t _totalContentSize = 0;
     std::string _boundary;   //includes leading EOL
     std::vector<ChunkInfo> _chunks;
-    PauseState _pauseState;
+    ThrottleState _throttle;
 public:
     MultipartDownload(
-        StdioFileHolder &&file, uint64_t fileSize,
+        const std::shared_ptr<ServedFile> &file,
         std::vector<std::pair<uint64_t, uint64_t>> arr,
-        const PauseModel *pauseModel
-    ) : _file(std::move(file)), _fileSize(fileSize), _pauseState(pauseModel) {
+        const ThrottleState &throttle
+    ) : _file(file), _throttle(throttle) {
         //note: we do NOT check that boundary does not occur in data
         _boundary = std::string("********") + "72FFC411326F7C93";
         int n = arr.size();
@@ -223,8 +469,9 @@ public:
             header += "--";
             header += _boundary;
             header += "\r\n";
-            char buff[64];
-            sprintf(buff, "Content-Range: bytes %llu-%llu/%llu\r\n\r\n", uint64(arr[i].first), uint64(arr[i].second), uint64(_fileSize));
+            header += "Content-Type: application/octet-stream\r\n";
+            char buff[96];
+            sprintf(buff, "Content-Range: bytes %llu-%llu/%llu\r\n\r\n", uint64(arr[i].first), uint64(arr[i].second), uint64(_file->size));
             header += buff;
             _chunks.push_back(ChunkInfo::CreateWithData(outPos, header));
             _chunks.push_back(ChunkInfo::CreateAsFileRange(outPos, arr[i].first, arr[i].second - arr[i].first + 1));
@@ -254,16 +501,17 @@ public:
             ZipSyncAssert(len > 0);
         }
         if (chunk.fileStart != UINT64_MAX) {
-            fseek(_file, chunk.fileStart + offset, SEEK_SET);
-            len = fread(buf, 1, len, _file);
+            len = _file->ReadAt(chunk.fileStart + offset, buf, len);
         }
         else {
             memcpy(buf, chunk.rawData.data() + offset, len);
         }
-        _pauseState.Think(len);
+        _throttle.Think(len);
     }
     static ssize_t FileReaderCallback(void *cls, uint64_t pos, char *buf, size_t max) {
         auto *down = (MultipartDownload*)cls;
+        if (!down->_throttle.Limit(pos, max))
+            return MHD_CONTENT_READER_END_WITH_ERROR;
         down->FileReaderCallback(pos, max, buf);
         if (max == 0)
             return ssize_t(-1);
@@ -280,96 +528,193 @@ public:
 #define PAGE_NOT_FOUND "<html><head><title>File not found</title></head><body>File not found</body></html>"
 #define PAGE_NOT_SATISFIABLE "<html><head><title>Range error</title></head><body>Range not satisfiable</body></html>"
 
-static MHD_Result ReturnWithErrorResponse(MHD_Connection *connection, int httpCode, const char *content) {
+static MHD_Result ReturnWithErrorResponse(MHD_Connection *connection, int httpCode, const char *content, uint64_t fileSize = UINT64_MAX) {
     MHD_Response *response = MHD_create_response_from_buffer(
         strlen(content),
         (void*)content,
         MHD_RESPMEM_MUST_COPY
     );
+    if (httpCode == MHD_HTTP_RANGE_NOT_SATISFIABLE && fileSize != UINT64_MAX) {
+        //tell client what the actual size is
+        char buff[64];
+        sprintf(buff, "bytes */%llu", uint64(fileSize));
+        MHD_add_response_header(response, "Content-Range", buff);
+    }
     MHD_Result ret = MHD_queue_response(
         connection,
         httpCode,
         response
     );
+    MHD_destroy_response(response);
     return ret;
 }
 
+//checks that URL cannot point outside of root directory
+static bool IsUrlPathSafe(const char *url) {
+    if (url[0] != '/')
+        return false;
+    if (strchr(url, '\\') || strchr(url, ':'))
+        return false;
+    std::vector<std::string> segs;
+    stdext::split(segs, url + 1, "/");
+    for (const std::string &s : segs)
+        if (s == "..")
+            return false;
+    return true;
+}
+
 int HttpServer::AcceptCallback(
     MHD_Connection *connection,
     const char *url,
     const char *method,
     const char *version
 ) const {
+    _requestsCount++;
+
+    const NetworkModel *model = FindNetworkModel(url);
+    if (model && (model->latencyMs > 0 || model->jitterMs > 0)) {
+        //note: with thread pool, this delays other connections too
+        int delay = model->latencyMs + int(RandomValue() * model->jitterMs);
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+    }
 
+    if (!IsUrlPathSafe(url))
+        return ReturnWithErrorResponse(connection, MHD_HTTP_NOT_FOUND, PAGE_NOT_FOUND);
     std::string filepath = _rootDir + url;
 
-    StdioFileHolder file(fopen(filepath.c_str(), "rb"));
+    std::shared_ptr<ServedFile> file = _fileCache->Open(filepath);
     if (!file)
         return ReturnWithErrorResponse(connection, MHD_HTTP_NOT_FOUND, PAGE_NOT_FOUND);
-
-    fseek(file, 0, SEEK_END);
-    uint64_t fsize = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    uint64_t flast = fsize - 1; 
+    uint64_t fsize = file->size;
+    const std::string &etag = file->etag;
+
+    if (const char *ifNoneMatch = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-None-Match")) {
+        if (file->version.exact && etag == ifNoneMatch) {
+            MHD_Response *response = MHD_create_response_from_buffer(0, (void*)"", MHD_RESPMEM_PERSISTENT);
+            MHD_add_response_header(response, "ETag", etag.c_str());
+            MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, response);
+            MHD_destroy_response(response);
+            return ret;
+        }
+    }
 
     std::vector<std::pair<uint64_t, uint64_t>> ranges;
     if (const char *rangeStr = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Range")) {
         bool bad = false;
         static const char *BYTES_PREFIX = "bytes=";
         for (int i = 0; BYTES_PREFIX[i]; i++)
-            if (tolower(BYTES_PREFIX[i]) != tolower(rangeStr[i]))
+            if (tolower(BYTES_PREFIX[i]) != tolower(rangeStr[i])) {
                 bad = true;
+                break;
+            }
         if (bad)
-            return ReturnWithErrorResponse(connection, MHD_HTTP_RANGE_NOT_SATISFIABLE, PAGE_NOT_SATISFIABLE);
+            return ReturnWithErrorResponse(connection, MHD_HTTP_RANGE_NOT_SATISFIABLE, PAGE_NOT_SATISFIABLE, fsize);
+        auto ParseNumber = [](const std::string &str, uint64_t &value) -> bool {
+            if (str.empty() || str.size() > 19 || str.find_first_not_of("0123456789") != std::string::npos)
+                return false;
+            value = strtoull(str.c_str(), NULL, 10);
+            return true;
+        };
+        //see RFC 7233, section 2.1
         std::vector<std::string> segs;
         stdext::split(segs, rangeStr + 6, ",");
-        for (const std::string &s : segs) {
-            int len = s.size();
+        for (std::string s : segs) {
+            stdext::trim(s);
             int pos = s.find('-');
-            if (pos < 0 || pos == 0) {
+            if (pos < 0) {
                 bad = true;
                 break;
             }
             std::string fromStr = s.substr(0, pos);
             std::string toStr = s.substr(pos+1);
-            uint64 from = 0;
-            uint64 to = UINT64_MAX;
-            if (sscanf(fromStr.c_str(), "%llu", &from) != 1)
-                bad = true;
-            if (sscanf(toStr.c_str(), "%llu", &to) != 1)
-                to = fsize - 1;
-            ranges.emplace_back(from, to);
+            uint64_t from = 0, to = UINT64_MAX;
+            if (fromStr.empty()) {
+                //suffix range "-N": last N bytes
+                uint64_t suffix;
+                if (!ParseNumber(toStr, suffix)) {
+                    bad = true;
+                    break;
+                }
+                if (suffix == 0)
+                    continue;   //unsatisfiable
+                from = (suffix < fsize ? fsize - suffix : 0);
+            }
+            else {
+                if (!ParseNumber(fromStr, from) || (!toStr.empty() && !ParseNumber(toStr, to)) || from > to) {
+                    bad = true;
+                    break;
+                }
+            }
+            if (from >= fsize)
+                continue;       //unsatisfiable
+            ranges.emplace_back(from, std::min(to, fsize - 1));
         }
-        if (bad)
-            return ReturnWithErrorResponse(connection, MHD_HTTP_RANGE_NOT_SATISFIABLE, PAGE_NOT_SATISFIABLE);
-        for (int i = 0; i < ranges.size(); i++) {
-            if (i && ranges[i-1].second >= ranges[i].first)
-                bad = true;
-            if (ranges[i].first > ranges[i].second)
-                bad = true;
-            if (ranges[i].second >= fsize)
-                bad = true;
+        //note: request is satisfiable if any of its ranges is
+        if (bad || ranges.empty())
+            return ReturnWithErrorResponse(connection, MHD_HTTP_RANGE_NOT_SATISFIABLE, PAGE_NOT_SATISFIABLE, fsize);
+        //unsorted and overlapping ranges are coalesced (parts are sent in increasing order)
+        std::sort(ranges.begin(), ranges.end());
+        int k = 0;
+        for (int i = 1; i < ranges.size(); i++) {
+            if (ranges[i].first <= ranges[k].second)
+                ranges[k].second = std::max(ranges[k].second, ranges[i].second);
+            else
+                ranges[++k] = ranges[i];
+        }
+        ranges.resize(k + 1);
+        if (model && model->maxRanges > 0 && ranges.size() > model->maxRanges) {
+            if (!model->fullBodyOnTooManyRanges)
+                return ReturnWithErrorResponse(connection, MHD_HTTP_RANGE_NOT_SATISFIABLE, PAGE_NOT_SATISFIABLE, fsize);
+            ranges.clear();     //ignore ranges, send whole file
         }
-        if (bad)
-            return ReturnWithErrorResponse(connection, MHD_HTTP_RANGE_NOT_SATISFIABLE, PAGE_NOT_SATISFIABLE);
     }
 
+    //decide if this response will be broken off at random point
+    uint64_t bandwidth = 0;
+    uint64_t resetPos = UINT64_MAX;
+    if (model) {
+        bandwidth = model->bandwidth;
+        if (model->resetProbability > 0.0 && RandomValue() < model->resetProbability) {
+            uint64_t responseSize = 0;
+            for (const auto &rng : ranges)
+                responseSize += rng.second - rng.first + 1;
+            if (ranges.empty())
+                responseSize = fsize;
+            resetPos = uint64_t(RandomValue() * responseSize);
+        }
+    }
+    ThrottleState throttle(&_pauseModel, bandwidth, resetPos);
+    //kernel can send file directly to socket only if we don't need to control the pace
+    bool canZeroCopy = _zeroCopy && bandwidth == 0 && resetPos == UINT64_MAX && _pauseModel.pauseSeconds <= 0;
+
     MHD_Response *response = nullptr;
     int httpCode = MHD_HTTP_OK;
-    if (ranges.size() == 0) {
-        std::unique_ptr<FileDownload> down(new FileDownload(std::move(file), 0, &_pauseModel));
-        response = MHD_create_response_from_callback(fsize, _blockSize, FileDownload::FileReaderCallback, down.release(), FileDownload::FileReaderFinalize);
-    }
-    else if (ranges.size() == 1) {
-        std::unique_ptr<FileDownload> down(new FileDownload(std::move(file), ranges[0].first, &_pauseModel));
-        response = MHD_create_response_from_callback(ranges[0].second - ranges[0].first + 1, _blockSize, FileDownload::FileReaderCallback, down.release(), FileDownload::FileReaderFinalize);
-        httpCode = MHD_HTTP_PARTIAL_CONTENT;
-        char buff[64];
-        sprintf(buff, "bytes %llu-%llu/%llu", uint64(ranges[0].first), uint64(ranges[0].second), uint64(fsize));
-        MHD_add_response_header(response, "Content-Range", buff);
+    if (ranges.size() <= 1) {
+        uint64_t start = 0, len = fsize;
+        if (ranges.size() == 1) {
+            start = ranges[0].first;
+            len = ranges[0].second - ranges[0].first + 1;
+        }
+        int fd = (canZeroCopy ? file->Duplicate() : -1);
+        if (fd >= 0) {
+            //note: microhttpd uses sendfile when possible, and closes descriptor in the end
+            response = MHD_create_response_from_fd_at_offset64(len, fd, start);
+            if (!response)
+                close(fd);
+        }
+        if (!response) {
+            std::unique_ptr<FileDownload> down(new FileDownload(file, start, throttle));
+            response = MHD_create_response_from_callback(len, _blockSize, FileDownload::FileReaderCallback, down.release(), FileDownload::FileReaderFinalize);
+        }
+        if (response && ranges.size() == 1) {
+            httpCode = MHD_HTTP_PARTIAL_CONTENT;
+            char buff[64];
+            sprintf(buff, "bytes %llu-%llu/%llu", uint64(ranges[0].first), uint64(ranges[0].second), uint64(fsize));
+            MHD_add_response_header(response, "Content-Range", buff);
+        }
     }
     else if (!_dropMultipart) {
-        std::unique_ptr<MultipartDownload> down(new MultipartDownload(std::move(file), fsize, ranges, &_pauseModel));
+        std::unique_ptr<MultipartDownload> down(new MultipartDownload(file, ranges, throttle));
         uint64_t totalContentSize = down->GetTotalSize();
         char buff[64];
         sprintf(buff, "multipart/byteranges; boundary=%s", down->GetBoundary());
@@ -379,6 +724,8 @@ int HttpServer::AcceptCallback(
     }
     if (!response)
         return MHD_NO;
+    MHD_add_response_header(response, "ETag", etag.c_str());
+    MHD_add_response_header(response, "Accept-Ranges", "bytes");
 
     MHD_Result ret = MHD_queue_response(
         connection,
@@ -2,6 +2,11 @@
 
 #include <string>
 #include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <vector>
+#include <memory>
 
 struct MHD_Daemon;
 struct MHD_Connection;
@@ -15,8 +20,8 @@ struct MHD_Connection;
 namespace ZipSync {
 
 /**
- * Simple embedded HTTP server.
- * Used only for tests.
+ * Simple embedded HTTP server for static files, supporting byteranges and multipart byteranges.
+ * Used for tests and benchmarks (with network emulation), and by "zipsync serve" command.
  */
 class HttpServer {
 public:
@@ -30,6 +35,24 @@ public:
         PauseModel(uint64_t bbp, int ps);
     };
 
+    //emulation of real network conditions (applied to every response separately)
+    struct NetworkModel {
+        //maximum speed of sending response in bytes per second (0 = unlimited)
+        uint64_t bandwidth = 0;
+        //delay before response starts (time to first byte)
+        int latencyMs = 0;
+        //random additional delay from 0 to this value
+        int jitterMs = 0;
+        //probability that connection is reset at random point of response
+        double resetProbability = 0.0;
+        //maximum number of ranges allowed in one request (0 = unlimited)
+        int maxRanges = 0;
+        //if there are more ranges than allowed:
+        //  true: whole file is returned with code 200 (like many real servers do)
+        //  false: 416 error is returned
+        bool fullBodyOnTooManyRanges = true;
+    };
+
 private:
     std::string _rootDir;
     MHD_Daemon *_daemon = nullptr;
@@ -37,7 +60,17 @@ private:
     int _port = -1;
     int _blockSize = -1;
     bool _dropMultipart = false;
+    int _threadPoolSize = 0;
+    bool _zeroCopy = false;
+    class ServedFile;
+    class FileCache;
+    std::unique_ptr<FileCache> _fileCache;
     PauseModel _pauseModel;
+    //sorted by prefix length descending: longest matching prefix wins
+    std::vector<std::pair<std::string, NetworkModel>> _networkModels;
+    mutable std::mt19937 _rnd;
+    mutable std::mutex _rndMutex;
+    mutable std::atomic<int> _requestsCount;
 
 public:
     static const int PORT_DEFAULT = 8090;
@@ -53,7 +86,23 @@ public:
     void SetBlockSize(int blockSize = 128*1024);
     void SetDropMultipart(bool drop = false);
     void SetPauseModel(const PauseModel &model = PauseModel());
+    //threads = 0: every connection gets its own thread (default)
+    //threads > 0: connections are served by fixed pool of threads
+    void SetThreadPoolSize(int threads = 0);
+    //enabled = true: send file data directly from descriptor (sendfile) when pace is not controlled
+    void SetZeroCopy(bool enabled = false);
+    //keep at most this number of recently served files open (0 = reopen file on every request)
+    void SetFileCacheSize(int maxFiles = 0);
+    //set network model for all URLs starting with given prefix (e.g. "/subdir/")
+    //empty prefix sets default model for all URLs
+    //note: must not be called while some request is being processed
+    void SetNetworkModel(const NetworkModel &model, const std::string &urlPrefix = "");
+    void ClearNetworkModels();
+    //seed for random decisions of network models (jitter, connection resets)
+    void SetRandomSeed(int seed);
     std::string GetRootUrl() const;
+    //number of requests received since creation
+    int GetRequestsCount() const { return _requestsCount; }
 
     void Start();
     void Stop();
@@ -71,6 +120,8 @@ private:
     class MultipartDownload;
 
     void CloseSuspendedSocket();
+    const NetworkModel *FindNetworkModel(const char *url) const;
+    double RandomValue() const;
 };
 
 }
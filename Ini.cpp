@@ -5,27 +5,92 @@
 #include "ZipUtils.h"
 #include "Hash.h"
 #include <string.h>
+#include <charconv>
 #include "ChecksummedZip.h"
+#include "Tracing.h"
 
 
 namespace ZipSync {
 
-void WriteIniFile(const char *path, const IniData &data, IniMode mode) {
-    ZipSyncAssertF(path[0], "Path to write INI file is empty");
-    std::string text;
-    for (const auto &pNS : data) {
-        char buffer[SIZE_LINEBUFFER];
-        sprintf(buffer, "[%s]\n", pNS.first.c_str());
-        text.append(buffer);
-        for (const auto &pKV : pNS.second) {
-            sprintf(buffer, "%s=%s\n", pKV.first.c_str(), pKV.second.c_str());
-            text.append(buffer);
-        }
-        text.append("\n");
-    }
+static IniMode ResolveMode(const char *path, IniMode mode) {
     if (mode == IniMode::Auto)
         mode = (path[strlen(path)-1] == 'z' ? IniMode::Zipped : IniMode::Plain);
-    if (mode == IniMode::Zipped)
+    return mode;
+}
+
+IniParseHandler::~IniParseHandler() {}
+
+void IniWriter::Section(std::string_view prefix, std::string_view name) {
+    if (_data) {
+        std::string fullName;
+        fullName.reserve(prefix.size() + name.size());
+        fullName.append(prefix).append(name);
+        _data->emplace_back(std::move(fullName), IniSect());
+        return;
+    }
+    _text->push_back('[');
+    _text->append(prefix);
+    _text->append(name);
+    _text->append("]\n");
+}
+void IniWriter::Property(std::string_view key, std::string_view value) {
+    if (_data) {
+        _data->back().second.emplace_back(std::string(key), std::string(value));
+        return;
+    }
+    _text->append(key);
+    _text->push_back('=');
+    _text->append(value);
+    _text->push_back('\n');
+}
+void IniWriter::Property(std::string_view key, uint64_t value) {
+    char buffer[24];
+    char *end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+    Property(key, std::string_view(buffer, end - buffer));
+}
+void IniWriter::Property(std::string_view key, const HashDigest &value) {
+    char buffer[HashDigest::HEX_LENGTH];
+    value.HexTo(buffer);
+    Property(key, std::string_view(buffer, sizeof(buffer)));
+}
+void IniWriter::Property(std::string_view key, uint64_t first, char delimiter, uint64_t second) {
+    char buffer[48];
+    char *end = std::to_chars(buffer, buffer + sizeof(buffer), first).ptr;
+    *end++ = delimiter;
+    end = std::to_chars(end, buffer + sizeof(buffer), second).ptr;
+    Property(key, std::string_view(buffer, end - buffer));
+}
+void IniWriter::EndSection() {
+    if (_text)
+        _text->push_back('\n');
+}
+
+std::vector<uint8_t> ReadIniText(const char *path, IniMode mode) {
+    TraceSpan span("ReadIniText");
+    span.Arg("path", path);
+    std::vector<uint8_t> text;
+    if (ResolveMode(path, mode) == IniMode::Zipped)
+        text = ReadChecksummedZip(path, "data.ini");
+    else {
+        //allocate whole buffer at once
+        StdioFileHolder f(path, "rb");
+        FileSeek64(f, 0, SEEK_END);
+        int64_t size = FileTell64(f);
+        ZipSyncAssertF(size >= 0, "Failed to get size of %s", path);
+        FileSeek64(f, 0, SEEK_SET);
+        text.resize(size);
+        size_t read = fread(text.data(), 1, size, f);
+        ZipSyncAssertF(read == size, "Failed to read %lld bytes from %s", (long long)size, path);
+    }
+    span.Arg("bytes", text.size());
+    return text;
+}
+
+void WriteIniText(const char *path, std::string_view text, IniMode mode) {
+    ZipSyncAssertF(path[0], "Path to write INI file is empty");
+    TraceSpan span("WriteIniText");
+    span.Arg("path", path).Arg("bytes", text.size());
+    if (ResolveMode(path, mode) == IniMode::Zipped)
         WriteChecksummedZip(path, text.data(), text.size(), "data.ini");
     else {
         StdioFileHolder f(path, "wb");
@@ -33,54 +98,76 @@ void WriteIniFile(const char *path, const IniData &data, IniMode mode) {
     }
 }
 
-IniData ReadIniFile(const char *path, IniMode mode) {
-    std::vector<char> text;
-    if (mode == IniMode::Auto)
-        mode = (path[strlen(path)-1] == 'z' ? IniMode::Zipped : IniMode::Plain);
-    if (mode == IniMode::Zipped) {
-        auto data = ReadChecksummedZip(path, "data.ini");
-        text.assign(data.begin(), data.end());
-    }
-    else {
-        StdioFileHolder f(path, "rb");
-        char buffer[SIZE_FILEBUFFER];
-        while (int bytes = fread(buffer, 1, SIZE_FILEBUFFER, f))
-            text.insert(text.end(), buffer, buffer+bytes);
-    }
+static std::string_view TrimView(std::string_view str) {
+    size_t b = 0, e = str.size();
+    while (b < e && isspace((unsigned char)str[b]))
+        b++;
+    while (e > b && isspace((unsigned char)str[e-1]))
+        e--;
+    return str.substr(b, e - b);
+}
 
-    IniData ini;
-    IniSect sec;
-    std::string name;
-    auto CommitSec = [&]() {
-        if (!name.empty())
-            ini.push_back(std::make_pair(std::move(name), std::move(sec)));
-        name.clear();
-        sec.clear();
-    };
+void ParseIniText(std::string_view text, IniParseHandler &handler) {
     size_t textPos = 0;
-    std::string line;
     while (textPos < text.size()) {
-        size_t eolPos = std::find(text.data() + textPos, text.data() + text.size(), '\n') - text.data();
-        line.assign(text.data() + textPos, text.data() + eolPos);
+        size_t eolPos = text.find('\n', textPos);
+        if (eolPos == std::string_view::npos)
+            eolPos = text.size();
+        std::string_view line = TrimView(text.substr(textPos, eolPos - textPos));
         textPos = eolPos + 1;
 
-        stdext::trim(line);
         if (line.empty())
             continue;
         if (line[0] == '#') //comment
             continue;
         if (line.front() == '[' && line.back() == ']') {
-            CommitSec();
-            name = line.substr(1, line.size() - 2);
+            handler.Section(line.substr(1, line.size() - 2));
+            if (handler.stop)
+                return;
         }
         else {
             size_t pos = line.find('=');
-            ZipSyncAssertF(pos != std::string::npos, "Cannot parse ini line: %s", line.c_str());
-            sec.emplace_back(line.substr(0, pos), line.substr(pos+1));
+            ZipSyncAssertF(pos != std::string_view::npos, "Cannot parse ini line: %s", std::string(line).c_str());
+            handler.Property(line.substr(0, pos), line.substr(pos+1));
         }
     }
-    CommitSec();
-    return ini;
+}
+
+void WriteIniFile(const char *path, const IniData &data, IniMode mode) {
+    std::string text;
+    IniWriter writer(text);
+    for (const auto &pNS : data) {
+        writer.Section(pNS.first);
+        for (const auto &pKV : pNS.second)
+            writer.Property(pKV.first, pKV.second);
+        writer.EndSection();
+    }
+    WriteIniText(path, text, mode);
+}
+
+IniData ParseIniData(std::string_view text) {
+    struct Handler : IniParseHandler {
+        IniData ini;
+        bool skip = true;
+        void Section(std::string_view name) override {
+            skip = name.empty();
+            if (!skip)
+                ini.emplace_back(std::string(name), IniSect());
+        }
+        void Property(std::string_view key, std::string_view value) override {
+            if (skip)
+                return;     //property outside of named section is ignored
+            ini.back().second.emplace_back(std::string(key), std::string(value));
+        }
+    };
+    Handler handler;
+    ParseIniText(text, handler);
+    return std::move(handler.ini);
+}
+
+IniData ReadIniFile(const char *path, IniMode mode) {
+    std::vector<uint8_t> text = ReadIniText(path, mode);
+    return ParseIniData(std::string_view((const char*)text.data(), text.size()));
 }
 
 }
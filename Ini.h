@@ -2,7 +2,9 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include <algorithm>
+#include "Hash.h"
 
 namespace ZipSync {
 
@@ -20,4 +22,45 @@ enum class IniMode {
 void WriteIniFile(const char *path, const IniData &data, IniMode mode = IniMode::Auto);
 IniData ReadIniFile(const char *path, IniMode mode = IniMode::Auto);
 
+/**
+ * Receives contents of ini file during single-pass parsing.
+ * All string views point into the text being parsed (valid only during the call).
+ */
+class IniParseHandler {
+public:
+    virtual ~IniParseHandler();
+    virtual void Section(std::string_view name) = 0;
+    virtual void Property(std::string_view key, std::string_view value) = 0;
+    //handler sets it to stop parsing (checked after every section header)
+    bool stop = false;
+};
+
+/**
+ * Appends ini text to a string buffer (or sections to IniData).
+ * Numbers and digests are formatted in-place, without temporary strings.
+ */
+class IniWriter {
+    std::string *_text = nullptr;
+    IniData *_data = nullptr;
+public:
+    IniWriter(std::string &text) : _text(&text) {}
+    IniWriter(IniData &data) : _data(&data) {}
+    //section name is concatenation of prefix and name
+    void Section(std::string_view prefix, std::string_view name = std::string_view());
+    void Property(std::string_view key, std::string_view value);
+    void Property(std::string_view key, uint64_t value);
+    void Property(std::string_view key, const HashDigest &value);
+    void Property(std::string_view key, uint64_t first, char delimiter, uint64_t second);
+    void EndSection();
+};
+
+//reads whole text of ini file (unpacks it in zipped mode)
+std::vector<uint8_t> ReadIniText(const char *path, IniMode mode = IniMode::Auto);
+//writes given text as ini file (packs it in zipped mode)
+void WriteIniText(const char *path, std::string_view text, IniMode mode = IniMode::Auto);
+//parses text of ini file in one pass, calling handler for every section and property
+void ParseIniText(std::string_view text, IniParseHandler &handler);
+//parses text of ini file into IniData
+IniData ParseIniData(std::string_view text);
+
 }
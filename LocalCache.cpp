@@ -1,7 +1,148 @@
 #include "LocalCache.h"
+#include "ZipUtils.h"
+#include "Path.h"
+#include "Ini.h"
+#include "Utils.h"
+#include <algorithm>
+#include <map>
+#include <set>
 
 
 namespace ZipSync {
 
+static const char *CACHE_MANIFEST_FILENAME = "manifest.iniz";
+static const char *CACHE_ZIP_PREFIX = "cache_";
+
+void LocalCache::Init(const std::string &cacheDir, uint64_t maxSize) {
+    _cacheDir = cacheDir;
+    _maxSize = maxSize;
+    _manifest.Clear();
+    CreateDir(_cacheDir);
+
+    std::string maniPath = _cacheDir + '/' + CACHE_MANIFEST_FILENAME;
+    if (IfFileExists(maniPath)) {
+        Manifest mani;
+        mani.ReadFromIniFile(maniPath.c_str(), _cacheDir);
+        //user could have deleted some cache zips manually
+        _manifest = mani.Filter([](const FileMetainfo &f) {
+            return f.location == FileLocation::Local && IfFileExists(f.zipPath.abs);
+        });
+    }
+}
+
+int LocalCache::GetZipNumber(const std::string &zipPath) const {
+    std::string fn = GetFilename(zipPath);
+    int number = -1;
+    sscanf(fn.c_str() + strlen(CACHE_ZIP_PREFIX), "%d", &number);
+    return number;
+}
+
+void LocalCache::AddFiles(const Manifest &files) {
+    if (files.GetHashAlgorithm() != _manifest.GetHashAlgorithm()) {
+        //hashes of different algorithms cannot be mixed: drop old cache contents
+        std::set<std::string> oldZips;
+        for (int i = 0; i < _manifest.size(); i++)
+            oldZips.insert(_manifest[i].zipPath.abs);
+        for (const std::string &zipPath : oldZips) {
+            g_logger->infof("Removing %s from local cache (hash algorithm changed)", zipPath.c_str());
+            RemoveFile(zipPath);
+        }
+        _manifest.Clear();
+        _manifest.SetHashAlgorithm(files.GetHashAlgorithm());
+    }
+
+    //select new files, group them by source zip
+    std::set<HashDigest> present;
+    for (int i = 0; i < _manifest.size(); i++)
+        present.insert(_manifest[i].compressedHash);
+    std::map<std::string, std::vector<const FileMetainfo*>> zipToFiles;
+    for (int i = 0; i < files.size(); i++) {
+        const FileMetainfo &pf = files[i];
+        if (!present.insert(pf.compressedHash).second)
+            continue;
+        zipToFiles[pf.zipPath.abs].push_back(&pf);
+    }
+    if (zipToFiles.empty())
+        return;
+
+    int number = 0;
+    for (int i = 0; i < _manifest.size(); i++)
+        number = std::max(number, GetZipNumber(_manifest[i].zipPath.abs) + 1);
+    PathAR zipPath = PathAR::FromRel(CACHE_ZIP_PREFIX + std::to_string(number) + ".zip", _cacheDir);
+
+    //copy files in raw mode
+    std::vector<const FileMetainfo*> copiedFiles;
+    {
+        ZipFileHolder zfOut(zipPath.abs.c_str());
+        for (const auto &pZF : zipToFiles) {
+            UnzFileIndexed zf;
+            zf.Open(pZF.first.c_str());
+            for (const FileMetainfo *pf : pZF.second) {
+                zf.LocateByByterange(pf->byterange[0], pf->byterange[1]);
+                unz_file_info64 info;
+                char filename[SIZE_PATH];
+                SAFE_CALL(unzGetCurrentFileInfo64(zf, &info, filename, sizeof(filename), NULL, 0, NULL, 0));
+                minizipCopyFile(zf, zfOut,
+                    filename,
+                    info.compression_method, info.flag,
+                    info.internal_fa, info.external_fa, info.dosDate,
+                    true, info.crc, info.compressed_size, info.uncompressed_size
+                );
+                copiedFiles.push_back(pf);
+            }
+        }
+    }
+
+    //analyze the new zip, add all files to manifest
+    UnzFileHolder zf(zipPath.abs.c_str());
+    SAFE_CALL(unzGoToFirstFile(zf));
+    for (int i = 0; i < copiedFiles.size(); i++) {
+        FileMetainfo pf;
+        AnalyzeCurrentFile(zf, pf, false, false);
+        pf.package = copiedFiles[i]->package;
+        pf.zipPath = zipPath;
+        pf.location = FileLocation::Local;
+        pf.contentsHash = copiedFiles[i]->contentsHash;
+        pf.compressedHash = copiedFiles[i]->compressedHash;
+        _manifest.AppendFile(pf);
+        if (i+1 < copiedFiles.size())
+            SAFE_CALL(unzGoToNextFile(zf));
+    }
+    zf.reset();
+
+    g_logger->infof("Added %d files to local cache as %s", int(copiedFiles.size()), zipPath.rel.c_str());
+    Save();
+}
+
+void LocalCache::Evict() {
+    //newest zips first
+    std::map<int, std::string, std::greater<int>> numberToZip;
+    for (int i = 0; i < _manifest.size(); i++)
+        numberToZip[GetZipNumber(_manifest[i].zipPath.abs)] = _manifest[i].zipPath.abs;
+
+    uint64_t totalSize = 0;
+    std::set<std::string> removedZips;
+    for (const auto &pNZ : numberToZip) {
+        totalSize += GetFileSize(pNZ.second);
+        if (totalSize > _maxSize)
+            removedZips.insert(pNZ.second);
+    }
+    if (removedZips.empty())
+        return;
+
+    _manifest = _manifest.Filter([&removedZips](const FileMetainfo &f) {
+        return removedZips.count(f.zipPath.abs) == 0;
+    });
+    Save();
+    for (const std::string &zipPath : removedZips) {
+        g_logger->infof("Removing %s from local cache", zipPath.c_str());
+        RemoveFile(zipPath);
+    }
+}
+
+void LocalCache::Save() const {
+    std::string maniPath = _cacheDir + '/' + CACHE_MANIFEST_FILENAME;
+    _manifest.WriteToIniFile(maniPath.c_str());
+}
 
 }
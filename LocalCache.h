@@ -1,5 +1,7 @@
 #pragma once
 
+#include "Manifest.h"
+
 
 namespace ZipSync {
 
@@ -9,9 +11,36 @@ namespace ZipSync {
  *   1. old files which are no longer used, but may be helpful to return back to previous version
  *   2. provided manifest for all the files in from p.1
  *   3. various manifests from remote places --- to avoid downloading them again
+ *
+ * Old files are packed into "cache_N.zip" files, one zip per update (greater N = newer).
+ * Every file is stored at most once (by compressed hash).
+ * When total size exceeds the limit, the oldest cache zips are removed.
  */
 class LocalCache {
-    //TODO
+    //absolute path to the cache directory
+    std::string _cacheDir;
+    //maximum total size of cache zips in bytes
+    uint64_t _maxSize = UINT64_MAX;
+    //provided manifest describing all files in the cache (Local location)
+    Manifest _manifest;
+
+public:
+    //load cache from given directory (it is created if absent)
+    void Init(const std::string &cacheDir, uint64_t maxSize = UINT64_MAX);
+
+    const std::string &GetCacheDir() const { return _cacheDir; }
+    const Manifest &GetManifest() const { return _manifest; }
+
+    //copy the given files into a new cache zip (files already present in cache are skipped)
+    //all the files must be available locally
+    //if files use another hash algorithm than the cache, then old cache contents are removed
+    void AddFiles(const Manifest &files);
+    //remove the oldest cache zips until total size fits into limit
+    void Evict();
+
+private:
+    void Save() const;
+    int GetZipNumber(const std::string &zipPath) const;
 };
 
 }
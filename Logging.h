@@ -29,6 +29,7 @@ enum LogCode {
     //the remaining log codes are intercepted during testing
     lcRenameZipWithoutRepack,
     lcRepackZip,
+    lcSharedCacheHit,
 };
 
 //thrown when message with "error" severity is posted
@@ -4,10 +4,14 @@
 #include "Utils.h"
 #include "ZipUtils.h"
 #include "Path.h"
+#include "Tracing.h"
 #include <tuple>
+#include <algorithm>
 #include <map>
+#include <set>
 #include <functional>
 #include <string.h>
+#include <charconv>
 
 #include "minizip_extra.h"
 
@@ -45,10 +49,13 @@ void FileMetainfo::DontProvide() {
 }
 
 
-void AnalyzeCurrentFile(unzFile zf, FileMetainfo &filemeta, bool hashContents, bool hashCompressed) {
+void AnalyzeCurrentFile(unzFile zf, FileMetainfo &filemeta, bool hashContents, bool hashCompressed, HashAlgorithm algo, BatchHasher *batch) {
     char filename[SIZE_PATH];
-    unz_file_info info;
-    SAFE_CALL(unzGetCurrentFileInfo(zf, &info, filename, sizeof(filename), NULL, 0, NULL, 0));
+    uint8_t extra[256];
+    unz_file_info64 info;
+    SAFE_CALL(unzGetCurrentFileInfo64(zf, &info, filename, sizeof(filename), extra, sizeof(extra), NULL, 0));
+    TraceSpan span("AnalyzeCurrentFile");
+    span.Arg("file", filename).Arg("bytes", info.compressed_size);
 
     ZipSyncAssertF(info.version == 0, "File %s has made-by version %d (not supported)", filename, info.version);
     ZipSyncAssertF(info.version_needed == 20, "File %s needs zip version %d (not supported)", filename, info.version_needed);
@@ -56,10 +63,8 @@ void AnalyzeCurrentFile(unzFile zf, FileMetainfo &filemeta, bool hashContents, b
     ZipSyncAssertF((info.flag & 0x01) == 0, "File %s is encrypted (not supported)", filename);
     ZipSyncAssertF((info.flag & (~0x06)) == 0, "File %s has flags %d (not supported)", filename, info.flag);
     ZipSyncAssertF(info.compression_method == 0 || info.compression_method == 8, "File %s has compression %d (not supported)", filename, info.compression_method);
-    ZipSyncAssertF(info.size_file_extra == 0, "File %s has extra field in header (not supported)", filename);
     ZipSyncAssertF(info.size_file_comment == 0, "File %s has comment in header (not supported)", filename);
     ZipSyncAssertF(info.disk_num_start == 0, "File %s has disk nonzero number (not supported)", filename);
-    //TODO: check that extra field is empty in local file header?...
 
     filemeta.filename = filename;
     filemeta.props.crc32 = info.crc;
@@ -70,37 +75,56 @@ void AnalyzeCurrentFile(unzFile zf, FileMetainfo &filemeta, bool hashContents, b
     filemeta.props.lastModTime = info.dosDate;
     filemeta.props.internalAttribs = info.internal_fa;
     filemeta.props.externalAttribs = info.external_fa;
-    unzGetCurrentFilePosition(zf, &filemeta.byterange[0], NULL, &filemeta.byterange[1]);
+    uint64_t dataStart;
+    unzGetCurrentFilePosition(zf, &filemeta.byterange[0], &dataStart, &filemeta.byterange[1]);
+
+    //extra fields may only contain zip64 extended info, exactly as minizip writes it
+    std::vector<uint8_t> expectedExtra = minizipCreateCentralExtra(info.compressed_size, info.uncompressed_size, filemeta.byterange[0]);
+    ZipSyncAssertF(info.size_file_extra == expectedExtra.size() && memcmp(extra, expectedExtra.data(), expectedExtra.size()) == 0, "File %s has extra field in header (not supported)", filename);
+    uint64_t localHeaderSize = 30 + strlen(filename) + (minizipIsZip64Entry(info.compressed_size, info.uncompressed_size) ? 20 : 0);
+    ZipSyncAssertF(dataStart - filemeta.byterange[0] == localHeaderSize, "File %s has extra field in local header (not supported)", filename);
 
     for (int mode = 0; mode < 2; mode++) {
         if (!(mode == 0 ? hashCompressed : hashContents))
             continue;
         SAFE_CALL(unzOpenCurrentFile2(zf, NULL, NULL, !mode));
 
-        Hasher hasher;
+        uint64_t expectedSize = (mode == 0 ? filemeta.props.compressedSize : filemeta.props.contentsSize);
+        HashDigest &cmpHash = (mode == 0 ? filemeta.compressedHash : filemeta.contentsHash);
+        //small file: read it whole and queue into batch
+        bool batched = (batch && algo == HashAlgorithm::Blake2s && expectedSize <= BatchHasher::MAX_MESSAGE_SIZE);
+        static_assert(BatchHasher::MAX_MESSAGE_SIZE < SIZE_FILEBUFFER, "Small file must fit into buffer");
+
+        Hasher hasher(algo);
         char buffer[SIZE_FILEBUFFER];
-        int processedBytes = 0;
+        uint64_t processedBytes = 0;
         while (1) {
-            int bytes = unzReadCurrentFile(zf, buffer, sizeof(buffer));
+            size_t offset = (batched ? processedBytes : 0);
+            int bytes = unzReadCurrentFile(zf, buffer + offset, sizeof(buffer) - offset);
             if (bytes < 0)
                 SAFE_CALL(bytes);
             if (bytes == 0)
                 break;
-            hasher.Update(buffer, bytes);
+            if (!batched)
+                hasher.Update(buffer, bytes);
             processedBytes += bytes;
+            if (batched && processedBytes > expectedSize)
+                break;  //reported size is wrong, assert below
         } 
-        HashDigest cmpHash = hasher.Finalize();
 
         SAFE_CALL(unzCloseCurrentFile(zf));
 
         if (mode == 0) {
-            ZipSyncAssertF(processedBytes == filemeta.props.compressedSize, "File %s has wrong compressed size: %d instead of %d", filename, filemeta.props.compressedSize, processedBytes);
-            filemeta.compressedHash = cmpHash;
+            ZipSyncAssertF(processedBytes == filemeta.props.compressedSize, "File %s has wrong compressed size: %llu instead of %llu", filename, (unsigned long long)filemeta.props.compressedSize, (unsigned long long)processedBytes);
         }
         else {
-            ZipSyncAssertF(processedBytes == filemeta.props.contentsSize, "File %s has wrong uncompressed size: %d instead of %d", filename, filemeta.props.contentsSize, processedBytes);
-            filemeta.contentsHash = cmpHash;
+            ZipSyncAssertF(processedBytes == filemeta.props.contentsSize, "File %s has wrong uncompressed size: %llu instead of %llu", filename, (unsigned long long)filemeta.props.contentsSize, (unsigned long long)processedBytes);
         }
+
+        if (batched)
+            batch->Add(buffer, processedBytes, &cmpHash);
+        else
+            cmpHash = hasher.Finalize();
     }
 }
 
@@ -108,29 +132,44 @@ void AppendManifestsFromLocalZip(
     const std::string &zipPathAbs, const std::string &rootDir,
     FileLocation location,
     const std::string &packageName,
-    Manifest &mani
+    Manifest &mani,
+    int fromIndex, int toIndex
 ) {
     PathAR zipPath = PathAR::FromAbs(zipPathAbs, rootDir);
 
     UnzFileHolder zf(zipPath.abs.c_str());
-    ZipSyncAssertF(!unzIsZip64(zf), "Zip64 is not supported!");
-    SAFE_CALL(unzGoToFirstFile(zf));
-    while (1) {
-        FileMetainfo filemeta;
+    unz_global_info64 globalInfo;
+    SAFE_CALL(unzGetGlobalInfo64(zf, &globalInfo));
+    int count = globalInfo.number_entry;
+    toIndex = std::min(toIndex, count);
+    ZipSyncAssertF(fromIndex >= 0 && fromIndex <= toIndex, "Wrong range of files [%d..%d) in zip %s", fromIndex, toIndex, zipPath.abs.c_str());
+
+    //note: small files are hashed in batches, so their metainfo must stay in place until flush
+    std::vector<FileMetainfo> files(toIndex - fromIndex);
+    BatchHasher batch;
+    if (!files.empty()) {
+        SAFE_CALL(unzGoToFirstFile(zf));
+        for (int i = 0; i < fromIndex; i++)
+            SAFE_CALL(unzGoToNextFile(zf));
+    }
+    for (int i = 0; i < files.size(); i++) {
+        if (i > 0)
+            SAFE_CALL(unzGoToNextFile(zf));
+        FileMetainfo &filemeta = files[i];
         filemeta.zipPath = zipPath;
         filemeta.location = location;
         filemeta.package = packageName;
 
-        AnalyzeCurrentFile(zf, filemeta);
-
-        mani.AppendFile(filemeta);
-
-        int err = unzGoToNextFile(zf);
-        if (err == UNZ_END_OF_LIST_OF_FILE)
-            break;
-        SAFE_CALL(err);
+        AnalyzeCurrentFile(zf, filemeta, true, true, mani.GetHashAlgorithm(), &batch);
+    }
+    if (!files.empty() && toIndex == count) {
+        ZipSyncAssertF(unzGoToNextFile(zf) == UNZ_END_OF_LIST_OF_FILE, "Zip %s has more files than declared", zipPath.abs.c_str());
     }
     zf.reset();
+    batch.Flush();
+
+    for (FileMetainfo &filemeta : files)
+        mani.AppendFile(filemeta);
 }
 void Manifest::AppendLocalZip(const std::string &zipPath, const std::string &rootDir, const std::string &packageName) {
     ZipSyncAssert(PathAR::IsHttp(rootDir) == false);
@@ -138,10 +177,69 @@ void Manifest::AppendLocalZip(const std::string &zipPath, const std::string &roo
 }
 
 void Manifest::AppendManifest(const Manifest &other) {
+    if (_files.empty())
+        _hashAlgorithm = other._hashAlgorithm;
+    else if (!other._files.empty())
+        ZipSyncAssertF(_hashAlgorithm == other._hashAlgorithm, "Cannot merge manifests with different hash algorithms: %s and %s", HashAlgorithmName(_hashAlgorithm), HashAlgorithmName(other._hashAlgorithm));
     AppendVector(_files, other._files);
 }
 
-IniData Manifest::WriteToIni() const {
+static const char *HASH_SECTION = "Hash";
+static const char *ROOT_DIGEST_SECTION = "RootDigest";
+static const char *ZIP_DIGEST_SECTION_PREFIX = "ZipDigest ";
+
+HashDigest ComputeZipDigest(std::vector<const FileMetainfo*> files) {
+    std::sort(files.begin(), files.end(), [](const FileMetainfo *a, const FileMetainfo *b) {
+        return FileMetainfo::IsLess_ByZip(*a, *b);
+    });
+    //note: numbers are serialized as 8-byte little-endian, so that digest does not depend on platform
+    std::vector<uint8_t> buffer;
+    auto AppendNumber = [&buffer](uint64_t value) {
+        for (int b = 0; b < 8; b++)
+            buffer.push_back((value >> (8 * b)) & 0xFF);
+    };
+    Hasher hasher;
+    for (const FileMetainfo *pf : files) {
+        buffer.clear();
+        buffer.insert(buffer.end(), pf->filename.begin(), pf->filename.end());
+        buffer.push_back(0);
+        buffer.insert(buffer.end(), (const uint8_t*)&pf->contentsHash, (const uint8_t*)&pf->contentsHash + sizeof(HashDigest));
+        buffer.insert(buffer.end(), (const uint8_t*)&pf->compressedHash, (const uint8_t*)&pf->compressedHash + sizeof(HashDigest));
+        AppendNumber(pf->byterange[0]);
+        AppendNumber(pf->byterange[1]);
+        AppendNumber(pf->props.lastModTime);
+        AppendNumber(pf->props.compressionMethod);
+        AppendNumber(pf->props.generalPurposeBitFlag);
+        AppendNumber(pf->props.internalAttribs);
+        AppendNumber(pf->props.externalAttribs);
+        AppendNumber(pf->props.compressedSize);
+        AppendNumber(pf->props.contentsSize);
+        AppendNumber(pf->props.crc32);
+        hasher.Update(buffer.data(), buffer.size());
+    }
+    return hasher.Finalize();
+}
+
+std::map<std::string, HashDigest> ComputeZipDigests(const Manifest &mani) {
+    std::map<std::string, std::vector<const FileMetainfo*>> zipFiles;
+    for (int i = 0; i < mani.size(); i++)
+        zipFiles[mani[i].zipPath.rel].push_back(&mani[i]);
+    std::map<std::string, HashDigest> res;
+    for (const auto &pZF : zipFiles)
+        res[pZF.first] = ComputeZipDigest(pZF.second);
+    return res;
+}
+
+HashDigest ComputeRootDigest(const std::map<std::string, HashDigest> &zipDigests) {
+    Hasher hasher;
+    for (const auto &pZD : zipDigests) {
+        hasher.Update(pZD.first.c_str(), pZD.first.size() + 1);
+        hasher.Update(&pZD.second, sizeof(HashDigest));
+    }
+    return hasher.Finalize();
+}
+
+void Manifest::WriteToIni(IniWriter &writer, bool withDigests) const {
     //sort files by INI order
     std::vector<const FileMetainfo*> order;
     for (const auto &f : _files)
@@ -150,78 +248,343 @@ IniData Manifest::WriteToIni() const {
         return FileMetainfo::IsLess_ByZip(*a, *b);
     });
 
-    IniData ini;
+    if (_hashAlgorithm != HashAlgorithm::Blake2s) {
+        //note: section is omitted for default algorithm, so that old manifests remain the same
+        writer.Section(HASH_SECTION);
+        writer.Property("algorithm", HashAlgorithmName(_hashAlgorithm));
+        writer.EndSection();
+    }
+    if (withDigests) {   //digests go first: they allow to compare manifests quickly
+        std::map<std::string, HashDigest> zipDigests = ComputeZipDigests(*this);
+        writer.Section(ROOT_DIGEST_SECTION);
+        writer.Property("digest", ComputeRootDigest(zipDigests));
+        writer.EndSection();
+        //size of local zip allows to notice that it was changed after manifest was written
+        //note: size is not included in digest
+        std::map<std::string, std::string> localZips;
+        for (const auto &f : _files)
+            if (f.location == FileLocation::Inplace || f.location == FileLocation::Local)
+                localZips.emplace(f.zipPath.rel, f.zipPath.abs);
+        for (const auto &pZD : zipDigests) {
+            writer.Section(ZIP_DIGEST_SECTION_PREFIX, pZD.first);
+            writer.Property("digest", pZD.second);
+            auto iter = localZips.find(pZD.first);
+            uint64_t zipSize;
+            int64_t zipTime;
+            if (iter != localZips.end() && GetFileStat(iter->second, zipSize, zipTime))
+                writer.Property("size", zipSize);
+            writer.EndSection();
+        }
+    }
+    std::string fullPath;
     for (const FileMetainfo *pf : order) {
-        IniSect section;
-        section.push_back(std::make_pair("contentsHash", pf->contentsHash.Hex()));
-        section.push_back(std::make_pair("compressedHash", pf->compressedHash.Hex()));
-        section.push_back(std::make_pair("byterange", std::to_string(pf->byterange[0]) + "-" + std::to_string(pf->byterange[1])));
-        section.push_back(std::make_pair("package", pf->package));
-        section.push_back(std::make_pair("crc32", std::to_string(pf->props.crc32)));
-        section.push_back(std::make_pair("lastModTime", std::to_string(pf->props.lastModTime)));
-        section.push_back(std::make_pair("compressionMethod", std::to_string(pf->props.compressionMethod)));
-        section.push_back(std::make_pair("gpbitFlag", std::to_string(pf->props.generalPurposeBitFlag)));
-        section.push_back(std::make_pair("compressedSize", std::to_string(pf->props.compressedSize)));
-        section.push_back(std::make_pair("contentsSize", std::to_string(pf->props.contentsSize)));
-        section.push_back(std::make_pair("internalAttribs", std::to_string(pf->props.internalAttribs)));
-        section.push_back(std::make_pair("externalAttribs", std::to_string(pf->props.externalAttribs)));
-
-        std::string secName = "File " + GetFullPath(pf->zipPath.rel, pf->filename);
-        ini.push_back(std::make_pair(secName, std::move(section)));
+        //note: the order of properties is relied upon in ManifestIniParser
+        //note: byterange and sizes exceed 32 bits in zip64 archives (older versions cannot parse such manifests)
+        fullPath = GetFullPath(pf->zipPath.rel, pf->filename);
+        writer.Section("File ", fullPath);
+        writer.Property("contentsHash", pf->contentsHash);
+        writer.Property("compressedHash", pf->compressedHash);
+        writer.Property("byterange", pf->byterange[0], '-', pf->byterange[1]);
+        writer.Property("package", pf->package);
+        writer.Property("crc32", pf->props.crc32);
+        writer.Property("lastModTime", pf->props.lastModTime);
+        writer.Property("compressionMethod", pf->props.compressionMethod);
+        writer.Property("gpbitFlag", pf->props.generalPurposeBitFlag);
+        writer.Property("compressedSize", pf->props.compressedSize);
+        writer.Property("contentsSize", pf->props.contentsSize);
+        writer.Property("internalAttribs", pf->props.internalAttribs);
+        writer.Property("externalAttribs", pf->props.externalAttribs);
+        writer.EndSection();
     }
-
+}
+void Manifest::WriteToIniText(std::string &text) const {
+    IniWriter writer(text);
+    WriteToIni(writer);
+}
+IniData Manifest::WriteToIni() const {
+    IniData ini;
+    IniWriter writer(ini);
+    WriteToIni(writer);
     return ini;
 }
-void Manifest::ReadFromIni(const IniData &data, const std::string &rootDir) {
-    bool remote = PathAR::IsHttp(rootDir);
+void Manifest::WriteToIniFile(const char *path, IniMode mode) const {
+    TraceSpan span("Manifest::WriteToIniFile");
+    span.Arg("files", _files.size());
+    std::string text;
+    WriteToIniText(text);
+    WriteIniText(path, text, mode);
+}
 
-    for (const auto &pNS : data) {
-        FileMetainfo pf;
-        pf.location = (remote ? FileLocation::RemoteHttp : FileLocation::Local);
+/**
+ * Fills manifest with files while ini is being parsed (property by property).
+ */
+class ManifestIniParser : public IniParseHandler {
+    Manifest &_manifest;
+    const std::string &_rootDir;
+    bool _remote;
+    //digests are collected here (if not null)
+    ManifestDigests *_digests;
+    HashDigest *_digest = nullptr;
+    //relative path of zip in current zip digest section
+    std::string _digestZip;
+
+    //the file being parsed now
+    FileMetainfo _pf;
+    bool _inFile = false;
+    int _propIdx = 0;
+
+    //hash algorithm declared in the ini
+    HashAlgorithm _hashAlgorithm = HashAlgorithm::Blake2s;
+    bool _inHash = false;
+    bool _hadFiles;
+
+    static uint64_t ParseNumber(std::string_view text, const char *key) {
+        uint64_t value = 0;
+        auto res = std::from_chars(text.data(), text.data() + text.size(), value);
+        ZipSyncAssertF(res.ec == std::errc() && res.ptr == text.data() + text.size(), "Cannot parse number %s in property %s", std::string(text).c_str(), key);
+        return value;
+    }
 
-        std::string name = pNS.first;
-        if (!stdext::starts_with(name, "File "))
-            continue;
-        name = name.substr(5);
-        const IniSect &sec = pNS.second;
-
-        ParseFullPath(name, pf.zipPath.rel, pf.filename);
-        pf.zipPath = PathAR::FromRel(pf.zipPath.rel, rootDir);
-
-        //note: since nobody would ever write manifest by hand
-        //here we rely on order of properties as written in WriteToIni
-        int propIdx = 0;
-        auto ReadProperty = [&sec,&propIdx](const char *key) -> const std::string& {
-            ZipSyncAssertF(propIdx < sec.size(), "No property while %s expected", key);
-            ZipSyncAssertF(sec[propIdx].first == key, "Expected property %s, got %s", key, sec[propIdx].first.c_str());
-            return sec[propIdx++].second;
-        };
-
-        pf.contentsHash.Parse(ReadProperty("contentsHash").c_str());
-        pf.compressedHash.Parse(ReadProperty("compressedHash").c_str());
-
-        const std::string &byterange = ReadProperty("byterange");
-        size_t pos = byterange.find('-');
-        ZipSyncAssertF(pos != std::string::npos, "Byterange %s has no hyphen", byterange.c_str());
-        pf.byterange[0] = std::stoul(byterange.substr(0, pos));
-        pf.byterange[1] = std::stoul(byterange.substr(pos+1));
-        if (pf.byterange[0] || pf.byterange[1]) {
-            ZipSyncAssert(pf.byterange[0] < pf.byterange[1]);
+public:
+    //note: since nobody would ever write manifest by hand
+    //here we rely on order of properties as written in WriteToIniText
+    static constexpr const char *PROPERTY_NAMES[] = {
+        "contentsHash", "compressedHash", "byterange", "package",
+        "crc32", "lastModTime", "compressionMethod", "gpbitFlag",
+        "compressedSize", "contentsSize", "internalAttribs", "externalAttribs",
+    };
+    static const int PROPERTY_COUNT = sizeof(PROPERTY_NAMES) / sizeof(PROPERTY_NAMES[0]);
+
+    ManifestIniParser(Manifest &manifest, const std::string &rootDir, ManifestDigests *digests = nullptr)
+        : _manifest(manifest), _rootDir(rootDir), _remote(PathAR::IsHttp(rootDir)), _digests(digests), _hadFiles(manifest.size() > 0)
+    {}
+
+    void Section(std::string_view name) override {
+        FinishFile();
+        _inHash = (name == HASH_SECTION);
+        _digest = nullptr;
+        if (_digests) {
+            static const std::string_view ZIP_PREFIX = ZIP_DIGEST_SECTION_PREFIX;
+            if (name == ROOT_DIGEST_SECTION) {
+                _digest = &_digests->root;
+                _digests->present = true;
+            }
+            else if (name.substr(0, ZIP_PREFIX.size()) == ZIP_PREFIX) {
+                _digestZip = std::string(name.substr(ZIP_PREFIX.size()));
+                _digest = &_digests->zips[_digestZip];
+            }
+        }
+        static const std::string_view FILE_PREFIX = "File ";
+        if (name.substr(0, FILE_PREFIX.size()) != FILE_PREFIX)
+            return;
+        _inFile = true;
+        _propIdx = 0;
+        _pf.location = (_remote ? FileLocation::RemoteHttp : FileLocation::Local);
+        std::string zipPathRel;
+        ParseFullPath(std::string(name.substr(FILE_PREFIX.size())), zipPathRel, _pf.filename);
+        _pf.zipPath = PathAR::FromRel(zipPathRel, _rootDir);
+    }
+
+    void Property(std::string_view key, std::string_view value) override {
+        if (_digest) {
+            if (key == "size" && _digest != &_digests->root) {
+                _digests->zipSizes[_digestZip] = ParseNumber(value, "size");
+                return;
+            }
+            ZipSyncAssertF(key == "digest", "Unexpected property %s in digest section", std::string(key).c_str());
+            _digest->Parse(value.data(), value.size());
+            return;
+        }
+        if (_inHash) {
+            if (key == "algorithm")
+                _hashAlgorithm = ParseHashAlgorithm(std::string(value).c_str());
+            return;
+        }
+        if (!_inFile)
+            return;
+        ZipSyncAssertF(_propIdx < PROPERTY_COUNT, "Unexpected property %s", std::string(key).c_str());
+        const char *expected = PROPERTY_NAMES[_propIdx];
+        ZipSyncAssertF(key == expected, "Expected property %s, got %s", expected, std::string(key).c_str());
+        switch (_propIdx++) {
+            case 0: _pf.contentsHash.Parse(value.data(), value.size()); break;
+            case 1: _pf.compressedHash.Parse(value.data(), value.size()); break;
+            case 2: {
+                size_t pos = value.find('-');
+                ZipSyncAssertF(pos != std::string_view::npos, "Byterange %s has no hyphen", std::string(value).c_str());
+                _pf.byterange[0] = ParseNumber(value.substr(0, pos), expected);
+                _pf.byterange[1] = ParseNumber(value.substr(pos+1), expected);
+                if (_pf.byterange[0] || _pf.byterange[1]) {
+                    ZipSyncAssert(_pf.byterange[0] < _pf.byterange[1]);
+                }
+                else
+                    _pf.location = FileLocation::Nowhere;
+                break;
+            }
+            case 3: _pf.package.assign(value.data(), value.size()); break;
+            case 4: _pf.props.crc32 = ParseNumber(value, expected); break;
+            case 5: _pf.props.lastModTime = ParseNumber(value, expected); break;
+            case 6: _pf.props.compressionMethod = ParseNumber(value, expected); break;
+            case 7: _pf.props.generalPurposeBitFlag = ParseNumber(value, expected); break;
+            case 8: _pf.props.compressedSize = ParseNumber(value, expected); break;
+            case 9: _pf.props.contentsSize = ParseNumber(value, expected); break;
+            case 10: _pf.props.internalAttribs = ParseNumber(value, expected); break;
+            case 11: _pf.props.externalAttribs = ParseNumber(value, expected); break;
         }
+    }
+
+    void FinishFile() {
+        if (!_inFile)
+            return;
+        ZipSyncAssertF(_propIdx == PROPERTY_COUNT, "No property while %s expected", PROPERTY_NAMES[_propIdx]);
+        _manifest.AppendFile(_pf);
+        _inFile = false;
+    }
+    //must be called after last property
+    void Finish() {
+        FinishFile();
+        if (!_hadFiles)
+            _manifest.SetHashAlgorithm(_hashAlgorithm);
         else
-            pf.location = FileLocation::Nowhere;
-        pf.package = ReadProperty("package");
-        pf.props.crc32 = std::stoul(ReadProperty("crc32"));
-        pf.props.lastModTime = std::stoul(ReadProperty("lastModTime"));
-        pf.props.compressionMethod = std::stoul(ReadProperty("compressionMethod"));
-        pf.props.generalPurposeBitFlag = std::stoul(ReadProperty("gpbitFlag"));
-        pf.props.compressedSize = std::stoul(ReadProperty("compressedSize"));
-        pf.props.contentsSize = std::stoul(ReadProperty("contentsSize"));
-        pf.props.internalAttribs = std::stoul(ReadProperty("internalAttribs"));
-        pf.props.externalAttribs = std::stoul(ReadProperty("externalAttribs"));
+            ZipSyncAssertF(_manifest.GetHashAlgorithm() == _hashAlgorithm, "Cannot read manifest with hash algorithm %s into manifest with %s", HashAlgorithmName(_hashAlgorithm), HashAlgorithmName(_manifest.GetHashAlgorithm()));
+    }
+};
 
-        AppendFile(pf);
+void Manifest::ReadFromIni(const IniData &data, const std::string &rootDir) {
+    ManifestIniParser parser(*this, rootDir);
+    for (const auto &pNS : data) {
+        parser.Section(pNS.first);
+        for (const auto &pKV : pNS.second)
+            parser.Property(pKV.first, pKV.second);
     }
+    parser.Finish();
+}
+void Manifest::ReadFromIniText(std::string_view text, const std::string &rootDir, ManifestDigests *digests) {
+    ManifestIniParser parser(*this, rootDir, digests);
+    ParseIniText(text, parser);
+    parser.Finish();
+}
+void Manifest::ReadFromIniFile(const char *path, const std::string &rootDir, IniMode mode, ManifestDigests *digests) {
+    TraceSpan span("Manifest::ReadFromIniFile");
+    std::vector<uint8_t> text = ReadIniText(path, mode);
+    ReadFromIniText(std::string_view((const char*)text.data(), text.size()), rootDir, digests);
+    span.Arg("files", _files.size());
+}
+
+bool ReadManifestDigests(std::string_view text, ManifestDigests &digests) {
+    //digests are written before files: stop at the first file
+    static const std::string NO_ROOT;
+    struct Handler : ManifestIniParser {
+        Handler(Manifest &mani, ManifestDigests &digests) : ManifestIniParser(mani, NO_ROOT, &digests) {}
+        void Section(std::string_view name) override {
+            static const std::string_view FILE_PREFIX = "File ";
+            if (name.substr(0, FILE_PREFIX.size()) == FILE_PREFIX)
+                stop = true;
+            else
+                ManifestIniParser::Section(name);
+        }
+    };
+    Manifest dummy;
+    digests = ManifestDigests();
+    Handler handler(dummy, digests);
+    ParseIniText(text, handler);
+    return digests.present;
+}
+
+static const char *DELTA_BASE_SECTION = "DeltaBase";
+static const char *DELTA_RESULT_SECTION = "DeltaResult";
+static const char *DELTA_REMOVED_SECTION_PREFIX = "Removed ";
+
+static bool AreFilesEqual(const FileMetainfo &a, const FileMetainfo &b) {
+    return !FileMetainfo::IsLess_ByZip(a, b) && !FileMetainfo::IsLess_ByZip(b, a);
+}
+
+std::string WriteManifestDelta(const Manifest &oldMani, const Manifest &newMani) {
+    std::map<std::string, const FileMetainfo*> oldFiles, newFiles;
+    for (int i = 0; i < oldMani.size(); i++)
+        oldFiles[GetFullPath(oldMani[i].zipPath.rel, oldMani[i].filename)] = &oldMani[i];
+    for (int i = 0; i < newMani.size(); i++)
+        newFiles[GetFullPath(newMani[i].zipPath.rel, newMani[i].filename)] = &newMani[i];
+
+    ZipSyncAssertF(oldMani.GetHashAlgorithm() == newMani.GetHashAlgorithm(), "Cannot create delta between manifests with different hash algorithms");
+    Manifest changed;
+    changed.SetHashAlgorithm(newMani.GetHashAlgorithm());
+    std::vector<std::string> removed;
+    for (const auto &pPF : newFiles) {
+        auto iter = oldFiles.find(pPF.first);
+        if (iter == oldFiles.end() || !AreFilesEqual(*iter->second, *pPF.second))
+            changed.AppendFile(*pPF.second);
+    }
+    for (const auto &pPF : oldFiles)
+        if (!newFiles.count(pPF.first))
+            removed.push_back(pPF.first);
+
+    std::string text;
+    IniWriter writer(text);
+    writer.Section(DELTA_BASE_SECTION);
+    writer.Property("digest", ComputeRootDigest(ComputeZipDigests(oldMani)));
+    writer.EndSection();
+    writer.Section(DELTA_RESULT_SECTION);
+    writer.Property("digest", ComputeRootDigest(ComputeZipDigests(newMani)));
+    writer.EndSection();
+    for (const std::string &path : removed) {
+        writer.Section(DELTA_REMOVED_SECTION_PREFIX, path);
+        writer.EndSection();
+    }
+    changed.WriteToIni(writer, false);
+    return text;
+}
+
+Manifest ApplyManifestDelta(const Manifest &oldMani, std::string_view delta, const std::string &rootDir) {
+    //changed files are parsed as manifest, delta sections are intercepted in the same pass
+    struct Handler : ManifestIniParser {
+        HashDigest baseDigest, resultDigest;
+        HashDigest *digest = nullptr;
+        std::set<std::string> removed;
+        Handler(Manifest &mani, const std::string &rootDir) : ManifestIniParser(mani, rootDir) {}
+        void Section(std::string_view name) override {
+            static const std::string_view REMOVED_PREFIX = DELTA_REMOVED_SECTION_PREFIX;
+            ManifestIniParser::Section(name);
+            digest = nullptr;
+            if (name == DELTA_BASE_SECTION)
+                digest = &baseDigest;
+            else if (name == DELTA_RESULT_SECTION)
+                digest = &resultDigest;
+            else if (name.substr(0, REMOVED_PREFIX.size()) == REMOVED_PREFIX)
+                removed.insert(std::string(name.substr(REMOVED_PREFIX.size())));
+        }
+        void Property(std::string_view key, std::string_view value) override {
+            if (!digest)
+                return ManifestIniParser::Property(key, value);
+            ZipSyncAssertF(key == "digest", "Bad delta property %s", std::string(key).c_str());
+            digest->Parse(value.data(), value.size());
+        }
+    };
+    Manifest changed;
+    Handler handler(changed, rootDir);
+    ParseIniText(delta, handler);
+    handler.Finish();
+
+    HashDigest oldDigest = ComputeRootDigest(ComputeZipDigests(oldMani));
+    ZipSyncAssertF(oldDigest == handler.baseDigest, "Manifest delta is based on different manifest: digest %s instead of %s", handler.baseDigest.Hex().c_str(), oldDigest.Hex().c_str());
+    ZipSyncAssertF(changed.GetHashAlgorithm() == oldMani.GetHashAlgorithm(), "Manifest delta uses hash algorithm %s instead of %s", HashAlgorithmName(changed.GetHashAlgorithm()), HashAlgorithmName(oldMani.GetHashAlgorithm()));
+    std::set<std::string> changedPaths;
+    for (int i = 0; i < changed.size(); i++)
+        changedPaths.insert(GetFullPath(changed[i].zipPath.rel, changed[i].filename));
+
+    Manifest result;
+    result.SetHashAlgorithm(oldMani.GetHashAlgorithm());
+    for (int i = 0; i < oldMani.size(); i++) {
+        std::string fullPath = GetFullPath(oldMani[i].zipPath.rel, oldMani[i].filename);
+        if (handler.removed.count(fullPath) || changedPaths.count(fullPath))
+            continue;
+        result.AppendFile(oldMani[i]);
+    }
+    result.ReRoot(rootDir);
+    result.AppendManifest(changed);
+
+    HashDigest newDigest = ComputeRootDigest(ComputeZipDigests(result));
+    ZipSyncAssertF(newDigest == handler.resultDigest, "Manifest obtained from delta has digest %s instead of %s", newDigest.Hex().c_str(), handler.resultDigest.Hex().c_str());
+    return result;
 }
 
 void Manifest::ReRoot(const std::string &rootDir) {
@@ -235,6 +598,7 @@ void Manifest::ReRoot(const std::string &rootDir) {
 
 Manifest Manifest::Filter(const std::function<bool(const FileMetainfo&)> &ifCopy) const {
     Manifest res;
+    res._hashAlgorithm = _hashAlgorithm;
     for (int i = 0; i < _files.size(); i++)
         if (ifCopy(_files[i]))
             res.AppendFile(_files[i]);
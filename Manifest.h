@@ -1,8 +1,10 @@
 #pragma once
 
 #include <stdint.h>
+#include <limits.h>
 #include <vector>
 #include <functional>
+#include <map>
 #include "Path.h"
 #include "Hash.h"
 #include "Ini.h"
@@ -17,24 +19,25 @@ namespace ZipSync {
 struct FileZipProps {
     //(contents of zip file central header follows)
     //  version made by                 2 bytes  (minizip: 0)
-    //  version needed to extract       2 bytes  (minizip: 20 --- NO zip64!)
+    //  version needed to extract       2 bytes  (minizip: 20 --- even for zip64)
     //  general purpose bit flag        2 bytes  ???  [0|2|4|6]
     //  compression method              2 bytes  ???  [0|8]
     //  last mod file time              2 bytes  ???
     //  last mod file date              2 bytes  ???
     //  crc-32                          4 bytes  (defined from contents --- checked by minizip)
-    //  compressed size                 4 bytes  (defined from contents --- checked by me)
-    //  uncompressed size               4 bytes  (defined from contents --- checked by me)
+    //  compressed size                 4 bytes  (defined from contents --- checked by me, 0xFFFFFFFF if zip64)
+    //  uncompressed size               4 bytes  (defined from contents --- checked by me, 0xFFFFFFFF if zip64)
     //  filename length                 2 bytes  ???
-    //  extra field length              2 bytes  (minizip: 0)
+    //  extra field length              2 bytes  (minizip: 0 unless zip64)
     //  file comment length             2 bytes  (minizip: 0)
     //  disk number start               2 bytes  (minizip: 0)
     //  internal file attributes        2 bytes  ???
     //  external file attributes        4 bytes  ???
-    //  relative offset of local header 4 bytes  (dependent on file layout)
+    //  relative offset of local header 4 bytes  (dependent on file layout, 0xFFFFFFFF if zip64)
     //  filename (variable size)        ***      ???
-    //  extra field (variable size)     ***      (minizip: empty)
+    //  extra field (variable size)     ***      (minizip: empty or zip64 extended info with values not fitting 32 bits)
     //  file comment (variable size)    ***      (minizip: empty)
+    //note: local file header has version 45 and zip64 extended info with both sizes iff any size does not fit 32 bits
 
     //last modification time in DOS format
     uint32_t lastModTime;
@@ -48,9 +51,9 @@ struct FileZipProps {
     uint32_t externalAttribs;
     //size of compressed file (excessive)
     //note: local file header EXcluded
-    uint32_t compressedSize;
+    uint64_t compressedSize;
     //size of uncompressed file (needed when writing in RAW mode)
-    uint32_t contentsSize;
+    uint64_t contentsSize;
     //CRC32 checksum of uncompressed file (needed when writing in RAW mode)
     uint32_t crc32;
 };
@@ -62,6 +65,7 @@ enum class FileLocation {
     Inplace = 0,    //local zip file in the place where it should be
     Local = 1,      //local zip file (e.g. inside local cache of old versions)
     RemoteHttp = 2, //file remotely available via HTTP 1.1+
+    RemoteCas = 3,  //file remotely available by compressed hash in content-addressed HTTP store
     Nowhere,        //file data is not available
     Repacked,       //internal: file is on its place in "repacked" zip (not yet renamed back)
     Reduced,        //internal: file is in "reduced" zip, to be moved to cache later
@@ -80,13 +84,13 @@ struct FileMetainfo {
     std::string filename;
 
     //in target manifest: Nowhere
-    //in provided manifest: Local/RemoteHttp
+    //in provided manifest: Local/RemoteHttp/RemoteCas
     //the update algorithm uses other values
     FileLocation location;
     //range of bytes in the zip representing the file
     //makes sense only if the file is actually provided
     //note: local file header INcluded
-    uint32_t byterange[2];
+    uint64_t byterange[2];
 
     //name of the target package it belongs to
     //"target package" = a set of files which must be installed (several packages may be chosen)
@@ -105,6 +109,19 @@ struct FileMetainfo {
     void DontProvide();
 };
 
+/**
+ * Digests stored in manifest ini (see ComputeZipDigest and ComputeRootDigest).
+ */
+struct ManifestDigests {
+    //false if manifest has no digests (i.e. written by older version)
+    bool present = false;
+    HashDigest root;
+    //indexed by relative path of zip
+    std::map<std::string, HashDigest> zips;
+    //sizes of zip files on disk (only for zips which were local when manifest was written)
+    std::map<std::string, uint64_t> zipSizes;
+};
+
 /**
  * Manifest describes a set of files, and stores metainfo for each of these files.
  * For update, one manifest is chosen as "target" (desired result), and several manifests "provide" files for copy/download.
@@ -114,6 +131,8 @@ struct FileMetainfo {
 class Manifest {
     //arbitrary text attached to the manifest (only for debugging)
     std::string _comment;
+    //hash function used for all contents/compressed hashes in this manifest
+    HashAlgorithm _hashAlgorithm = HashAlgorithm::Blake2s;
 
     //the set of files described by this manifest
     std::vector<FileMetainfo> _files;
@@ -121,6 +140,8 @@ class Manifest {
 public:
     const std::string &GetComment() const { return _comment; }
     void SetComment(const std::string &text) { _comment = text; }
+    HashAlgorithm GetHashAlgorithm() const { return _hashAlgorithm; }
+    void SetHashAlgorithm(HashAlgorithm algo) { _hashAlgorithm = algo; }
 
     int size() const { return _files.size(); }
     const FileMetainfo &operator[](int index) const { return _files[index]; }
@@ -133,6 +154,14 @@ public:
 
     void ReadFromIni(const IniData &data, const std::string &rootDir);
     IniData WriteToIni() const;
+    //same as above, but file is parsed/formatted in one pass (without IniData)
+    //if digests is given, digests stored in the ini are collected in the same pass
+    void ReadFromIniText(std::string_view text, const std::string &rootDir, ManifestDigests *digests = nullptr);
+    void ReadFromIniFile(const char *path, const std::string &rootDir, IniMode mode = IniMode::Auto, ManifestDigests *digests = nullptr);
+    void WriteToIniFile(const char *path, IniMode mode = IniMode::Auto) const;
+    void WriteToIniText(std::string &text) const;
+    //writes all sections of manifest (digest sections are optional)
+    void WriteToIni(IniWriter &writer, bool withDigests = true) const;
 
     void ReRoot(const std::string &rootDir);
     Manifest Filter(const std::function<bool(const FileMetainfo&)> &ifCopy) const;
@@ -166,20 +195,44 @@ struct ManifestIter {
 };
 
 
+//digest of one zip: hash over all its files (sorted by filename) including byteranges, hashes and header props
+//if two zips are described by same digest, then they are byte-for-byte equal (package and location are ignored)
+//note: a file without byterange (target-only) makes digest different from any provided zip
+HashDigest ComputeZipDigest(std::vector<const FileMetainfo*> files);
+//digests of all zips in manifest, indexed by relative path of zip
+std::map<std::string, HashDigest> ComputeZipDigests(const Manifest &mani);
+//root digest of manifest: hash over all zips (relative paths + zip digests)
+HashDigest ComputeRootDigest(const std::map<std::string, HashDigest> &zipDigests);
+//reads digests which WriteToIni stores in manifest text (parsing stops before the files)
+//returns false if manifest has no digests (i.e. written by older version)
+bool ReadManifestDigests(std::string_view text, ManifestDigests &digests);
+
+//creates delta (ini text) which turns oldMani into newMani: files added or changed are written in full, removed files are listed by path
+//delta also contains root digests of both manifests
+std::string WriteManifestDelta(const Manifest &oldMani, const Manifest &newMani);
+//applies delta (created by WriteManifestDelta) to the manifest which it was created from
+//root digests are checked both before and after applying (exception is thrown if they don't match)
+Manifest ApplyManifestDelta(const Manifest &oldMani, std::string_view delta, const std::string &rootDir);
+
 //sets all properties except for:
 //  zipPath
 //  location
 //  package
 //  contentsHash (if hashContents = false)
 //  compressedHash (if hashCompressed = false)
-void AnalyzeCurrentFile(unzFile zf, FileMetainfo &target, bool hashContents = true, bool hashCompressed = true);
+//if batch is given and algo is BLAKE2s, then hashes of small files are queued into batch (and computed on its flush)
+//note: target must stay in place until batch is flushed
+void AnalyzeCurrentFile(unzFile zf, FileMetainfo &target, bool hashContents = true, bool hashCompressed = true, HashAlgorithm algo = HashAlgorithm::Blake2s, BatchHasher *batch = nullptr);
 
 //creates manifest for local zip, serving both as target and provided
+//note: hashes are computed with the hash algorithm of the output manifest
+//analysis of a large zip can be split by file indices between threads (every call opens its own handle)
 void AppendManifestsFromLocalZip(
     const std::string &zipPath, const std::string &rootDir,             //path to local zip (both absolute?)
     FileLocation location,                                              //for provided
     const std::string &packageName,                                     //for target
-    Manifest &mani                                                      //output
+    Manifest &mani,                                                     //output
+    int fromIndex = 0, int toIndex = INT_MAX                            //only files with these indices (in central directory order)
 );
 
 }
@@ -0,0 +1,113 @@
+#include "ManifestShards.h"
+#include "ChecksummedZip.h"
+#include "StdString.h"
+#include <map>
+#include <set>
+#include <algorithm>
+#include <string.h>
+
+
+namespace ZipSync {
+
+static const char *SHARD_SECTION_PREFIX = "Shard ";
+static const char *SHARDS_DIRECTORY = "shards";
+
+std::vector<ManifestShard> WriteManifestShards(const Manifest &mani, const std::string &rootDir, ShardingMode mode) {
+    //group files by shard path
+    std::map<std::string, Manifest> shardManis;
+    for (int i = 0; i < mani.size(); i++) {
+        const FileMetainfo &mf = mani[i];
+        std::string shardPath;
+        if (mode == ShardingMode::PerZip)
+            shardPath = std::string(SHARDS_DIRECTORY) + "/" + mf.zipPath.rel + ".iniz";
+        else
+            shardPath = std::string(SHARDS_DIRECTORY) + "/package_" + mf.package + ".iniz";
+        Manifest &shardMani = shardManis[shardPath];
+        shardMani.SetHashAlgorithm(mani.GetHashAlgorithm());
+        shardMani.AppendFile(mf);
+    }
+
+    std::vector<ManifestShard> shards;
+    for (const auto &pPM : shardManis) {
+        ManifestShard shard;
+        shard.path = pPM.first;
+        const Manifest &shardMani = pPM.second;
+        std::set<std::string> zips, packages;
+        for (int i = 0; i < shardMani.size(); i++) {
+            zips.insert(shardMani[i].zipPath.rel);
+            packages.insert(shardMani[i].package);
+        }
+        shard.zips.assign(zips.begin(), zips.end());
+        shard.packages.assign(packages.begin(), packages.end());
+
+        std::string absPath = PathAR::FromRel(shard.path, rootDir).abs;
+        CreateDirectoriesForFile(absPath, rootDir);
+        shardMani.WriteToIniFile(absPath.c_str(), IniMode::Zipped);
+        shard.hash = GetHashOfChecksummedZip(absPath.c_str());
+        shards.push_back(std::move(shard));
+    }
+    return shards;
+}
+
+IniData WriteShardIndex(const std::vector<ManifestShard> &shards) {
+    IniData ini;
+    for (const ManifestShard &shard : shards) {
+        IniSect section;
+        section.push_back(std::make_pair("hash", shard.hash.Hex()));
+        for (const std::string &zip : shard.zips)
+            section.push_back(std::make_pair("zip", zip));
+        for (const std::string &package : shard.packages)
+            section.push_back(std::make_pair("package", package));
+        ini.push_back(std::make_pair(SHARD_SECTION_PREFIX + shard.path, std::move(section)));
+    }
+    return ini;
+}
+
+std::vector<ManifestShard> ReadShardIndex(const IniData &data) {
+    std::vector<ManifestShard> shards;
+    for (const auto &pNS : data) {
+        if (!stdext::starts_with(pNS.first, SHARD_SECTION_PREFIX))
+            continue;
+        ManifestShard shard;
+        shard.path = pNS.first.substr(strlen(SHARD_SECTION_PREFIX));
+        bool hasHash = false;
+        for (const auto &pKV : pNS.second) {
+            if (pKV.first == "hash") {
+                shard.hash.Parse(pKV.second.c_str());
+                hasHash = true;
+            }
+            else if (pKV.first == "zip")
+                shard.zips.push_back(pKV.second);
+            else if (pKV.first == "package")
+                shard.packages.push_back(pKV.second);
+        }
+        ZipSyncAssertF(hasHash, "Shard %s has no hash in index", shard.path.c_str());
+        shards.push_back(std::move(shard));
+    }
+    return shards;
+}
+
+bool IsShardIndex(const IniData &data) {
+    for (const auto &pNS : data)
+        if (stdext::starts_with(pNS.first, SHARD_SECTION_PREFIX))
+            return true;
+    return false;
+}
+
+bool IsShardIndex(std::string_view text) {
+    //index contains only shard sections, so looking at the first one is enough
+    struct Handler : IniParseHandler {
+        bool isIndex = false;
+        void Section(std::string_view name) override {
+            static const std::string_view PREFIX = SHARD_SECTION_PREFIX;
+            isIndex = (name.substr(0, PREFIX.size()) == PREFIX);
+            stop = true;
+        }
+        void Property(std::string_view key, std::string_view value) override {}
+    };
+    Handler handler;
+    ParseIniText(text, handler);
+    return handler.isIndex;
+}
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "Manifest.h"
+
+
+namespace ZipSync {
+
+/**
+ * Sharded manifest is an alternative layout of a (big) manifest.
+ * The files are split into several smaller manifests ("shards"), and a small index lists all of them.
+ * A client which needs only a few zips (or packages) fetches the index and only the shards it needs.
+ *
+ * Index is an ini file with one section per shard:
+ *   [Shard shards/data/textures.pk4.iniz]
+ *   hash=<checksum of shard: same as embedded in .iniz>
+ *   zip=data/textures.pk4          (one line per zip described by the shard)
+ *   package=base                   (one line per package present in the shard)
+ * Shard paths are relative to the directory of index, same as zip paths inside shards.
+ */
+struct ManifestShard {
+    //path to shard manifest (.iniz), relative to the index
+    std::string path;
+    //hash embedded into the shard (see ChecksummedZip.h)
+    HashDigest hash;
+    //relative paths of zips described by the shard
+    std::vector<std::string> zips;
+    //names of target packages present in the shard
+    std::vector<std::string> packages;
+};
+
+enum class ShardingMode {
+    PerZip,         //every zip gets its own shard
+    PerPackage,     //every target package gets its own shard
+};
+
+//splits given manifest into shards, writes them into rootDir and returns their descriptions
+std::vector<ManifestShard> WriteManifestShards(const Manifest &mani, const std::string &rootDir, ShardingMode mode);
+
+//conversion of shard index from/to ini
+IniData WriteShardIndex(const std::vector<ManifestShard> &shards);
+std::vector<ManifestShard> ReadShardIndex(const IniData &data);
+//returns true if given ini is a shard index (as opposed to ordinary manifest)
+bool IsShardIndex(const IniData &data);
+//same as above, but only the first section of ini text is parsed
+bool IsShardIndex(std::string_view text);
+
+}
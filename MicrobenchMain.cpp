@@ -0,0 +1,423 @@
+#include "Hash.h"
+#include "Ini.h"
+#include "Manifest.h"
+#include "ZipUtils.h"
+#include "Downloader.h"
+#include "TestCreator.h"
+#include "StdFilesystem.h"
+#include "Utils.h"
+#include "args.hxx"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+
+using namespace ZipSync;
+
+//note: these are microbenchmarks of isolated hot kernels
+//all inputs are synthetic and generated from fixed seed, so that results are comparable between runs
+
+/**
+ * Accumulates time of the measured parts of kernel run.
+ * Kernel can stop timer to exclude per-iteration setup from measurement.
+ */
+class Timer {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point _start;
+    double _elapsed = 0.0;
+    bool _running = false;
+
+public:
+    void Start() {
+        if (!_running)
+            _start = Clock::now();
+        _running = true;
+    }
+    void Stop() {
+        if (_running)
+            _elapsed += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - _start).count() * 1e-9;
+        _running = false;
+    }
+    double Elapsed() const { return _elapsed; }
+};
+
+struct Kernel {
+    std::string name;
+    //runs the kernel given number of iterations (timer is already started)
+    //returns number of bytes processed by one iteration (0 if throughput makes no sense)
+    std::function<uint64_t(int iterations, Timer &timer)> run;
+};
+
+struct KernelResult {
+    std::string name;
+    int iterations = 0;
+    std::vector<double> samples;    //seconds per iteration
+    uint64_t bytes = 0;
+
+    double Median() const {
+        std::vector<double> sorted = samples;
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[sorted.size() / 2];
+    }
+    double Min() const {
+        return *std::min_element(samples.begin(), samples.end());
+    }
+};
+
+static double RunOnce(const Kernel &kernel, int iterations, uint64_t &bytes) {
+    Timer timer;
+    timer.Start();
+    bytes = kernel.run(iterations, timer);
+    timer.Stop();
+    return timer.Elapsed();
+}
+
+//chooses number of iterations so that every sample takes at least minTime, then measures several samples
+static KernelResult Measure(const Kernel &kernel, double minTime, int samplesNum) {
+    KernelResult res;
+    res.name = kernel.name;
+    //calibration (also serves as warm-up)
+    int iterations = 1;
+    while (1) {
+        double elapsed = RunOnce(kernel, iterations, res.bytes);
+        if (elapsed >= minTime || iterations >= (1<<30))
+            break;
+        double factor = (elapsed > 0.0 ? 1.2 * minTime / elapsed : 10.0);
+        factor = std::min(std::max(factor, 1.5), 10.0);
+        iterations = int(std::min(iterations * factor + 1.0, double(1<<30)));
+    }
+    res.iterations = iterations;
+    for (int s = 0; s < samplesNum; s++)
+        res.samples.push_back(RunOnce(kernel, iterations, res.bytes) / iterations);
+    return res;
+}
+
+static void WriteWholeFile(const std::string &path, const std::vector<uint8_t> &data) {
+    StdioFileHolder f(path.c_str(), "wb");
+    if (!data.empty())
+        ZipSyncAssert(fwrite(data.data(), data.size(), 1, f) == 1);
+}
+
+/**
+ * Synthetic inputs shared by all kernels.
+ */
+struct Inputs {
+    std::string dir;
+    std::mt19937 rnd;
+
+    std::vector<uint8_t> randomBuffer;          //for hashing
+    std::vector<HashDigest> digests;
+    std::vector<std::string> digestHexes;
+    std::string zipPath;                        //normalized zip with many small files
+    Manifest mani;                              //manifest of the zip
+    std::string maniPath;                       //the manifest written to ini file
+    std::string maniText;                       //the manifest written to ini text
+    IniData maniIni;
+    std::vector<uint8_t> multipartBody;         //multipart/byteranges response
+    std::string multipartBoundary;
+    std::vector<uint8_t> zipWithoutCentralDir;  //prefix of the zip (only local headers and data)
+
+    void Generate(const std::string &workDir, int seed, int filesNum) {
+        dir = workDir;
+        rnd.seed(seed);
+
+        randomBuffer.resize(1<<20);
+        for (uint8_t &b : randomBuffer)
+            b = rnd() & 0xFF;
+
+        for (int i = 0; i < 4096; i++) {
+            uint32_t value = rnd();
+            digests.push_back(Hasher().Update(&value, sizeof(value)).Finalize());
+            digestHexes.push_back(digests.back().Hex());
+        }
+
+        TestCreator creator;
+        creator.SetSeed(seed);
+        creator.SetFileSizeRange(4, 13);
+        DirState state = creator.GenTargetState(filesNum, 1);
+        DirState renamed;
+        renamed["data.pk4"] = std::move(state.begin()->second);
+        TestCreator::WriteState(dir, "", renamed, nullptr);
+        zipPath = dir + "/data.pk4";
+        minizipNormalize(zipPath.c_str());
+        AppendManifestsFromLocalZip(zipPath, dir, FileLocation::Local, "bench", mani);
+        maniPath = dir + "/manifest.ini";
+        mani.WriteToIniFile(maniPath.c_str());
+        maniIni = ReadIniFile(maniPath.c_str());
+        mani.WriteToIniText(maniText);
+
+        //zip is normalized, so central directory starts right after the last file
+        uint64_t cdOffset = 0;
+        for (int i = 0; i < mani.size(); i++)
+            cdOffset = std::max(cdOffset, mani[i].byterange[1]);
+        std::vector<uint8_t> zipData = ReadWholeFile(zipPath);
+        zipWithoutCentralDir.assign(zipData.begin(), zipData.begin() + cdOffset);
+
+        //multipart response as sent by HTTP server for a request of many byteranges
+        //note: boundary as stored by Downloader includes leading CRLF and dashes
+        multipartBoundary = "\r\n--3d6b6a416f9b5";
+        uint32_t pos = 0;
+        for (int i = 0; i < 64; i++) {
+            uint32_t len = std::uniform_int_distribution<uint32_t>(1, 64<<10)(rnd);
+            char buffer[256];
+            snprintf(buffer, sizeof(buffer),
+                "%s\r\nContent-Type: application/octet-stream\r\nContent-Range: bytes %u-%u/%u\r\n\r\n",
+                multipartBoundary.c_str(), pos, pos + len - 1, 1u<<30
+            );
+            multipartBody.insert(multipartBody.end(), buffer, buffer + strlen(buffer));
+            for (uint32_t j = 0; j < len; j++)
+                multipartBody.push_back(rnd() & 0xFF);
+            pos += len + 100;
+        }
+        std::string tail = multipartBoundary + "--\r\n";
+        multipartBody.insert(multipartBody.end(), tail.begin(), tail.end());
+    }
+};
+
+static std::vector<Kernel> CreateKernels(Inputs &in) {
+    std::vector<Kernel> kernels;
+
+    for (HashAlgorithm algo : {HashAlgorithm::Blake2s, HashAlgorithm::Blake2sp}) {
+        kernels.push_back({std::string("Hasher::Update/") + HashAlgorithmName(algo), [&in,algo](int iters, Timer &timer) -> uint64_t {
+            for (int i = 0; i < iters; i++) {
+                //note: data is fed in chunks, as it is read from zip
+                Hasher hasher(algo);
+                for (size_t pos = 0; pos < in.randomBuffer.size(); pos += SIZE_FILEBUFFER)
+                    hasher.Update(in.randomBuffer.data() + pos, std::min(in.randomBuffer.size() - pos, size_t(SIZE_FILEBUFFER)));
+                hasher.Finalize();
+            }
+            return in.randomBuffer.size();
+        }});
+    }
+
+    //typical small file in zip: hash each one separately vs in batch
+    static const size_t SMALL_SIZE = 2000;
+    kernels.push_back({"Hasher/small", [&in](int iters, Timer &timer) -> uint64_t {
+        for (int i = 0; i < iters; i++) {
+            for (size_t pos = 0; pos + SMALL_SIZE <= in.randomBuffer.size(); pos += SMALL_SIZE)
+                Hasher(HashAlgorithm::Blake2s).Update(in.randomBuffer.data() + pos, SMALL_SIZE).Finalize();
+        }
+        return in.randomBuffer.size() / SMALL_SIZE * SMALL_SIZE;
+    }});
+    kernels.push_back({"BatchHasher/small", [&in](int iters, Timer &timer) -> uint64_t {
+        std::vector<HashDigest> results(in.randomBuffer.size() / SMALL_SIZE);
+        BatchHasher batch;
+        for (int i = 0; i < iters; i++) {
+            for (size_t k = 0; k < results.size(); k++)
+                batch.Add(in.randomBuffer.data() + k * SMALL_SIZE, SMALL_SIZE, &results[k]);
+            batch.Flush();
+        }
+        return results.size() * SMALL_SIZE;
+    }});
+
+    kernels.push_back({"HashDigest::Hex", [&in](int iters, Timer &timer) -> uint64_t {
+        size_t total = 0;
+        for (int i = 0; i < iters; i++)
+            total += in.digests[i & 4095].Hex().size();
+        ZipSyncAssert(total > 0);
+        return 0;
+    }});
+    kernels.push_back({"HashDigest::Parse", [&in](int iters, Timer &timer) -> uint64_t {
+        HashDigest digest;
+        for (int i = 0; i < iters; i++)
+            digest.Parse(in.digestHexes[i & 4095].c_str());
+        return 0;
+    }});
+
+    kernels.push_back({"ReadIniFile", [&in](int iters, Timer &timer) -> uint64_t {
+        for (int i = 0; i < iters; i++)
+            ReadIniFile(in.maniPath.c_str());
+        return GetFileSize(in.maniPath);
+    }});
+    kernels.push_back({"Manifest::ReadFromIni", [&in](int iters, Timer &timer) -> uint64_t {
+        for (int i = 0; i < iters; i++) {
+            Manifest mani;
+            mani.ReadFromIni(in.maniIni, in.dir);
+        }
+        return 0;
+    }});
+    kernels.push_back({"Manifest::WriteToIni", [&in](int iters, Timer &timer) -> uint64_t {
+        for (int i = 0; i < iters; i++)
+            in.mani.WriteToIni();
+        return 0;
+    }});
+    //streaming versions: without intermediate IniData
+    kernels.push_back({"Manifest::ReadFromIniText", [&in](int iters, Timer &timer) -> uint64_t {
+        for (int i = 0; i < iters; i++) {
+            Manifest mani;
+            mani.ReadFromIniText(in.maniText, in.dir);
+        }
+        return in.maniText.size();
+    }});
+    kernels.push_back({"Manifest::WriteToIniText", [&in](int iters, Timer &timer) -> uint64_t {
+        for (int i = 0; i < iters; i++) {
+            std::string text;
+            in.mani.WriteToIniText(text);
+        }
+        return in.maniText.size();
+    }});
+    kernels.push_back({"Manifest::ReadFromIniFile", [&in](int iters, Timer &timer) -> uint64_t {
+        for (int i = 0; i < iters; i++) {
+            Manifest mani;
+            mani.ReadFromIniFile(in.maniPath.c_str(), in.dir);
+        }
+        return GetFileSize(in.maniPath);
+    }});
+    kernels.push_back({"Manifest::WriteToIniFile", [&in](int iters, Timer &timer) -> uint64_t {
+        std::string outPath = in.dir + "/written.ini";
+        for (int i = 0; i < iters; i++)
+            in.mani.WriteToIniFile(outPath.c_str());
+        return in.maniText.size();
+    }});
+
+    kernels.push_back({"Downloader::BreakMultipartResponse", [&in](int iters, Timer &timer) -> uint64_t {
+        for (int i = 0; i < iters; i++) {
+            auto parts = ParseMultipartResponse(in.multipartBody.data(), in.multipartBody.size(), in.multipartBoundary);
+            ZipSyncAssert(parts.size() == 64);
+        }
+        return in.multipartBody.size();
+    }});
+
+    kernels.push_back({"UnzFileIndexed::Open", [&in](int iters, Timer &timer) -> uint64_t {
+        for (int i = 0; i < iters; i++) {
+            UnzFileIndexed zf;
+            zf.Open(in.zipPath.c_str());
+        }
+        return 0;
+    }});
+    kernels.push_back({"UnzFileIndexed::LocateByByterange", [&in](int iters, Timer &timer) -> uint64_t {
+        timer.Stop();
+        UnzFileIndexed zf;
+        zf.Open(in.zipPath.c_str());
+        std::vector<int> order(in.mani.size());
+        for (int i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::shuffle(order.begin(), order.end(), std::mt19937(13));
+        timer.Start();
+        for (int i = 0; i < iters; i++) {
+            const FileMetainfo &file = in.mani[order[i % order.size()]];
+            zf.LocateByByterange(file.byterange[0], file.byterange[1]);
+        }
+        return 0;
+    }});
+
+    for (bool copyRaw : {true, false}) {
+        kernels.push_back({std::string("minizipCopyFile/") + (copyRaw ? "raw" : "recompress"), [&in,copyRaw](int iters, Timer &timer) -> uint64_t {
+            std::string outPath = in.dir + "/copy.pk4";
+            for (int i = 0; i < iters; i++) {
+                UnzFileHolder zf(in.zipPath.c_str());
+                ZipFileHolder zfOut(outPath.c_str());
+                SAFE_CALL(unzGoToFirstFile(zf));
+                while (1) {
+                    char filename[SIZE_PATH];
+                    unz_file_info64 info;
+                    SAFE_CALL(unzGetCurrentFileInfo64(zf, &info, filename, sizeof(filename), NULL, 0, NULL, 0));
+                    minizipCopyFile(zf, zfOut,
+                        filename,
+                        info.compression_method, info.flag,
+                        info.internal_fa, info.external_fa, info.dosDate,
+                        copyRaw, info.crc, info.compressed_size, info.uncompressed_size
+                    );
+                    int res = unzGoToNextFile(zf);
+                    if (res == UNZ_END_OF_LIST_OF_FILE)
+                        break;
+                    SAFE_CALL(res);
+                }
+            }
+            return GetFileSize(in.zipPath);
+        }});
+    }
+
+    kernels.push_back({"minizipAddCentralDirectory", [&in](int iters, Timer &timer) -> uint64_t {
+        std::string outPath = in.dir + "/nocd.pk4";
+        for (int i = 0; i < iters; i++) {
+            timer.Stop();
+            WriteWholeFile(outPath, in.zipWithoutCentralDir);
+            timer.Start();
+            minizipAddCentralDirectory(outPath.c_str());
+        }
+        return 0;
+    }});
+
+    return kernels;
+}
+
+int main(int argc, char **argv) {
+    args::ArgumentParser parser("Microbenchmarks of ZipSync hot kernels.");
+    parser.helpParams.programName = "zipsync_microbench";
+    args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+    args::ValueFlag<std::string> argFilter(parser, "filter", "Run only kernels with this substring in name", {'f', "filter"});
+    args::ValueFlag<std::string> argDir(parser, "dir", "Directory for temporary files (removed at the end)", {'d', "dir"}, "__microbench__");
+    args::ValueFlag<double> argMinTime(parser, "seconds", "Minimal duration of one sample", {"min-time"}, 0.2);
+    args::ValueFlag<int> argSamples(parser, "samples", "Number of samples per kernel", {'s', "samples"}, 5);
+    args::ValueFlag<int> argSeed(parser, "seed", "Random seed for input data", {"seed"}, 1);
+    args::ValueFlag<int> argFiles(parser, "files", "Number of files in test zip/manifest", {"files"}, 5000);
+    args::ValueFlag<std::string> argOutput(parser, "output", "Write JSON results to this file (default: stdout)", {'o', "output"});
+    try {
+        parser.ParseCLI(argc, argv);
+    }
+    catch (const args::Help&) {
+        std::cout << parser;
+        return 0;
+    }
+    catch (const args::Error& e) {
+        std::cerr << e.what() << std::endl;
+        std::cerr << parser;
+        return 1;
+    }
+
+    try {
+        stdext::path baseDir = stdext::canonical(stdext::current_path()) / argDir.Get();
+        stdext::remove_all(baseDir);
+        stdext::create_directories(baseDir);
+
+        Inputs inputs;
+        inputs.Generate(baseDir.string(), argSeed.Get(), argFiles.Get());
+        std::vector<Kernel> kernels = CreateKernels(inputs);
+
+        std::vector<KernelResult> results;
+        for (const Kernel &kernel : kernels) {
+            if (argFilter && kernel.name.find(argFilter.Get()) == std::string::npos)
+                continue;
+            KernelResult res = Measure(kernel, argMinTime.Get(), std::max(argSamples.Get(), 1));
+            double median = res.Median();
+            fprintf(stderr, "%-40s %12.1lf ns/op", res.name.c_str(), median * 1e9);
+            if (res.bytes)
+                fprintf(stderr, "  %9.1lf MB/s", res.bytes * 1e-6 / median);
+            fprintf(stderr, "\n");
+            results.push_back(res);
+        }
+
+        auto WriteJson = [&](FILE *f) {
+            fprintf(f, "{\n");
+            fprintf(f, "  \"config\": {\"seed\": %d, \"files\": %d, \"minTime\": %0.3lf, \"samples\": %d},\n", argSeed.Get(), argFiles.Get(), argMinTime.Get(), argSamples.Get());
+            fprintf(f, "  \"kernels\": [\n");
+            for (int i = 0; i < results.size(); i++) {
+                const KernelResult &r = results[i];
+                double median = r.Median();
+                fprintf(f, "    {\"name\": \"%s\", \"iterations\": %d, \"medianNs\": %0.3lf, \"minNs\": %0.3lf, \"bytes\": %llu, \"MBps\": %0.3lf}%s\n",
+                    r.name.c_str(), r.iterations, median * 1e9, r.Min() * 1e9, (unsigned long long)r.bytes,
+                    r.bytes ? r.bytes * 1e-6 / median : 0.0,
+                    i+1 < results.size() ? "," : ""
+                );
+            }
+            fprintf(f, "  ]\n");
+            fprintf(f, "}\n");
+        };
+        if (argOutput) {
+            StdioFileHolder f(argOutput.Get().c_str(), "wt");
+            WriteJson(f);
+        }
+        else
+            WriteJson(stdout);
+
+        stdext::remove_all(baseDir);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Microbenchmark failed: " << e.what() << std::endl;
+        return 2;
+    }
+    return 0;
+}
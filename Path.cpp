@@ -5,10 +5,16 @@
 
 #ifdef _WIN32
 #include <direct.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/utime.h>
 #else
 #include <stdint.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
 #endif
 
 
@@ -128,6 +134,23 @@ void RenameFile(const std::string &oldPath, const std::string &newPath) {
     ZipSyncAssertF(res == 0, "Failed to rename file %s to %s (error %d)", oldPath.c_str(), newPath.c_str(), res);
 }
 
+void TruncateFile(const std::string &path, uint64_t size) {
+    int res = 0;
+#ifdef _WIN32
+    int fd = -1;
+    res = _sopen_s(&fd, path.c_str(), _O_RDWR | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE);
+    if (res == 0) {
+        res = _chsize_s(fd, size);
+        _close(fd);
+    }
+#else
+    res = truncate(path.c_str(), size);
+    if (res == -1)
+        res = errno;
+#endif
+    ZipSyncAssertF(res == 0, "Failed to truncate file %s to %llu bytes (error %d)", path.c_str(), (unsigned long long)size, res);
+}
+
 bool CreateDir(const std::string &dirPath) {
     int res = 0;
 #ifdef _WIN32
@@ -181,4 +204,64 @@ void PruneDirectoriesAfterFileRemoval(const std::string &filePath, const std::st
     }
 }
 
+std::vector<std::string> ListFilesInDirectory(const std::string &dirPath) {
+    std::vector<std::string> res;
+#ifdef _WIN32
+    _finddata64_t data;
+    intptr_t handle = _findfirst64((dirPath + "/*").c_str(), &data);
+    if (handle == -1)
+        return res;
+    do {
+        if (!(data.attrib & _A_SUBDIR))
+            res.push_back(data.name);
+    } while (_findnext64(handle, &data) == 0);
+    _findclose(handle);
+#else
+    DIR *dir = opendir(dirPath.c_str());
+    if (!dir)
+        return res;
+    while (dirent *entry = readdir(dir)) {
+        struct stat st;
+        std::string path = dirPath + '/' + entry->d_name;
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            res.push_back(entry->d_name);
+    }
+    closedir(dir);
+#endif
+    return res;
+}
+
+bool GetFileStat(const std::string &path, uint64_t &size, int64_t &modTime) {
+    int64_t modTimeNsec;
+    return GetFileStat(path, size, modTime, modTimeNsec);
+}
+bool GetFileStat(const std::string &path, uint64_t &size, int64_t &modTime, int64_t &modTimeNsec) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(path.c_str(), &st) != 0)
+        return false;
+    modTimeNsec = 0;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+#ifdef __APPLE__
+    modTimeNsec = st.st_mtimespec.tv_nsec;
+#else
+    modTimeNsec = st.st_mtim.tv_nsec;
+#endif
+#endif
+    size = st.st_size;
+    modTime = st.st_mtime;
+    return true;
+}
+
+bool TouchFile(const std::string &path) {
+#ifdef _WIN32
+    return _utime(path.c_str(), NULL) == 0;
+#else
+    return utime(path.c_str(), NULL) == 0;
+#endif
+}
+
 }
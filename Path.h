@@ -1,6 +1,8 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <stdint.h>
 
 namespace ZipSync {
 
@@ -39,9 +41,18 @@ void ParseFullPath(const std::string &fullPath, std::string &zipPath, std::strin
 bool IfFileExists(const std::string &path);
 void RemoveFile(const std::string &path);
 void RenameFile(const std::string &oldPath, const std::string &newPath);
+void TruncateFile(const std::string &path, uint64_t size);
 bool CreateDir(const std::string &dirPath);
 bool RemoveDirectoryIfEmpty(const std::string dirPath);
 void CreateDirectoriesForFile(const std::string &filePath, const std::string &rootPath);
 void PruneDirectoriesAfterFileRemoval(const std::string &filePath, const std::string &rootPath);
+//returns names of regular files directly inside given directory (empty if directory does not exist)
+std::vector<std::string> ListFilesInDirectory(const std::string &dirPath);
+//get size and last modification time (seconds since epoch) of file, returns false if it does not exist
+bool GetFileStat(const std::string &path, uint64_t &size, int64_t &modTime);
+//same as above, and also get nanoseconds part of modification time (always 0 if platform does not provide it)
+bool GetFileStat(const std::string &path, uint64_t &size, int64_t &modTime, int64_t &modTimeNsec);
+//set last modification time of file to current time, returns false on failure
+bool TouchFile(const std::string &path);
 
 }
@@ -0,0 +1,225 @@
+#include "ResourceGovernor.h"
+#include "ThreadPool.h"
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#ifdef _WIN32
+#include <windows.h>
+#undef min
+#undef max
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+
+namespace ZipSync {
+
+//rate limiter can accumulate at most this many seconds of data (but not less than this number of bytes)
+static const double RATE_BURST_TIME = 0.1;
+static const int RATE_BURST_MIN = 64<<10;
+//when page cache is dropped, it happens after processing this number of bytes of a file (and on closing it)
+static const int DROP_CACHE_PERIOD = 8<<20;
+//nice value of threads with lowered priority
+static const int LOW_PRIORITY_NICE = 19;
+
+static std::mutex g_limitsMutex;
+static ResourceLimits g_limits;
+
+void SetResourceLimits(const ResourceLimits &limits) {
+    std::lock_guard<std::mutex> lock(g_limitsMutex);
+    g_limits = limits;
+}
+ResourceLimits GetResourceLimits() {
+    std::lock_guard<std::mutex> lock(g_limitsMutex);
+    return g_limits;
+}
+
+/**
+ * Token bucket shared by all threads.
+ * Every caller reserves its bytes immediately and then sleeps until the reservation fits into rate.
+ */
+class RateLimiter {
+    std::mutex _mutex;
+    double _available = 0.0;
+    std::chrono::steady_clock::time_point _lastTime = std::chrono::steady_clock::now();
+public:
+    void Acquire(int64_t rate, size_t bytes) {
+        if (rate <= 0)
+            return;
+        double waitTime = 0.0;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto now = std::chrono::steady_clock::now();
+            double elapsed = std::chrono::duration<double>(now - _lastTime).count();
+            _lastTime = now;
+            double burst = std::max(rate * RATE_BURST_TIME, double(RATE_BURST_MIN));
+            _available = std::min(_available + elapsed * rate, burst);
+            _available -= bytes;
+            if (_available < 0.0)
+                waitTime = -_available / rate;
+        }
+        if (waitTime > 0.0)
+            std::this_thread::sleep_for(std::chrono::duration<double>(waitTime));
+    }
+};
+static RateLimiter g_readLimiter, g_writeLimiter;
+
+//note: normal priority cannot be restored without privileges, so this must never be done on the caller's thread
+static void LowerCurrentThreadPriority() {
+    static thread_local bool t_lowered = false;
+    if (t_lowered)
+        return;
+    t_lowered = true;
+#if defined(_WIN32)
+    //background mode lowers CPU, I/O and memory priority at once
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#elif defined(__linux__)
+    //on Linux, nice value and I/O priority belong to individual threads
+    int tid = (int)syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, LOW_PRIORITY_NICE);
+    static const int IOPRIO_WHO_PROCESS = 1, IOPRIO_CLASS_SHIFT = 13, IOPRIO_CLASS_IDLE = 3;
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+    //note: not supported on other platforms
+}
+
+std::unique_ptr<ThreadPool> CreateLowPriorityPool(int threadsNum) {
+    if (!GetResourceLimits().lowPriority)
+        return nullptr;
+    return std::unique_ptr<ThreadPool>(new ThreadPool(threadsNum, LowerCurrentThreadPriority));
+}
+
+void RunWithLowPriority(const std::function<void()> &func) {
+    if (!GetResourceLimits().lowPriority)
+        return func();
+    std::exception_ptr exception;
+    std::thread thread([&func, &exception]() {
+        LowerCurrentThreadPriority();
+        try {
+            func();
+        }
+        catch(...) {
+            exception = std::current_exception();
+        }
+    });
+    thread.join();
+    if (exception)
+        std::rethrow_exception(exception);
+}
+
+//zip file opened through governed file functions
+struct GovernedFile {
+    FILE *file;
+    ResourceLimits limits;
+    bool written = false;
+    uint64_t bytesSinceDrop = 0;
+};
+
+static void DropPageCache(GovernedFile &gf) {
+    gf.bytesSinceDrop = 0;
+#ifdef __linux__
+    int fd = fileno(gf.file);
+    if (gf.written) {
+        //dirty pages are not dropped: write them to disk first
+        fflush(gf.file);
+        fdatasync(fd);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    //note: on macOS caching is disabled on open, on Windows nothing is done
+}
+
+static voidpf ZCALLBACK GovernedOpen(voidpf opaque, const void *filename, int mode) {
+    const char *fmode = nullptr;
+    if ((mode & ZLIB_FILEFUNC_MODE_READWRITEFILTER) == ZLIB_FILEFUNC_MODE_READ)
+        fmode = "rb";
+    else if (mode & ZLIB_FILEFUNC_MODE_EXISTING)
+        fmode = "r+b";
+    else if (mode & ZLIB_FILEFUNC_MODE_CREATE)
+        fmode = "wb";
+    if (!filename || !fmode)
+        return nullptr;
+    FILE *f = fopen((const char*)filename, fmode);
+    if (!f)
+        return nullptr;
+    GovernedFile *gf = new GovernedFile{f, GetResourceLimits()};
+#ifdef __APPLE__
+    if (gf->limits.dropPageCache)
+        fcntl(fileno(f), F_NOCACHE, 1);
+#endif
+    return gf;
+}
+
+static uLong ZCALLBACK GovernedRead(voidpf opaque, voidpf stream, void *buf, uLong size) {
+    GovernedFile &gf = *(GovernedFile*)stream;
+    g_readLimiter.Acquire(gf.limits.maxReadSpeed, size);
+    uLong res = (uLong)fread(buf, 1, size, gf.file);
+    if (gf.limits.dropPageCache && (gf.bytesSinceDrop += res) >= DROP_CACHE_PERIOD)
+        DropPageCache(gf);
+    return res;
+}
+
+static uLong ZCALLBACK GovernedWrite(voidpf opaque, voidpf stream, const void *buf, uLong size) {
+    GovernedFile &gf = *(GovernedFile*)stream;
+    g_writeLimiter.Acquire(gf.limits.maxWriteSpeed, size);
+    uLong res = (uLong)fwrite(buf, 1, size, gf.file);
+    gf.written = true;
+    if (gf.limits.dropPageCache && (gf.bytesSinceDrop += res) >= DROP_CACHE_PERIOD)
+        DropPageCache(gf);
+    return res;
+}
+
+static ZPOS64_T ZCALLBACK GovernedTell(voidpf opaque, voidpf stream) {
+    GovernedFile &gf = *(GovernedFile*)stream;
+#ifdef _WIN32
+    return _ftelli64(gf.file);
+#else
+    return ftello(gf.file);
+#endif
+}
+
+static long ZCALLBACK GovernedSeek(voidpf opaque, voidpf stream, ZPOS64_T offset, int origin) {
+    GovernedFile &gf = *(GovernedFile*)stream;
+    int whence = SEEK_SET;
+    if (origin == ZLIB_FILEFUNC_SEEK_CUR)
+        whence = SEEK_CUR;
+    else if (origin == ZLIB_FILEFUNC_SEEK_END)
+        whence = SEEK_END;
+    else if (origin != ZLIB_FILEFUNC_SEEK_SET)
+        return -1;
+#ifdef _WIN32
+    return _fseeki64(gf.file, offset, whence) == 0 ? 0 : -1;
+#else
+    return fseeko(gf.file, offset, whence) == 0 ? 0 : -1;
+#endif
+}
+
+static int ZCALLBACK GovernedClose(voidpf opaque, voidpf stream) {
+    GovernedFile *gf = (GovernedFile*)stream;
+    if (gf->limits.dropPageCache)
+        DropPageCache(*gf);
+    int res = fclose(gf->file);
+    delete gf;
+    return res;
+}
+
+static int ZCALLBACK GovernedError(voidpf opaque, voidpf stream) {
+    GovernedFile &gf = *(GovernedFile*)stream;
+    return ferror(gf.file);
+}
+
+zlib_filefunc64_def *GetGovernedFileFuncs() {
+    static zlib_filefunc64_def funcs = {
+        GovernedOpen, GovernedRead, GovernedWrite, GovernedTell, GovernedSeek, GovernedClose, GovernedError, nullptr
+    };
+    return &funcs;
+}
+
+}
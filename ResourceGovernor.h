@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <minizip/ioapi.h>
+
+
+namespace ZipSync {
+
+class ThreadPool;
+
+/**
+ * Limits on resources used by disk-heavy phases (analysis, repacking).
+ * They reduce the impact of update on other processes running on the same machine (e.g. game server).
+ * Apply to all zip files opened via UnzFileHolder, ZipFileHolder and UnzFileIndexed.
+ */
+struct ResourceLimits {
+    //maximum total speed of reading / writing zips over all threads (bytes per second, 0 = unlimited)
+    int64_t maxReadSpeed = 0;
+    int64_t maxWriteSpeed = 0;
+    //ask OS to drop data of processed zips from page cache, so that working set of other processes is not evicted
+    //note: written data is flushed to disk regularly to make this possible
+    bool dropPageCache = false;
+    //lower CPU and I/O priority of threads which analyze or repack zips
+    //note: only dedicated threads are lowered, never the caller's thread or workers of global thread pool
+    bool lowPriority = false;
+};
+
+//set limits for the whole process (no limits by default)
+//note: files which are already open keep using old limits
+void SetResourceLimits(const ResourceLimits &limits);
+ResourceLimits GetResourceLimits();
+
+//minizip file functions which obey current resource limits
+zlib_filefunc64_def *GetGovernedFileFuncs();
+
+//creates thread pool with lowered priority of all workers if lowPriority is set in current limits (returns null otherwise)
+//threadsNum is the number of workers, as in ThreadPool constructor
+//note: priority cannot be restored without privileges, so the pool must be destroyed after use
+std::unique_ptr<ThreadPool> CreateLowPriorityPool(int threadsNum);
+//runs func on a dedicated thread with lowered priority if lowPriority is set in current limits (directly otherwise)
+//exception thrown by func is rethrown in the caller's thread
+void RunWithLowPriority(const std::function<void()> &func);
+
+}
@@ -0,0 +1,155 @@
+#include "SharedCache.h"
+#include "Path.h"
+#include "Utils.h"
+#include "Logging.h"
+#include <algorithm>
+#include <random>
+#include <string.h>
+#include <time.h>
+
+
+namespace ZipSync {
+
+static const int HASH_HEX_LEN = HashDigest().Hex().size();
+//temporary files older than this are considered abandoned (e.g. writer has crashed)
+static const int ABANDONED_TEMP_AGE = 24 * 60 * 60;
+static const char *TEMP_PREFIX = "__temp";
+
+std::string GetContentAddressedPath(const std::string &rootDir, const HashDigest &compressedHash) {
+    std::string hex = compressedHash.Hex();
+    return rootDir + '/' + hex.substr(0, 2) + '/' + hex;
+}
+
+SharedCache::SharedCache(const std::string &rootDir, uint64_t maxSize)
+    : _rootDir(rootDir)
+    , _maxSize(maxSize)
+{}
+
+std::string SharedCache::GetObjectPath(const HashDigest &compressedHash) const {
+    return GetContentAddressedPath(_rootDir, compressedHash);
+}
+
+bool SharedCache::Load(const HashDigest &compressedHash, std::vector<uint8_t> &data, HashAlgorithm algo) const {
+    std::string path = GetObjectPath(compressedHash);
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    StdioFileHolder holder(f);
+
+    data.clear();
+    char buffer[SIZE_FILEBUFFER];
+    while (size_t bytes = fread(buffer, 1, sizeof(buffer), f))
+        data.insert(data.end(), buffer, buffer + bytes);
+    holder.reset();
+
+    Hasher hasher(algo);
+    hasher.Update(data.data(), data.size());
+    if (!(hasher.Finalize() == compressedHash)) {
+        g_logger->warningf("Object %s in shared cache is broken, removing it", path.c_str());
+        remove(path.c_str());
+        return false;
+    }
+
+    //mark as recently used
+    TouchFile(path);
+    return true;
+}
+
+void SharedCache::Store(const HashDigest &compressedHash, const void *data, size_t size) {
+    Writer writer(*this, compressedHash);
+    if (!writer.IsOpen())
+        return;
+    writer.Append(data, size);
+    writer.Commit();
+}
+
+SharedCache::Writer::Writer(SharedCache &cache, const HashDigest &compressedHash) {
+    _path = cache.GetObjectPath(compressedHash);
+    if (IfFileExists(_path)) {
+        TouchFile(_path);
+        return;
+    }
+
+    std::string dirPath = GetDirPath(_path);
+    CreateDir(cache._rootDir);
+    CreateDir(dirPath);
+    _tempPath = PrefixFile(_path, TEMP_PREFIX + std::to_string(std::random_device()()) + "__");
+
+    _file = fopen(_tempPath.c_str(), "wb");
+    if (!_file)
+        g_logger->warningf(lcCantOpenFile, "Failed to write %s to shared cache", _path.c_str());
+}
+
+SharedCache::Writer::~Writer() {
+    if (_file) {
+        fclose(_file);
+        remove(_tempPath.c_str());
+    }
+}
+
+void SharedCache::Writer::Append(const void *data, size_t size) {
+    if (_file && !_failed && fwrite(data, 1, size, _file) != size)
+        _failed = true;
+}
+
+void SharedCache::Writer::Commit() {
+    if (!_file)
+        return;
+    bool ok = (fclose(_file) == 0 && !_failed);
+    _file = nullptr;
+
+    //note: if another process has stored same object in the meantime, rename may fail on some platforms
+    if (!ok || rename(_tempPath.c_str(), _path.c_str()) != 0)
+        remove(_tempPath.c_str());
+}
+
+void SharedCache::Evict() {
+    if (_maxSize == UINT64_MAX)
+        return;
+
+    struct Object {
+        int64_t modTime;
+        uint64_t size;
+        std::string path;
+    };
+    std::vector<Object> objects;
+    uint64_t totalSize = 0;
+    int64_t now = time(0);
+
+    static const char *HEX_DIGITS = "0123456789abcdef";
+    for (int i = 0; i < 256; i++) {
+        std::string dirPath = _rootDir + '/' + HEX_DIGITS[i >> 4] + HEX_DIGITS[i & 15];
+        for (const std::string &fn : ListFilesInDirectory(dirPath)) {
+            Object obj;
+            obj.path = dirPath + '/' + fn;
+            if (!GetFileStat(obj.path, obj.size, obj.modTime))
+                continue;   //removed by someone else
+            if (fn.size() != HASH_HEX_LEN) {
+                //temporary file: either being written right now, or abandoned
+                if (fn.compare(0, strlen(TEMP_PREFIX), TEMP_PREFIX) == 0 && now - obj.modTime > ABANDONED_TEMP_AGE)
+                    remove(obj.path.c_str());
+                continue;
+            }
+            totalSize += obj.size;
+            objects.push_back(std::move(obj));
+        }
+    }
+    if (totalSize <= _maxSize)
+        return;
+
+    std::sort(objects.begin(), objects.end(), [](const Object &a, const Object &b) {
+        return a.modTime < b.modTime;
+    });
+    int removedCnt = 0;
+    for (const Object &obj : objects) {
+        if (totalSize <= _maxSize)
+            break;
+        //note: object may be in use by another process: then we simply fail to remove it
+        if (remove(obj.path.c_str()) == 0)
+            removedCnt++;
+        totalSize -= obj.size;
+    }
+    g_logger->infof("Evicted %d objects from shared cache %s", removedCnt, _rootDir.c_str());
+}
+
+}
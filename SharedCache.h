@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include "Hash.h"
+
+
+namespace ZipSync {
+
+//subdirectory of content-addressed remote store (see UpdateProcess::AddRemoteCas)
+static const char *const REMOTE_CAS_DIR = "cas";
+
+//path of object with given hash in content-addressed layout: "<root>/<ab>/<abcdef...>"
+//works both for local directories and for URLs
+std::string GetContentAddressedPath(const std::string &rootDir, const HashDigest &compressedHash);
+
+/**
+ * Content-addressed store of compressed file data, which can be shared between
+ * several installations (and several zipsync processes running simultaneously).
+ * Object with given compressedHash is stored in file "<root>/<ab>/<abcdef...>"
+ * and contains only compressed data (local file header is regenerated from manifest).
+ *
+ * All the operations are safe to run concurrently:
+ *   - new objects are written to temporary files and renamed into place
+ *   - objects are verified by hash on every load
+ *   - any failure (missing file, broken file, removed by other process) is treated as cache miss
+ * Modification time of object file serves as last usage time for LRU eviction.
+ * The same layout is used by content-addressed remote store, so it can be filled by Store too.
+ */
+class SharedCache {
+    std::string _rootDir;
+    uint64_t _maxSize;
+
+public:
+    SharedCache(const std::string &rootDir, uint64_t maxSize = UINT64_MAX);
+
+    const std::string &GetRootDir() const { return _rootDir; }
+    uint64_t GetMaxSize() const { return _maxSize; }
+
+    //path to object file with given hash (even if there is no such object)
+    std::string GetObjectPath(const HashDigest &compressedHash) const;
+
+    //read object with given hash into memory
+    //returns false if it is not present in cache (or data is broken)
+    //data is verified with given hash algorithm (the one compressedHash was computed with)
+    bool Load(const HashDigest &compressedHash, std::vector<uint8_t> &data, HashAlgorithm algo = HashAlgorithm::Blake2s) const;
+    //put given data into cache (does nothing if it is already present)
+    //note: caller must ensure that data really has the specified hash
+    void Store(const HashDigest &compressedHash, const void *data, size_t size);
+
+    /**
+     * Puts new object into cache chunk by chunk, without holding it in memory.
+     * Data is written to temporary file, which is renamed into place on Commit.
+     * If writer is destroyed without Commit (e.g. hash check has failed), temporary file is removed.
+     */
+    class Writer {
+        std::string _path;
+        std::string _tempPath;
+        FILE *_file = nullptr;
+        bool _failed = false;
+    public:
+        //note: if object is already present, it is marked as recently used and writer is not opened
+        Writer(SharedCache &cache, const HashDigest &compressedHash);
+        ~Writer();
+        Writer(const Writer &) = delete;
+        Writer& operator=(const Writer &) = delete;
+
+        //false if there is nothing to write (object is present or temporary file cannot be created)
+        bool IsOpen() const { return _file != nullptr; }
+        void Append(const void *data, size_t size);
+        //note: caller must ensure that all the data really has the specified hash
+        void Commit();
+    };
+
+    //remove least recently used objects until total size fits into limit
+    void Evict();
+};
+
+}
@@ -23,6 +23,11 @@ void TestCreator::SetUpdateType(UpdateType type) {
 void TestCreator::SetRemote(bool remote) {
     _remote = remote;
 }
+void TestCreator::SetFileSizeRange(int minPwr, int maxPwr) {
+    ZipSyncAssert(0 <= minPwr && minPwr <= maxPwr && maxPwr <= 29);
+    _sizeMinPwr = minPwr;
+    _sizeMaxPwr = maxPwr;
+}
 
 int TestCreator::RndInt(int low, int high) {
     return std::uniform_int_distribution<int>(low, high)(_rnd);
@@ -123,7 +128,7 @@ std::vector<std::string> TestCreator::GenPaths(int number, const char *extension
 }
 
 std::vector<uint8_t> TestCreator::GenFileContents() {
-    int pwr = RndInt(0, 10);
+    int pwr = RndInt(_sizeMinPwr, _sizeMaxPwr);
     int size = RndInt((1<<pwr)-1, 2<<pwr);
     std::vector<uint8_t> res;
     int t = RndInt(0, 3);
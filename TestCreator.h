@@ -31,11 +31,15 @@ protected:
     std::mt19937 _rnd;
     UpdateType _updateType = UpdateType::SameCompressed;
     bool _remote = false;
+    //file sizes are distributed log-uniformly between 2^minPwr and 2^(maxPwr+1)
+    int _sizeMinPwr = 0;
+    int _sizeMaxPwr = 10;
 
 public:
     void SetSeed(int seed);
     void SetUpdateType(UpdateType type);
     void SetRemote(bool remote);
+    void SetFileSizeRange(int minPwr, int maxPwr);
 
     int RndInt(int low, int high);
     double RndDbl(double low, double high);
@@ -6,12 +6,19 @@
 
 #include "Utils.h"
 #include "StdFilesystem.h"
+#include "StdString.h"
 #include "ZipSync.h"
 #include "Fuzzer.h"
 #include "HttpServer.h"
 #include "Downloader.h"
 #include "TestCreator.h"
 #include "ChecksummedZip.h"
+#include "SharedCache.h"
+#include "LocalCache.h"
+#include "ManifestShards.h"
+#include "ThreadPool.h"
+#include "Tracing.h"
+#include "ResourceGovernor.h"
 #include "minizip_extra.h"
 using namespace ZipSync;
 
@@ -27,6 +34,10 @@ using namespace ZipSync;
 #else
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 //TODO: move it somewhere
 stdext::path GetCwd() {
     char buffer[4096];
@@ -290,6 +301,200 @@ TEST_CASE("TargetManifest: Read/Write") {
     }
 }
 
+TEST_CASE("ManifestShards") {
+    std::string root = (GetTempDir() / "shards").string();
+    stdext::create_directories(root);
+
+    const char *zips[3] = {"base.pk4", "subdir/models.pk4", "subdir/textures.pk4"};
+    const char *packages[2] = {"core", "extra"};
+    Manifest mani;
+    for (int i = 0; i < 12; i++) {
+        FileMetainfo tf;
+        tf.location = FileLocation::Nowhere;
+        tf.byterange[0] = tf.byterange[1] = 0;
+        memset(&tf.props, 0, sizeof(tf.props));
+        tf.zipPath = PathAR::FromRel(zips[i % 3], root);
+        tf.filename = "file" + std::to_string(i) + ".txt";
+        tf.package = packages[i / 6];
+        tf.compressedHash = GenHash(2 * i);
+        tf.contentsHash = GenHash(2 * i + 1);
+        tf.props.compressedSize = tf.props.contentsSize = 100 + i;
+        mani.AppendFile(tf);
+    }
+
+    for (int t = 0; t < 2; t++) {
+        ShardingMode mode = (t == 0 ? ShardingMode::PerZip : ShardingMode::PerPackage);
+        std::vector<ManifestShard> shards = WriteManifestShards(mani, root, mode);
+        CHECK(shards.size() == (t == 0 ? 3 : 2));
+
+        IniData indexIni = WriteShardIndex(shards);
+        CHECK(IsShardIndex(indexIni));
+        CHECK(!IsShardIndex(mani.WriteToIni()));
+        std::vector<ManifestShard> restored = ReadShardIndex(indexIni);
+        REQUIRE(restored.size() == shards.size());
+
+        Manifest merged;
+        for (int i = 0; i < restored.size(); i++) {
+            const ManifestShard &shard = restored[i];
+            CHECK(shard.path == shards[i].path);
+            CHECK(shard.hash == shards[i].hash);
+            CHECK(shard.zips == shards[i].zips);
+            CHECK(shard.packages == shards[i].packages);
+            CHECK(shard.zips.size() == (t == 0 ? 1 : 3));
+            CHECK(shard.packages.size() == (t == 0 ? 2 : 1));
+
+            std::string shardPath = PathAR::FromRel(shard.path, root).abs;
+            CHECK(GetHashOfChecksummedZip(shardPath.c_str()) == shard.hash);
+            Manifest shardMani;
+            shardMani.ReadFromIni(ReadIniFile(shardPath.c_str()), root);
+            CHECK(shardMani.size() == (t == 0 ? 4 : 6));
+            for (int j = 0; j < shardMani.size(); j++) {
+                if (t == 0)
+                    CHECK(shardMani[j].zipPath.rel == shard.zips[0]);
+                else
+                    CHECK(shardMani[j].package == shard.packages[0]);
+            }
+            merged.AppendManifest(shardMani);
+        }
+        CHECK(merged.WriteToIni() == mani.WriteToIni());
+    }
+}
+
+TEST_CASE("ManifestDigests") {
+    Manifest mani;
+    for (int i = 0; i < 12; i++) {
+        FileMetainfo pf;
+        pf.location = FileLocation::Local;
+        memset(&pf.props, 0, sizeof(pf.props));
+        pf.zipPath = PathAR::FromRel("zip" + std::to_string(i % 3) + ".pk4", "nowhere");
+        pf.filename = "file" + std::to_string(i) + ".txt";
+        pf.package = "base";
+        pf.compressedHash = GenHash(2 * i);
+        pf.contentsHash = GenHash(2 * i + 1);
+        pf.byterange[0] = 1000 * i;
+        pf.byterange[1] = 1000 * i + 500;
+        pf.props.compressedSize = pf.props.contentsSize = 470;
+        mani.AppendFile(pf);
+    }
+    std::map<std::string, HashDigest> zipDigests = ComputeZipDigests(mani);
+    HashDigest rootDigest = ComputeRootDigest(zipDigests);
+    CHECK(zipDigests.size() == 3);
+    CHECK(!(zipDigests["zip0.pk4"] == zipDigests["zip1.pk4"]));
+
+    //digests are stored in ini
+    std::string maniText;
+    mani.WriteToIniText(maniText);
+    ManifestDigests readDigests;
+    CHECK(ReadManifestDigests(maniText, readDigests));
+    CHECK(readDigests.root == rootDigest);
+    CHECK(readDigests.zips == zipDigests);
+    CHECK(!ReadManifestDigests("", readDigests));
+    //digests are collected while reading the whole manifest too
+    Manifest reread;
+    ManifestDigests rereadDigests;
+    reread.ReadFromIniText(maniText, "nowhere", &rereadDigests);
+    CHECK(rereadDigests.present);
+    CHECK(rereadDigests.root == rootDigest);
+    CHECK(rereadDigests.zips == zipDigests);
+    CHECK(reread.WriteToIni() == mani.WriteToIni());
+    //size is stored only for local zips which exist
+    CHECK(readDigests.zipSizes.empty());
+    stdext::create_directories(GetTempDir());
+    std::string zipPath = (GetTempDir() / "digests.zip").string();
+    zipFile zf = zipOpen(zipPath.c_str(), 0);
+    zipOpenNewFileInZip(zf, "data.txt", NULL, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_DEFAULT_COMPRESSION);
+    zipWriteInFileInZip(zf, "hello", 5);
+    zipCloseFileInZip(zf);
+    zipClose(zf, NULL);
+    Manifest localMani;
+    localMani.AppendLocalZip(zipPath, GetTempDir().string(), "");
+    std::string localText;
+    localMani.WriteToIniText(localText);
+    ManifestDigests localDigests;
+    CHECK(ReadManifestDigests(localText, localDigests));
+    CHECK(localDigests.zipSizes.size() == 1);
+    CHECK(localDigests.zipSizes["digests.zip"] == GetFileSize(zipPath));
+
+    //order of files, package and location do not matter
+    Manifest shuffled;
+    for (int i = mani.size() - 1; i >= 0; i--) {
+        FileMetainfo pf = mani[i];
+        pf.package = "other";
+        pf.location = FileLocation::Inplace;
+        shuffled.AppendFile(pf);
+    }
+    CHECK(ComputeZipDigests(shuffled) == zipDigests);
+
+    //any change of file props changes digest of its zip only
+    for (int t = 0; t < 4; t++) {
+        Manifest changed = mani;
+        FileMetainfo &pf = changed[4];
+        if (t == 0) pf.props.crc32++;
+        if (t == 1) pf.byterange[1]++;
+        if (t == 2) pf.filename += "x";
+        if (t == 3) pf.compressedHash = GenHash(100);
+        std::map<std::string, HashDigest> newDigests = ComputeZipDigests(changed);
+        CHECK(newDigests["zip0.pk4"] == zipDigests["zip0.pk4"]);
+        CHECK(!(newDigests["zip1.pk4"] == zipDigests["zip1.pk4"]));
+        CHECK(newDigests["zip2.pk4"] == zipDigests["zip2.pk4"]);
+        CHECK(!(ComputeRootDigest(newDigests) == rootDigest));
+    }
+}
+
+TEST_CASE("ManifestDelta") {
+    Manifest oldMani;
+    for (int i = 0; i < 20; i++) {
+        FileMetainfo pf;
+        pf.location = FileLocation::Local;
+        memset(&pf.props, 0, sizeof(pf.props));
+        pf.zipPath = PathAR::FromRel("zip" + std::to_string(i % 4) + ".pk4", "nowhere");
+        pf.filename = "file" + std::to_string(i) + ".txt";
+        pf.package = "base";
+        pf.compressedHash = GenHash(2 * i);
+        pf.contentsHash = GenHash(2 * i + 1);
+        pf.byterange[0] = 1000 * i;
+        pf.byterange[1] = 1000 * i + 500;
+        oldMani.AppendFile(pf);
+    }
+
+    Manifest newMani;
+    for (int i = 0; i < oldMani.size(); i++) {
+        FileMetainfo pf = oldMani[i];
+        if (i == 3)
+            continue;   //removed
+        if (i == 7)
+            pf.compressedHash = GenHash(100);
+        if (i == 11)
+            pf.package = "extra";
+        newMani.AppendFile(pf);
+    }
+    FileMetainfo added = oldMani[5];
+    added.filename = "added.txt";
+    added.zipPath = PathAR::FromRel("newzip.pk4", "nowhere");
+    newMani.AppendFile(added);
+
+    std::string delta = WriteManifestDelta(oldMani, newMani);
+    int removedCnt = 0, fileCnt = 0;
+    for (const auto &pNS : ParseIniData(delta)) {
+        if (stdext::starts_with(pNS.first, "Removed "))
+            removedCnt++;
+        if (stdext::starts_with(pNS.first, "File "))
+            fileCnt++;
+    }
+    CHECK(removedCnt == 1);
+    CHECK(fileCnt == 3);
+
+    Manifest restored = ApplyManifestDelta(oldMani, delta, "nowhere");
+    CHECK(restored.WriteToIni() == newMani.WriteToIni());
+
+    //delta must not be applied to different manifest
+    CHECK_THROWS(ApplyManifestDelta(newMani, delta, "nowhere"));
+    //empty delta
+    std::string sameDelta = WriteManifestDelta(newMani, newMani);
+    CHECK(ParseIniData(sameDelta).size() == 2);
+    CHECK(ApplyManifestDelta(newMani, sameDelta, "nowhere").WriteToIni() == newMani.WriteToIni());
+}
+
 TEST_CASE("Ini: Read/Write") {
     IniData ini;
     for (int i = 0; i < 5; i++) {
@@ -319,6 +524,171 @@ TEST_CASE("Ini: Read/Write") {
     UnzFileHolder zf(testpathz.c_str());
 }
 
+static Manifest GenerateManifestForIniTests(int count) {
+    Manifest mani;
+    for (int i = 0; i < count; i++) {
+        FileMetainfo pf;
+        pf.location = (i % 7 == 0 ? FileLocation::Nowhere : FileLocation::Local);
+        pf.zipPath = PathAR::FromRel("subdir/zip" + std::to_string(i % 100) + ".pk4", "nowhere");
+        pf.filename = "textures/darkmod/file" + std::to_string(i) + ".dds";
+        pf.package = (i % 3 ? "base" : "");
+        pf.compressedHash = GenHash(2 * i);
+        pf.contentsHash = GenHash(2 * i + 1);
+        pf.byterange[0] = (i % 7 == 0 ? 0 : 1000 * i);
+        pf.byterange[1] = (i % 7 == 0 ? 0 : 1000 * i + 777);
+        pf.props.crc32 = 0xDEADBEEF + i;
+        pf.props.lastModTime = 4000000000U - i;
+        pf.props.compressionMethod = (i % 2 ? 8 : 0);
+        pf.props.generalPurposeBitFlag = (i % 4) * 2;
+        pf.props.compressedSize = 777 - 30;
+        pf.props.contentsSize = 1000 + i;
+        pf.props.internalAttribs = i % 2;
+        pf.props.externalAttribs = i * 12345;
+        mani.AppendFile(pf);
+    }
+    return mani;
+}
+
+TEST_CASE("Manifest: streaming Read/Write") {
+    Manifest mani = GenerateManifestForIniTests(1000);
+    stdext::create_directories(GetTempDir());
+    for (const char *fn : {"stream.ini", "stream.iniz"}) {
+        std::string pathOld = (GetTempDir() / (std::string("old_") + fn)).string();
+        std::string pathNew = (GetTempDir() / (std::string("new_") + fn)).string();
+        WriteIniFile(pathOld.c_str(), mani.WriteToIni());
+        mani.WriteToIniFile(pathNew.c_str());
+        CHECK(ReadWholeFile(pathOld) == ReadWholeFile(pathNew));
+
+        Manifest readOld, readNew;
+        readOld.ReadFromIni(ReadIniFile(pathOld.c_str()), "nowhere");
+        readNew.ReadFromIniFile(pathNew.c_str(), "nowhere");
+        REQUIRE(readOld.size() == mani.size());
+        REQUIRE(readNew.size() == mani.size());
+        for (int i = 0; i < readNew.size(); i++) {
+            CHECK(readNew[i].location == readOld[i].location);
+            CHECK(readNew[i].zipPath.abs == readOld[i].zipPath.abs);
+        }
+        CHECK(readNew.WriteToIni() == mani.WriteToIni());
+    }
+
+    //broken manifests are rejected
+    std::string path = (GetTempDir() / "broken.ini").string();
+    for (int t = 0; t < 3; t++) {
+        std::string text;
+        mani.WriteToIniText(text);
+        if (t == 0)
+            text.replace(text.find("crc32="), 6, "crc33=");
+        if (t == 1)
+            text.replace(text.find("contentsSize=") + 13, 1, "x");
+        if (t == 2)
+            text.resize(text.rfind("externalAttribs="));
+        WriteIniText(path.c_str(), text);
+        Manifest broken;
+        CHECK_THROWS(broken.ReadFromIniFile(path.c_str(), "nowhere"));
+    }
+}
+
+TEST_CASE("HashAlgorithm") {
+    std::vector<uint8_t> data(100000);
+    std::mt19937 rnd;
+    for (auto &x : data)
+        x = rnd();
+    //incremental hashing gives the same result as one-shot library call
+    for (HashAlgorithm algo : {HashAlgorithm::Blake2s, HashAlgorithm::Blake2sp}) {
+        uint8_t expected[32];
+        if (algo == HashAlgorithm::Blake2sp)
+            blake2sp(expected, sizeof(expected), data.data(), data.size(), NULL, 0);
+        else
+            blake2s(expected, sizeof(expected), data.data(), data.size(), NULL, 0);
+        char expectedHex[65];
+        for (int i = 0; i < 32; i++)
+            sprintf(expectedHex + 2*i, "%02x", expected[i]);
+        Hasher hasher(algo);
+        for (size_t pos = 0; pos < data.size(); pos += 7777)
+            hasher.Update(data.data() + pos, std::min(data.size() - pos, size_t(7777)));
+        CHECK(hasher.Finalize().Hex() == expectedHex);
+        CHECK(ParseHashAlgorithm(HashAlgorithmName(algo)) == algo);
+    }
+    CHECK(!(Hasher(HashAlgorithm::Blake2s).Update(data.data(), data.size()).Finalize() == Hasher(HashAlgorithm::Blake2sp).Update(data.data(), data.size()).Finalize()));
+    CHECK_THROWS(ParseHashAlgorithm("md5"));
+
+    //algorithm is stored in manifest (but default one is not mentioned)
+    Manifest mani = GenerateManifestForIniTests(10);
+    std::string text;
+    mani.WriteToIniText(text);
+    CHECK(text.find("[Hash]") == std::string::npos);
+    mani.SetHashAlgorithm(HashAlgorithm::Blake2sp);
+    stdext::create_directories(GetTempDir());
+    std::string path = (GetTempDir() / "blake2sp.iniz").string();
+    mani.WriteToIniFile(path.c_str());
+    Manifest restored;
+    restored.ReadFromIniFile(path.c_str(), "nowhere");
+    CHECK(restored.GetHashAlgorithm() == HashAlgorithm::Blake2sp);
+    CHECK(restored.WriteToIni() == mani.WriteToIni());
+    CHECK(restored.Filter([](const FileMetainfo &) { return true; }).GetHashAlgorithm() == HashAlgorithm::Blake2sp);
+    //digests are found after [Hash] section
+    std::vector<uint8_t> readText = ReadIniText(path.c_str());
+    ManifestDigests readDigests;
+    CHECK(ReadManifestDigests(std::string_view((const char*)readText.data(), readText.size()), readDigests));
+    CHECK(readDigests.root == ComputeRootDigest(ComputeZipDigests(mani)));
+    CHECK(readDigests.zips == ComputeZipDigests(mani));
+
+    //manifests with different algorithms cannot be mixed
+    Manifest other = GenerateManifestForIniTests(10);
+    CHECK_THROWS(other.AppendManifest(mani));
+    CHECK_THROWS(other.ReadFromIniFile(path.c_str(), "nowhere"));
+    CHECK_THROWS(WriteManifestDelta(other, mani));
+
+    //local zip is analyzed with algorithm of the manifest
+    std::string zipPath = (GetTempDir() / "hashalgo.zip").string();
+    zipFile zf = zipOpen(zipPath.c_str(), 0);
+    zipOpenNewFileInZip(zf, "data.bin", NULL, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_DEFAULT_COMPRESSION);
+    zipWriteInFileInZip(zf, data.data(), data.size());
+    zipCloseFileInZip(zf);
+    zipClose(zf, NULL);
+    Manifest zipMani;
+    zipMani.SetHashAlgorithm(HashAlgorithm::Blake2sp);
+    zipMani.AppendLocalZip(zipPath, GetTempDir().string(), "default");
+    REQUIRE(zipMani.size() == 1);
+    CHECK(zipMani[0].contentsHash == Hasher(HashAlgorithm::Blake2sp).Update(data.data(), data.size()).Finalize());
+}
+
+TEST_CASE("BatchHasher") {
+    std::mt19937 rnd;
+    //enough messages to trigger automatic flush several times
+    std::vector<std::vector<uint8_t>> messages;
+    messages.emplace_back();
+    size_t totalSize = 0;
+    while (totalSize <= 3 * BatchHasher::BUFFER_SIZE) {
+        size_t size = std::uniform_int_distribution<size_t>(0, BatchHasher::MAX_MESSAGE_SIZE)(rnd);
+        if (messages.size() % 5 == 0)
+            size %= 100;    //many tiny files too
+        std::vector<uint8_t> msg(size);
+        for (auto &x : msg)
+            x = rnd();
+        messages.push_back(std::move(msg));
+        totalSize += size;
+    }
+    std::vector<HashDigest> results(messages.size());
+    BatchHasher batch;
+    for (size_t i = 0; i < messages.size(); i++)
+        batch.Add(messages[i].data(), messages[i].size(), &results[i]);
+    batch.Flush();
+    for (size_t i = 0; i < messages.size(); i++)
+        CHECK(results[i] == Hasher(HashAlgorithm::Blake2s).Update(messages[i].data(), messages[i].size()).Finalize());
+
+    //known answer (RFC 7693)
+    HashDigest abc;
+    batch.Add("abc", 3, &abc);
+    batch.Flush();
+    CHECK(abc.Hex() == "508c5e8c327c14e2e1a72ba34eeb452f37458b209ed63a294d999b4c86675982");
+
+    //large messages must be hashed by Hasher
+    std::vector<uint8_t> large(BatchHasher::MAX_MESSAGE_SIZE + 1);
+    HashDigest largeHash;
+    CHECK_THROWS(batch.Add(large.data(), large.size(), &largeHash));
+}
+
 TEST_CASE("AppendManifestsFromLocalZip") {
     std::string rootDir = GetTempDir().string();
     std::string zipPath1 = (GetTempDir() / stdext::path("a/f1.zip")).string();
@@ -445,7 +815,7 @@ string(REGEX REPLACE "/$" "" CMAKE_INSTALL_PREFIX "${CMAKE_INSTALL_PREFIX}")
     }
 
     for (int i = 0; i < 4; i++) {
-        const uint32_t *br = mani[i].byterange;
+        const uint64_t *br = mani[i].byterange;
         std::vector<char> fdata(br[1] - br[0]);
         int totalSize = mani[i].props.compressedSize + mani[i].filename.size() + 30;
         CHECK(fdata.size() == totalSize);
@@ -463,6 +833,22 @@ string(REGEX REPLACE "/$" "" CMAKE_INSTALL_PREFIX "${CMAKE_INSTALL_PREFIX}")
         HashDigest digest = Hasher().Update(fdata.data() + offs, sz).Finalize();
         CHECK(mani[i].compressedHash == digest);
     }
+
+    //analysis split by file ranges (as done in parallel) gives the same result
+    Manifest split;
+    for (int r = 0; r < 3; r++)
+        AppendManifestsFromLocalZip(zipPath1, rootDir, FileLocation::Local, "default", split, r, r == 2 ? INT_MAX : r + 1);
+    REQUIRE(split.size() == 3);
+    for (int i = 0; i < 3; i++) {
+        CHECK(split[i].filename == mani[i].filename);
+        CHECK(split[i].byterange[0] == mani[i].byterange[0]);
+        CHECK(split[i].contentsHash == mani[i].contentsHash);
+        CHECK(split[i].compressedHash == mani[i].compressedHash);
+    }
+    Manifest empty;
+    AppendManifestsFromLocalZip(zipPath1, rootDir, FileLocation::Local, "default", empty, 3, INT_MAX);
+    CHECK(empty.size() == 0);
+    CHECK_THROWS(AppendManifestsFromLocalZip(zipPath1, rootDir, FileLocation::Local, "default", empty, 4, INT_MAX));
 }
 
 TEST_CASE("BadZips") {
@@ -499,12 +885,13 @@ TEST_CASE("BadZips") {
         const char extra_field[] = "extra_field";
         zipOpenNewFileInZip4(zf, "temp.txt", NULL, NULL, 0, extra_field, strlen(extra_field), NULL, Z_DEFLATED, Z_BEST_SPEED, 0, -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY, NULL, 0, 0, 0);
     TEST_END
-#if 0   //not verified yet: minizip ignores it
     TEST_BEGIN //extra field (local)
         const char extra_field[] = "extra_field";
         zipOpenNewFileInZip4(zf, "temp.txt", NULL, extra_field, strlen(extra_field), NULL, 0, NULL, Z_DEFLATED, Z_BEST_SPEED, 0, -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY, NULL, 0, 0, 0);
     TEST_END
-#endif
+    TEST_BEGIN //zip64 extended info for small file
+        zipOpenNewFileInZip4_64(zf, "temp.txt", NULL, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_BEST_SPEED, 0, -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY, NULL, 0, 0, 0, 1);
+    TEST_END
     TEST_BEGIN  //comment
         zipOpenNewFileInZip4(zf, "temp.txt", NULL, NULL, 0, NULL, 0, "comment", Z_DEFLATED, Z_BEST_SPEED, 0, -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY, NULL, 0, 0, 0);
     TEST_END
@@ -531,6 +918,256 @@ TEST_CASE("BadZips") {
     }
 }
 
+TEST_CASE("minizipNormalize") {
+    stdext::create_directories(GetTempDir());
+    std::string rootDir = GetTempDir().string();
+    std::string zipPath = (GetTempDir() / "unnormal.zip").string();
+    std::string zipPathOut = (GetTempDir() / "normal_copy.zip").string();
+
+    std::vector<std::string> names = {"zzz.txt", "dir/", "aaa.txt", "mmm/extra.bin"};
+    std::vector<std::string> contents = {"last file", "", "first file", std::string(5000, 'x')};
+    zipFile zf = zipOpen(zipPath.c_str(), 0);
+    for (int i = 0; i < names.size(); i++) {
+        zip_fileinfo info = {0};
+        info.dosDate = 12345678;
+        info.external_fa = (i == 0 ? 0xDEAD0020 : 0);
+        const char extra[8] = {1, 0, 4, 0, 'a', 'b', 'c', 'd'};
+        bool withExtra = (i == 3);
+        zipOpenNewFileInZip(zf, names[i].c_str(), &info, withExtra ? extra : NULL, withExtra ? 8 : 0, NULL, 0, NULL, i == 1 ? 0 : Z_DEFLATED, Z_DEFAULT_COMPRESSION);
+        zipWriteInFileInZip(zf, contents[i].data(), contents[i].size());
+        zipCloseFileInZip(zf);
+    }
+    zipClose(zf, "comment");
+
+    //zip is rewritten: sorted, without directories, extra fields and comments
+    CHECK(minizipNormalize(zipPath.c_str()) == true);
+    Manifest mani;
+    mani.AppendLocalZip(zipPath, rootDir, "");
+    REQUIRE(mani.size() == 3);
+    CHECK(mani[0].filename == "aaa.txt");
+    CHECK(mani[1].filename == "mmm/extra.bin");
+    CHECK(mani[2].filename == "zzz.txt");
+    CHECK(mani[0].contentsHash == Hasher().Update(contents[2].data(), contents[2].size()).Finalize());
+    CHECK(mani[1].contentsHash == Hasher().Update(contents[3].data(), contents[3].size()).Finalize());
+    CHECK(mani[2].contentsHash == Hasher().Update(contents[0].data(), contents[0].size()).Finalize());
+    CHECK(mani[2].props.externalAttribs == 0x20);
+    CHECK(mani[2].props.lastModTime == 12345678);
+
+    //already normal zip is left intact
+    std::vector<uint8_t> normalData = ReadWholeFile(zipPath);
+    CHECK(minizipNormalize(zipPath.c_str()) == false);
+    CHECK(ReadWholeFile(zipPath) == normalData);
+    //but normalizing into other file produces the same bytes
+    CHECK(minizipNormalize(zipPath.c_str(), zipPathOut.c_str()) == true);
+    CHECK(ReadWholeFile(zipPathOut) == normalData);
+}
+
+TEST_CASE("Zip64") {
+    stdext::create_directories(GetTempDir());
+    std::string rootDir = GetTempDir().string();
+
+    //local header of zip64 entry has both sizes in extra field
+    std::vector<uint8_t> header = minizipCreateLocalHeader("a.txt", Z_DEFLATED, 0, 12345678, 0xDEADBEEF, 1000, 5000);
+    CHECK(header.size() == 30 + 5);
+    header = minizipCreateLocalHeader("a.txt", Z_DEFLATED, 0, 12345678, 0xDEADBEEF, 1000, 5000000000ULL);
+    REQUIRE(header.size() == 30 + 5 + 20);
+    CHECK(header[4] == 45);
+    uint64_t extraSizes[2];
+    memcpy(extraSizes, &header[30 + 5 + 4], sizeof(extraSizes));
+    CHECK(extraSizes[0] == 5000000000ULL);
+    CHECK(extraSizes[1] == 1000);
+    //central extra field only has values which don't fit into 32 bits
+    CHECK(minizipCreateCentralExtra(1000, 5000, 123).empty());
+    CHECK(minizipCreateCentralExtra(1000, 5000, 6000000000ULL).size() == 4 + 8);
+    CHECK(minizipCreateCentralExtra(5000000000ULL, 6000000000ULL, 123).size() == 4 + 16);
+
+    //small file with zip64 extended info is not normal, but can be normalized
+    std::string zipPath = (GetTempDir() / "zip64_small.zip").string();
+    std::string contents = "contents of file written with zip64 header";
+    zipFile zf = zipOpen64(zipPath.c_str(), 0);
+    zip_fileinfo info = {0};
+    zipOpenNewFileInZip2_64(zf, "file.txt", &info, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_DEFAULT_COMPRESSION, 0, 1);
+    zipWriteInFileInZip(zf, contents.data(), contents.size());
+    zipCloseFileInZip(zf);
+    zipClose(zf, NULL);
+    CHECK_THROWS(Manifest().AppendLocalZip(zipPath, rootDir, ""));
+    CHECK(minizipNormalize(zipPath.c_str()) == true);
+    Manifest mani;
+    mani.AppendLocalZip(zipPath, rootDir, "");
+    REQUIRE(mani.size() == 1);
+    CHECK(mani[0].byterange[1] - mani[0].byterange[0] == 30 + 8 + mani[0].props.compressedSize);
+    CHECK(mani[0].contentsHash == Hasher().Update(contents.data(), contents.size()).Finalize());
+
+    //64-bit byteranges and sizes in manifest
+    Manifest bigMani;
+    FileMetainfo pf;
+    memset(&pf.props, 0, sizeof(pf.props));
+    pf.location = FileLocation::Nowhere;
+    pf.filename = "video/intro.roq";
+    pf.zipPath.rel = "merged_assets.pk4";
+    pf.compressedHash = GenHash(1);
+    pf.contentsHash = GenHash(2);
+    pf.byterange[0] = 5000000000ULL;
+    pf.byterange[1] = 9500000063ULL;
+    pf.props.compressedSize = 4500000000ULL;
+    pf.props.contentsSize = 7000000000ULL;
+    bigMani.AppendFile(pf);
+    Manifest restored;
+    restored.ReadFromIni(bigMani.WriteToIni(), "nowhere");
+    REQUIRE(restored.size() == 1);
+    CHECK(restored[0].byterange[0] == pf.byterange[0]);
+    CHECK(restored[0].byterange[1] == pf.byterange[1]);
+    CHECK(restored[0].props.compressedSize == pf.props.compressedSize);
+    CHECK(restored[0].props.contentsSize == pf.props.contentsSize);
+    //high bits of numbers affect zip digest
+    FileMetainfo shifted = pf;
+    shifted.byterange[0] -= 1ULL << 32;
+    CHECK(!(ComputeZipDigest({&pf}) == ComputeZipDigest({&shifted})));
+
+    //multipart response with 64-bit byteranges
+    std::string body =
+        "\r\n--XYZ\r\nContent-Range: bytes 5000000000-5000000004/9000000000\r\n\r\nHello"
+        "\r\n--XYZ--\r\n";
+    auto parts = ParseMultipartResponse((const uint8_t*)body.data(), body.size(), "\r\n--XYZ");
+    REQUIRE(parts.size() == 1);
+    CHECK(parts[0].byterange[0] == 5000000000ULL);
+    CHECK(parts[0].byterange[1] == 5000000005ULL);
+}
+
+TEST_CASE("Zip64: large zip"
+    * doctest::skip()   //writes 4.5 GB to disk
+) {
+    stdext::create_directories(GetTempDir());
+    std::string rootDir = GetTempDir().string();
+    std::string zipPath = (GetTempDir() / "zip64_large.zip").string();
+
+    //large stored file, followed by small file with local header beyond 4 GB
+    uint64_t largeSize = 4500ULL << 20;
+    std::vector<char> chunk(16 << 20, 'z');
+    std::string contents = "small file after large one";
+    zipFile zf = zipOpen64(zipPath.c_str(), 0);
+    zip_fileinfo info = {0};
+    zipOpenNewFileInZip2_64(zf, "large.bin", &info, NULL, 0, NULL, 0, NULL, 0, 0, 0, 1);
+    for (uint64_t done = 0; done < largeSize; done += chunk.size())
+        zipWriteInFileInZip(zf, chunk.data(), chunk.size());
+    zipCloseFileInZip(zf);
+    zipOpenNewFileInZip2_64(zf, "small.txt", &info, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_DEFAULT_COMPRESSION, 0, 0);
+    zipWriteInFileInZip(zf, contents.data(), contents.size());
+    zipCloseFileInZip(zf);
+    zipClose(zf, NULL);
+
+    //zip written by minizip with zip64 only where necessary is normal
+    CHECK(minizipNormalize(zipPath.c_str()) == false);
+    Manifest mani;
+    mani.AppendLocalZip(zipPath, rootDir, "");
+    REQUIRE(mani.size() == 2);
+    CHECK(mani[0].filename == "large.bin");
+    CHECK(mani[0].props.contentsSize == largeSize);
+    CHECK(mani[0].byterange[1] - mani[0].byterange[0] == 30 + 9 + 20 + largeSize);
+    CHECK(mani[1].byterange[0] == mani[0].byterange[1]);
+    CHECK(mani[1].contentsHash == Hasher().Update(contents.data(), contents.size()).Finalize());
+
+    //central directory rebuilt from local headers is the same
+    uint64_t centralOffset = mani[1].byterange[1];
+    TruncateFile(zipPath, centralOffset);
+    std::vector<FileAttribInfo> attribs;
+    minizipAddCentralDirectory(zipPath.c_str(), attribs);
+    CHECK(minizipNormalize(zipPath.c_str()) == false);
+}
+
+TEST_CASE("ResourceGovernor") {
+    stdext::create_directories(GetTempDir());
+    std::string zipPath = (GetTempDir() / "governed.zip").string();
+    std::string contents(2<<20, 0);
+    for (int i = 0; i < contents.size(); i++)
+        contents[i] = char(i * 7 + (i >> 10));
+
+    static const int64_t SPEED = 8<<20;
+    ResourceLimits limits;
+    limits.maxReadSpeed = SPEED;
+    limits.maxWriteSpeed = SPEED;
+    limits.dropPageCache = true;
+    SetResourceLimits(limits);
+    auto Elapsed = [](std::chrono::steady_clock::time_point start) -> double {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() * 1e-6;
+    };
+
+    auto startTime = std::chrono::steady_clock::now();
+    {
+        ZipFileHolder zf(zipPath.c_str());
+        zip_fileinfo info = {0};
+        SAFE_CALL(zipOpenNewFileInZip(zf, "data.bin", &info, NULL, 0, NULL, 0, NULL, 0, Z_NO_COMPRESSION));
+        SAFE_CALL(zipWriteInFileInZip(zf, contents.data(), contents.size()));
+        SAFE_CALL(zipCloseFileInZip(zf));
+    }
+    CHECK(Elapsed(startTime) >= 0.5 * contents.size() / SPEED);
+
+    startTime = std::chrono::steady_clock::now();
+    std::string readBack(contents.size(), 0);
+    {
+        UnzFileHolder zf(zipPath.c_str());
+        SAFE_CALL(unzLocateFile(zf, "data.bin", true));
+        SAFE_CALL(unzOpenCurrentFile(zf));
+        CHECK(unzReadCurrentFile(zf, &readBack[0], readBack.size()) == readBack.size());
+        SAFE_CALL(unzCloseCurrentFile(zf));
+    }
+    CHECK(Elapsed(startTime) >= 0.5 * contents.size() / SPEED);
+    CHECK(readBack == contents);
+
+    //no limits: same data, no delays
+    SetResourceLimits(ResourceLimits());
+    Manifest mani;
+    mani.AppendLocalZip(zipPath, GetTempDir().string(), "");
+    REQUIRE(mani.size() == 1);
+    CHECK(mani[0].contentsHash == Hasher().Update(contents.data(), contents.size()).Finalize());
+
+    //low priority: caller's thread is never touched
+    limits = ResourceLimits();
+    limits.lowPriority = true;
+    SetResourceLimits(limits);
+#ifdef __linux__
+    int callerNice = getpriority(PRIO_PROCESS, (int)syscall(SYS_gettid));
+#endif
+    std::thread::id workerId;
+    RunWithLowPriority([&workerId, &zipPath]() {
+        workerId = std::this_thread::get_id();
+        Manifest lowMani;
+        lowMani.AppendLocalZip(zipPath, GetTempDir().string(), "");
+        CHECK(lowMani.size() == 1);
+    });
+    CHECK(workerId != std::thread::id());
+    CHECK(workerId != std::this_thread::get_id());
+    CHECK_THROWS(RunWithLowPriority([]() { ZipSyncAssert(false); }));
+    //dedicated pool gets lowered workers, global pool is not touched
+    std::unique_ptr<ThreadPool> lowPool = CreateLowPriorityPool(2);
+    REQUIRE(lowPool);
+    CHECK(lowPool->GetThreadsNum() == 2);
+#ifdef __linux__
+    std::atomic<int> workerCnt(0), loweredCnt(0), globalLoweredCnt(0);
+    ParallelFor(0, 100, [&](int i) {
+        if (ThreadPool::Current() != lowPool.get())
+            return;
+        workerCnt++;
+        if (callerNice >= 19 || getpriority(PRIO_PROCESS, (int)syscall(SYS_gettid)) > callerNice)
+            loweredCnt++;
+    }, -1, 1, nullptr, *lowPool);
+    CHECK(loweredCnt == workerCnt);
+    ParallelFor(0, 100, [&](int i) {
+        if (getpriority(PRIO_PROCESS, (int)syscall(SYS_gettid)) > callerNice)
+            globalLoweredCnt++;
+    });
+    CHECK(globalLoweredCnt == 0);
+#endif
+    lowPool.reset();
+    {
+        UnzFileHolder zf(zipPath.c_str());
+    }
+#ifdef __linux__
+    CHECK(getpriority(PRIO_PROCESS, (int)syscall(SYS_gettid)) == callerNice);
+#endif
+    SetResourceLimits(ResourceLimits());
+}
+
 TEST_CASE("UpdateProcess::DevelopPlan") {
     Manifest provided;
     Manifest target;
@@ -690,22 +1327,128 @@ static void PrepareFilesForHttpServer() {
     for (int i = 0; i < 100000; i++)
         fprintf(numbers, "%d-th square is %d\n", i, i*i);
 }
+TEST_CASE("ThreadPool") {
+    ThreadPool pool(4);
+    {   //tasks spawning nested tasks
+        std::atomic<int> count(0);
+        std::function<void(TaskGroup&, int)> Spawn = [&](TaskGroup &group, int depth) {
+            count++;
+            if (depth == 0)
+                return;
+            TaskGroup nested(pool);
+            for (int i = 0; i < 3; i++)
+                nested.Run([&, depth]() { Spawn(nested, depth - 1); });
+            nested.Wait();
+        };
+        TaskGroup group(pool);
+        group.Run([&]() { Spawn(group, 6); });
+        group.Wait();
+        CHECK(count == (2187 - 1) / 2);     //1 + 3 + ... + 3^6
+    }
+    {   //exception is rethrown in waiting thread
+        TaskGroup group(pool);
+        std::atomic<int> count(0);
+        for (int i = 0; i < 100; i++)
+            group.Run([&, i]() {
+                count++;
+                if (i == 10)
+                    throw std::runtime_error("test");
+            });
+        CHECK_THROWS(group.Wait());
+        CHECK(count <= 100);
+    }
+
+    //global pool is already running: it cannot be resized
+    ThreadPool::Global();
+    CHECK_THROWS(ThreadPool::SetGlobalThreadsNum(3));
+
+    for (int thrNum : {1, 3, -1}) {
+        std::vector<int> hits(10000, 0);
+        ParallelFor(0, hits.size(), [&](int i) {
+            hits[i]++;
+            //nested parallel loop must not deadlock
+            if (i % 1000 == 0)
+                ParallelFor(0, 10, [](int j) {}, thrNum);
+        }, thrNum, 7);
+        CHECK(std::count(hits.begin(), hits.end(), 1) == hits.size());
+        CHECK_THROWS(ParallelFor(0, 100, [](int i) {
+            if (i == 50) g_logger->errorf(lcGeneric, "test");
+        }, thrNum));
+
+        //cancellation via progress callback
+        std::atomic<int> calls(0), done(0);
+        ParallelProgress progress([&](double ratio, const char *comment) -> int {
+            CHECK(ratio >= 0.0);
+            CHECK(ratio <= 1.0);
+            return (++calls >= 5 ? 1 : 0);
+        }, 10000);
+        CHECK_THROWS(ParallelFor(0, 10000, [&](int i) {
+            done++;
+            progress.Add(1, "working");
+        }, thrNum, 1, &progress));
+        CHECK(progress.IsCancelled());
+        CHECK(done < 10000);
+    }
+}
+
+TEST_CASE("Tracing") {
+    std::string path = (GetTempDir() / "trace.json").string();
+    {   //disabled: nothing recorded
+        TraceSpan span("Disabled");
+        CHECK(!span.IsActive());
+    }
+    TraceStart();
+    {
+        TraceSpan span("Outer");
+        CHECK(span.IsActive());
+        span.Arg("bytes", 123).Arg("path", "C:\\dir\\\"q\"");
+        ParallelFor(0, 10, [](int i) {
+            TraceSpan span("Inner");
+            span.Arg("idx", i);
+        }, 3);
+        TraceSetLaneName(TRACE_LANE_BASE, "HTTP lane");
+        TraceAddEvent("Async", TraceNow(), 10, "", TRACE_LANE_BASE);
+    }
+    TraceFinish(path.c_str());
+    CHECK(!IsTraceEnabled());
+
+    std::string text = ReadWholeFileAsStr(path);
+    CHECK(text.find("\"traceEvents\"") != std::string::npos);
+    CHECK(text.find("\"name\":\"Disabled\"") == std::string::npos);
+    CHECK(text.find("\"name\":\"Outer\"") != std::string::npos);
+    CHECK(text.find("\"bytes\":123,\"path\":\"C:\\\\dir\\\\\\\"q\\\"\"") != std::string::npos);
+    CHECK(text.find("\"name\":\"Async\",\"ph\":\"X\",\"pid\":1,\"tid\":1000") != std::string::npos);
+    CHECK(text.find("\"HTTP lane\"") != std::string::npos);
+    int inner = 0;
+    for (size_t pos = 0; (pos = text.find("\"name\":\"Inner\"", pos)) != std::string::npos; pos++)
+        inner++;
+    CHECK(inner == 10);
+}
+
 TEST_CASE("HttpServer") {
     PrepareFilesForHttpServer();
     std::string DataTestTxt = ReadWholeFileAsStr((GetTempDir() / "test.txt").string());
     std::string DataIdentityBin = ReadWholeFileAsStr((GetTempDir() / "identity.bin").string());
     std::string DataSquaresTxt = ReadWholeFileAsStr((GetTempDir() / "subdir" / "squares.txt").string());
 
-    for (int blk = 0; blk < 2; blk++) {
+    for (int blk = 0; blk < 3; blk++) {
         HttpServer server;
         if (blk == 0)
             server.SetBlockSize(13);    //small block size to test stuff better
+        if (blk == 2) {
+            //as used by "zipsync serve"
+            server.SetThreadPoolSize(4);
+            server.SetZeroCopy(true);
+            server.SetFileCacheSize(2);
+        }
         server.SetRootDir(GetTempDir().string());
         server.Start();
         server.Start();
 
         CHECK(CurlSimple(server.GetRootUrl() + "test.txt") == DataTestTxt);
         CurlSimple(server.GetRootUrl() + "badfilename.txt", "", {404});
+        CurlSimple(server.GetRootUrl() + "subdir", "", {404});
+        CurlSimple(server.GetRootUrl() + "subdir/%2e%2e/test.txt", "", {404});
         CHECK(CurlSimple(server.GetRootUrl() + "test.txt", "3-9", {206}) == DataTestTxt.substr(3, 7));
         CHECK(CurlSimple(server.GetRootUrl() + "test.txt", "3-", {206}) == DataTestTxt.substr(3));
         CHECK(CurlSimple(server.GetRootUrl() + "test.txt", "13-13", {206}) == DataTestTxt.substr(13, 1));
@@ -715,14 +1458,17 @@ TEST_CASE("HttpServer") {
         std::string mpResp = CurlSimple(server.GetRootUrl() + "test.txt", "2-5,7-10,14-16", {206});
         std::string mpRespExp = R"(
 --********72FFC411326F7C93
+Content-Type: application/octet-stream
 Content-Range: bytes 2-5/19
 
 llo,
 --********72FFC411326F7C93
+Content-Type: application/octet-stream
 Content-Range: bytes 7-10/19
 
 micr
 --********72FFC411326F7C93
+Content-Type: application/octet-stream
 Content-Range: bytes 14-16/19
 
 tpd
@@ -738,13 +1484,20 @@ tpd
 
         CurlSimple(server.GetRootUrl() + "test.txt", "5-2", {416});
         CurlSimple(server.GetRootUrl() + "test.txt", "-3-2", {416});
-        CurlSimple(server.GetRootUrl() + "test.txt", "-2", {416});
         CurlSimple(server.GetRootUrl() + "test.txt", "23", {416});
         CurlSimple(server.GetRootUrl() + "test.txt", "2fg", {416});
-        CurlSimple(server.GetRootUrl() + "test.txt", "0-100", {416});
         CurlSimple(server.GetRootUrl() + "test.txt", "0-3,10-7", {416});
-        CurlSimple(server.GetRootUrl() + "test.txt", "0-5,5-7", {416});
         CurlSimple(server.GetRootUrl() + "test.txt", "low-high", {416});
+        CurlSimple(server.GetRootUrl() + "test.txt", "19-25", {416});
+        CurlSimple(server.GetRootUrl() + "test.txt", "-0", {416});
+        //suffix ranges, ranges beyond end of file
+        CHECK(CurlSimple(server.GetRootUrl() + "test.txt", "-2", {206}) == DataTestTxt.substr(17));
+        CHECK(CurlSimple(server.GetRootUrl() + "test.txt", "-100", {206}) == DataTestTxt);
+        CHECK(CurlSimple(server.GetRootUrl() + "test.txt", "0-100", {206}) == DataTestTxt);
+        CHECK(CurlSimple(server.GetRootUrl() + "test.txt", "19-25, 3-9", {206}) == DataTestTxt.substr(3, 7));
+        //overlapping and unsorted ranges are coalesced
+        CHECK(CurlSimple(server.GetRootUrl() + "test.txt", "0-5,5-7", {206}) == DataTestTxt.substr(0, 8));
+        CHECK(CurlSimple(server.GetRootUrl() + "test.txt", "14-16,2-5,7-10,3-4", {206}) == mpResp);
 
         if (blk == 1) CHECK(CurlSimple(server.GetRootUrl() + "subdir/squares.txt") == DataSquaresTxt);
         CHECK(CurlSimple(server.GetRootUrl() + "subdir/squares.txt", "1000000-1000100", {206}) == DataSquaresTxt.substr(1000000, 101));
@@ -759,13 +1512,75 @@ tpd
     }
 }
 
+TEST_CASE("HttpServer: NetworkModel") {
+    PrepareFilesForHttpServer();
+    std::string DataTestTxt = ReadWholeFileAsStr((GetTempDir() / "test.txt").string());
+    std::string DataIdentityBin = ReadWholeFileAsStr((GetTempDir() / "identity.bin").string());
+
+    HttpServer server;
+    server.SetRootDir(GetTempDir().string());
+    HttpServer::NetworkModel model;
+    model.maxRanges = 2;
+    server.SetNetworkModel(model);
+    model.maxRanges = 1;
+    model.fullBodyOnTooManyRanges = false;
+    server.SetNetworkModel(model, "/subdir/");
+    model = HttpServer::NetworkModel();
+    model.latencyMs = 200;
+    model.jitterMs = 100;
+    model.bandwidth = 4<<20;
+    server.SetNetworkModel(model, "/identity.bin");
+    server.Start();
+
+    //too many ranges: either whole file or error
+    CHECK(CurlSimple(server.GetRootUrl() + "test.txt", "2-5,7-10", {206}).size() > 8);
+    CHECK(CurlSimple(server.GetRootUrl() + "test.txt", "2-5,7-10,14-16", {200}) == DataTestTxt);
+    CHECK(CurlSimple(server.GetRootUrl() + "subdir/squares.txt", "0-10", {206}).size() == 11);
+    CurlSimple(server.GetRootUrl() + "subdir/squares.txt", "0-3,10-20", {416});
+
+    //latency and bandwidth cap
+    auto startTime = std::chrono::steady_clock::now();
+    CHECK(CurlSimple(server.GetRootUrl() + "identity.bin") == DataIdentityBin);
+    double elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count() * 1e-3;
+    CHECK(elapsed >= 0.2 + 0.9 * DataIdentityBin.size() / (4<<20));
+
+    //connection reset
+    model = HttpServer::NetworkModel();
+    model.resetProbability = 1.0;
+    server.SetNetworkModel(model, "/identity.bin");
+    {
+        std::unique_ptr<CURL, void (*)(CURL*)> curl(curl_easy_init(), curl_easy_cleanup);
+        curl_easy_setopt(curl.get(), CURLOPT_URL, (server.GetRootUrl() + "identity.bin").c_str());
+        curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, (curl_write_callback)[](char *buffer, size_t size, size_t nitems, void *outstream) -> size_t {
+            return size * nitems;
+        });
+        CHECK(curl_easy_perform(curl.get()) != CURLE_OK);
+    }
+}
+
+TEST_CASE("ParseMultipartResponse") {
+    std::string body =
+        "\r\n--XYZ\r\nContent-Type: application/octet-stream\r\nContent-Range: bytes 10-14/100\r\n\r\nHello"
+        "\r\n--XYZ\r\nContent-Range: bytes 50-55/100\r\n\r\n World"
+        "\r\n--XYZ--\r\n";
+    //note: boundary includes leading CRLF and dashes (as in Downloader)
+    auto parts = ParseMultipartResponse((const uint8_t*)body.data(), body.size(), "\r\n--XYZ");
+    REQUIRE(parts.size() == 2);
+    CHECK(parts[0].byterange[0] == 10);
+    CHECK(parts[0].byterange[1] == 15);
+    CHECK(std::string((const char*)parts[0].data, parts[0].size) == "Hello");
+    CHECK(parts[1].byterange[0] == 50);
+    CHECK(parts[1].byterange[1] == 56);
+    CHECK(std::string((const char*)parts[1].data, parts[1].size) == " World");
+}
+
 TEST_CASE("Downloader") {
     PrepareFilesForHttpServer();
     std::string DataTestTxt = ReadWholeFileAsStr((GetTempDir() / "test.txt").string());
     std::string DataIdentityBin = ReadWholeFileAsStr((GetTempDir() / "identity.bin").string());
     std::string DataSquaresTxt = ReadWholeFileAsStr((GetTempDir() / "subdir" / "squares.txt").string());
     auto CreateDownloadCallback = [](std::string &buffer) -> DownloadFinishedCallback {
-        return [&buffer](const void *ptr, uint32_t bytes) -> void {
+        return [&buffer](const void *ptr, size_t bytes) -> void {
             buffer.assign((char*)ptr, (char*)ptr + bytes);
         };
     };
@@ -871,6 +1686,74 @@ TEST_CASE("Downloader") {
             CHECK(data[9] == DataIdentityBin.substr(50000, 5000));
         }
 
+        { //parallel connections + conditional download
+            std::string data[3];
+            DownloadResponseInfo infos[3];
+            const char *names[3] = {"test.txt", "identity.bin", "subdir/squares.txt"};
+            Downloader down;
+            down.SetMaxConnections(3);
+            for (int i = 0; i < 3; i++)
+                down.EnqueueDownload(DownloadSource(server.GetRootUrl() + names[i]), CreateDownloadCallback(data[i]), [&infos,i](const DownloadResponseInfo &info) {
+                    infos[i] = info;
+                });
+            down.DownloadAll();
+            CHECK(data[0] == DataTestTxt);
+            CHECK(data[1] == DataIdentityBin);
+            CHECK(data[2] == DataSquaresTxt);
+            for (int i = 0; i < 3; i++) {
+                CHECK(infos[i].notModified == false);
+                CHECK(infos[i].etag.size() > 0);
+            }
+            std::string etag0 = infos[0].etag;
+
+            Downloader down2;
+            down2.SetMaxConnections(3);
+            for (int i = 0; i < 3; i++) {
+                data[i] = "unchanged";
+                DownloadSource src(server.GetRootUrl() + names[i]);
+                src.ifNoneMatch = (i == 1 ? "\"wrong-etag\"" : infos[i].etag);
+                down2.EnqueueDownload(src, CreateDownloadCallback(data[i]), [&infos,i](const DownloadResponseInfo &info) {
+                    infos[i] = info;
+                });
+            }
+            down2.DownloadAll();
+#ifdef _WIN32
+            //file version is not exact: etag is weak and never matched
+            CHECK(infos[0].notModified == false);
+            CHECK(infos[2].notModified == false);
+#else
+            CHECK(infos[0].notModified == true);
+            CHECK(infos[1].notModified == false);
+            CHECK(infos[2].notModified == true);
+            CHECK(data[0] == "unchanged");
+            CHECK(data[1] == DataIdentityBin);
+            CHECK(data[2] == "unchanged");
+            CHECK(down2.TotalBytesDownloaded() == DataIdentityBin.size());
+#endif
+
+            //file rewritten with same size within the same second: must not be considered unchanged
+            std::string changedTxt = DataTestTxt;
+            changedTxt[0] = 'J';
+            {
+                StdioFileHolder f((GetTempDir() / "test.txt").string().c_str(), "wb");
+                fwrite(changedTxt.data(), 1, changedTxt.size(), f);
+            }
+            Downloader down3;
+            std::string changedData;
+            DownloadSource src(server.GetRootUrl() + names[0]);
+            src.ifNoneMatch = etag0;
+            DownloadResponseInfo changedInfo;
+            down3.EnqueueDownload(src, CreateDownloadCallback(changedData), [&changedInfo](const DownloadResponseInfo &info) {
+                changedInfo = info;
+            });
+            down3.DownloadAll();
+            CHECK(changedInfo.notModified == false);
+            CHECK(changedData == changedTxt);
+            CHECK(CurlSimple(server.GetRootUrl() + "test.txt") == changedTxt);
+            StdioFileHolder f((GetTempDir() / "test.txt").string().c_str(), "wb");
+            fwrite(DataTestTxt.data(), 1, DataTestTxt.size(), f);
+        }
+
         { //download empty
             Downloader down;
             down.DownloadAll();
@@ -954,7 +1837,7 @@ TEST_CASE("DownloaderSubtasks") {
     }
 
     auto CreateDownloadCallback = [](std::string &buffer) -> DownloadFinishedCallback {
-        return [&buffer](const void *ptr, uint32_t bytes) -> void {
+        return [&buffer](const void *ptr, size_t bytes) -> void {
             buffer.assign((char*)ptr, (char*)ptr + bytes);
         };
     };
@@ -1001,6 +1884,55 @@ TEST_CASE("DownloaderSubtasks") {
     RemoveFile((GetTempDir() / "subtasks.bin").string());
 }
 
+TEST_CASE("DownloaderBandwidthLimit") {
+    PrepareFilesForHttpServer();
+    std::string expected[2] = {
+        ReadWholeFileAsStr((GetTempDir() / "identity.bin").string()),
+        ReadWholeFileAsStr((GetTempDir() / "subdir" / "squares.txt").string())
+    };
+    HttpServer server;
+    server.SetRootDir(GetTempDir().string());
+    server.Start();
+
+    for (int useCallback = 0; useCallback < 2; useCallback++) {
+        Downloader down;
+        down.SetMaxConnections(2);
+        std::string data[2];
+        down.EnqueueDownload(DownloadSource(server.GetRootUrl() + "identity.bin", 0, expected[0].size()), [&](const void *ptr, size_t bytes) {
+            data[0].assign((char*)ptr, (char*)ptr + bytes);
+        });
+        down.EnqueueDownload(DownloadSource(server.GetRootUrl() + "subdir/squares.txt"), [&](const void *ptr, size_t bytes) {
+            data[1].assign((char*)ptr, (char*)ptr + bytes);
+        });
+        static const int64_t LIMIT = 8<<20;
+        auto startTime = std::chrono::steady_clock::now();
+        int calls = 0;
+        if (useCallback) {
+            //limited at first, then unlimited
+            down.SetBandwidthLimitCallback([&]() -> int64_t {
+                calls++;
+                return calls <= 2 ? LIMIT : 0;
+            });
+        }
+        else
+            down.SetBandwidthLimit(LIMIT);
+        down.DownloadAll();
+        double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count() * 1e-6;
+
+        CHECK(data[0] == expected[0]);
+        CHECK(data[1] == expected[1]);
+        const DownloaderMetrics &metrics = down.GetMetrics();
+        CHECK(metrics.retriesPerProfile[0] == 0);
+        if (useCallback)
+            CHECK(calls > 2);
+        else {
+            //nothing can be received before tokens are accumulated
+            CHECK(metrics.throttlePauses > 0);
+            CHECK(elapsed >= 0.8 * (expected[0].size() + expected[1].size()) / LIMIT);
+        }
+    }
+}
+
 TEST_CASE("DownloaderTimeout"
     * doctest::skip()   //takes hours due to repeated pauses
 ) {
@@ -1016,7 +1948,7 @@ TEST_CASE("DownloaderTimeout"
     std::string DataIdentityBin = ReadWholeFileAsStr((GetTempDir() / "identity_large.bin").string());
     std::string DataSquaresTxt = ReadWholeFileAsStr((GetTempDir() / "squares_large.txt").string());
     auto CreateDownloadCallback = [](std::string &buffer) -> DownloadFinishedCallback {
-        return [&buffer](const void *ptr, uint32_t bytes) -> void {
+        return [&buffer](const void *ptr, size_t bytes) -> void {
             buffer.assign((char*)ptr, (char*)ptr + bytes);
         };
     };
@@ -1161,6 +2093,16 @@ TEST_CASE("CleanInstall") {
         updater.RepackZips();
         CHECK(g_testLogger->counts[lcRenameZipWithoutRepack] == (canRename ? 3 : 0));
         CHECK(g_testLogger->counts[lcRepackZip] == (canRename ? 0 : 3));
+        const UpdateMetrics &metrics = updater.GetMetrics();
+        CHECK(metrics.zipsRenamed == (canRename ? 3 : 0));
+        CHECK(metrics.zipsRepacked == (canRename ? 0 : 3));
+        CHECK(metrics.entriesRecompressed == 0);
+        CHECK(metrics.entriesCopiedRaw == (canRename ? 0 : targetMani.size()));
+        CHECK(metrics.filesDownloaded > 0);
+        CHECK(metrics.download.requestsCount > 0);
+        CHECK(metrics.download.bytesUseful > 0);
+        CHECK(metrics.bytesHashed > 0);
+        CHECK(metrics.peakBufferMemory > 0);
 
         Manifest resMani = updater.GetProvidedManifest().Filter([](const FileMetainfo &f) {
             return f.location == FileLocation::Inplace;
@@ -1174,6 +2116,390 @@ TEST_CASE("CleanInstall") {
     }
 }
 
+TEST_CASE("ResumeDownload") {
+    //interrupt download in the middle, then check that next update continues it
+    auto tempDir = GetTempDir() / "resume";
+    TestCreator tc;
+    auto params = tc.GenInZipParams();
+    DirState state;
+    for (int z = 0; z < 4; z++) {
+        InZipState &zf = state["arch" + std::to_string(z) + ".zip"];
+        for (int i = 0; i < 50; i++)
+            zf.emplace_back("file" + std::to_string(i) + ".tmp", InZipFile{params, tc.GenFileContents()});
+    }
+
+    HttpServer server;
+    server.SetRootDir((tempDir / "src").string());
+    server.Start();
+
+    Manifest targetMani;
+    TestCreator::WriteState((tempDir / "current").string(), "", state, &targetMani);
+    stdext::remove_all(tempDir / "current");
+    stdext::create_directories(tempDir / "current");
+    Manifest providedMani;
+    TestCreator::WriteState((tempDir / "src").string(), server.GetRootUrl(), state, &providedMani);
+    double totalRemoteBytes = 0.0;
+    for (int i = 0; i < providedMani.size(); i++)
+        totalRemoteBytes += providedMani[i].byterange[1] - providedMani[i].byterange[0];
+
+    std::string rootDir = (tempDir / "current").string();
+    std::string journalPath = rootDir + "/__download_journal__.ini";
+    {
+        UpdateProcess updater;
+        updater.Init(targetMani, providedMani, rootDir);
+        REQUIRE(updater.DevelopPlan(UpdateType::SameContents));
+        CHECK_THROWS(updater.DownloadRemoteFiles([](double ratio, const char *comment) -> int {
+            return ratio > 0.5 ? 1 : 0;
+        }));
+    }
+    REQUIRE(stdext::is_regular_file(journalPath));
+
+    //simulate crash in the middle of writing
+    for (const auto &entry : stdext::recursive_directory_enumerate(rootDir)) {
+        StdioFileHolder f(entry.string().c_str(), "ab");
+        fprintf(f, "entry=12");
+    }
+
+    {
+        UpdateProcess updater;
+        updater.Init(targetMani, providedMani, rootDir);
+        REQUIRE(updater.DevelopPlan(UpdateType::SameContents));
+        g_testLogger->clear();
+        uint64_t bytes = updater.DownloadRemoteFiles();
+        CHECK(bytes > 0);
+        CHECK(bytes < 0.75 * totalRemoteBytes);
+        updater.RepackZips();
+        CHECK(g_testLogger->counts[lcRenameZipWithoutRepack] == 4);
+        CHECK(g_testLogger->counts[lcRepackZip] == 0);
+    }
+    CHECK(!stdext::is_regular_file(journalPath));
+
+    Manifest resMani;
+    for (int z = 0; z < 4; z++)
+        resMani.AppendLocalZip(rootDir + "/arch" + std::to_string(z) + ".zip", rootDir, "");
+    REQUIRE(resMani.size() == targetMani.size());
+    std::map<std::string, HashDigest> expectedHashes;
+    for (int i = 0; i < targetMani.size(); i++)
+        expectedHashes[targetMani[i].zipPath.rel + "||" + targetMani[i].filename] = targetMani[i].contentsHash;
+    for (int i = 0; i < resMani.size(); i++)
+        CHECK(resMani[i].contentsHash == expectedHashes[resMani[i].zipPath.rel + "||" + resMani[i].filename]);
+}
+
+TEST_CASE("DownloadDeduplication") {
+    //same data provided by different remote files must be downloaded only once
+    auto tempDir = GetTempDir() / "dedup";
+    TestCreator tc;
+    auto params = tc.GenInZipParams();
+    std::vector<std::vector<uint8_t>> fileContents;
+    for (int i = 0; i < 20; i++)
+        fileContents.push_back(tc.GenFileContents());
+
+    DirState targetState, providedState;
+    for (int i = 0; i < 20; i++) {
+        targetState["x.zip"].emplace_back("a" + std::to_string(i), InZipFile{params, fileContents[i]});
+        targetState["y.zip"].emplace_back("bb" + std::to_string(i), InZipFile{params, fileContents[i]});
+        providedState["x.zip"].emplace_back("a" + std::to_string(i), InZipFile{params, fileContents[i]});
+        //same layout as y.zip: planner prefers it due to matching byteranges
+        providedState["z.zip"].emplace_back("cc" + std::to_string(i), InZipFile{params, fileContents[i]});
+    }
+
+    HttpServer server;
+    server.SetRootDir((tempDir / "src").string());
+    server.Start();
+
+    std::string rootDir = (tempDir / "current").string();
+    Manifest targetMani;
+    TestCreator::WriteState(rootDir, "", targetState, &targetMani);
+    stdext::remove_all(rootDir);
+    stdext::create_directories(rootDir);
+    Manifest providedMani;
+    TestCreator::WriteState((tempDir / "src").string(), server.GetRootUrl(), providedState, &providedMani);
+    double xzipBytes = 0.0;
+    for (int i = 0; i < providedMani.size(); i++)
+        if (providedMani[i].zipPath.rel == "x.zip")
+            xzipBytes += providedMani[i].byterange[1] - providedMani[i].byterange[0];
+
+    UpdateProcess updater;
+    updater.Init(targetMani, providedMani, rootDir);
+    REQUIRE(updater.DevelopPlan(UpdateType::SameContents));
+    int fromZ = 0;
+    for (int i = 0; i < updater.MatchCount(); i++)
+        fromZ += (updater.GetMatch(i).provided->zipPath.rel == "z.zip");
+    CHECK(fromZ >= 10);
+
+    uint64_t bytes = updater.DownloadRemoteFiles();
+    CHECK(bytes >= xzipBytes);
+    CHECK(bytes < 1.2 * xzipBytes);    //z.zip is not downloaded
+    updater.RepackZips();
+
+    Manifest resMani;
+    resMani.AppendLocalZip(rootDir + "/x.zip", rootDir, "");
+    resMani.AppendLocalZip(rootDir + "/y.zip", rootDir, "");
+    CHECK(resMani.size() == 40);
+}
+
+TEST_CASE("SharedCache") {
+    //second installation must take everything from cache populated by the first one
+    auto tempDir = GetTempDir() / "shcache";
+    TestCreator tc;
+    auto params = tc.GenInZipParams();
+    DirState state;
+    for (int z = 0; z < 2; z++) {
+        InZipState &zf = state["arch" + std::to_string(z) + ".zip"];
+        for (int i = 0; i < 30; i++)
+            zf.emplace_back("file" + std::to_string(i) + ".tmp", InZipFile{params, tc.GenFileContents()});
+    }
+
+    HttpServer server;
+    server.SetRootDir((tempDir / "src").string());
+    server.Start();
+    Manifest targetMani;
+    TestCreator::WriteState((tempDir / "orig").string(), "", state, &targetMani);
+    Manifest providedMani;
+    TestCreator::WriteState((tempDir / "src").string(), server.GetRootUrl(), state, &providedMani);
+
+    SharedCache cache((tempDir / "cache").string());
+    for (int inst = 0; inst < 3; inst++) {
+        std::string rootDir = (tempDir / ("inst" + std::to_string(inst))).string();
+        stdext::create_directories(rootDir);
+        if (inst == 2) {
+            //spoil one object: it must be detected and downloaded again
+            StdioFileHolder f(cache.GetObjectPath(providedMani[0].compressedHash).c_str(), "ab");
+            fprintf(f, "trash");
+        }
+
+        UpdateProcess updater;
+        updater.Init(targetMani, providedMani, rootDir);
+        updater.SetSharedCache(&cache);
+        REQUIRE(updater.DevelopPlan(UpdateType::SameCompressed));
+        g_testLogger->clear();
+        uint64_t bytes = updater.DownloadRemoteFiles();
+        int hits = g_testLogger->counts[lcSharedCacheHit];
+        if (inst == 0) {
+            CHECK(hits == 0);
+            CHECK(bytes > 0);
+        }
+        else if (inst == 1) {
+            CHECK(hits == targetMani.size());
+            CHECK(bytes == 0);
+        }
+        else {
+            CHECK(hits == targetMani.size() - 1);
+            CHECK(bytes == providedMani[0].byterange[1] - providedMani[0].byterange[0]);
+        }
+        updater.RepackZips();
+        CHECK(g_testLogger->counts[lcRenameZipWithoutRepack] == 2);
+        CHECK(g_testLogger->counts[lcRepackZip] == 0);
+
+        Manifest resMani;
+        for (int z = 0; z < 2; z++)
+            resMani.AppendLocalZip(rootDir + "/arch" + std::to_string(z) + ".zip", rootDir, "");
+        std::set<HashDigest> resHashes, targetHashes;
+        for (int i = 0; i < resMani.size(); i++)
+            resHashes.insert(resMani[i].compressedHash);
+        for (int i = 0; i < targetMani.size(); i++)
+            targetHashes.insert(targetMani[i].compressedHash);
+        CHECK(resHashes == targetHashes);
+    }
+
+    //evict almost everything
+    SharedCache smallCache((tempDir / "cache").string(), 1);
+    smallCache.Evict();
+    int remains = 0;
+    for (int i = 0; i < providedMani.size(); i++)
+        remains += IfFileExists(cache.GetObjectPath(providedMani[i].compressedHash));
+    CHECK(remains == 0);
+
+    //object is written chunk by chunk, and appears only on commit
+    std::vector<uint8_t> data = tc.GenFileContents();
+    data.resize(data.size() + 1000, 'x');
+    HashDigest dataHash = Hasher().Update(data.data(), data.size()).Finalize();
+    {
+        SharedCache::Writer writer(cache, dataHash);
+        REQUIRE(writer.IsOpen());
+        writer.Append(data.data(), 1000);
+    }
+    CHECK(!IfFileExists(cache.GetObjectPath(dataHash)));
+    CHECK(ListFilesInDirectory(GetDirPath(cache.GetObjectPath(dataHash))).empty());
+    {
+        SharedCache::Writer writer(cache, dataHash);
+        REQUIRE(writer.IsOpen());
+        for (size_t pos = 0; pos < data.size(); pos += 1000)
+            writer.Append(data.data() + pos, std::min(data.size() - pos, size_t(1000)));
+        CHECK(!IfFileExists(cache.GetObjectPath(dataHash)));
+        writer.Commit();
+    }
+    std::vector<uint8_t> loaded;
+    CHECK(cache.Load(dataHash, loaded));
+    CHECK(loaded == data);
+    CHECK(!SharedCache::Writer(cache, dataHash).IsOpen());
+}
+
+TEST_CASE("RemoteCas") {
+    //export two versions into content-addressed store, then update to the new one using only the store
+    auto tempDir = GetTempDir() / "remotecas";
+    TestCreator tc;
+    auto params = tc.GenInZipParams();
+    auto storedParams = params;
+    storedParams.method = storedParams.level = 0;
+    DirState oldState, newState;
+    for (int z = 0; z < 3; z++) {
+        std::string zipName = "arch" + std::to_string(z) + ".zip";
+        for (int i = 0; i < 30; i++) {
+            std::string filename = "file" + std::to_string(i) + ".tmp";
+            std::vector<uint8_t> contents = tc.GenFileContents();
+            oldState[zipName].emplace_back(filename, InZipFile{params, contents});
+            if (i % 5 == 0)
+                contents.push_back(uint8_t(z));     //changed in new version
+            newState[zipName].emplace_back(filename, InZipFile{params, contents});
+            if (i == 0)     //empty and duplicate files
+                newState[zipName].emplace_back("empty.tmp", InZipFile{storedParams, {}});
+            if (i == 7)
+                newState[zipName].emplace_back("dup.tmp", InZipFile{params, contents});
+        }
+    }
+
+    std::string storeDir = (tempDir / "store").string();
+    std::string newDir = (tempDir / "new").string();
+    Manifest newMani, oldMani;
+    TestCreator::WriteState(newDir, "", newState, &newMani);
+    TestCreator::WriteState((tempDir / "old").string(), "", oldState, &oldMani);
+    std::set<HashDigest> newHashes, allHashes;
+    for (int i = 0; i < newMani.size(); i++)
+        newHashes.insert(newMani[i].compressedHash);
+    allHashes = newHashes;
+    for (int i = 0; i < oldMani.size(); i++)
+        allHashes.insert(oldMani[i].compressedHash);
+    CHECK(ExportToCas(newMani, storeDir) == int(newHashes.size()));
+    CHECK(ExportToCas(oldMani, storeDir) == int(allHashes.size() - newHashes.size()));
+    CHECK(ExportToCas(newMani, storeDir) == 0);
+    for (const HashDigest &hash : allHashes)
+        CHECK(IfFileExists(GetContentAddressedPath(storeDir + "/cas", hash)));
+
+    HttpServer server;
+    server.SetRootDir(storeDir);
+    server.Start();
+
+    //mode 2: clean install with target manifest without layout (all byteranges are 0-0)
+    for (int mode = 0; mode < 3; mode++) {
+        bool clean = (mode > 0), noLayout = (mode == 2);
+        std::string rootDir = (tempDir / ("inst" + std::to_string(mode))).string();
+        Manifest targetMani = newMani;
+        targetMani.ReRoot(rootDir);
+        if (noLayout)
+            for (int i = 0; i < targetMani.size(); i++)
+                targetMani[i].byterange[0] = targetMani[i].byterange[1] = 0;
+        Manifest providedMani;
+        if (clean)
+            stdext::create_directories(rootDir);
+        else
+            TestCreator::WriteState(rootDir, "", oldState, &providedMani);
+
+        UpdateProcess updater;
+        updater.Init(targetMani, providedMani, rootDir);
+        updater.AddRemoteCas(server.GetRootUrl());
+        REQUIRE(updater.DevelopPlan(UpdateType::SameCompressed));
+        g_testLogger->clear();
+        Downloader downloader;
+        downloader.SetMaxConnections(4);
+        updater.DownloadRemoteFiles(downloader, GlobalProgressCallback());
+        const UpdateMetrics &metrics = updater.GetMetrics();
+        if (noLayout)
+            CHECK(metrics.filesDownloaded == targetMani.size() - 6);    //duplicates are downloaded once too
+        else if (clean)
+            CHECK(metrics.filesDownloaded == targetMani.size() - 3);    //empty files are not downloaded
+        else
+            CHECK(metrics.filesDownloaded == 3 * 6);        //changed files only
+        updater.RepackZips();
+        if (clean && !noLayout) {
+            CHECK(g_testLogger->counts[lcRenameZipWithoutRepack] == 3);
+            CHECK(g_testLogger->counts[lcRepackZip] == 0);
+        }
+
+        Manifest resMani;
+        for (int z = 0; z < 3; z++)
+            resMani.AppendLocalZip(rootDir + "/arch" + std::to_string(z) + ".zip", rootDir, "");
+        REQUIRE(resMani.size() == targetMani.size());
+        std::map<std::string, const FileMetainfo*> expected;
+        for (int i = 0; i < targetMani.size(); i++)
+            expected[targetMani[i].zipPath.rel + "||" + targetMani[i].filename] = &targetMani[i];
+        for (int i = 0; i < resMani.size(); i++) {
+            const FileMetainfo *tf = expected[resMani[i].zipPath.rel + "||" + resMani[i].filename];
+            REQUIRE(tf);
+            CHECK(resMani[i].compressedHash == tf->compressedHash);
+            if (clean && !noLayout)     //objects arrive in any order, but layout must be preserved
+                CHECK(resMani[i].byterange[0] == tf->byterange[0]);
+        }
+    }
+}
+
+TEST_CASE("LocalCache") {
+    //switch to new version and back: second switch must take everything from local cache
+    auto tempDir = GetTempDir() / "lcache";
+    TestCreator tc;
+    auto params = tc.GenInZipParams();
+    DirState stateA, stateB;
+    for (int i = 0; i < 30; i++) {
+        std::string fn = "file" + std::to_string(i) + ".tmp";
+        auto contents = tc.GenFileContents();
+        stateA["a.zip"].emplace_back(fn, InZipFile{params, contents});
+        if (i >= 15)
+            contents = tc.GenFileContents();
+        stateB["a.zip"].emplace_back(fn, InZipFile{params, contents});
+    }
+
+    HttpServer servers[2];
+    servers[0].SetRootDir((tempDir / "srcA").string());
+    servers[1].SetRootDir((tempDir / "srcB").string());
+    servers[0].SetPortNumber(8123);
+    servers[0].Start();
+    servers[1].Start();
+    Manifest remoteManiA, remoteManiB;
+    TestCreator::WriteState((tempDir / "srcA").string(), servers[0].GetRootUrl(), stateA, &remoteManiA);
+    TestCreator::WriteState((tempDir / "srcB").string(), servers[1].GetRootUrl(), stateB, &remoteManiB);
+
+    std::string rootDir = (tempDir / "current").string();
+    std::string cacheDir = rootDir + "/__cache__";
+    Manifest installedMani;
+    TestCreator::WriteState(rootDir, "", stateA, &installedMani);
+
+    for (int step = 0; step < 2; step++) {
+        const Manifest &targetMani = (step == 0 ? remoteManiB : remoteManiA);
+        Manifest providedMani = installedMani;
+        providedMani.AppendManifest(targetMani);
+
+        LocalCache cache;
+        cache.Init(cacheDir);
+        CHECK(cache.GetManifest().size() == 15 * step);
+
+        UpdateProcess updater;
+        updater.Init(targetMani, providedMani, rootDir);
+        updater.SetLocalCache(&cache);
+        REQUIRE(updater.DevelopPlan(UpdateType::SameCompressed));
+        uint64_t bytes = updater.DownloadRemoteFiles();
+        if (step == 0)
+            CHECK(bytes > 0);
+        else
+            CHECK(bytes == 0);
+        updater.RepackZips();
+        updater.RemoveOldZips(&cache);
+        CHECK(cache.GetManifest().size() == 15 * (step + 1));
+        CHECK(!stdext::is_regular_file(rootDir + "/__reduced__a.zip"));
+
+        installedMani = updater.GetProvidedManifest().Filter([](const FileMetainfo &f) {
+            return f.location == FileLocation::Inplace;
+        });
+        CHECK(installedMani.size() == 30);
+    }
+
+    //limit cache size: old files are evicted
+    LocalCache cache;
+    cache.Init(cacheDir, 1);
+    cache.Evict();
+    CHECK(cache.GetManifest().size() == 0);
+    CHECK(!stdext::is_regular_file(cacheDir + "/cache_0.zip"));
+}
+
 TEST_CASE("ChecksummedZip") {
     static const int NUM = 10;
     auto tempDir = GetTempDir() / "chkZip";
@@ -1215,6 +2541,21 @@ TEST_CASE("ChecksummedZip") {
         hashes.push_back(hash);
     }
 
+    {   //file rewritten with same size within the same second must not return stale hash
+        std::string path = (tempDir / "rewritten.zip").string();
+        std::vector<uint8_t> other = datas[0];
+        other[0] ^= 0xFF;
+        HashDigest otherHash = Hasher().Update(other.data(), other.size()).Finalize();
+        const std::vector<uint8_t> *versions[2] = {&datas[0], &other};
+        HashDigest versionHashes[2] = {hashes[0], otherHash};
+        for (int i = 0; i < 4; i++) {
+            const std::vector<uint8_t> &data = *versions[i % 2];
+            WriteChecksummedZip(path.c_str(), data.data(), data.size(), "trashData.bin");
+            CHECK(GetHashOfChecksummedZip(path.c_str()) == versionHashes[i % 2]);
+            CHECK(ReadChecksummedZip(path.c_str(), "trashData.bin") == data);
+        }
+    }
+
     for (int t = 0; t < 2; t++) {
         //read local file (wrong)
         std::string path = (tempDir / ("wrongData0.zip")).string();
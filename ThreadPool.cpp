@@ -0,0 +1,233 @@
+#include "ThreadPool.h"
+#include <algorithm>
+#include "Logging.h"
+
+
+namespace ZipSync {
+
+//which pool current thread works for (if any), and index of its queue there
+static thread_local ThreadPool *t_pool = nullptr;
+static thread_local int t_queueIdx = -1;
+
+ThreadPool::ThreadPool(int threadsNum, std::function<void()> threadInit) : _queuedCnt(0), _stop(false), _threadInit(std::move(threadInit)) {
+    if (threadsNum <= 0)
+        threadsNum = std::max(int(std::thread::hardware_concurrency()), 1);
+    for (int i = 0; i <= threadsNum; i++)
+        _queues.emplace_back(new Queue());
+    for (int i = 0; i < threadsNum; i++)
+        _threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    _stop = true;
+    WakeUp(true);
+    for (std::thread &thr : _threads)
+        thr.join();
+}
+
+static std::atomic<int> g_globalThreadsNum(0);
+static std::atomic<bool> g_globalCreated(false);
+
+ThreadPool &ThreadPool::Global() {
+    static ThreadPool pool([]() {
+        g_globalCreated = true;
+        return g_globalThreadsNum.load();
+    }());
+    return pool;
+}
+void ThreadPool::SetGlobalThreadsNum(int threadsNum) {
+    ZipSyncAssertF(!g_globalCreated, "Global thread pool is already created");
+    g_globalThreadsNum = threadsNum;
+}
+ThreadPool *ThreadPool::Current() {
+    return t_pool;
+}
+
+void ThreadPool::Push(Task &&task) {
+    //workers put new tasks into their own queue, other threads use the shared queue
+    int idx = (t_pool == this ? t_queueIdx : _queues.size() - 1);
+    Queue &queue = *_queues[idx];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    _queuedCnt++;
+    WakeUp(false);
+}
+
+bool ThreadPool::TryPop(Task &task) {
+    if (_queuedCnt == 0)
+        return false;
+    int n = _queues.size();
+    int self = (t_pool == this ? t_queueIdx : n - 1);
+    for (int k = 0; k < n; k++) {
+        int idx = (self + k) % n;
+        Queue &queue = *_queues[idx];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            continue;
+        if (k == 0) {
+            //own queue: newest task (its data is most likely in cache)
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        else {
+            //steal: oldest task (usually the largest piece of work)
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        _queuedCnt--;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::Execute(Task &task) {
+    TaskGroup *group = task.group;
+    if (!group->_cancelled) {
+        try {
+            task.func();
+        }
+        catch(...) {
+            std::lock_guard<std::mutex> lock(group->_exceptionMutex);
+            if (!group->_exception)
+                group->_exception = std::current_exception();
+            group->_cancelled = true;
+        }
+    }
+    //release captured data before group can be destroyed
+    task.func = nullptr;
+    //note: group must not be touched after decrement
+    if (--group->_pendingCnt == 0)
+        WakeUp(true);   //thread in TaskGroup::Wait sleeps on the same condition as idle workers
+}
+
+void ThreadPool::WakeUp(bool all) {
+    //note: locking ensures that a thread which is going to sleep does not miss the signal
+    std::lock_guard<std::mutex> lock(_sleepMutex);
+    if (all)
+        _sleepCond.notify_all();
+    else
+        _sleepCond.notify_one();
+}
+
+void ThreadPool::WorkerLoop(int index) {
+    t_pool = this;
+    t_queueIdx = index;
+    if (_threadInit)
+        _threadInit();
+    while (1) {
+        Task task;
+        if (TryPop(task)) {
+            Execute(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(_sleepMutex);
+        _sleepCond.wait(lock, [this]() { return _stop || _queuedCnt > 0; });
+        if (_stop && _queuedCnt == 0)
+            break;
+    }
+    t_pool = nullptr;
+    t_queueIdx = -1;
+}
+
+
+TaskGroup::TaskGroup(ThreadPool &pool) : _pool(pool), _pendingCnt(0), _cancelled(false) {}
+
+TaskGroup::~TaskGroup() {
+    try {
+        Wait();
+    } catch(...) {}
+}
+
+void TaskGroup::Run(std::function<void()> func) {
+    _pendingCnt++;
+    _pool.Push(ThreadPool::Task{std::move(func), this});
+}
+
+void TaskGroup::Cancel() {
+    _cancelled = true;
+}
+
+void TaskGroup::Wait() {
+    while (_pendingCnt > 0) {
+        ThreadPool::Task task;
+        if (_pool.TryPop(task)) {
+            //help instead of sleeping (task may belong to other group)
+            _pool.Execute(task);
+            continue;
+        }
+        //note: Push and Execute (when last task finishes) notify under the same mutex, so no signal is missed
+        std::unique_lock<std::mutex> lock(_pool._sleepMutex);
+        _pool._sleepCond.wait(lock, [this]() {
+            return _pendingCnt == 0 || _pool._queuedCnt > 0;
+        });
+    }
+    std::exception_ptr exception;
+    {
+        std::lock_guard<std::mutex> lock(_exceptionMutex);
+        std::swap(exception, _exception);
+    }
+    bool cancelled = _cancelled.exchange(false);
+    if (exception)
+        std::rethrow_exception(exception);
+    if (cancelled)
+        g_logger->errorf(lcUserInterrupt, "Interrupted by user");
+}
+
+
+ParallelProgress::ParallelProgress(const GlobalProgressCallback &callback, uint64_t total)
+    : _callback(callback), _total(total), _done(0), _reporting(false), _cancelled(false)
+{}
+
+void ParallelProgress::Add(uint64_t amount, const char *comment) {
+    uint64_t done = (_done += amount);
+    if (!_callback || _reporting.exchange(true))
+        return;     //somebody else is reporting right now
+    uint64_t total = std::max(uint64_t(_total), uint64_t(1));
+    int code = _callback(std::min(double(done) / double(total), 1.0), comment);
+    if (code != 0)
+        _cancelled = true;
+    _reporting = false;
+}
+
+
+void ParallelFor(int from, int to, const std::function<void(int)> &body, int thrNum, int blockSize, ParallelProgress *progress, ThreadPool &pool) {
+    if (thrNum == 1) {
+        for (int i = from; i < to; i++) {
+            if (progress && progress->IsCancelled())
+                g_logger->errorf(lcUserInterrupt, "Interrupted by user");
+            body(i);
+        }
+        return;
+    }
+
+    if (thrNum <= 0)
+        thrNum = pool.GetThreadsNum() + 1;
+    int blocksNum = (to - from + blockSize - 1) / blockSize;
+    thrNum = std::min(thrNum, blocksNum);
+
+    //every runner grabs blocks one by one until they are over
+    std::atomic<int> nextBlock(0);
+    TaskGroup group(pool);
+    auto Runner = [&]() {
+        while (!group.IsCancelled()) {
+            if (progress && progress->IsCancelled()) {
+                group.Cancel();
+                break;
+            }
+            int block = nextBlock++;
+            if (block >= blocksNum)
+                break;
+            int left = from + block * blockSize;
+            int right = std::min(left + blockSize, to);
+            for (int i = left; i < right; i++)
+                body(i);
+        }
+    };
+    for (int t = 0; t < thrNum; t++)
+        group.Run(Runner);
+    group.Wait();
+}
+
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+
+namespace ZipSync {
+
+typedef std::function<int(double, const char*)> GlobalProgressCallback;
+
+class TaskGroup;
+
+/**
+ * Persistent pool of worker threads with work stealing.
+ * Every worker has its own queue of tasks: it takes tasks from the back of its queue (newest first),
+ * and when it is empty, it steals tasks from the front of other queues (oldest first).
+ * Tasks are always submitted and waited for via TaskGroup.
+ * Thread waiting for a group executes pending tasks instead of sleeping, so nested parallelism does not deadlock.
+ */
+class ThreadPool {
+    friend class TaskGroup;
+
+    struct Task {
+        std::function<void()> func;
+        TaskGroup *group;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+    //one queue per worker thread + one queue for tasks submitted from outside
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::vector<std::thread> _threads;
+
+    //total number of tasks in all queues
+    std::atomic<int> _queuedCnt;
+    std::atomic<bool> _stop;
+    //idle threads sleep on this condition
+    std::mutex _sleepMutex;
+    std::condition_variable _sleepCond;
+    //called by every worker thread before it starts taking tasks
+    std::function<void()> _threadInit;
+
+    void Push(Task &&task);
+    bool TryPop(Task &task);
+    void Execute(Task &task);
+    void WakeUp(bool all);
+    void WorkerLoop(int index);
+
+public:
+    //threadsNum = number of worker threads (0 = number of hardware threads)
+    //threadInit (if set) is called on every worker thread when it starts
+    ThreadPool(int threadsNum = 0, std::function<void()> threadInit = nullptr);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool& operator=(const ThreadPool &) = delete;
+
+    int GetThreadsNum() const { return _threads.size(); }
+
+    //the pool shared by the whole process (created on first use)
+    static ThreadPool &Global();
+    //set number of worker threads in global pool (0 = number of hardware threads)
+    //note: must be called before global pool is used for the first time
+    static void SetGlobalThreadsNum(int threadsNum);
+    //the pool which current thread is a worker of (nullptr if it is not a worker thread)
+    static ThreadPool *Current();
+};
+
+/**
+ * Set of tasks running on thread pool, which are waited for together.
+ * Tasks may submit more tasks into the same group or into their own nested groups.
+ * If a task throws exception, the group gets cancelled and Wait rethrows the (first) exception.
+ * Tasks of cancelled group which have not started yet are skipped.
+ */
+class TaskGroup {
+    friend class ThreadPool;
+
+    ThreadPool &_pool;
+    std::atomic<int> _pendingCnt;
+    std::atomic<bool> _cancelled;
+    std::mutex _exceptionMutex;
+    std::exception_ptr _exception;
+
+public:
+    TaskGroup(ThreadPool &pool = ThreadPool::Global());
+    //waits for remaining tasks (but does not throw)
+    ~TaskGroup();
+
+    void Run(std::function<void()> func);
+    //skip tasks which have not started yet
+    void Cancel();
+    bool IsCancelled() const { return _cancelled; }
+    //waits until all tasks are finished, helping to execute them meanwhile
+    //throws exception of failed task, or lcUserInterrupt error if group was cancelled
+    void Wait();
+};
+
+/**
+ * Aggregates progress of parallel tasks without locking.
+ * Tasks report how much work they have done, and one of them passes the total to callback
+ * (if some other thread is inside callback at this moment, reporting is simply skipped).
+ * If callback returns nonzero, then progress becomes cancelled (see ParallelFor).
+ */
+class ParallelProgress {
+    GlobalProgressCallback _callback;
+    std::atomic<uint64_t> _total;
+    std::atomic<uint64_t> _done;
+    std::atomic<bool> _reporting;
+    std::atomic<bool> _cancelled;
+
+public:
+    ParallelProgress(const GlobalProgressCallback &callback, uint64_t total);
+    void AddTotal(uint64_t amount) { _total += amount; }
+    void Add(uint64_t amount, const char *comment);
+    bool IsCancelled() const { return _cancelled; }
+};
+
+//calls body(i) for every i in [from, to) on thread pool, giving blocks of blockSize indices to tasks
+//at most thrNum threads (including caller) are used: thrNum = 1 means serial execution, thrNum <= 0 means whole pool
+//note: pool cannot use more threads than it has, so thrNum is capped by GetThreadsNum() + 1 (see SetGlobalThreadsNum)
+//if progress is cancelled, remaining blocks are skipped and lcUserInterrupt error is thrown
+void ParallelFor(int from, int to, const std::function<void(int)> &body, int thrNum = -1, int blockSize = 1, ParallelProgress *progress = nullptr, ThreadPool &pool = ThreadPool::Global());
+
+}
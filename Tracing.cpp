@@ -0,0 +1,144 @@
+#include "Tracing.h"
+#include "Utils.h"
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace ZipSync {
+
+std::atomic<bool> g_traceEnabled(false);
+
+//steady clock time of TraceStart (in microseconds)
+static std::atomic<int64_t> g_traceStartTime(0);
+
+struct TraceEvent {
+    const char *name;
+    int tid;
+    int64_t start;
+    int64_t duration;
+    std::string args;
+};
+
+//every thread appends events to its own buffer, so threads don't contend with each other
+struct TraceThreadBuffer {
+    int tid;
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+};
+static std::mutex g_traceBuffersMutex;
+static std::vector<std::shared_ptr<TraceThreadBuffer>> g_traceBuffers;
+static std::map<int, std::string> g_traceLaneNames;
+static thread_local std::shared_ptr<TraceThreadBuffer> t_traceBuffer;
+
+static int64_t SteadyMicroseconds() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static TraceThreadBuffer &GetThreadBuffer() {
+    if (!t_traceBuffer) {
+        auto buffer = std::make_shared<TraceThreadBuffer>();
+        std::lock_guard<std::mutex> lock(g_traceBuffersMutex);
+        buffer->tid = g_traceBuffers.size() + 1;
+        g_traceBuffers.push_back(buffer);
+        t_traceBuffer = buffer;
+    }
+    return *t_traceBuffer;
+}
+
+static std::string EscapeJson(const std::string &str) {
+    std::string res;
+    res.reserve(str.size() + 2);
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += c;
+        }
+        else if ((unsigned char)c < 0x20) {
+            char buffer[8];
+            sprintf(buffer, "\\u%04x", (unsigned char)c);
+            res += buffer;
+        }
+        else
+            res += c;
+    }
+    return res;
+}
+
+void TraceStart() {
+    {
+        std::lock_guard<std::mutex> lock(g_traceBuffersMutex);
+        for (const auto &buffer : g_traceBuffers) {
+            std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+            buffer->events.clear();
+        }
+        g_traceLaneNames.clear();
+    }
+    g_traceStartTime = SteadyMicroseconds();
+    g_traceEnabled = true;
+}
+
+int64_t TraceNow() {
+    return SteadyMicroseconds() - g_traceStartTime.load(std::memory_order_relaxed);
+}
+
+void TraceAddEvent(const char *name, int64_t startUs, int64_t durationUs, const std::string &args, int lane) {
+    if (!IsTraceEnabled())
+        return;
+    TraceThreadBuffer &buffer = GetThreadBuffer();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    buffer.events.push_back(TraceEvent{name, lane >= 0 ? lane : buffer.tid, startUs, durationUs, args});
+}
+
+void TraceSetLaneName(int lane, const std::string &name) {
+    if (!IsTraceEnabled())
+        return;
+    std::lock_guard<std::mutex> lock(g_traceBuffersMutex);
+    g_traceLaneNames[lane] = name;
+}
+
+void TraceArgAppend(std::string &args, const char *key, uint64_t value) {
+    if (!args.empty())
+        args += ',';
+    args += '"';
+    args += key;
+    args += "\":";
+    args += std::to_string(value);
+}
+void TraceArgAppend(std::string &args, const char *key, const std::string &value) {
+    if (!args.empty())
+        args += ',';
+    args += '"';
+    args += key;
+    args += "\":\"";
+    args += EscapeJson(value);
+    args += '"';
+}
+
+void TraceFinish(const char *path) {
+    g_traceEnabled = false;
+
+    StdioFileHolder f(path, "wt");
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"zipsync\"}}");
+    std::lock_guard<std::mutex> lock(g_traceBuffersMutex);
+    for (const auto &pair : g_traceLaneNames) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            pair.first, EscapeJson(pair.second).c_str()
+        );
+    }
+    for (const auto &buffer : g_traceBuffers) {
+        std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+        for (const TraceEvent &e : buffer->events) {
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,\"args\":{%s}}",
+                e.name, e.tid, (long long)e.start, (long long)e.duration, e.args.c_str()
+            );
+        }
+        buffer->events.clear();
+    }
+    fprintf(f, "\n]}\n");
+}
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+
+namespace ZipSync {
+
+/**
+ * Timeline of scoped spans, saved in Chrome trace format (open with chrome://tracing or ui.perfetto.dev).
+ * Recording happens only between TraceStart and TraceFinish.
+ * When tracing is disabled, span costs one relaxed atomic load.
+ */
+extern std::atomic<bool> g_traceEnabled;
+
+inline bool IsTraceEnabled() {
+    return g_traceEnabled.load(std::memory_order_relaxed);
+}
+
+//starts recording (previously recorded events are dropped)
+void TraceStart();
+//stops recording and writes all recorded events to file as Chrome trace JSON
+void TraceFinish(const char *path);
+
+//microseconds since TraceStart
+int64_t TraceNow();
+//adds complete event with explicit timing (e.g. for asynchronous operation)
+//args is a sequence of JSON members formatted by TraceArgAppend
+//lane = -1 means current thread, otherwise event goes to virtual thread with this id
+void TraceAddEvent(const char *name, int64_t startUs, int64_t durationUs, const std::string &args = "", int lane = -1);
+//lanes should start from this value, so that they don't mix with real threads
+static const int TRACE_LANE_BASE = 1000;
+//sets name of virtual thread (lane) displayed in trace viewer
+void TraceSetLaneName(int lane, const std::string &name);
+
+void TraceArgAppend(std::string &args, const char *key, uint64_t value);
+void TraceArgAppend(std::string &args, const char *key, const std::string &value);
+
+/**
+ * Records the time from construction to destruction as trace event on the current thread.
+ * Name must be a string literal (pointer is stored).
+ */
+class TraceSpan {
+    const char *_name;
+    int64_t _start = -1;    //negative if tracing is disabled
+    std::string _args;
+
+public:
+    TraceSpan(const char *name) : _name(name) {
+        if (IsTraceEnabled())
+            _start = TraceNow();
+    }
+    ~TraceSpan() {
+        if (_start >= 0)
+            TraceAddEvent(_name, _start, TraceNow() - _start, _args);
+    }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan& operator=(const TraceSpan &) = delete;
+
+    bool IsActive() const { return _start >= 0; }
+    TraceSpan &Arg(const char *key, uint64_t value) {
+        if (_start >= 0)
+            TraceArgAppend(_args, key, value);
+        return *this;
+    }
+    TraceSpan &Arg(const char *key, const std::string &value) {
+        if (_start >= 0)
+            TraceArgAppend(_args, key, value);
+        return *this;
+    }
+    TraceSpan &Arg(const char *key, const char *value) {
+        if (_start >= 0)
+            TraceArgAppend(_args, key, std::string(value));
+        return *this;
+    }
+};
+
+}
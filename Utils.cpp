@@ -16,6 +16,21 @@ StdioFileHolder::StdioFileHolder(const char *path, const char *mode)
         g_logger->errorf(lcCantOpenFile, "Failed to open file \"%s\"", path);
 }
 
+int FileSeek64(FILE *f, int64_t offset, int origin) {
+#ifdef _WIN32
+    return _fseeki64(f, offset, origin);
+#else
+    return fseeko(f, offset, origin);
+#endif
+}
+int64_t FileTell64(FILE *f) {
+#ifdef _WIN32
+    return _ftelli64(f);
+#else
+    return ftello(f);
+#endif
+}
+
 std::vector<uint8_t> ReadWholeFile(const std::string &filename) {
     StdioFileHolder f(filename.c_str(), "rb");
     fseek(f.get(), 0, SEEK_END);
@@ -28,10 +43,10 @@ std::vector<uint8_t> ReadWholeFile(const std::string &filename) {
     return res;
 }
 
-int GetFileSize(const std::string &filename) {
+uint64_t GetFileSize(const std::string &filename) {
     StdioFileHolder f(filename.c_str(), "rb");
-    fseek(f.get(), 0, SEEK_END);
-    int size = ftell(f.get());
+    FileSeek64(f.get(), 0, SEEK_END);
+    uint64_t size = FileTell64(f.get());
     return size;
 }
 
@@ -3,6 +3,8 @@
 #include <memory>
 #include <vector>
 #include <string>
+#include <stdio.h>
+#include <stdint.h>
 
 
 namespace ZipSync {
@@ -32,7 +34,11 @@ public:
     operator FILE*() const { return get(); }
 };
 
+//fseek/ftell with 64-bit offsets (files may be larger than 4 GB)
+int FileSeek64(FILE *f, int64_t offset, int origin);
+int64_t FileTell64(FILE *f);
+
 std::vector<uint8_t> ReadWholeFile(const std::string &filename);
-int GetFileSize(const std::string &filename);
+uint64_t GetFileSize(const std::string &filename);
 
 }
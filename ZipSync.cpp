@@ -3,23 +3,51 @@
 #include <algorithm>
 #include <map>
 #include <set>
+#include <tuple>
+#include <chrono>
 #include "Logging.h"
 #include "Utils.h"
 #include "ZipUtils.h"
 #include "Downloader.h"
+#include "SharedCache.h"
+#include "LocalCache.h"
+#include "Tracing.h"
+#include "ResourceGovernor.h"
 
 
 namespace ZipSync {
 
+//adds time from construction to Stop (or destruction) to the given counter (in seconds)
+class MetricsTimer {
+    double *_counter;
+    std::chrono::steady_clock::time_point _start;
+public:
+    MetricsTimer(double &counter) : _counter(&counter), _start(std::chrono::steady_clock::now()) {}
+    ~MetricsTimer() { Stop(); }
+    void Stop() {
+        if (_counter)
+            *_counter += std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+        _counter = nullptr;
+    }
+};
+
 void UpdateProcess::Init(const Manifest &targetMani_, const Manifest &providedMani_, const std::string &rootDir_) {
     _targetMani = targetMani_;
     _providedMani = providedMani_;
     _rootDir = rootDir_;
 
     _targetMani.ReRoot(_rootDir);
+    //all hashes must be computed with the same function, otherwise nothing would match
+    HashAlgorithm algo = _targetMani.GetHashAlgorithm();
+    ZipSyncAssertF(_providedMani.size() == 0 || _providedMani.GetHashAlgorithm() == algo,
+        "Provided manifest uses hash algorithm %s, but target manifest uses %s",
+        HashAlgorithmName(_providedMani.GetHashAlgorithm()), HashAlgorithmName(algo)
+    );
+    _providedMani.SetHashAlgorithm(algo);
 
     _updateType = (UpdateType)0xDDDDDDDD;
     _matches.clear();
+    _metrics = UpdateMetrics();
 
     //make sure every target zip is "managed"
     for (int i = 0; i < _targetMani.size(); i++) {
@@ -32,7 +60,55 @@ void UpdateProcess::AddManagedZip(const std::string &zipPath, bool relative) {
     auto pib = _managedZips.insert(path.abs);
 }
 
+void UpdateProcess::SetLocalCache(const LocalCache *cache) {
+    const Manifest &cacheMani = cache->GetManifest();
+    if (cacheMani.size() > 0 && cacheMani.GetHashAlgorithm() != _targetMani.GetHashAlgorithm()) {
+        g_logger->infof("Local cache uses hash algorithm %s, ignoring it", HashAlgorithmName(cacheMani.GetHashAlgorithm()));
+        return;
+    }
+    _providedMani.AppendManifest(cacheMani);
+}
+
+void UpdateProcess::SetSharedCache(SharedCache *cache) {
+    _sharedCache = cache;
+}
+
+void UpdateProcess::AddRemoteCas(const std::string &rootUrl) {
+    _remoteCasUrl = rootUrl;
+    if (_remoteCasUrl.size() > 1 && _remoteCasUrl.back() == '/')
+        _remoteCasUrl.pop_back();
+    //every target file is provided by the store at the same place as in target zip,
+    //so that clean install downloads whole zips which can be renamed without repacking
+    //note: size of file in zip is computed from regenerated local header, since byterange of target may be empty
+    //(if target zip has no layout, its files are placed one after another in order of target manifest)
+    std::set<std::string> noLayoutZips;
+    for (int i = 0; i < _targetMani.size(); i++)
+        if (_targetMani[i].byterange[1] <= _targetMani[i].byterange[0])
+            noLayoutZips.insert(_targetMani[i].zipPath.rel);
+    std::map<std::string, uint64_t> zipEnd;
+    for (int i = 0; i < _targetMani.size(); i++) {
+        FileMetainfo pf = _targetMani[i];
+        uint64_t size = minizipCreateLocalHeader(
+            pf.filename.c_str(), pf.props.compressionMethod, pf.props.generalPurposeBitFlag,
+            pf.props.lastModTime, pf.props.crc32, pf.props.compressedSize, pf.props.contentsSize
+        ).size() + pf.props.compressedSize;
+        if (noLayoutZips.count(pf.zipPath.rel)) {
+            uint64_t &end = zipEnd[pf.zipPath.rel];
+            pf.byterange[0] = end;
+            end += size;
+        }
+        else
+            ZipSyncAssertF(pf.byterange[1] - pf.byterange[0] == size, "Byterange of target file \"%s\" does not match its header and compressed size", GetFullPath(pf.zipPath.rel, pf.filename).c_str());
+        pf.byterange[1] = pf.byterange[0] + size;
+        pf.zipPath = PathAR::FromRel(pf.zipPath.rel, _remoteCasUrl);
+        pf.location = FileLocation::RemoteCas;
+        _providedMani.AppendFile(pf);
+    }
+}
+
 bool UpdateProcess::DevelopPlan(UpdateType type) {
+    TraceSpan span("DevelopPlan");
+    MetricsTimer timer(_metrics.timePlan);
     _updateType = type;
 
     //build index of target files: by zip path + file path inside zip
@@ -57,6 +133,34 @@ bool UpdateProcess::DevelopPlan(UpdateType type) {
         }
     }
 
+    //find target zips which are already in place and equal to target (by digest)
+    //files of such zips are matched to themselves without searching
+    std::vector<const FileMetainfo*> identicalMatch(_targetMani.size(), nullptr);
+    {
+        std::map<std::string, std::vector<const FileMetainfo*>> targetByZip, inplaceByZip;
+        for (int i = 0; i < _targetMani.size(); i++)
+            targetByZip[_targetMani[i].zipPath.abs].push_back(&_targetMani[i]);
+        for (int i = 0; i < _providedMani.size(); i++)
+            if (_providedMani[i].location == FileLocation::Inplace)
+                inplaceByZip[_providedMani[i].zipPath.abs].push_back(&_providedMani[i]);
+        for (auto &pZT : targetByZip) {
+            auto iter = inplaceByZip.find(pZT.first);
+            if (iter == inplaceByZip.end())
+                continue;
+            std::vector<const FileMetainfo*> &tfs = pZT.second;
+            std::vector<const FileMetainfo*> &pfs = iter->second;
+            if (tfs.size() != pfs.size() || !(ComputeZipDigest(tfs) == ComputeZipDigest(pfs)))
+                continue;
+            auto ByFilename = [](const FileMetainfo *a, const FileMetainfo *b) {
+                return a->filename < b->filename;
+            };
+            std::sort(tfs.begin(), tfs.end(), ByFilename);
+            std::sort(pfs.begin(), pfs.end(), ByFilename);
+            for (int j = 0; j < tfs.size(); j++)
+                identicalMatch[tfs[j] - &_targetMani[0]] = pfs[j];
+        }
+    }
+
     //build index of provided files (by hash on uncompressed file)
     std::map<HashDigest, std::vector<const FileMetainfo*>> pfIndex;
     for (int i = 0; i < _providedMani.size(); i++) {
@@ -69,6 +173,10 @@ bool UpdateProcess::DevelopPlan(UpdateType type) {
     bool fullPlan = true;
     for (int i = 0; i < _targetMani.size(); i++) {
         const FileMetainfo &tf = _targetMani[i];
+        if (identicalMatch[i]) {
+            _matches.push_back(Match{ManifestIter(_targetMani, &tf), ManifestIter(_providedMani, identicalMatch[i])});
+            continue;
+        }
 
         const FileMetainfo *bestFile = nullptr;
         int bestScore = 1000000000;
@@ -203,7 +311,7 @@ public:
         }
         for (int i = 0; i < _owner._providedMani.size(); i++) {
             const FileMetainfo &pf = _owner._providedMani[i];
-            if (pf.location == FileLocation::RemoteHttp)
+            if (pf.location == FileLocation::RemoteHttp || pf.location == FileLocation::RemoteCas)
                 continue;
             FindZip(pf.zipPath.abs)._provided.push_back(ManifestIter(_owner._providedMani, i));
         }
@@ -258,8 +366,17 @@ public:
             if (srcZip._usedCnt != k)
                 continue;       //every file inside zip must be used exactly once
 
-            { //check that filenames and header data are same (TODO: do it without scanning file)
-                std::map<uint32_t, ManifestIter> bytestartToTarget;
+            bool sameDigest = false;
+            {   //if manifests describe exactly same zip, then file scan is not needed
+                std::vector<const FileMetainfo*> targetFiles, providedFiles;
+                for (int midx : dstZip._matchIds)
+                    targetFiles.push_back(_owner._matches[midx].target.get());
+                for (ManifestIter pf : srcZip._provided)
+                    providedFiles.push_back(pf.get());
+                sameDigest = (ComputeZipDigest(targetFiles) == ComputeZipDigest(providedFiles));
+            }
+            if (!sameDigest) { //check that filenames and header data are same
+                std::map<uint64_t, ManifestIter> bytestartToTarget;
                 for (int midx : dstZip._matchIds) {
                     Match m = _owner._matches[midx];
                     bytestartToTarget[m.provided->byterange[0]] = m.target;
@@ -301,12 +418,13 @@ public:
             //do the physical action
             CreateDirectoriesForFile(dstZip._zipPath, _owner._rootDir);
             RenameFile(srcZip._zipPath, dstZip._zipPathRepacked);
+            _owner._metrics.zipsRenamed++;
 
             //update all the data structures
             dstZip._repacked = true;
             srcZip._usedCnt = 0;
             srcZip._reduced = true;
-            std::map<uint32_t, ManifestIter> filesMap;
+            std::map<uint64_t, ManifestIter> filesMap;
             for (ManifestIter pf : srcZip._provided) {
                 pf->location = FileLocation::Repacked;
                 _repackedMani.AppendFile(*pf);
@@ -327,6 +445,8 @@ public:
     }
 
     void RepackZip(ZipInfo &zip) {
+        TraceSpan span("RepackZip");
+        span.Arg("zip", zip._zipPathRepacked).Arg("files", zip._matchIds.size());
         g_logger->infof(lcRepackZip, "Repacking %s...", zip._zipPathRepacked.c_str());
         if (_progress)
             _progress(ComputeProgressRatio(), formatMessage("Repacking %s...", zip._zipPathRepacked.c_str()).c_str());
@@ -345,8 +465,8 @@ public:
             zf.LocateByByterange(m.provided->byterange[0], m.provided->byterange[1]);
 
             //can we avoid recompressing the file?
-            unz_file_info info;
-            SAFE_CALL(unzGetCurrentFileInfo(zf, &info, NULL, 0, NULL, 0, NULL, 0));
+            unz_file_info64 info;
+            SAFE_CALL(unzGetCurrentFileInfo64(zf, &info, NULL, 0, NULL, 0, NULL, 0));
             bool copyRaw = false;
             if (m.provided->compressedHash == m.target->compressedHash)
                 copyRaw = true;  //bitwise same
@@ -358,16 +478,20 @@ public:
                 m.target->filename.c_str(),
                 m.target->props.compressionMethod, m.target->props.generalPurposeBitFlag,
                 m.target->props.internalAttribs, m.target->props.externalAttribs, m.target->props.lastModTime,
-                copyRaw, m.target->props.crc32, m.target->props.contentsSize
+                copyRaw, m.target->props.crc32, m.target->props.compressedSize, m.target->props.contentsSize
             );
             //remember whether we repacked or not --- to be used in AnalyzeRepackedZip
             _recompressed.resize(midx+1, false);
             _recompressed[midx] = !copyRaw;
+            (copyRaw ? _owner._metrics.entriesCopiedRaw : _owner._metrics.entriesRecompressed)++;
+            _owner._metrics.bytesRepackRead += m.provided->byterange[1] - m.provided->byterange[0];
         }
 
         //flush and close new zip
         zfOut.reset();
         zip._repacked = true;
+        _owner._metrics.zipsRepacked++;
+        _owner._metrics.bytesRepackWritten += GetFileSize(zip._zipPathRepacked);
 
         if (_progress)
             _progress(ComputeProgressRatio(), formatMessage("Repacking %s...", zip._zipPathRepacked.c_str()).c_str());
@@ -393,8 +517,14 @@ public:
     }
 
     void AnalyzeRepackedZip(const ZipInfo &zip) {
+        TraceSpan span("AnalyzeRepackedZip");
+        span.Arg("zip", zip._zipPathRepacked).Arg("files", zip._matchIds.size());
+        MetricsTimer timer(_owner._metrics.timeHashing);
         //analyze the repacked new zip
         UnzFileHolder zf(zip._zipPathRepacked.c_str());
+        //note: small recompressed files are hashed in batch, so all files are analyzed first
+        std::vector<FileMetainfo> metasNew(zip._matchIds.size());
+        BatchHasher batch;
         SAFE_CALL(unzGoToFirstFile(zf));
         for (int i = 0; i < zip._matchIds.size(); i++) {
             int midx = zip._matchIds[i];
@@ -403,13 +533,23 @@ public:
 
             //analyze current file
             bool needsRehashCompressed = _recompressed[midx];
-            FileMetainfo metaNew;
+            FileMetainfo &metaNew = metasNew[i];
             metaNew.zipPath = PathAR::FromAbs(zip._zipPathRepacked, _owner._rootDir);
             metaNew.location = FileLocation::Repacked;
             metaNew.package = m.target->package;
             metaNew.contentsHash = m.provided->contentsHash;
             metaNew.compressedHash = m.provided->compressedHash;   //will be recomputed if needsRehashCompressed
-            AnalyzeCurrentFile(zf, metaNew, false, needsRehashCompressed);
+            AnalyzeCurrentFile(zf, metaNew, false, needsRehashCompressed, _owner._targetMani.GetHashAlgorithm(), &batch);
+            if (needsRehashCompressed)
+                _owner._metrics.bytesHashed += metaNew.props.compressedSize;
+        }
+        zf.reset();
+        batch.Flush();
+
+        for (int i = 0; i < zip._matchIds.size(); i++) {
+            int midx = zip._matchIds[i];
+            Match &m = _owner._matches[midx];
+            const FileMetainfo &metaNew = metasNew[i];
             //check that it indeed matches the target
             ValidateFile(*m.target, metaNew);
 
@@ -425,10 +565,10 @@ public:
             //switch the match for the target file to this new file
             m.provided = ManifestIter(_repackedMani, _repackedMani.size() - 1);
         }
-        zf.reset();
     }
 
     void ReduceOldZips() {
+        TraceSpan span("ReduceOldZips");
         //see which target zip-s have contents no longer needed
         for (ZipInfo &zip : _zips) {
             if (!zip._managed)
@@ -442,13 +582,14 @@ public:
             if (IfFileExists(zip._zipPath)) {
                 UnzFileHolder zf(zip._zipPath.c_str());
                 ZipFileHolder zfOut(zip._zipPathReduced.c_str());
+                _owner._metrics.zipsReduced++;
 
                 //go over files and copy unique ones to reduced zip
                 std::vector<FileMetainfo> copiedFiles;
                 SAFE_CALL(unzGoToFirstFile(zf));
                 while (1) {
                     //find current file in provided manifest
-                    uint32_t range[2];
+                    uint64_t range[2];
                     unzGetCurrentFilePosition(zf, &range[0], NULL, &range[1]);
                     ManifestIter found;
                     for (ManifestIter pf : zip._provided) {
@@ -458,9 +599,9 @@ public:
                         }
                     }
                     //check whether we should retain the file or remove it
-                    unz_file_info info;
+                    unz_file_info64 info;
                     char filename[SIZE_PATH];
-                    SAFE_CALL(unzGetCurrentFileInfo(zf, &info, filename, sizeof(filename), NULL, 0, NULL, 0));
+                    SAFE_CALL(unzGetCurrentFileInfo64(zf, &info, filename, sizeof(filename), NULL, 0, NULL, 0));
                     if (found) {
                         int &usedCnt = _hashProvidedCnt.at(found->compressedHash);
                         if (usedCnt == 1) {
@@ -469,9 +610,10 @@ public:
                                 filename,
                                 info.compression_method, info.flag,
                                 info.internal_fa, info.external_fa, info.dosDate,
-                                true, info.crc, info.uncompressed_size
+                                true, info.crc, info.compressed_size, info.uncompressed_size
                             );
                             copiedFiles.push_back(*found);
+                            _owner._metrics.bytesRepackRead += range[1] - range[0];
                         }
                         else {
                             //drop it: it will still be available
@@ -498,6 +640,7 @@ public:
                     PruneDirectoriesAfterFileRemoval(zip._zipPathReduced, _owner._rootDir);
                 }
                 else {
+                    _owner._metrics.bytesRepackWritten += GetFileSize(zip._zipPathReduced);
                     //analyze reduced zip, add all files to manifest
                     UnzFileHolder zf(zip._zipPathReduced.c_str());
                     SAFE_CALL(unzGoToFirstFile(zf));
@@ -529,6 +672,7 @@ public:
     }
 
     void RenameRepackedZips() {
+        TraceSpan span("RenameRepackedZips");
         //see which target zip-s have contents no longer needed
         for (ZipInfo &zip : _zips) {
             if (!zip._repacked)
@@ -556,6 +700,7 @@ public:
 
     void RewriteProvidedManifest() {
         Manifest newProvidedMani;
+        newProvidedMani.SetHashAlgorithm(_owner._providedMani.GetHashAlgorithm());
 
         for (int i = 0; i < _repackedMani.size(); i++)
             newProvidedMani.AppendFile(std::move(_repackedMani[i]));
@@ -614,12 +759,185 @@ public:
 };
 
 void UpdateProcess::RepackZips(const GlobalProgressCallback &progressCallback) {
+    TraceSpan span("RepackZips");
+    MetricsTimer timer(_metrics.timeRepack);
     Repacker impl(*this);
     impl._progress = progressCallback;
-    impl.DoAll();
+    //note: priority of caller's thread must not be changed
+    RunWithLowPriority([&impl]() { impl.DoAll(); });
+}
+
+void UpdateProcess::RemoveOldZips(LocalCache *cache) {
+    TraceSpan span("RemoveOldZips");
+    Manifest reducedMani = _providedMani.Filter([](const FileMetainfo &f) {
+        return f.location == FileLocation::Reduced;
+    });
+    if (cache) {
+        cache->AddFiles(reducedMani);
+        cache->Evict();
+    }
+
+    std::set<std::string> reducedZips;
+    for (int i = 0; i < reducedMani.size(); i++)
+        reducedZips.insert(reducedMani[i].zipPath.abs);
+    for (const std::string &zipPath : reducedZips) {
+        RemoveFile(zipPath);
+        PruneDirectoriesAfterFileRemoval(zipPath, _rootDir);
+    }
+
+    //replace old info about cached files with the actual one
+    std::string cachePrefix = cache ? cache->GetCacheDir() + '/' : "";
+    _providedMani = _providedMani.Filter([&cachePrefix](const FileMetainfo &f) {
+        if (f.location == FileLocation::Reduced)
+            return false;
+        if (!cachePrefix.empty() && f.location == FileLocation::Local && stdext::starts_with(f.zipPath.abs, cachePrefix))
+            return false;
+        return true;
+    });
+    if (cache)
+        _providedMani.AppendManifest(cache->GetManifest());
 }
 
 
+static const char *DOWNLOAD_JOURNAL_FILENAME = "__download_journal__.ini";
+
+/**
+ * Records which files have been fully written into which "__download??__" zips.
+ * Allows to continue download after interruption instead of starting from scratch.
+ * Journal is appended and flushed after every downloaded file,
+ * so a crash can spoil at most its last line (which is ignored on load).
+ */
+class DownloadJournal {
+public:
+    struct Entry {
+        uint64_t offset;        //where local file header starts in the download file
+        uint64_t byterange[2];  //byterange in the remote zip
+        HashDigest compressedHash;
+    };
+    struct UrlRecord {
+        std::string downloadPath;   //relative to root dir
+        std::vector<Entry> entries;
+    };
+
+    DownloadJournal() : _file(nullptr) {}
+
+    void Load(const std::string &path) {
+        _path = path;
+        _records.clear();
+        if (!IfFileExists(_path))
+            return;
+        StdioFileHolder f(_path.c_str(), "rb");
+        UrlRecord *curr = nullptr;
+        char buffer[SIZE_LINEBUFFER];
+        while (fgets(buffer, sizeof(buffer), f)) {
+            int len = strlen(buffer);
+            if (len == 0 || buffer[len-1] != '\n')
+                break;      //incomplete line: write was interrupted
+            buffer[--len] = 0;
+            if (strncmp(buffer, "[Download ", 10) == 0 && buffer[len-1] == ']') {
+                std::string url(buffer + 10, buffer + len-1);
+                curr = &_records[url];
+            }
+            else if (curr && strncmp(buffer, "file=", 5) == 0) {
+                curr->downloadPath = buffer + 5;
+            }
+            else if (curr && strncmp(buffer, "entry=", 6) == 0) {
+                unsigned long long offset, from, to;
+                char hex[128] = {0};
+                if (sscanf(buffer + 6, "%llu %llu-%llu %100s", &offset, &from, &to, hex) != 4)
+                    break;
+                Entry e = {offset, {from, to}};
+                if (strlen(hex) != HashDigest().Hex().size())
+                    break;
+                e.compressedHash.Parse(hex);
+                curr->entries.push_back(e);
+            }
+        }
+    }
+
+    const UrlRecord *Find(const std::string &url) const {
+        auto iter = _records.find(url);
+        if (iter == _records.end() || iter->second.downloadPath.empty())
+            return nullptr;
+        return &iter->second;
+    }
+
+    //all subsequent entries belong to file downloaded from given url
+    void StartUrl(const std::string &url, const std::string &downloadPath) {
+        if (!_file)
+            _file = StdioFileHolder(_path.c_str(), "wb");   //previous contents are already loaded
+        if (url == _currentUrl)
+            return;
+        _currentUrl = url;
+        fprintf(_file, "[Download %s]\nfile=%s\n", url.c_str(), downloadPath.c_str());
+        fflush(_file);
+    }
+    void AddEntry(const Entry &e) {
+        fprintf(_file, "entry=%llu %llu-%llu %s\n",
+            (unsigned long long)e.offset, (unsigned long long)e.byterange[0], (unsigned long long)e.byterange[1],
+            e.compressedHash.Hex().c_str()
+        );
+        fflush(_file);
+    }
+
+    void Remove() {
+        _file.reset();
+        _currentUrl.clear();
+        if (IfFileExists(_path))
+            RemoveFile(_path);
+    }
+
+private:
+    std::string _path;
+    std::map<std::string, UrlRecord> _records;
+    StdioFileHolder _file;
+    std::string _currentUrl;
+};
+
+//check that downloaded file data at given offset is complete and matches hash
+static bool VerifyDownloadedFile(FILE *f, uint64_t offset, uint64_t size, const HashDigest &compressedHash, HashAlgorithm algo) {
+    TraceSpan span("VerifyDownloadedFile");
+    span.Arg("bytes", size);
+    static const int LOCAL_HEADER_SIZE = 30;
+    static const int ZIP64_EXTRA_SIZE = 20;
+    uint8_t header[LOCAL_HEADER_SIZE + ZIP64_EXTRA_SIZE];
+    if (size < LOCAL_HEADER_SIZE || FileSeek64(f, offset, SEEK_SET) != 0)
+        return false;
+    if (fread(header, 1, LOCAL_HEADER_SIZE, f) != LOCAL_HEADER_SIZE)
+        return false;
+    auto Read16 = [&header](int pos) -> uint32_t { return header[pos] + (header[pos+1] << 8); };
+    auto Read32 = [&Read16](int pos) -> uint32_t { return Read16(pos) + (Read16(pos+2) << 16); };
+    uint32_t signature = Read32(0);
+    uint64_t compressedSize = Read32(18);
+    uint64_t dataStart = LOCAL_HEADER_SIZE + Read16(26) + Read16(28);
+    if (compressedSize == 0xFFFFFFFFU && Read16(28) == ZIP64_EXTRA_SIZE) {
+        //zip64 entry: actual compressed size is in extra field after filename
+        if (FileSeek64(f, offset + LOCAL_HEADER_SIZE + Read16(26), SEEK_SET) != 0)
+            return false;
+        if (fread(header + LOCAL_HEADER_SIZE, 1, ZIP64_EXTRA_SIZE, f) != ZIP64_EXTRA_SIZE)
+            return false;
+        if (Read16(LOCAL_HEADER_SIZE) != 0x0001)
+            return false;
+        compressedSize = Read32(LOCAL_HEADER_SIZE + 12) + (uint64_t(Read32(LOCAL_HEADER_SIZE + 16)) << 32);
+    }
+    if (signature != 0x04034b50 || dataStart > size || size - dataStart != compressedSize)
+        return false;
+    if (FileSeek64(f, offset + dataStart, SEEK_SET) != 0)
+        return false;
+
+    Hasher hasher(algo);
+    char buffer[SIZE_FILEBUFFER];
+    uint64_t remains = compressedSize;
+    while (remains > 0) {
+        uint32_t chunk = uint32_t(std::min(remains, uint64_t(sizeof(buffer))));
+        if (fread(buffer, 1, chunk, f) != chunk)
+            return false;
+        hasher.Update(buffer, chunk);
+        remains -= chunk;
+    }
+    return hasher.Finalize() == compressedHash;
+}
+
 uint64_t UpdateProcess::DownloadRemoteFiles(
     const GlobalProgressCallback &progressDownloadCallback,
     const GlobalProgressCallback &progressPostprocessCallback
@@ -638,65 +956,278 @@ void UpdateProcess::DownloadRemoteFiles(
     Downloader &downloader,
     const GlobalProgressCallback &progressPostprocessCallback
 ) {
+    TraceSpan span("DownloadRemoteFiles");
+    MetricsTimer downloadTimer(_metrics.timeDownload);
     struct UrlData {
         PathAR path;
         StdioFileHolder file;
         int finishedCount = 0, totalCount = 0;
-        std::map<uint32_t, int> baseToProvIdx;
+        std::map<uint64_t, int> baseToProvIdx;
+        std::map<int, uint64_t> provIdxToBase;  //where every file must be written (in order of byteranges)
+        std::vector<int> provIdxs;
+        std::set<int> fromSharedCache;
         UrlData() : file(nullptr) {}
     };
     std::map<std::string, UrlData> urlStates;
     std::map<int, std::vector<int>> provIdxToMatchIds;
 
-    std::set<std::string> downloadedFilenames;
-    for (int midx = 0; midx < _matches.size(); midx++) {
-        const Match &m = _matches[midx];
-        if (m.provided->location != FileLocation::RemoteHttp)
-            continue;
-        const std::string &url = m.provided->zipPath.abs;
+    //see what was downloaded by previous (interrupted) runs
+    DownloadJournal journal;
+    journal.Load(PathAR::FromRel(DOWNLOAD_JOURNAL_FILENAME, _rootDir).abs);
+
+    //different remote files can have same compressed data (e.g. duplicates across zips)
+    //download only one copy of such data and use it for all matches
+    typedef std::tuple<HashDigest, HashDigest, uint16_t> DataKey;
+    auto GetDataKey = [](const FileMetainfo &f) -> DataKey {
+        return DataKey(f.compressedHash, f.contentsHash, f.props.compressionMethod);
+    };
+    std::map<DataKey, std::vector<int>> remoteByData;
+    for (int i = 0; i < _providedMani.size(); i++) {
+        const FileMetainfo &pf = _providedMani[i];
+        if (pf.location == FileLocation::RemoteHttp || pf.location == FileLocation::RemoteCas)
+            remoteByData[GetDataKey(pf)].push_back(i);
+    }
+    std::map<DataKey, int> dataToProvIdx;
+
+    //find which provided files must be downloaded
+    //pass 0: files which keep their place in zip --- they are downloaded as is,
+    //  so that downloaded zip can be renamed without repacking on clean install
+    //pass 1: all the rest --- reuse already scheduled data or choose the cheapest source
+    for (int pass = 0; pass < 2; pass++) {
+        for (int midx = 0; midx < _matches.size(); midx++) {
+            const Match &m = _matches[midx];
+            if (m.provided->location != FileLocation::RemoteHttp && m.provided->location != FileLocation::RemoteCas)
+                continue;
+            const FileMetainfo &tf = *m.target;
+            const FileMetainfo &pf = *m.provided;
+            bool sameShape = (pf.filename == tf.filename && pf.zipPath.rel == tf.zipPath.rel && pf.byterange[0] == tf.byterange[0]);
+            if (sameShape != (pass == 0))
+                continue;
 
-        int provIdx = m.provided._index;
-        bool alreadyScheduled = (provIdxToMatchIds.count(provIdx) > 0);
-        provIdxToMatchIds[provIdx].push_back(midx);
-        if (alreadyScheduled)
-            continue;   //same file wanted by many targets: download once
+            DataKey key = GetDataKey(pf);
+            int provIdx = m.provided._index;
+            if (pass == 1) {
+                auto iter = dataToProvIdx.find(key);
+                if (iter != dataToProvIdx.end())
+                    provIdx = iter->second;
+                else {
+                    //prefer url which is downloaded anyway, then smaller byterange
+                    uint64_t bestScore = UINT64_MAX;
+                    for (int pi : remoteByData[key]) {
+                        const FileMetainfo &cand = _providedMani[pi];
+                        uint64_t score = cand.byterange[1] - cand.byterange[0];
+                        if (!urlStates.count(cand.zipPath.abs))
+                            score += uint64_t(1) << 62;
+                        if (score < bestScore) {
+                            bestScore = score;
+                            provIdx = pi;
+                        }
+                    }
+                }
+            }
+            dataToProvIdx.insert(std::make_pair(key, provIdx));
 
-        PathAR &fn = urlStates[url].path;
+            bool alreadyScheduled = (provIdxToMatchIds.count(provIdx) > 0);
+            provIdxToMatchIds[provIdx].push_back(midx);
+            if (alreadyScheduled)
+                continue;   //same file wanted by many targets: download once
+
+            const std::string &url = _providedMani[provIdx].zipPath.abs;
+            urlStates[url].provIdxs.push_back(provIdx);
+        }
+    }
+
+    //writes the whole byterange of provided file to the download file for its url
+    //note: files can arrive in any order (e.g. from content-addressed store), but each one is put to its planned place
+    auto WriteDownloaded = [this,&urlStates,&journal](const std::string &url, int provIdx, const void *data, size_t bytes) {
+        UrlData &state = urlStates[url];
+        if (!state.file) {
+            CreateDirectoriesForFile(state.path.abs, _rootDir);
+            state.file = StdioFileHolder(state.path.abs.c_str(), "wb");
+        }
+
+        uint64_t base = state.provIdxToBase.at(provIdx);
+        ZipSyncAssert(FileSeek64(state.file, base, SEEK_SET) == 0);
+        state.baseToProvIdx[base] = provIdx;
+        size_t written = fwrite(data, 1, bytes, state.file);
+        ZipSyncAssert(written == bytes);
+
+        //data must reach the file before we claim it in the journal
+        fflush(state.file);
+        const FileMetainfo &pf = _providedMani[provIdx];
+        journal.StartUrl(url, state.path.rel);
+        journal.AddEntry(DownloadJournal::Entry{base, {pf.byterange[0], pf.byterange[1]}, pf.compressedHash});
+    };
+    //appends compressed data of provided file (without local file header) to the download file for its url
+    //local file header is regenerated from manifest, returns false if resulting size does not match byterange
+    auto WriteWithHeader = [this,&WriteDownloaded](const std::string &url, int provIdx, const void *data, size_t bytes) -> bool {
+        const FileMetainfo &pf = _providedMani[provIdx];
+        std::vector<uint8_t> entry = minizipCreateLocalHeader(
+            pf.filename.c_str(), pf.props.compressionMethod, pf.props.generalPurposeBitFlag,
+            pf.props.lastModTime, pf.props.crc32, pf.props.compressedSize, pf.props.contentsSize
+        );
+        if (entry.size() + bytes != pf.byterange[1] - pf.byterange[0])
+            return false;
+        entry.insert(entry.end(), (const uint8_t*)data, (const uint8_t*)data + bytes);
+        WriteDownloaded(url, provIdx, entry.data(), entry.size());
+        return true;
+    };
+    std::vector<uint8_t> cachedData;
+    //object url in content-addressed store -> (url, provIdx) of all files which need it
+    std::map<std::string, std::vector<std::pair<std::string, int>>> casObjectUsers;
+
+    std::set<std::string> downloadedFilenames;
+    for (auto &pKV : urlStates) {
+        const std::string &url = pKV.first;
+        UrlData &state = pKV.second;
+        std::sort(state.provIdxs.begin(), state.provIdxs.end(), [this](int a, int b) {
+            return _providedMani[a].byterange[0] < _providedMani[b].byterange[0];
+        });
+        const FileMetainfo &first = _providedMani[state.provIdxs[0]];
+
+        //try to continue download from where previous run has stopped
+        std::set<int> resumedProvIdxs;
+        uint64_t validEnd = 0;
+        if (const DownloadJournal::UrlRecord *record = journal.Find(url)) {
+            PathAR fn = PathAR::FromRel(record->downloadPath, _rootDir);
+            if (!downloadedFilenames.count(fn.abs) && IfFileExists(fn.abs)) {
+                state.path = fn;
+                //files could be written out of order: take the longest contiguous prefix
+                std::vector<DownloadJournal::Entry> entries = record->entries;
+                std::stable_sort(entries.begin(), entries.end(), [](const DownloadJournal::Entry &a, const DownloadJournal::Entry &b) {
+                    return a.offset < b.offset;
+                });
+                StdioFileHolder f(fn.abs.c_str(), "rb");
+                for (const DownloadJournal::Entry &e : entries) {
+                    if (e.offset != validEnd)
+                        break;
+                    int provIdx = -1;
+                    for (int pi : state.provIdxs) {
+                        const FileMetainfo &pf = _providedMani[pi];
+                        if (!resumedProvIdxs.count(pi) && pf.byterange[0] == e.byterange[0] && pf.byterange[1] == e.byterange[1] && pf.compressedHash == e.compressedHash) {
+                            provIdx = pi;
+                            break;
+                        }
+                    }
+                    if (provIdx < 0)
+                        break;      //no longer needed (target has changed)
+                    uint64_t size = e.byterange[1] - e.byterange[0];
+                    if (!VerifyDownloadedFile(f, e.offset, size, e.compressedHash, _targetMani.GetHashAlgorithm()))
+                        break;      //data was not written completely
+                    resumedProvIdxs.insert(provIdx);
+                    state.baseToProvIdx[e.offset] = provIdx;
+                    validEnd = e.offset + size;
+                }
+                f.reset();
+                _metrics.filesResumed += resumedProvIdxs.size();
+                if (validEnd > 0) {
+                    //drop everything after the last good file, continue writing from there
+                    TruncateFile(fn.abs, validEnd);
+                    state.file = StdioFileHolder(fn.abs.c_str(), "r+b");
+                    FileSeek64(state.file, 0, SEEK_END);
+                    g_logger->infof("Resuming download of %s: %d files already downloaded", url.c_str(), int(resumedProvIdxs.size()));
+                }
+            }
+        }
+
+        PathAR &fn = state.path;
         if (fn.abs.empty()) {
             for (int t = 0; t < 100; t++) {
-                fn = PathAR::FromRel(PrefixFile(m.provided->zipPath.rel, "__download" + std::to_string(t) + "__"), _rootDir);
+                fn = PathAR::FromRel(PrefixFile(first.zipPath.rel, "__download" + std::to_string(t) + "__"), _rootDir);
                 if (downloadedFilenames.count(fn.abs))
                     continue;
                 if (!IfFileExists(fn.abs))
                     break;
             }
-            ZipSyncAssertF(!fn.abs.empty(), "too many \"__download??__%s\" files", m.provided->zipPath.rel.c_str());
-            downloadedFilenames.insert(fn.abs);
-        }
-        urlStates[url].totalCount++;
-
-        DownloadSource src;
-        src.url = url;
-        src.byterange[0] = m.provided->byterange[0];
-        src.byterange[1] = m.provided->byterange[1];
-        downloader.EnqueueDownload(src, [this,&urlStates,url,provIdx](const void *data, uint32_t bytes) {
-            UrlData &state = urlStates[url];
-            if (!state.file) {
-                CreateDirectoriesForFile(state.path.abs, _rootDir);
-                state.file = StdioFileHolder(state.path.abs.c_str(), "wb");
+            ZipSyncAssertF(!fn.abs.empty(), "too many \"__download??__%s\" files", first.zipPath.rel.c_str());
+        }
+        downloadedFilenames.insert(fn.abs);
+
+        //record all the resumed files, so that journal stays valid if interrupted again
+        journal.StartUrl(url, fn.rel);
+        for (const auto &pOI : state.baseToProvIdx) {
+            const FileMetainfo &pf = _providedMani[pOI.second];
+            journal.AddEntry(DownloadJournal::Entry{pOI.first, {pf.byterange[0], pf.byterange[1]}, pf.compressedHash});
+        }
+
+        //plan layout of the rest: same order as in remote zip, so that it can be renamed without repacking
+        uint64_t nextBase = validEnd;
+        for (int provIdx : state.provIdxs) {
+            if (resumedProvIdxs.count(provIdx))
+                continue;
+            const FileMetainfo &pf = _providedMani[provIdx];
+            state.provIdxToBase[provIdx] = nextBase;
+            nextBase += pf.byterange[1] - pf.byterange[0];
+        }
+
+        for (int provIdx : state.provIdxs) {
+            if (resumedProvIdxs.count(provIdx))
+                continue;
+            const FileMetainfo &pf = _providedMani[provIdx];
+
+            if (_sharedCache && _sharedCache->Load(pf.compressedHash, cachedData, _targetMani.GetHashAlgorithm())) {
+                //take compressed data from shared cache, regenerate local file header
+                if (WriteWithHeader(url, provIdx, cachedData.data(), cachedData.size())) {
+                    g_logger->debugf(lcSharedCacheHit, "Taking %s from shared cache", GetFullPath(url, pf.filename).c_str());
+                    state.fromSharedCache.insert(provIdx);
+                    _metrics.filesFromSharedCache++;
+                    _metrics.bytesFromSharedCache += pf.byterange[1] - pf.byterange[0];
+                    continue;
+                }
+            }
+            if (pf.location == FileLocation::RemoteCas && pf.props.compressedSize == 0) {
+                //nothing to download (and empty byterange cannot be requested)
+                bool ok = WriteWithHeader(url, provIdx, nullptr, 0);
+                ZipSyncAssertF(ok, "Empty file \"%s\" has unexpected byterange", GetFullPath(url, pf.filename).c_str());
+                continue;
             }
+            state.totalCount++;
+            _metrics.filesDownloaded++;
 
-            size_t base = ftell(state.file);
-            state.baseToProvIdx[base] = provIdx;
-            size_t written = fwrite(data, 1, bytes, state.file);
-            ZipSyncAssert(written == bytes);
+            if (pf.location == FileLocation::RemoteCas) {
+                //enqueued later: same object may be wanted at several places
+                std::string objectUrl = GetContentAddressedPath(_remoteCasUrl + '/' + REMOTE_CAS_DIR, pf.compressedHash);
+                casObjectUsers[objectUrl].push_back(std::make_pair(url, provIdx));
+                continue;
+            }
+
+            DownloadSource src;
+            src.url = url;
+            src.byterange[0] = pf.byterange[0];
+            src.byterange[1] = pf.byterange[1];
+            downloader.EnqueueDownload(src, [&urlStates,&WriteDownloaded,url,provIdx](const void *data, size_t bytes) {
+                WriteDownloaded(url, provIdx, data, bytes);
+                UrlData &state = urlStates[url];
+                if (++state.finishedCount == state.totalCount)
+                    state.file.reset();
+            });
+        }
+        if (state.totalCount == 0)
+            state.file.reset();     //everything resumed or taken from cache, nothing to download
+    }
 
-            if (++state.finishedCount == state.totalCount)
-                state.file.reset();
+    //object in content-addressed store contains only compressed data, so it is downloaded as a whole
+    //note: all objects are enqueued into one downloader run, so that requests reuse connections
+    //and go in parallel (up to max connections), which is crucial for many small objects
+    for (const auto &pKV : casObjectUsers) {
+        const std::string &objectUrl = pKV.first;
+        const std::vector<std::pair<std::string, int>> &users = pKV.second;
+        DownloadSource src(objectUrl, 0, _providedMani[users[0].second].props.compressedSize);
+        downloader.EnqueueDownload(src, [&urlStates,&WriteWithHeader,objectUrl,users](const void *data, size_t bytes) {
+            for (const auto &pUP : users) {
+                bool ok = WriteWithHeader(pUP.first, pUP.second, data, bytes);
+                ZipSyncAssertF(ok, "Object %s in content-addressed store has unexpected size %llu", objectUrl.c_str(), (unsigned long long)bytes);
+                UrlData &state = urlStates[pUP.first];
+                if (++state.finishedCount == state.totalCount)
+                    state.file.reset();
+            }
         });
     }
 
     downloader.DownloadAll();
+    _metrics.download = downloader.GetMetrics();
+    downloadTimer.Stop();
+    MetricsTimer verifyTimer(_metrics.timeVerify);
 
     double totalBytesToPostprocess = 1e-20;
     for (const auto &pKV : urlStates)
@@ -727,19 +1258,25 @@ void UpdateProcess::DownloadRemoteFiles(
         zf.Open(state.path.abs.c_str());
 
         for (const auto &pOI : state.baseToProvIdx) {
-            uint32_t offset = pOI.first;
+            uint64_t offset = pOI.first;
             int provIdx = pOI.second;
             std::vector<int> matchIds = provIdxToMatchIds[provIdx];
             ManifestIter provided(_providedMani, provIdx);
 
             //verify hash of the downloaded file (we must be sure that it is correct)
             //TODO: what if bad mirror changes file local header?...
-            uint32_t size = provided->byterange[1] - provided->byterange[0];
+            uint64_t size = provided->byterange[1] - provided->byterange[0];
             zf.LocateByByterange(offset, offset + size);
             SAFE_CALL(unzOpenCurrentFile2(zf, NULL, NULL, true));
-            Hasher hasher;
+            const HashDigest &expectedHash = provided->compressedHash;
+            //data goes to shared cache while it is being hashed (committed only if hash matches)
+            std::unique_ptr<SharedCache::Writer> cacheWriter;
+            if (_sharedCache && !state.fromSharedCache.count(provIdx))
+                cacheWriter.reset(new SharedCache::Writer(*_sharedCache, expectedHash));
+            MetricsTimer hashTimer(_metrics.timeHashing);
+            Hasher hasher(_targetMani.GetHashAlgorithm());
             char buffer[SIZE_FILEBUFFER];
-            int processedBytes = 0;
+            uint64_t processedBytes = 0;
             while (1) {
                 int bytes = unzReadCurrentFile(zf, buffer, sizeof(buffer));
                 if (bytes < 0)
@@ -747,14 +1284,19 @@ void UpdateProcess::DownloadRemoteFiles(
                 if (bytes == 0)
                     break;
                 hasher.Update(buffer, bytes);
+                if (cacheWriter)
+                    cacheWriter->Append(buffer, bytes);
                 processedBytes += bytes;
             } 
             HashDigest obtainedHash = hasher.Finalize();
             SAFE_CALL(unzCloseCurrentFile(zf));
+            hashTimer.Stop();
+            _metrics.bytesHashed += processedBytes;
 
-            const HashDigest &expectedHash = provided->compressedHash;
             std::string fullPath = GetFullPath(url, provided->filename);
             ZipSyncAssertF(obtainedHash == expectedHash, "Hash of \"%s\" after download is %s instead of %s", fullPath.c_str(), obtainedHash.Hex().c_str(), expectedHash.Hex().c_str());
+            if (cacheWriter)
+                cacheWriter->Commit();
 
             FileMetainfo pf = *provided;
             pf.zipPath = state.path;
@@ -777,8 +1319,83 @@ void UpdateProcess::DownloadRemoteFiles(
         bytesPostprocessed += rawZipSize;
     }
 
+    //all downloaded files are verified: journal is no longer needed
+    journal.Remove();
+    if (_sharedCache)
+        _sharedCache->Evict();
+    _metrics.peakBufferMemory = std::max(_metrics.peakBufferMemory, std::max(_metrics.download.peakBufferMemory, cachedData.capacity()));
+
     if (progressPostprocessCallback)
         progressPostprocessCallback(1.0, "Verifying finished");
 }
 
+int ExportToCas(const Manifest &mani, const std::string &rootDir, const GlobalProgressCallback &progressCallback) {
+    TraceSpan span("ExportToCas");
+    //store has the same layout as shared cache, but objects are never evicted
+    SharedCache store(rootDir + '/' + REMOTE_CAS_DIR);
+    CreateDir(rootDir);
+
+    std::map<std::string, std::vector<int>> zipToFiles;
+    uint64_t totalBytes = 1;
+    for (int i = 0; i < mani.size(); i++) {
+        const FileMetainfo &f = mani[i];
+        if (f.location != FileLocation::Local && f.location != FileLocation::Inplace)
+            continue;
+        zipToFiles[f.zipPath.abs].push_back(i);
+        totalBytes += f.props.compressedSize;
+    }
+
+    int newObjects = 0;
+    uint64_t doneBytes = 0;
+    for (auto &pZF : zipToFiles) {
+        std::vector<int> &ids = pZF.second;
+        std::sort(ids.begin(), ids.end(), [&mani](int a, int b) {
+            return mani[a].byterange[0] < mani[b].byterange[0];
+        });
+        if (progressCallback) {
+            int code = progressCallback(double(doneBytes) / totalBytes, formatMessage("Exporting \"%s\"...", pZF.first.c_str()).c_str());
+            if (code != 0)
+                g_logger->errorf(lcUserInterrupt, "Interrupted by user");
+        }
+
+        UnzFileIndexed zf;
+        for (int idx : ids) {
+            const FileMetainfo &f = mani[idx];
+            doneBytes += f.props.compressedSize;
+            if (IfFileExists(store.GetObjectPath(f.compressedHash)))
+                continue;   //exported earlier (maybe from another version)
+            if (!zf)
+                zf.Open(pZF.first.c_str());
+
+            zf.LocateByByterange(f.byterange[0], f.byterange[1]);
+            SAFE_CALL(unzOpenCurrentFile2(zf, NULL, NULL, true));
+            SharedCache::Writer writer(store, f.compressedHash);
+            Hasher hasher(mani.GetHashAlgorithm());
+            char buffer[SIZE_FILEBUFFER];
+            while (1) {
+                int bytes = unzReadCurrentFile(zf, buffer, sizeof(buffer));
+                if (bytes < 0)
+                    SAFE_CALL(bytes);
+                if (bytes == 0)
+                    break;
+                hasher.Update(buffer, bytes);
+                writer.Append(buffer, bytes);
+            }
+            SAFE_CALL(unzCloseCurrentFile(zf));
+
+            //object is found by name only, so it must never contain wrong data
+            HashDigest obtainedHash = hasher.Finalize();
+            std::string fullPath = GetFullPath(pZF.first, f.filename);
+            ZipSyncAssertF(obtainedHash == f.compressedHash, "Hash of \"%s\" is %s instead of %s", fullPath.c_str(), obtainedHash.Hex().c_str(), f.compressedHash.Hex().c_str());
+            writer.Commit();
+            ZipSyncAssertF(IfFileExists(store.GetObjectPath(f.compressedHash)), "Failed to write object for \"%s\"", fullPath.c_str());
+            newObjects++;
+        }
+    }
+
+    if (progressCallback)
+        progressCallback(1.0, "Exporting finished");
+    return newObjects;
+}
+
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Manifest.h"
+#include "Downloader.h"
 #include <set>
 #include <functional>
 
@@ -8,7 +9,7 @@
 namespace ZipSync {
 
 class LocalCache;
-class Downloader;
+class SharedCache;
 
 //called to report progress: returning nonzero value interrupts processing
 typedef std::function<int(double, const char*)> GlobalProgressCallback;
@@ -18,6 +19,41 @@ enum class UpdateType {
     SameCompressed,     //compressed contents and local file header must be bitwise the same
 };
 
+/**
+ * Counters collected by UpdateProcess during all phases of update.
+ * Times are wall-clock durations in seconds.
+ */
+struct UpdateMetrics {
+    //DevelopPlan
+    double timePlan = 0.0;
+
+    //DownloadRemoteFiles
+    double timeDownload = 0.0;          //downloading (including shared cache and resume)
+    double timeVerify = 0.0;            //verifying downloaded files (after download)
+    DownloaderMetrics download;
+    int filesDownloaded = 0;            //files requested from remote servers
+    int filesFromSharedCache = 0;
+    int filesResumed = 0;               //files taken from interrupted download of previous run
+    uint64_t bytesFromSharedCache = 0;
+
+    //RepackZips
+    double timeRepack = 0.0;
+    int zipsRenamed = 0;                //renamed without repacking (e.g. downloaded as is)
+    int zipsRepacked = 0;
+    int zipsReduced = 0;                //old zips reduced to files still needed
+    int entriesCopiedRaw = 0;           //copied without recompression
+    int entriesRecompressed = 0;
+    uint64_t bytesRepackRead = 0;       //compressed data read from source zips
+    uint64_t bytesRepackWritten = 0;    //size of all created zips
+
+    //hashing of downloaded and repacked data
+    double timeHashing = 0.0;
+    uint64_t bytesHashed = 0;
+
+    //maximum size of data buffers in memory
+    size_t peakBufferMemory = 0;
+};
+
 /**
  * Represents the whole updating process.
  */
@@ -48,6 +84,14 @@ private:
     //the best matching provided file for every target file
     std::vector<Match> _matches;
 
+    //optional content-addressed cache of compressed data shared with other installations
+    SharedCache *_sharedCache = nullptr;
+    //root URL of content-addressed remote store (empty if not used)
+    std::string _remoteCasUrl;
+
+    //counters collected so far
+    UpdateMetrics _metrics;
+
     class Repacker;
     friend class Repacker;
 
@@ -59,6 +103,20 @@ public:
     //it means that updater must delete it if it's not mentioned on target manifest
     void AddManagedZip(const std::string &zipPath, bool relative = false);
 
+    //add all files from local cache as provided ones
+    //note: must be called after Init and before DevelopPlan
+    void SetLocalCache(const LocalCache *cache);
+
+    //use given shared cache when downloading remote files:
+    //files present in cache are not downloaded, and downloaded files are added to cache
+    void SetSharedCache(SharedCache *cache);
+
+    //use content-addressed remote store with given root URL as fallback source of every target file:
+    //compressed data is downloaded from "<rootUrl>/cas/<ab>/<abcdef...>" by compressedHash
+    //the store is filled by ExportToCas and may contain objects of any number of versions
+    //note: must be called after Init and before DevelopPlan
+    void AddRemoteCas(const std::string &rootUrl);
+
     //decide how to execute the update (which files to find where)
     bool DevelopPlan(UpdateType type);
 
@@ -78,14 +136,23 @@ public:
     //having all matches available locally, perform the update
     void RepackZips(const GlobalProgressCallback &progressCallback = GlobalProgressCallback());
 
-    //TODO: local cache for reduced zips?
-    void RemoveOldZips(const LocalCache *cache);
+    //remove "reduced" zips left after repacking
+    //if cache is given, then the files from them are moved to the cache before removal
+    void RemoveOldZips(LocalCache *cache);
 
 
     const Manifest &GetProvidedManifest() const { return _providedMani; }
+    //counters collected by all phases called so far
+    const UpdateMetrics &GetMetrics() const { return _metrics; }
 
     int MatchCount() const { return _matches.size(); }
     const Match &GetMatch(int idx) const { return _matches[idx]; }
 };
 
+//put compressed data of all files provided by manifest (in local zips) into content-addressed remote store
+//rooted at given directory: object for every compressedHash is written to "<rootDir>/cas/<ab>/<abcdef...>"
+//objects already present are not rewritten, so the same store can be filled with many versions
+//returns number of new objects
+int ExportToCas(const Manifest &mani, const std::string &rootDir, const GlobalProgressCallback &progressCallback = GlobalProgressCallback());
+
 }
@@ -1,6 +1,7 @@
 #include "ZipUtils.h"
 #include "Utils.h"
 #include "Path.h"
+#include "ResourceGovernor.h"
 #include <algorithm>
 #include "minizip_extra.h"
 #include <string.h>
@@ -18,7 +19,7 @@ UnzFileHolder::UnzFileHolder(unzFile zf)
     : UnzFileUniquePtr(zf, unzClose)
 {}
 UnzFileHolder::UnzFileHolder(const char *path)
-    : UnzFileUniquePtr(unzOpen(path), unzClose)
+    : UnzFileUniquePtr(unzOpen2_64(path, GetGovernedFileFuncs()), unzClose)
 {
     if (!get())
         g_logger->errorf(lcCantOpenFile, "Failed to open zip file \"%s\"", path);
@@ -35,19 +36,19 @@ ZipFileHolder::ZipFileHolder(const char *path)
     //allow to overwrite
     if (IfFileExists(path))
         RemoveFile(path);
-    reset(zipOpen(path, 0));
+    reset(zipOpen2_64(path, 0, NULL, GetGovernedFileFuncs()));
     if (!get())
         g_logger->errorf(lcCantOpenFile, "Failed to open zip file \"%s\"", path);
 }
 
-void unzGetCurrentFilePosition(unzFile zf, uint32_t *localHeaderStart, uint32_t *fileDataStart, uint32_t *fileDataEnd) {
-    unz_file_info info;
-    SAFE_CALL(unzGetCurrentFileInfo(zf, &info, NULL, 0, NULL, 0, NULL, 0));
+void unzGetCurrentFilePosition(unzFile zf, uint64_t *localHeaderStart, uint64_t *fileDataStart, uint64_t *fileDataEnd) {
+    unz_file_info64 info;
+    SAFE_CALL(unzGetCurrentFileInfo64(zf, &info, NULL, 0, NULL, 0, NULL, 0));
     SAFE_CALL(unzOpenCurrentFile(zf));
     int64_t pos = unzGetCurrentFileZStreamPos64(zf);
-    int localHeaderSize = 30 + info.size_filename + info.size_file_extra;
+    //note: extra field in local header may differ from the one in central directory (e.g. Zip64)
     if (localHeaderStart)
-        *localHeaderStart = pos - localHeaderSize;
+        *localHeaderStart = unzGetLocalHeaderOffset64(zf);
     if (fileDataStart)
         *fileDataStart = pos;
     if (fileDataEnd)
@@ -65,7 +66,7 @@ void UnzFileIndexed::Clear() {
     _sortedEntries.clear();
 }
 void UnzFileIndexed::Open(const char *path) {
-    unzFile zf = unzOpen(path);
+    unzFile zf = unzOpen2_64(path, GetGovernedFileFuncs());
     if (!zf)
         g_logger->errorf(lcCantOpenFile, "Failed to open zip file \"%s\"", path);
     _zfHandle.reset(zf);
@@ -74,7 +75,7 @@ void UnzFileIndexed::Open(const char *path) {
     while (1) {
         char currFilename[SIZE_PATH];
         SAFE_CALL(unzGetCurrentFileInfo(zf, NULL, currFilename, sizeof(currFilename), NULL, 0, NULL, 0));
-        uint32_t from, to;
+        uint64_t from, to;
         unzGetCurrentFilePosition(zf, &from, NULL, &to);
         Entry e;
         e.byterangeStart = from;
@@ -88,22 +89,22 @@ void UnzFileIndexed::Open(const char *path) {
     if (!std::is_sorted(_sortedEntries.begin(), _sortedEntries.end()))
         std::sort(_sortedEntries.begin(), _sortedEntries.end());
 }
-void UnzFileIndexed::LocateByByterange(uint32_t start, uint32_t end) {
+void UnzFileIndexed::LocateByByterange(uint64_t start, uint64_t end) {
     Entry aux;
     aux.byterangeStart = start;
     int idx = std::lower_bound(_sortedEntries.begin(), _sortedEntries.end(), aux) - _sortedEntries.begin();
-    ZipSyncAssertF(idx < _sortedEntries.size() && _sortedEntries[idx].byterangeStart == start, "Failed to find file at byterange [%u..%u]", start, end);
+    ZipSyncAssertF(idx < _sortedEntries.size() && _sortedEntries[idx].byterangeStart == start, "Failed to find file at byterange [%llu..%llu]", (unsigned long long)start, (unsigned long long)end);
     SAFE_CALL(unzGoToFilePos(_zfHandle.get(), &_sortedEntries[idx].unzPos));
 }
 
 
-bool unzLocateFileAtBytes(unzFile zf, const char *filename, uint32_t from, uint32_t to) {
+bool unzLocateFileAtBytes(unzFile zf, const char *filename, uint64_t from, uint64_t to) {
     SAFE_CALL(unzGoToFirstFile(zf));
     while (1) {
         char currFilename[SIZE_PATH];
         SAFE_CALL(unzGetCurrentFileInfo(zf, NULL, currFilename, sizeof(currFilename), NULL, 0, NULL, 0));
         if (strcmp(filename, currFilename) == 0) {
-            uint32_t currFrom, currTo;
+            uint64_t currFrom, currTo;
             unzGetCurrentFilePosition(zf, &currFrom, NULL, &currTo);
             if (currFrom == from && currTo == to)
                 return true;    //hit
@@ -128,7 +129,11 @@ int CompressionLevelFromGpFlags(int flags) {
         compressionLevel = Z_BEST_SPEED;        //minizip: 1
     return compressionLevel;
 }
-void minizipCopyFile(unzFile zf, zipFile zfOut, const char *filename, int method, int flags, uint16_t internalAttribs, uint32_t externalAttribs, uint32_t dosDate, bool copyRaw, uint32_t crc, uint32_t contentsSize) {
+bool minizipIsZip64Entry(uint64_t compressedSize, uint64_t contentsSize) {
+    return compressedSize >= 0xFFFFFFFFU || contentsSize >= 0xFFFFFFFFU;
+}
+
+void minizipCopyFile(unzFile zf, zipFile zfOut, const char *filename, int method, int flags, uint16_t internalAttribs, uint32_t externalAttribs, uint32_t dosDate, bool copyRaw, uint32_t crc, uint64_t compressedSize, uint64_t contentsSize) {
     //copy provided file data into target file
     SAFE_CALL(unzOpenCurrentFile2(zf, NULL, NULL, copyRaw));
     zip_fileinfo info;
@@ -136,7 +141,8 @@ void minizipCopyFile(unzFile zf, zipFile zfOut, const char *filename, int method
     info.external_fa = externalAttribs;
     info.dosDate = dosDate;
     int level = CompressionLevelFromGpFlags(flags);
-    SAFE_CALL(zipOpenNewFileInZip2(zfOut, filename, &info, NULL, 0, NULL, 0, NULL, method, level, copyRaw));
+    int zip64 = minizipIsZip64Entry(compressedSize, contentsSize);
+    SAFE_CALL(zipOpenNewFileInZip2_64(zfOut, filename, &info, NULL, 0, NULL, 0, NULL, method, level, copyRaw, zip64));
     char buffer[SIZE_FILEBUFFER];
     if (copyRaw) {
         //faster than minizip copy: no CRC32 calculation, large buffer
@@ -154,7 +160,7 @@ void minizipCopyFile(unzFile zf, zipFile zfOut, const char *filename, int method
     }
     if (!copyRaw)
         SAFE_CALL(zipForceDataType(zfOut, info.internal_fa));
-    SAFE_CALL(copyRaw ? zipCloseFileInZipRaw(zfOut, contentsSize, crc) : zipCloseFileInZip(zfOut));
+    SAFE_CALL(copyRaw ? zipCloseFileInZipRaw64(zfOut, contentsSize, crc) : zipCloseFileInZip(zfOut));
     SAFE_CALL(unzCloseCurrentFile(zf));
 }
 
@@ -199,24 +205,89 @@ struct ZipEndOfCentral {
     uint32_t offset;
     uint16_t commentLen;
 };
+struct ZipLocalZip64Extra {
+    uint16_t headerId;
+    uint16_t dataSize;
+    uint64_t uncompSize;
+    uint64_t compSize;
+};
+struct ZipEndOfCentral64 {
+    uint32_t magic;
+    uint64_t recordSize;
+    uint16_t versionMade;
+    uint16_t versionNeeded;
+    uint32_t thisDiskNum;
+    uint32_t startDiskNum;
+    uint64_t numCentralHeaders;
+    uint64_t totalCentralHeaders;
+    uint64_t centralDirSize;
+    uint64_t offset;
+};
+struct ZipEndOfCentral64Locator {
+    uint32_t magic;
+    uint32_t startDiskNum;
+    uint64_t offset;
+    uint32_t totalDisks;
+};
 #pragma pack(pop)
+//Zip64 end of central directory is written iff one of these values does not fit (same as in minizip)
+static bool NeedsZip64EndOfCentral(uint64_t centralOffset, uint64_t numEntries) {
+    return centralOffset >= 0xFFFFFFFFU || numEntries > 0xFFFF;
+}
+static const int ZIP64_END_OF_CENTRAL_SIZE = sizeof(ZipEndOfCentral64) + sizeof(ZipEndOfCentral64Locator);
+
+std::vector<uint8_t> minizipCreateCentralExtra(uint64_t compressedSize, uint64_t contentsSize, uint64_t localHeaderOffset) {
+    //only the values which don't fit into 32 bits are stored, in this order
+    std::vector<uint64_t> values;
+    if (contentsSize >= 0xFFFFFFFFU)
+        values.push_back(contentsSize);
+    if (compressedSize >= 0xFFFFFFFFU)
+        values.push_back(compressedSize);
+    if (localHeaderOffset >= 0xFFFFFFFFU)
+        values.push_back(localHeaderOffset);
+    std::vector<uint8_t> res;
+    if (values.empty())
+        return res;
+    uint16_t header[2] = {0x0001, uint16_t(8 * values.size())};
+    res.resize(sizeof(header) + header[1]);
+    memcpy(res.data(), header, sizeof(header));
+    memcpy(res.data() + sizeof(header), values.data(), header[1]);
+    return res;
+}
+
 void minizipAddCentralDirectory(const char *zipFilename, std::vector<FileAttribInfo> attribs) {
     std::sort(attribs.begin(), attribs.end(), [](const FileAttribInfo &a, const FileAttribInfo &b) { return a.offset < b.offset; });
     StdioFileHolder f(zipFilename, "r+b");
     std::vector<ZipCentralHeader> headers;
     std::vector<std::string> filenames;
+    std::vector<std::vector<uint8_t>> extras;
     ZipLocalHeader lh;
     int attrIdx = 0;
     while (fread(&lh, sizeof(lh), 1, f) == 1) {
-        uint32_t offset = ftell(f) - sizeof(lh);
+        uint64_t offset = FileTell64(f) - sizeof(lh);
         ZipSyncAssert(lh.magic == 0x04034b50);
-        ZipSyncAssert(lh.extraLen == 0);
+        ZipSyncAssert(lh.extraLen == 0 || lh.extraLen == sizeof(ZipLocalZip64Extra));
         std::unique_ptr<char[]> filename(new char[lh.filenameLen]);
         ZipSyncAssert(fread(filename.get(), lh.filenameLen, 1, f) == 1);
+        uint64_t compSize = lh.compSize, uncompSize = lh.uncompSize;
+        if (lh.extraLen != 0) {
+            //Zip64 entry: actual sizes are in the extra field
+            ZipLocalZip64Extra z64;
+            ZipSyncAssert(fread(&z64, sizeof(z64), 1, f) == 1);
+            ZipSyncAssert(z64.headerId == 0x0001 && z64.dataSize == 16);
+            compSize = z64.compSize;
+            uncompSize = z64.uncompSize;
+        }
         ZipCentralHeader ch = {0};
         ch.magic = 0x02014b50;
         memcpy(&ch.versionNeeded, &lh.versionNeeded, sizeof(ZipLocalHeader) - offsetof(ZipLocalHeader, versionNeeded));
-        ch.offset = offset;
+        //minizip always declares version 2.0 in central directory (even for Zip64 entries)
+        ch.versionNeeded = 20;
+        ch.compSize = uint32_t(std::min<uint64_t>(compSize, 0xFFFFFFFFU));
+        ch.uncompSize = uint32_t(std::min<uint64_t>(uncompSize, 0xFFFFFFFFU));
+        ch.offset = uint32_t(std::min<uint64_t>(offset, 0xFFFFFFFFU));
+        std::vector<uint8_t> extra = minizipCreateCentralExtra(compSize, uncompSize, offset);
+        ch.extraLen = extra.size();
         while (attrIdx < attribs.size() && attribs[attrIdx].offset < offset)
             attrIdx++;
         if (attrIdx < attribs.size() && attribs[attrIdx].offset == offset) {
@@ -225,92 +296,186 @@ void minizipAddCentralDirectory(const char *zipFilename, std::vector<FileAttribI
         }
         headers.push_back(ch);
         filenames.push_back(std::string(filename.get(), filename.get() + lh.filenameLen));
-        ZipSyncAssert(fseek(f, lh.compSize, SEEK_CUR) == 0);
+        extras.push_back(std::move(extra));
+        ZipSyncAssert(FileSeek64(f, compSize, SEEK_CUR) == 0);
     }
-    fseek(f, 0, SEEK_END);
-    size_t centralOffset = ftell(f);
+    FileSeek64(f, 0, SEEK_END);
+    uint64_t centralOffset = FileTell64(f);
     for (int i = 0; i < headers.size(); i++) {
         fwrite(&headers[i], sizeof(headers[i]), 1, f);
         fwrite(filenames[i].c_str(), 1, filenames[i].size(), f);
+        fwrite(extras[i].data(), 1, extras[i].size(), f);
+    }
+    uint64_t centralSize = FileTell64(f) - centralOffset;
+    if (NeedsZip64EndOfCentral(centralOffset, headers.size())) {
+        ZipEndOfCentral64 eocd64 = {0};
+        eocd64.magic = 0x06064b50;
+        eocd64.recordSize = sizeof(eocd64) - 12;
+        eocd64.versionMade = eocd64.versionNeeded = 45;
+        eocd64.numCentralHeaders = eocd64.totalCentralHeaders = headers.size();
+        eocd64.centralDirSize = centralSize;
+        eocd64.offset = centralOffset;
+        ZipEndOfCentral64Locator locator = {0};
+        locator.magic = 0x07064b50;
+        locator.offset = FileTell64(f);
+        locator.totalDisks = 1;
+        fwrite(&eocd64, sizeof(eocd64), 1, f);
+        fwrite(&locator, sizeof(locator), 1, f);
     }
     ZipEndOfCentral eocd = {0};
     eocd.magic = 0x06054b50;
-    eocd.numCentralHeaders = eocd.totalCentralHeaders = headers.size();
-    eocd.centralDirSize = ftell(f) - centralOffset;
-    eocd.offset = centralOffset;
+    eocd.numCentralHeaders = eocd.totalCentralHeaders = uint16_t(std::min<uint64_t>(headers.size(), 0xFFFF));
+    eocd.centralDirSize = uint32_t(centralSize);
+    eocd.offset = uint32_t(std::min<uint64_t>(centralOffset, 0xFFFFFFFFU));
     fwrite(&eocd, sizeof(eocd), 1, f);
 }
 
+std::vector<uint8_t> minizipCreateLocalHeader(const char *filename, int method, int flags, uint32_t dosDate, uint32_t crc, uint64_t compressedSize, uint64_t contentsSize) {
+    bool zip64 = minizipIsZip64Entry(compressedSize, contentsSize);
+    ZipLocalHeader lh = {0};
+    lh.magic = 0x04034b50;
+    lh.versionNeeded = (zip64 ? 45 : 20);
+    lh.flag = flags;
+    lh.compMethod = method;
+    lh.timeDate = dosDate;
+    lh.crc32 = crc;
+    lh.compSize = (zip64 ? 0xFFFFFFFFU : uint32_t(compressedSize));
+    lh.uncompSize = (zip64 ? 0xFFFFFFFFU : uint32_t(contentsSize));
+    lh.filenameLen = strlen(filename);
+    lh.extraLen = (zip64 ? sizeof(ZipLocalZip64Extra) : 0);
+    std::vector<uint8_t> res(sizeof(lh) + lh.filenameLen + lh.extraLen);
+    memcpy(res.data(), &lh, sizeof(lh));
+    memcpy(res.data() + sizeof(lh), filename, lh.filenameLen);
+    if (zip64) {
+        //sizes are stored in Zip64 extended information (as minizip does)
+        ZipLocalZip64Extra z64 = {0x0001, 16, contentsSize, compressedSize};
+        memcpy(res.data() + sizeof(lh) + lh.filenameLen, &z64, sizeof(z64));
+    }
+    return res;
+}
+
 //note: see AnalyzeCurrentFile in Manifest.cpp for exact requirements
-void minizipNormalize(const char *srcFilename, const char *dstFilename) {
+bool minizipNormalize(const char *srcFilename, const char *dstFilename) {
+    bool inplace = (!dstFilename || strcmp(srcFilename, dstFilename) == 0);
     if (!dstFilename)
         dstFilename = srcFilename;
 
     std::string tempFilename = PrefixFile(dstFilename, "__normalized__");
     struct FileLocation {
         std::string filename;
-        uint32_t range[2];
+        uint64_t range[2];
+        uint64_t dataStart;
+        unz_file_info64 info;
         bool operator< (const FileLocation &b) const {
             return std::make_pair(filename, range[0]) < std::make_pair(b.filename, b.range[0]);
         }
     };
     std::vector<FileLocation> files;
 
-    UnzFileIndexed zfIn;
-    zfIn.Open(srcFilename);
-    SAFE_CALL(unzGoToFirstFile(zfIn));
-    while (1) {
-        char filename[SIZE_PATH];
-        unz_file_info info;
-        SAFE_CALL(unzGetCurrentFileInfo(zfIn, &info, filename, SIZE_PATH, NULL, 0, NULL, 0));
-        FileLocation floc;
-        uint32_t temp;
-        unzGetCurrentFilePosition(zfIn, &floc.range[0], &temp, &floc.range[1]);
-        floc.filename = filename;
-        int len = strlen(filename);
-        bool isDirectory = info.uncompressed_size == 0 && info.compression_method == 0 && ((info.external_fa & 16) || (len > 0 && filename[len-1] == '/'));
-        if (!isDirectory)
-            files.push_back(floc);
+    //zip is normal if rewriting it would produce exactly the same bytes
+    bool isNormal = true;
+    uint64_t expectedSize = 0;
+    {
+        UnzFileHolder zfIn(srcFilename);
+        unz_global_info64 globalInfo;
+        SAFE_CALL(unzGetGlobalInfo64(zfIn, &globalInfo));
+        SAFE_CALL(unzGoToFirstFile(zfIn));
+        uint64_t centralOffset = unzGetOffset64(zfIn);
+        bool zip64End = NeedsZip64EndOfCentral(centralOffset, globalInfo.number_entry);
+        if (bool(unzIsZip64(zfIn)) != zip64End || globalInfo.size_comment != 0)
+            isNormal = false;
+        expectedSize = centralOffset + 22;      //end of central directory record
+        if (zip64End)
+            expectedSize += ZIP64_END_OF_CENTRAL_SIZE;
+        while (1) {
+            char filename[SIZE_PATH];
+            uint8_t extra[256];
+            FileLocation floc;
+            unz_file_info64 &info = floc.info;
+            SAFE_CALL(unzGetCurrentFileInfo64(zfIn, &info, filename, SIZE_PATH, extra, sizeof(extra), NULL, 0));
+            unzGetCurrentFilePosition(zfIn, &floc.range[0], &floc.dataStart, &floc.range[1]);
+            floc.filename = filename;
+            int len = strlen(filename);
+            bool isDirectory = info.uncompressed_size == 0 && info.compression_method == 0 && ((info.external_fa & 16) || (len > 0 && filename[len-1] == '/'));
+            if (!isDirectory) {
+                ZipSyncAssertF(info.compression_method == 0 || info.compression_method == 8, "File %s has compression %d (not supported)", filename, info.compression_method);
+                ZipSyncAssertF((info.flag & (~0x06)) == 0, "File %s has flags %d (not supported)", filename, info.flag);
+                ZipSyncAssertF((info.internal_fa & (~0x01)) == 0, "File %s has internal attribs %d (not supported)", filename, info.internal_fa);
+                files.push_back(floc);
+            }
+
+            if (isDirectory || info.version != 0 || info.version_needed != 20 || info.size_file_comment != 0 || info.disk_num_start != 0 || info.external_fa > 0xFF)
+                isNormal = false;
+            //central extra field may only contain Zip64 extended information, and only when necessary
+            std::vector<uint8_t> expectedExtra = minizipCreateCentralExtra(info.compressed_size, info.uncompressed_size, floc.range[0]);
+            if (info.size_file_extra != expectedExtra.size() || memcmp(extra, expectedExtra.data(), expectedExtra.size()) != 0)
+                isNormal = false;
+            //tightly packed in sorted order, local header exactly as we would write it
+            if (isNormal && files.size() > 1 && files[files.size() - 1] < files[files.size() - 2])
+                isNormal = false;
+            uint64_t prevEnd = (files.size() > 1 ? files[files.size() - 2].range[1] : 0);
+            int localExtraLen = (minizipIsZip64Entry(info.compressed_size, info.uncompressed_size) ? sizeof(ZipLocalZip64Extra) : 0);
+            if (isNormal && (floc.range[0] != prevEnd || floc.dataStart != prevEnd + 30 + len + localExtraLen))
+                isNormal = false;
+            expectedSize += 46 + len + expectedExtra.size();    //central directory header
 
-        int err = unzGoToNextFile(zfIn);
-        if (err == UNZ_END_OF_LIST_OF_FILE)
-            break;
-        SAFE_CALL(err);
+            int err = unzGoToNextFile(zfIn);
+            if (err == UNZ_END_OF_LIST_OF_FILE)
+                break;
+            SAFE_CALL(err);
+        }
+        if (isNormal && (files.empty() ? 0 : files.back().range[1]) != centralOffset)
+            isNormal = false;
+    }
+
+    StdioFileHolder fIn(srcFilename, "rb");
+    if (isNormal && (FileSeek64(fIn, 0, SEEK_END) != 0 || FileTell64(fIn) != expectedSize))
+        isNormal = false;
+    for (int i = 0; isNormal && i < files.size(); i++) {
+        const FileLocation &f = files[i];
+        std::vector<uint8_t> header = minizipCreateLocalHeader(f.filename.c_str(), f.info.compression_method, f.info.flag, f.info.dosDate, f.info.crc, f.info.compressed_size, f.info.uncompressed_size);
+        std::vector<uint8_t> actual(header.size());
+        if (FileSeek64(fIn, f.dataStart - header.size(), SEEK_SET) != 0 || fread(actual.data(), 1, actual.size(), fIn) != actual.size() || actual != header)
+            isNormal = false;
     }
+    if (isNormal && inplace)
+        return false;
 
     std::stable_sort(files.begin(), files.end());
 
     if (IfFileExists(tempFilename))
         RemoveFile(tempFilename);
-    ZipFileHolder zfOut(tempFilename.c_str());
-    for (const FileLocation &f : files) {
-        zfIn.LocateByByterange(f.range[0], f.range[1]);
+    //write local headers and raw data ourselves: reading is sequential if input order is almost sorted
+    std::vector<FileAttribInfo> attribs;
+    {
+        StdioFileHolder fOut(tempFilename.c_str(), "wb");
+        std::vector<char> buffer(SIZE_FILEBUFFER);
+        uint64_t outOffset = 0;
+        for (const FileLocation &f : files) {
+            std::vector<uint8_t> header = minizipCreateLocalHeader(f.filename.c_str(), f.info.compression_method, f.info.flag, f.info.dosDate, f.info.crc, f.info.compressed_size, f.info.uncompressed_size);
+            ZipSyncAssert(fwrite(header.data(), 1, header.size(), fOut) == header.size());
+            //drop anything in external attribs except for lower byte (which has MS-DOS attribs)
+            attribs.push_back(FileAttribInfo{outOffset, uint32_t(f.info.external_fa & 0xFF), uint16_t(f.info.internal_fa)});
 
-        unz_file_info infoIn;
-        SAFE_CALL(unzGetCurrentFileInfo(zfIn, &infoIn, NULL, 0, NULL, 0, NULL, 0));
-        ZipSyncAssertF(infoIn.compression_method == 0 || infoIn.compression_method == 8, "File %s has compression %d (not supported)", f.filename.c_str(), infoIn.compression_method);
-        ZipSyncAssertF((infoIn.flag & (~0x06)) == 0, "File %s has flags %d (not supported)", f.filename.c_str(), infoIn.flag);
-        ZipSyncAssertF((infoIn.internal_fa & (~0x01)) == 0, "File %s has internal attribs %d (not supported)", f.filename.c_str(), infoIn.internal_fa);
-
-        SAFE_CALL(unzOpenCurrentFile2(zfIn, NULL, NULL, true));
-        zip_fileinfo infoOut;
-        infoOut.dosDate = infoIn.dosDate;
-        infoOut.internal_fa = infoIn.internal_fa;
-        infoOut.external_fa = infoIn.external_fa & 0xFF;    //drop anything except for lower byte (which has MS-DOS attribs)
-        int level = CompressionLevelFromGpFlags(infoIn.flag);
-        SAFE_CALL(zipOpenNewFileInZip2(zfOut, f.filename.c_str(), &infoOut, NULL, 0, NULL, 0, NULL, infoIn.compression_method, level, true));
-        char buffer[SIZE_FILEBUFFER];
-        //faster than minizip copy: no CRC32 calculation, large buffer
-        minizipCopyDataRaw(zfIn, zfOut, buffer, sizeof(buffer));
-        SAFE_CALL(zipCloseFileInZipRaw(zfOut, infoIn.uncompressed_size, infoIn.crc));
-        SAFE_CALL(unzCloseCurrentFile(zfIn));
+            if (FileTell64(fIn) != f.dataStart)
+                ZipSyncAssert(FileSeek64(fIn, f.dataStart, SEEK_SET) == 0);
+            uint64_t remains = f.info.compressed_size;
+            while (remains > 0) {
+                uint32_t bytes = uint32_t(std::min(remains, uint64_t(buffer.size())));
+                ZipSyncAssertF(fread(buffer.data(), 1, bytes, fIn) == bytes, "Cannot read data of %s from %s", f.filename.c_str(), srcFilename);
+                ZipSyncAssert(fwrite(buffer.data(), 1, bytes, fOut) == bytes);
+                remains -= bytes;
+            }
+            outOffset += header.size() + f.info.compressed_size;
+        }
     }
-    zfIn.Clear();
-    zfOut.reset();
+    fIn.reset();
+    minizipAddCentralDirectory(tempFilename.c_str(), attribs);
 
     if (IfFileExists(dstFilename))
         RemoveFile(dstFilename);
     RenameFile(tempFilename, dstFilename);
+    return true;
 }
 
 }
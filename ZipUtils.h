@@ -49,11 +49,11 @@ public:
 
 
 //note: file must be NOT opened
-void unzGetCurrentFilePosition(unzFile zf, uint32_t *localHeaderStart, uint32_t *fileDataStart, uint32_t *fileDataEnd);
+void unzGetCurrentFilePosition(unzFile zf, uint64_t *localHeaderStart, uint64_t *fileDataStart, uint64_t *fileDataEnd);
 
 class UnzFileIndexed {
     struct Entry {
-        uint32_t byterangeStart;
+        uint64_t byterangeStart;
         unz_file_pos unzPos;
         bool operator< (const Entry &b) const;
     };
@@ -66,25 +66,38 @@ public:
     operator unzFile() const { return _zfHandle.get(); }
     void Clear();
     void Open(const char *path);
-    void LocateByByterange(uint32_t start, uint32_t end);
+    void LocateByByterange(uint64_t start, uint64_t end);
 };
 
 /*
 //like unzLocateFile, but also checks exact match by byterange (which includes local file header)
-bool unzLocateFileAtBytes(unzFile zf, const char *filename, uint32_t from, uint32_t to);
+bool unzLocateFileAtBytes(unzFile zf, const char *filename, uint64_t from, uint64_t to);
 */
 
-void minizipCopyFile(unzFile zf, zipFile zfOut, const char *filename, int method, int flags, uint16_t internalAttribs, uint32_t externalAttribs, uint32_t dosDate, bool copyRaw, uint32_t crc, uint32_t contentsSize);
+//normalization rule: Zip64 extended information is written into local file header iff file sizes don't fit into 32 bits
+bool minizipIsZip64Entry(uint64_t compressedSize, uint64_t contentsSize);
+
+//note: compressed size is only used to decide whether Zip64 entry is written (must be exact if copyRaw = false)
+void minizipCopyFile(unzFile zf, zipFile zfOut, const char *filename, int method, int flags, uint16_t internalAttribs, uint32_t externalAttribs, uint32_t dosDate, bool copyRaw, uint32_t crc, uint64_t compressedSize, uint64_t contentsSize);
 
 struct FileAttribInfo {
-    uint32_t offset;
+    uint64_t offset;
     uint32_t externalAttribs;
     uint16_t internalAttribs;
 };
 //given a tightly packed zip file without central directory, rebuilds it and appends it to the end of file
+//Zip64 end of central directory is added if offsets or number of files don't fit into ordinary one
 void minizipAddCentralDirectory(const char *filename, std::vector<FileAttribInfo> attribs = {});
 
+//generates local file header exactly as it is written in zips accepted by ZipSync
+//together with compressed data, it makes up the whole byterange of file in zip
+std::vector<uint8_t> minizipCreateLocalHeader(const char *filename, int method, int flags, uint32_t dosDate, uint32_t crc, uint64_t compressedSize, uint64_t contentsSize);
+//generates extra field of central directory header exactly as it is written in zips accepted by ZipSync
+//it is empty unless some of the values don't fit into 32 bits (then it contains Zip64 extended information)
+std::vector<uint8_t> minizipCreateCentralExtra(uint64_t compressedSize, uint64_t contentsSize, uint64_t localHeaderOffset);
+
 //repack given zip file so that it gets accepted by ZipSync
-void minizipNormalize(const char *srcFilename, const char *dstFilename = NULL);
+//if zip is already normal and is to be normalized in-place, then it is not rewritten and false is returned
+bool minizipNormalize(const char *srcFilename, const char *dstFilename = NULL);
 
 }
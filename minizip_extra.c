@@ -114,6 +114,16 @@ extern int ZEXPORT unzIsZip64(unzFile file)
     return s->isZip64;
 }
 
+extern ZPOS64_T ZEXPORT unzGetLocalHeaderOffset64(unzFile file)
+{
+	unz64_s* s = (unz64_s*)file;
+    if (s == NULL)
+        return 0;
+    if (!s->current_file_ok)
+        return 0;
+    return s->cur_file_info_internal.offset_curfile + s->byte_before_the_zipfile;
+}
+
 extern int ZEXPORT minizipCopyDataRaw(unzFile srcHandle, zipFile dstHandle, voidp buffer, unsigned bufSize)
 {
 	unz64_s* src = (unz64_s*)srcHandle;
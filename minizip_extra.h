@@ -17,6 +17,9 @@ extern int ZEXPORT unzseek64 OF((unzFile file, ZPOS64_T offset, int origin));
 extern int ZEXPORT unzIsZip64(unzFile file);
 /* Returns 1 iff specified file is zip64 */
 
+extern ZPOS64_T ZEXPORT unzGetLocalHeaderOffset64(unzFile file);
+/* Returns offset of the local header of the current file (as written in central directory, Zip64 included). */
+
 extern int ZEXPORT minizipCopyDataRaw(unzFile srcHandle, zipFile dstHandle, voidp buffer, unsigned bufSize);
 /* Directly copies current file data from unz file to zip file.
    Both unz and zip file must be opened in raw mode, without any bytes read/written to them. */